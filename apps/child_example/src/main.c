@@ -40,6 +40,9 @@
 #include <thread/thread.h>
 #include <process/process.h>
 
+/* Generated from root_task/connections by gen_conn_ids.py */
+#include <conn_ids.h>
+
 
 UNUSED char *my_name;
 UNUSED char *ep_name;
@@ -48,15 +51,15 @@ void * worker_thread(void *cookie) {
 
     printf("Worker thread id %lu\n", (long unsigned)thread_get_id());
 
-    seL4_CPtr ep_cap = init_lookup_endpoint(ep_name);
+    seL4_CPtr ep_cap = init_conn_cap(CONN_ECHO1_EP);
 
     char *shmem[2];
-    shmem[0] = init_lookup_shmem("echo1-shmem");
-    shmem[1] = init_lookup_shmem("echo2-shmem");
+    shmem[0] = init_conn_addr(CONN_ECHO1_SHMEM);
+    shmem[1] = init_conn_addr(CONN_ECHO2_SHMEM);
 
     seL4_CPtr notifs[2];
-    notifs[0] = init_lookup_notification("echo1-notif");
-    notifs[1] = init_lookup_notification("echo2-notif");
+    notifs[0] = init_conn_cap(CONN_ECHO1_NOTIF);
+    notifs[1] = init_conn_cap(CONN_ECHO2_NOTIF);
 
     if(strcmp(my_name, "child1") == 0) {
         seL4_Send(ep_cap, seL4_MessageInfo_new(99,0,0,0));
@@ -31,6 +31,7 @@
 /* Include libc headers */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 /* Include seL4 Libraries */
@@ -40,14 +41,29 @@
 
 /* Include seL4 COE library headers */
 #include <init/init.h>
+#include <mmap/mmap.h>
 #include <process/process.h>
 #include <thread/thread.h>
 #include <atomic_sync/sync.h>
 
+/* Generated from ../connections by gen_conn_ids.py */
+#include <conn_ids.h>
+
 //#define RUN_TESTS
 #define RUN_DEMO
 
 #define NUM_TEST_PROCS 5
+#define NUM_TEST_SLAB_OBJS 3
+
+/* What seL4_DebugCapIdentify returns for a notification cap, the kernel's cap_notification_cap */
+#define TEST_NOTIFICATION_CAP_TYPE 6
+
+#define LAZY_TEST_STACK_BYTES (64 * 1024)
+#define LAZY_TEST_REGION_PAGES 64
+#define LAZY_TEST_TOUCHED_PAGE 32
+
+#define MALLOC_TEST_SLOTS 128
+#define MALLOC_TEST_ROUNDS 16
 
 volatile int runner_count;
 cond_t runner_cond;
@@ -163,6 +179,21 @@ UNUSED static void test_libprocess(void) {
     error = process_create_conn_obj(PROCESS_SHARED_MEMORY, "testshmem", NULL, &shmem);
     ZF_LOGF_IF(error, "Failed to create shmem");
 
+    /**
+     * Two notifications under one name, and one the children only find by
+     * name, see test_lookups in test_proc
+     */
+    UNUSED process_conn_obj_t *dup[2];
+    UNUSED process_conn_obj_t *fallback;
+
+    for(i = 0; i < 2; i++) {
+        error = process_create_conn_obj(PROCESS_NOTIFICATION, CONN_TESTDUP_NAME, NULL, &dup[i]);
+        ZF_LOGF_IF(error, "Failed to create testdup");
+    }
+
+    error = process_create_conn_obj(PROCESS_NOTIFICATION, CONN_TESTFALLBACK_NAME, NULL, &fallback);
+    ZF_LOGF_IF(error, "Failed to create testfallback");
+
     for(i = 0; i < NUM_TEST_PROCS; i++) {
         error = process_connect(&test_procs[i],
                                 ep,
@@ -185,6 +216,22 @@ UNUSED static void test_libprocess(void) {
                                 NULL);
         ZF_LOGF_IF(error, "Failed to connect shmem");
 
+        for(int j = 0; j < 2; j++) {
+            error = process_connect(&test_procs[i],
+                                    dup[j],
+                                    process_rw,
+                                    &((process_conn_attr_t){.badge=BIT(i)}),
+                                    NULL);
+            ZF_LOGF_IF(error, "Failed to connect testdup");
+        }
+
+        error = process_connect(&test_procs[i],
+                                fallback,
+                                process_rw,
+                                NULL,
+                                NULL);
+        ZF_LOGF_IF(error, "Failed to connect testfallback");
+
         error = process_run(&test_procs[i], 1, (char**)&test_procs[i].name);
         assert(error == 0);
     }
@@ -209,6 +256,23 @@ UNUSED static void test_libprocess(void) {
         seL4_Yield();
     }
 
+    /**
+     * Connections are prepended to the init data, so every child found the
+     * testdup connected last, and signalled it with its badge before
+     * touching testep. Every one of them has replied by now.
+     */
+    seL4_Word badge;
+    error = process_connect(PROCESS_SELF, dup[0], process_rw, NULL, &ret);
+    ZF_LOGF_IF(error, "Failed to connect testdup to self");
+    seL4_Poll(ret.self_cap, &badge);
+    ZF_LOGF_IF(badge != 0, "A child found the wrong testdup: %lx", (long unsigned)badge);
+
+    error = process_connect(PROCESS_SELF, dup[1], process_rw, NULL, &ret);
+    ZF_LOGF_IF(error, "Failed to connect testdup to self");
+    seL4_Poll(ret.self_cap, &badge);
+    ZF_LOGF_IF(badge != BIT(NUM_TEST_PROCS) - 1, "Not every child found testdup: %lx",
+               (long unsigned)badge);
+
     for(i = 0; i < NUM_TEST_PROCS; i++) {
         error = process_destroy(&test_procs[i]);
         ZF_LOGF_IF(error, "Failed to destroy process");
@@ -223,11 +287,316 @@ UNUSED static void test_libprocess(void) {
     error = process_free_conn_obj(&shmem);
     ZF_LOGF_IF(error, "Failed to free shmem");
 
+    for(i = 0; i < 2; i++) {
+        error = process_free_conn_obj(&dup[i]);
+        ZF_LOGF_IF(error, "Failed to free testdup");
+    }
+
+    error = process_free_conn_obj(&fallback);
+    ZF_LOGF_IF(error, "Failed to free testfallback");
+
 
     ZF_LOGD("Finished libprocess test.");
 }
 
 
+UNUSED static void test_slabs(void) {
+    int error;
+    process_slab_t slab;
+    vka_object_t objs[NUM_TEST_SLAB_OBJS];
+    vka_object_t obj;
+
+    ZF_LOGD("Starting slab test.");
+
+    error = process_slab_init(&slab, seL4_NotificationObject, seL4_NotificationBits);
+    assert(error == 0);
+
+    error = process_slab_reserve(&slab, NUM_TEST_SLAB_OBJS);
+    assert(error == 0);
+    assert(slab.num_free >= NUM_TEST_SLAB_OBJS);
+    UNUSED seL4_Word num_total = slab.num_total;
+
+    /**
+     * Testing allocation, reserved objects don't grow the slab
+     */
+    for(int i = 0; i < NUM_TEST_SLAB_OBJS; i++) {
+        error = process_slab_alloc(&slab, &objs[i]);
+        assert(error == 0);
+        assert(objs[i].cptr != seL4_CapNull);
+        assert(objs[i].ut != 0);
+        assert(objs[i].type == seL4_NotificationObject);
+#ifdef CONFIG_DEBUG_BUILD
+        assert(seL4_DebugCapIdentify(objs[i].cptr) == TEST_NOTIFICATION_CAP_TYPE);
+#endif
+        for(int j = 0; j < i; j++) {
+            assert(objs[j].cptr != objs[i].cptr);
+        }
+    }
+    assert(slab.num_total == num_total);
+
+    error = process_slab_destroy(&slab);
+    assert(error != 0);
+
+    /**
+     * Testing free, the last object back is the next one out
+     */
+    UNUSED seL4_CPtr last = objs[NUM_TEST_SLAB_OBJS - 1].cptr;
+    for(int i = 0; i < NUM_TEST_SLAB_OBJS; i++) {
+        error = process_slab_free(&slab, &objs[i]);
+        assert(error == 0);
+        assert(objs[i].cptr == seL4_CapNull);
+    }
+    assert(slab.num_free == slab.num_total);
+
+    error = process_slab_free(&slab, &objs[0]);
+    assert(error != 0);
+
+    error = process_slab_alloc(&slab, &obj);
+    assert(error == 0);
+    assert(obj.cptr == last);
+    assert(slab.num_total == num_total);
+
+    error = process_slab_free(&slab, &obj);
+    assert(error == 0);
+
+    error = process_slab_destroy(&slab);
+    assert(error == 0);
+    assert(slab.blocks == NULL);
+    assert(slab.num_total == 0);
+
+#ifdef CONFIG_LIB_PROCESS_SLABS
+    /**
+     * Testing the connection slabs, they stay while an object is in use.
+     * test_runner destroys them once every core is done.
+     */
+    process_conn_obj_t *ep;
+    error = process_create_conn_obj(PROCESS_ENDPOINT, "testslab", NULL, &ep);
+    ZF_LOGF_IF(error, "Failed to create ep");
+
+    error = process_destroy_conn_slabs();
+    assert(error != 0);
+
+    error = process_free_conn_obj(&ep);
+    ZF_LOGF_IF(error, "Failed to free ep");
+#endif
+
+    ZF_LOGD("Finished slab test.");
+}
+
+
+/**
+ * Runs on a lazy stack, so its faults go to the fault handler. The deep
+ * frame and the region page are both committed on first touch.
+ */
+UNUSED static void *lazy_helper_func(void *cookie) {
+    volatile char deep[LAZY_TEST_STACK_BYTES];
+
+    for(seL4_Word i = 0; i < sizeof(deep); i += PAGE_SIZE_4K) {
+        deep[i] = (char)(i >> PAGE_BITS_4K);
+    }
+
+    int *region = cookie;
+    region[(LAZY_TEST_TOUCHED_PAGE << PAGE_BITS_4K) / sizeof(int)] = 410;
+
+    return (void*)(uintptr_t)deep[PAGE_SIZE_4K];
+}
+
+
+UNUSED static void test_lazy(void) {
+    int error;
+    void *region;
+    reservation_t res;
+    mmap_lazy_stats_t stats;
+    UNUSED seL4_Word bytes;
+
+    ZF_LOGD("Starting lazy region test.");
+
+    error = thread_fault_handler_start();
+    assert(error == 0);
+
+    error = mmap_new_pages_lazy(LAZY_TEST_REGION_PAGES, &mmap_attr_4k_data, &region, &res);
+    assert(error == 0);
+
+    /* Stats are looked up by the end of a region, like a stack top */
+    void *region_end = (void*)((uintptr_t)region + (LAZY_TEST_REGION_PAGES << PAGE_BITS_4K));
+    error = mmap_lazy_get_stats(region_end, &stats);
+    assert(error == 0);
+    assert(stats.size_pages == LAZY_TEST_REGION_PAGES);
+    assert(stats.committed_pages == 0);
+
+    thread_handle_t *helper = thread_handle_create(&thread_defaults_1MB_lazy_stack);
+    assert(helper != NULL);
+
+    error = thread_start(helper, lazy_helper_func, region);
+    assert(error == 0);
+
+    UNUSED void *ret = thread_join(helper);
+    assert(ret == (void*)1);
+
+    /**
+     * Testing the region, only the touched page's fault around window is
+     * backed and the write shows up here
+     */
+    assert(((int*)region)[(LAZY_TEST_TOUCHED_PAGE << PAGE_BITS_4K) / sizeof(int)] == 410);
+
+    error = mmap_lazy_get_stats(region_end, &stats);
+    assert(error == 0);
+    assert(stats.committed_pages >= 1);
+    assert(stats.committed_pages <= CONFIG_LIB_MMAP_LAZY_FAULT_AROUND_PAGES);
+    assert(stats.high_water_pages >= LAZY_TEST_REGION_PAGES - LAZY_TEST_TOUCHED_PAGE);
+
+    /**
+     * Testing the stack, it grew past its committed pages on demand
+     */
+    error = mmap_lazy_get_stats(helper->stack_vaddr, &stats);
+    assert(error == 0);
+    assert(stats.size_pages == thread_defaults_1MB_lazy_stack.stack_size_pages);
+    assert(stats.committed_pages > thread_defaults_1MB_lazy_stack.stack_commit_pages);
+
+    error = thread_get_stack_high_water(helper, &bytes);
+    assert(error == 0);
+    assert(bytes >= LAZY_TEST_STACK_BYTES);
+
+    error = thread_destroy_free_handle(&helper);
+    assert(error == 0);
+
+    /* Freeing the pages forgets the region */
+    error = mmap_free_pages(LAZY_TEST_REGION_PAGES, &mmap_attr_4k_data, region, res);
+    assert(error == 0);
+
+    error = mmap_lazy_get_stats(region_end, &stats);
+    assert(error != 0);
+
+    /**
+     * Testing a commit that fails. With no vspace root to remap into, the
+     * write combining attributes can't be set after the frame is mapped.
+     * The fault must stay unresolved, or the handler would reply and the
+     * thread would fault on the same page forever.
+     */
+    error = mmap_new_pages_lazy_custom(&init_objects.vspace, seL4_CapNull, 1,
+                                       &mmap_attr_4k_write_combine, 1, &region, &res);
+    assert(error == 0);
+
+    error = mmap_lazy_handle_fault(region);
+    assert(error != 0);
+    assert(vspace_get_cap(&init_objects.vspace, region) == seL4_CapNull);
+
+    region_end = (void*)((uintptr_t)region + PAGE_SIZE_4K);
+    error = mmap_lazy_get_stats(region_end, &stats);
+    assert(error == 0);
+    assert(stats.committed_pages == 0);
+
+    error = mmap_free_pages(1, &mmap_attr_4k_write_combine, region, res);
+    assert(error == 0);
+
+    ZF_LOGD("Finished lazy region test.");
+}
+
+
+/**
+ * xorshift, sizes from 1 byte to 16KB with small ones the most common
+ */
+UNUSED static size_t malloc_test_size(uint32_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return 1 + (((*seed >> 8) & 0x3fff) >> ((*seed >> 24) % 12));
+}
+
+UNUSED static void malloc_test_check(const uint8_t *ptr, size_t size, uint8_t fill) {
+    for(size_t i = 0; i < size; i++) {
+        ZF_LOGF_IF(ptr[i] != fill, "Heap corruption at %p", &ptr[i]);
+    }
+}
+
+/**
+ * Frees the first half of the test's blocks from another thread.
+ */
+UNUSED static void *malloc_free_func(void *cookie) {
+    void **ptrs = cookie;
+    for(int i = 0; i < MALLOC_TEST_SLOTS / 2; i++) {
+        free(ptrs[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Every core runs this at once, so the thread caches, the central lists and
+ * the chunk heap all see contention.
+ */
+UNUSED static void test_malloc_stress(void) {
+    int error;
+    void *ptrs[MALLOC_TEST_SLOTS];
+    size_t sizes[MALLOC_TEST_SLOTS];
+    uint32_t seed = 2463534242u ^ (uint32_t)thread_get_id();
+
+    ZF_LOGD("Starting malloc stress test.");
+
+    for(int i = 0; i < MALLOC_TEST_SLOTS; i++) {
+        sizes[i] = malloc_test_size(&seed);
+        ptrs[i] = malloc(sizes[i]);
+        ZF_LOGF_IF(ptrs[i] == NULL, "Failed to malloc %lu bytes", (long unsigned)sizes[i]);
+        memset(ptrs[i], (uint8_t)i, sizes[i]);
+    }
+
+    for(int round = 0; round < MALLOC_TEST_ROUNDS; round++) {
+        for(int i = 0; i < MALLOC_TEST_SLOTS; i++) {
+            uint8_t fill = (uint8_t)(i + round);
+            malloc_test_check(ptrs[i], sizes[i], fill);
+
+            size_t size = malloc_test_size(&seed);
+            switch(seed % 3) {
+            case 0:
+                free(ptrs[i]);
+                ptrs[i] = malloc(size);
+                break;
+            case 1:
+                /* realloc keeps the old contents */
+                ptrs[i] = realloc(ptrs[i], size);
+                ZF_LOGF_IF(ptrs[i] == NULL, "Failed to realloc %lu bytes", (long unsigned)size);
+                malloc_test_check(ptrs[i], MIN(size, sizes[i]), fill);
+                break;
+            default: {
+                size_t align = BIT(4 + seed % 9);
+                free(ptrs[i]);
+                ptrs[i] = aligned_alloc(align, ROUND_UP(size, align));
+                ZF_LOGF_IF(((uintptr_t)ptrs[i] & (align - 1)) != 0,
+                           "%p is not aligned to %lu", ptrs[i], (long unsigned)align);
+                break;
+            }
+            }
+            ZF_LOGF_IF(ptrs[i] == NULL, "Failed to allocate %lu bytes", (long unsigned)size);
+#ifdef CONFIG_LIB_MMAP_MALLOC
+            ZF_LOGF_IF(mmap_malloc_usable_size(ptrs[i]) < size, "Usable size of %p is too small",
+                       ptrs[i]);
+#endif
+            sizes[i] = size;
+            memset(ptrs[i], (uint8_t)(fill + 1), size);
+        }
+    }
+
+    /**
+     * Testing frees from a thread that didn't allocate the blocks
+     */
+    thread_handle_t *helper = thread_handle_create(&thread_defaults_1MB_stack);
+    ZF_LOGF_IF(helper == NULL, "Failed to create thread");
+
+    error = thread_start(helper, malloc_free_func, ptrs);
+    ZF_LOGF_IF(error, "Failed to start thread");
+    thread_join(helper);
+
+    error = thread_destroy_free_handle(&helper);
+    ZF_LOGF_IF(error, "Failed to destroy thread");
+
+    for(int i = MALLOC_TEST_SLOTS / 2; i < MALLOC_TEST_SLOTS; i++) {
+        malloc_test_check(ptrs[i], sizes[i], (uint8_t)(i + MALLOC_TEST_ROUNDS));
+        free(ptrs[i]);
+    }
+
+    ZF_LOGD("Finished malloc stress test.");
+}
+
+
 UNUSED static void test_process_leaks(void) {
     int err;
     uint64_t num_cycles = 0;
@@ -335,7 +704,7 @@ UNUSED static void demo(void) {
      * Give the new processes an IPC endpoint to communicate
      */
     process_conn_obj_t *echo1ep;
-    err = process_create_conn_obj(PROCESS_ENDPOINT, "echo1-ep", NULL, &echo1ep); 
+    err = process_create_conn_obj(PROCESS_ENDPOINT, CONN_ECHO1_EP_NAME, NULL, &echo1ep); 
     ZF_LOGF_IF(err, "Failed to create ep");
     checkpoint(); // 4
     err = process_connect(&child1, echo1ep, process_rwg, NULL, NULL);
@@ -352,10 +721,10 @@ UNUSED static void demo(void) {
     process_conn_obj_t *echo1shmem;
     process_conn_obj_t *echo2shmem;
 
-    err = process_create_conn_obj(PROCESS_SHARED_MEMORY, "echo1-shmem", NULL, &echo1shmem);
+    err = process_create_conn_obj(PROCESS_SHARED_MEMORY, CONN_ECHO1_SHMEM_NAME, NULL, &echo1shmem);
     ZF_LOGF_IF(err, "Failed to create shared memory");
     checkpoint(); // 7
-    err = process_create_conn_obj(PROCESS_SHARED_MEMORY, "echo2-shmem", NULL, &echo2shmem);
+    err = process_create_conn_obj(PROCESS_SHARED_MEMORY, CONN_ECHO2_SHMEM_NAME, NULL, &echo2shmem);
     ZF_LOGF_IF(err, "Failed to create shared memory");
     checkpoint(); // 8
     err = process_connect(&child1, echo1shmem, process_rw, NULL, NULL);
@@ -376,10 +745,10 @@ UNUSED static void demo(void) {
     process_conn_obj_t *echo1notif;
     process_conn_obj_t *echo2notif;
 
-    err = process_create_conn_obj(PROCESS_NOTIFICATION, "echo1-notif", NULL, &echo1notif);
+    err = process_create_conn_obj(PROCESS_NOTIFICATION, CONN_ECHO1_NOTIF_NAME, NULL, &echo1notif);
     ZF_LOGF_IF(err, "Failed to create notification ep");
     checkpoint(); // 13
-    err = process_create_conn_obj(PROCESS_NOTIFICATION, "echo2-notif", NULL, &echo2notif);
+    err = process_create_conn_obj(PROCESS_NOTIFICATION, CONN_ECHO2_NOTIF_NAME, NULL, &echo2notif);
     ZF_LOGF_IF(err, "Failed to create notification ep");
     checkpoint(); // 14
     err = process_connect(&child1, echo1notif, process_rw, NULL, NULL);
@@ -505,6 +874,9 @@ void * test_runner(void* cookie) {
 #ifdef RUN_TESTS
 		test_libthread();
 		test_libprocess();
+		test_slabs();
+		test_lazy();
+		test_malloc_stress();
 		//test_process_leaks();
 		//test_thread_init_objects();
 #endif
@@ -521,6 +893,10 @@ void * test_runner(void* cookie) {
 			ZF_LOGI("\n\n\n>>>>> ALL CORES FINISHED QUICK DEMO. \n\nDONE.\n\n");
 			cond_lock_release(&runner_cond);
         		while(1)seL4_Sleep(1000);
+#endif
+#if defined(RUN_TESTS) && defined(CONFIG_LIB_PROCESS_SLABS)
+			/* Every test has freed its connection objects by now */
+			ZF_LOGF_IF(process_destroy_conn_slabs(), "Failed to destroy the connection slabs");
 #endif
 			ZF_LOGI("\n\n\n>>>>> ALL CORES FINISHED TEST, RESTARTING...");
 			ZF_LOGI(">>>>> STARTING CYCLE %i", cycle_count);
@@ -559,6 +935,15 @@ int main(void) {
     }
 
 
+    /**
+     * Let the demo and test children find their connections by ID.
+     * testfallback is the last ID and is left out on purpose, test_proc
+     * finds it by name.
+     */
+    static const init_conn_id_t conn_ids[] = CONN_ID_TABLE;
+    err = process_set_conn_ids(conn_ids, CONN_TESTFALLBACK);
+    ZF_LOGF_IF(err, "Failed to set connection IDs");
+
     cond_init(&runner_cond, LOCK_NOTIFICATION);
     runner_count = CONFIG_MAX_NUM_NODES;
 
@@ -588,6 +973,7 @@ int main(void) {
 
 #ifdef RUN_TESTS
     int current_checks[CONFIG_MAX_NUM_NODES];
+    bool usage_printed = false;
     while(1){
         nanosleep(&(struct timespec){.tv_sec=2, .tv_nsec=0}, NULL);
         for(int i=0; i< CONFIG_MAX_NUM_NODES; i++) {
@@ -600,6 +986,12 @@ int main(void) {
         for(int i=0; i<CONFIG_MAX_NUM_NODES; i++) {
             printf("%d\t\t\t%d\n", i+1, current_checks[i]);
         }
+        if(!usage_printed) {
+            /* Peaks only grow, one report while the tests run is enough */
+            thread_print_memory_usage();
+            process_print_memory_usage();
+            usage_printed = true;
+        }
     }
 #else
     printf("\n\nMain idling.\n\n\n\n");
@@ -37,8 +37,72 @@
 
 /* Include seL4 COE library headers */
 #include <init/init.h>
+#include <init/internal.h>
 #include <thread/thread.h>
 
+/* Generated from root_task/connections by gen_conn_ids.py */
+#include <conn_ids.h>
+
+
+/**
+ * Every way of finding a connection has to agree, see test_libprocess in
+ * the root task. Returns the testdup everyone found.
+ */
+static seL4_CPtr test_lookups(void) {
+    /**
+     * testdup was connected twice, the index and the init data itself pick
+     * the same one
+     */
+    seL4_CPtr dup = init_lookup_notification(CONN_TESTDUP_NAME);
+    ZF_LOGF_IF(dup == seL4_CapNull, "Failed to lookup testdup");
+
+    init_handle_t handle = init_lookup_handle(INIT_NAME_NOTIFICATION, CONN_TESTDUP_NAME);
+    ZF_LOGF_IF(handle == NULL || handle->value.cap != dup, "Indexed lookup disagrees on testdup");
+
+#ifdef CONFIG_LIB_INIT_FLAT_INIT_DATA
+    const init_flat_endpoint_t *record = libinit_flat_find(init_objects.init_flat,
+                                                           INIT_FLAT_NOTIFICATION,
+                                                           sizeof(init_flat_endpoint_t),
+                                                           CONN_TESTDUP_NAME);
+    ZF_LOGF_IF(record == NULL || record->cap != dup, "Flat lookup disagrees on testdup");
+#else
+    EndpointData *ntfn = init_objects.init_data->notification_list_head;
+    while(ntfn != NULL && strcmp(ntfn->name, CONN_TESTDUP_NAME) != 0) {
+        ntfn = ntfn->next;
+    }
+    ZF_LOGF_IF(ntfn == NULL || ntfn->cap != dup, "Init data disagrees on testdup");
+#endif
+
+    /**
+     * Filled in by our parent
+     */
+    ZF_LOGF_IF(CONN_TESTDUP >= init_objects.num_conn_ids ||
+               init_objects.conn_ids[CONN_TESTDUP] != dup, "testdup ID wasn't filled in");
+    ZF_LOGF_IF(init_conn_cap(CONN_TESTDUP) != dup, "ID lookup disagrees on testdup");
+    ZF_LOGF_IF(CONN_TESTNOTIF >= init_objects.num_conn_ids, "testnotif ID wasn't filled in");
+    ZF_LOGF_IF(init_conn_cap(CONN_TESTNOTIF) != init_lookup_notification(CONN_TESTNOTIF_NAME),
+               "ID lookup disagrees on testnotif");
+    ZF_LOGF_IF(init_conn_cap(CONN_TESTEP) != init_lookup_endpoint(CONN_TESTEP_NAME),
+               "ID lookup disagrees on testep");
+    ZF_LOGF_IF(init_conn_addr(CONN_TESTSHMEM) != init_lookup_shmem(CONN_TESTSHMEM_NAME),
+               "ID lookup disagrees on testshmem");
+
+    /**
+     * Left out of the table, found by name
+     */
+    ZF_LOGF_IF(CONN_TESTFALLBACK < init_objects.num_conn_ids, "testfallback ID was filled in");
+    seL4_CPtr fallback = init_conn_cap(CONN_TESTFALLBACK);
+    ZF_LOGF_IF(fallback == seL4_CapNull ||
+               fallback != init_lookup_notification(CONN_TESTFALLBACK_NAME),
+               "Fallback lookup failed for testfallback");
+
+    /**
+     * Not given to us at all
+     */
+    ZF_LOGF_IF(init_conn_cap(CONN_ECHO1_EP) != seL4_CapNull, "Found echo1-ep");
+
+    return dup;
+}
 
 /**
  * Demo entry point
@@ -49,6 +113,9 @@ int main(int argc, char **argv) {
     error = init_process();
     ZF_LOGF_IF(error, "Failed to init child process");
 
+    /* Before testep, so the root task can check it once we've replied */
+    seL4_Signal(test_lookups());
+
     seL4_CPtr testep = init_lookup_endpoint("testep");
     ZF_LOGF_IF(testep == seL4_CapNull, "Failed to lookup testep");
 
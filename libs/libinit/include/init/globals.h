@@ -8,3 +8,10 @@
 #include "types.h"
 
 extern init_objects_t init_objects; 
+
+/**
+ * Pattern written over unused memory to measure peak heap and stack usage.
+ * The 32 bit pattern is repeated to fill a word, so it fits both word sizes.
+ */
+#define INIT_WATERMARK_PATTERN 0xC0E5C0E5u
+#define INIT_WATERMARK_CANARY ((seL4_Word)INIT_WATERMARK_PATTERN * (~(seL4_Word)0 / 0xFFFFFFFFu))
@@ -46,6 +46,24 @@ init_has_untypeds(void) {
     return __atomic_load_n(&init_objects.has_untypeds, __ATOMIC_SEQ_CST) ? true : false;
 }
 
+/**
+ * @brief Lookup a connection by the ID tools/gen_conn_ids.py gave it
+ *
+ * A single array load when our parent filled in the ID, otherwise the name
+ * is looked up instead. Use init_conn_cap and init_conn_addr with the
+ * generated CONN_* macros rather than calling this directly.
+ */
+static inline seL4_Word
+init_lookup_conn_id(seL4_Word id, init_name_kind_t kind, const char *name) {
+    if(id < init_objects.num_conn_ids && init_objects.conn_ids[id] != 0) {
+        return init_objects.conn_ids[id];
+    }
+    return init_lookup_conn_name(kind, name);
+}
+
+#define init_conn_cap(ID)   ((seL4_CPtr)init_lookup_conn_id(ID, ID##_KIND, ID##_NAME))
+#define init_conn_addr(ID)  ((void *)init_lookup_conn_id(ID, ID##_KIND, ID##_NAME))
+
 static inline int
 init_lock_init(seL4_CPtr notification) {
     #ifdef CONFIG_DEBUG_BUILD
@@ -0,0 +1,75 @@
+/**
+ * @file internal.h
+ * @brief Internal definitions shared between the libinit source files
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sel4/sel4.h>
+
+#include <init/init.h>
+
+
+/**
+ * Take over brk and anonymous mmap for the heap range [start, start + reserve_size).
+ * The top initial_size bytes are already backed. Must run before the first malloc.
+ */
+int libinit_heap_setup(uintptr_t start, size_t reserve_size, size_t initial_size);
+
+/**
+ * Reserve the unbacked part of the heap and let it commit frames. Call right
+ * after bootstrapping the vspace, before anything else reserves address space.
+ */
+int libinit_heap_enable_growth(void);
+
+/**
+ * Bytes committed to a growable heap and its reserved size. Returns false,
+ * touching nothing, if the heap isn't growable.
+ */
+bool libinit_heap_get_usage(seL4_Word *used, seL4_Word *size);
+
+
+/**
+ * Check flat init data of size bytes. Returns NULL if it's malformed.
+ */
+const init_flat_header_t *libinit_flat_open(const void *data, size_t size);
+
+/**
+ * Binary search a named section for a record, NULL if there is none.
+ */
+const void *libinit_flat_find(const init_flat_header_t *flat,
+                              init_flat_section_id_t section,
+                              size_t record_size,
+                              const char *name);
+
+#define INIT_FLAT_SECTION(flat, id, type) \
+    ((const type *)((uintptr_t)(flat) + (flat)->sections[id].offset))
+
+static inline const char *libinit_flat_string(const init_flat_header_t *flat, seL4_Word offset)
+{
+    /* The data ends in a NUL, so any offset inside it is a valid string */
+    return (offset < flat->size) ? (const char *)((uintptr_t)flat + offset) : "";
+}
+
+
+/**
+ * Hash every name in the init data into a table. Runs once from init_process.
+ */
+int libinit_index_build(void);
+
+/**
+ * Find a name in the index, NULL if it isn't there or there is no index.
+ */
+const init_name_t *libinit_index_find(init_name_kind_t kind, const char *name);
+
+/**
+ * Like libinit_index_find, but without an index resolves the name from the
+ * init data itself into scratch.
+ */
+const init_name_t *libinit_index_lookup(init_name_kind_t kind, const char *name,
+                                        init_name_t *scratch);
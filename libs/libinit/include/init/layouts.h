@@ -25,3 +25,20 @@
 
 
 
+
+
+/**
+ * Flat init data layout, used instead of protobuf with CONFIG_LIB_INIT_FLAT_INIT_DATA.
+ * Every field is a seL4_Word and every offset counts from the start of the header.
+ *
+ * +------------------------------------+
+ * | init_flat_header_t                 |
+ * +------------------------------------+
+ * | record arrays, one per section     | <- named records sorted by name
+ * +------------------------------------+
+ * | device memory cap arrays           |
+ * +------------------------------------+
+ * | string table                       | <- NUL terminated, ends the data
+ * +------------------------------------+
+ */
+#define INIT_FLAT_MAGIC                     0x54494e49 /* "INIT" */
@@ -72,6 +72,80 @@ seL4_CPtr init_lookup_notification(const char *);
 void * init_lookup_shmem(const char *);
 
 
+/**
+ * @brief Get the peak number of heap bytes this process has used.
+ *
+ * A growable heap reports the bytes it has committed. Otherwise child
+ * processes need CONFIG_LIB_INIT_HEAP_WATERMARK, and the estimate is the
+ * heap size minus the largest span that was never written.
+ *
+ * @param[out]  used    Peak bytes used
+ * @param[out]  size    Total heap size in bytes, reserved size for a growable heap, may be NULL
+ * @return              Error code
+ */
+int init_get_heap_high_water(seL4_Word *used, seL4_Word *size);
+
+/**
+ * @brief Get the peak number of bytes used on our main thread's stack.
+ *
+ * Only child processes know where their main stack is. The parent paints it
+ * when CONFIG_LIB_THREAD_STACK_WATERMARK is set.
+ *
+ * @param[out]  used    Peak bytes used, counted from the stack top
+ * @param[out]  size    Stack size in bytes, may be NULL
+ * @return              Error code
+ */
+int init_get_main_stack_high_water(seL4_Word *used, seL4_Word *size);
+
+
+/**
+ * @brief Set up an empty arena whose first block will be block_size bytes.
+ */
+void init_arena_init(init_arena_t *arena, size_t block_size);
+
+/**
+ * @brief Allocate from an arena, 16 byte aligned. There is no matching free.
+ */
+void *init_arena_alloc(init_arena_t *arena, size_t size);
+
+char *init_arena_strndup(init_arena_t *arena, const char *str, size_t max_len);
+
+/**
+ * @brief Free everything allocated from an arena.
+ */
+void init_arena_destroy(init_arena_t *arena);
+
+
+/**
+ * @brief Allocate count cslots that are next to each other in one CNode.
+ *
+ * A single seL4_Untyped_Retype to first fills the whole range.
+ *
+ * @param[out]  slots   The count cptrs, in slot order
+ * @param[out]  first   Path to the first slot
+ * @return              0 on success, -1 if no such range could be found
+ */
+int init_cspace_alloc_range(vka_t *vka, seL4_Word count, seL4_CPtr *slots, cspacepath_t *first);
+
+/**
+ * @brief Free the slots of a range from init_cspace_alloc_range.
+ */
+void init_cspace_free_range(vka_t *vka, const seL4_CPtr *slots, seL4_Word count);
+
+
+/**
+ * @brief Size of init data packed in the flat format, see layouts.h
+ */
+size_t init_flat_get_packed_size(const InitData *data);
+
+/**
+ * @brief Pack init data in the flat format. out needs init_flat_get_packed_size bytes.
+ *
+ * @return  bytes written
+ */
+size_t init_flat_pack(const InitData *data, void *out);
+
+
 int init_set_thread_local_storage(void * storage);
 void *init_get_thread_local_storage(void);
 
@@ -108,3 +182,26 @@ void * init_lookup_devmem_addr(const char *);
  */
 int init_lookup_devmem_info(const char *, init_devmem_info_t *);
 
+
+/**
+ * @brief Resolve a name once and keep the handle
+ *
+ * Handles stay valid for the life of the process. Reading handle->value
+ * skips hashing the name on every use.
+ *
+ * @return The handle, NULL if there is no such name or the init data
+ *         couldn't be indexed.
+ */
+init_handle_t init_lookup_handle(init_name_kind_t kind, const char *name);
+
+
+/**
+ * @brief Lookup the cap or address of a connection by name
+ *
+ * The fallback of init_lookup_conn_id when our parent didn't set the ID.
+ *
+ * @return The cap for endpoints and notifications, the address for shmem
+ *         and device memory, 0 if there is no such connection.
+ */
+seL4_Word init_lookup_conn_name(init_name_kind_t kind, const char *name);
+
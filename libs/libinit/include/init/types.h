@@ -37,6 +37,125 @@ typedef struct init_devmem_info {
     seL4_CPtr *caps;
 } init_devmem_info_t;
 
+/**
+ * @brief Kinds of named init data
+ */
+typedef enum init_name_kind {
+    INIT_NAME_ENDPOINT = 0,
+    INIT_NAME_NOTIFICATION,
+    INIT_NAME_SHMEM,
+    INIT_NAME_IRQ,
+    INIT_NAME_DEVMEM,
+    INIT_NAME_NUM_KINDS,
+} init_name_kind_t;
+
+/**
+ * @brief A resolved name from the init data index, see init_lookup_handle
+ */
+typedef struct init_name {
+    const char *name;
+    init_name_kind_t kind;
+    uint32_t hash;
+    union {
+        seL4_CPtr cap;                  /* Endpoints and notifications */
+        void *addr;                     /* Shared memory */
+        init_irq_info_t irq;
+        init_devmem_info_t devmem;
+    } value;
+} init_name_t;
+
+typedef const init_name_t *init_handle_t;
+
+/**
+ * @brief An entry of the table generated by tools/gen_conn_ids.py
+ *
+ * A connection's ID is its position in the table.
+ */
+typedef struct init_conn_id {
+    init_name_kind_t kind;
+    const char *name;
+} init_conn_id_t;
+
+/**
+ * @brief Sections of the flat init data, see layouts.h
+ */
+typedef enum init_flat_section_id {
+    INIT_FLAT_UNTYPED = 0,
+    INIT_FLAT_ENDPOINT,
+    INIT_FLAT_NOTIFICATION,
+    INIT_FLAT_SHMEM,
+    INIT_FLAT_IRQ,
+    INIT_FLAT_DEVMEM,
+    INIT_FLAT_CONN_IDS,             /* seL4_Words indexed by connection ID */
+    INIT_FLAT_NUM_SECTIONS,
+} init_flat_section_id_t;
+
+typedef struct init_flat_section {
+    seL4_Word offset;
+    seL4_Word count;
+} init_flat_section_t;
+
+typedef struct init_flat_header {
+    seL4_Word magic;
+    seL4_Word size;                 /* Including the header */
+    seL4_Word proc_name;            /* String offset */
+    seL4_Word cnode_next_free;
+    seL4_Word cnode_size_bits;
+    seL4_Word stack_size_pages;
+    seL4_Word stack_vaddr;
+    seL4_Word cpu_affinity;
+    init_flat_section_t sections[INIT_FLAT_NUM_SECTIONS];
+} init_flat_header_t;
+
+/**
+ * Named records all start with the offset of their name.
+ */
+typedef struct init_flat_untyped {
+    seL4_Word cap;
+    seL4_Word size_bits;
+    seL4_Word phys_addr;
+} init_flat_untyped_t;
+
+typedef struct init_flat_endpoint {
+    seL4_Word name;
+    seL4_Word cap;
+} init_flat_endpoint_t;
+
+typedef struct init_flat_shmem {
+    seL4_Word name;
+    seL4_Word addr;
+    seL4_Word length_bytes;
+} init_flat_shmem_t;
+
+typedef struct init_flat_irq {
+    seL4_Word name;
+    seL4_Word irq_cap;
+    seL4_Word ep_cap;
+    seL4_Word number;
+} init_flat_irq_t;
+
+typedef struct init_flat_devmem {
+    seL4_Word name;
+    seL4_Word virt_addr;
+    seL4_Word phys_addr;
+    seL4_Word size_bits;
+    seL4_Word num_pages;
+    seL4_Word caps;                 /* Offset of num_pages caps, 0 if there are none */
+} init_flat_devmem_t;
+
+typedef struct init_arena_block init_arena_block_t;
+
+/**
+ * @brief Bump allocator for init data, see arena.c
+ *
+ * allocator can be passed to protobuf-c directly.
+ */
+typedef struct init_arena {
+    ProtobufCAllocator allocator;
+    init_arena_block_t *blocks;     /* Newest first */
+    size_t block_size;              /* Size of the next block */
+} init_arena_t;
+
 /**
  * @brief Bookkeeping objects/managers/allocators
  *
@@ -57,9 +176,15 @@ typedef struct init_objects {
 
     sync_recursive_mutex_t vspace_lock;
     lockvspace_t lockvspace;
+#ifdef CONFIG_LIB_LOCK_WRAPPER_RANGE_VSPACE
+    rangevspace_t rangevspace;
+#endif
 
     sync_mutex_t vka_lock;
     lockvka_t lockvka;
+#ifdef CONFIG_LIB_LOCK_WRAPPER_MAGAZINES
+    cachevka_t cachevka;
+#endif
 
     /* We can abstract away from boot info here */
     seL4_CPtr cnode_cap;
@@ -74,6 +199,14 @@ typedef struct init_objects {
 
     const char *proc_name;
 
+    /* Core the main thread runs on, the root task boots on core 0 */
+    int main_core;
+
     InitData *init_data;
+    const init_flat_header_t *init_flat;    /* Instead of init_data with flat init data */
+
+    /* Cap or address of each connection ID, 0 if the parent didn't set it */
+    const seL4_Word *conn_ids;
+    seL4_Word num_conn_ids;
 
 } init_objects_t;
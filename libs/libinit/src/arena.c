@@ -0,0 +1,102 @@
+/**
+ * @file arena.c
+ * @brief Bump allocator for init data
+ *
+ * Init data is built up and unpacked one small node at a time and only ever
+ * released all at once, so nodes are carved out of a few large blocks. Each
+ * new block is twice the size of the last, a list of any length costs a
+ * handful of mallocs. Freeing a single node does nothing.
+ *
+ * The arena doubles as a ProtobufCAllocator, so init_data__unpack can
+ * allocate from it directly.
+ */
+#include <autoconf.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <init/init.h>
+
+#define ARENA_ALIGN 16
+
+struct init_arena_block {
+    struct init_arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+#define ARENA_BLOCK_HEADER ROUND_UP(sizeof(init_arena_block_t), ARENA_ALIGN)
+
+
+static void *arena_protobuf_alloc(void *allocator_data, size_t size)
+{
+    return init_arena_alloc((init_arena_t *)allocator_data, size);
+}
+
+static void arena_protobuf_free(UNUSED void *allocator_data, UNUSED void *pointer)
+{
+}
+
+
+void init_arena_init(init_arena_t *arena, size_t block_size)
+{
+    arena->allocator.alloc = arena_protobuf_alloc;
+    arena->allocator.free = arena_protobuf_free;
+    arena->allocator.allocator_data = arena;
+    arena->blocks = NULL;
+    arena->block_size = MAX(block_size, ARENA_BLOCK_HEADER + ARENA_ALIGN);
+}
+
+
+void *init_arena_alloc(init_arena_t *arena, size_t size)
+{
+    size = ROUND_UP(MAX(size, 1), ARENA_ALIGN);
+
+    init_arena_block_t *block = arena->blocks;
+    if(block == NULL || block->size - block->used < size) {
+        size_t block_size = MAX(arena->block_size, ARENA_BLOCK_HEADER + size);
+        block = malloc(block_size);
+        if(block == NULL) {
+            ZF_LOGE("Failed to malloc an arena block of %lu bytes", (long unsigned)block_size);
+            return NULL;
+        }
+        block->size = block_size;
+        block->used = ARENA_BLOCK_HEADER;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->block_size *= 2;
+    }
+
+    void *ptr = (void *)((uintptr_t)block + block->used);
+    block->used += size;
+    return ptr;
+}
+
+
+char *init_arena_strndup(init_arena_t *arena, const char *str, size_t max_len)
+{
+    size_t len = strnlen(str, max_len);
+    char *copy = init_arena_alloc(arena, len + 1);
+    if(copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+
+/**
+ * Frees every block. The arena can be used again afterwards and starts over
+ * at its current block size.
+ */
+void init_arena_destroy(init_arena_t *arena)
+{
+    while(arena->blocks != NULL) {
+        init_arena_block_t *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
@@ -0,0 +1,119 @@
+/**
+ * @file cspace.c
+ * @brief Contiguous cslot ranges
+ *
+ * seL4_Untyped_Retype writes all of its objects to consecutive slots of one
+ * CNode, but the vka only hands out single slots in whatever order its
+ * allocator likes. A range is found by taking slots until count of them
+ * sit next to each other, then giving the rest back. With allocman that is
+ * usually the first count slots.
+ */
+#include <autoconf.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <vka/vka.h>
+#include <vka/capops.h>
+#include <utils/util.h>
+
+#include <init/init.h>
+
+/* Slots taken beyond count before giving up on finding a range */
+#define CSPACE_RANGE_SLACK 64
+
+typedef struct cspace_slot {
+    seL4_CPtr cptr;
+    cspacepath_t path;
+} cspace_slot_t;
+
+
+static inline bool cspace_same_cnode(const cspacepath_t *a, const cspacepath_t *b)
+{
+    return a->root == b->root && a->dest == b->dest && a->destDepth == b->destDepth;
+}
+
+static inline bool cspace_before(const cspacepath_t *a, const cspacepath_t *b)
+{
+    if(a->dest != b->dest) {
+        return a->dest < b->dest;
+    }
+    return a->offset < b->offset;
+}
+
+
+int init_cspace_alloc_range(vka_t *vka, seL4_Word count, seL4_CPtr *slots, cspacepath_t *first)
+{
+    if(vka == NULL || slots == NULL || first == NULL || count == 0) {
+        ZF_LOGE("Invalid arguments");
+        return -1;
+    }
+
+    seL4_Word max_held = 2 * count + CSPACE_RANGE_SLACK;
+    cspace_slot_t *held = malloc(sizeof(cspace_slot_t) * max_held);
+    if(held == NULL) {
+        ZF_LOGE("Failed to malloc cslot bookkeeping");
+        return -1;
+    }
+
+    /* held stays sorted by CNode and offset, so a range is a run of neighbours */
+    seL4_Word num_held = 0;
+    seL4_Word run_start = 0;
+    bool found = false;
+
+    while(!found && num_held < max_held) {
+        cspace_slot_t slot;
+        if(vka_cspace_alloc(vka, &slot.cptr) != 0) {
+            break;
+        }
+        vka_cspace_make_path(vka, slot.cptr, &slot.path);
+
+        seL4_Word pos = num_held;
+        while(pos > 0 && cspace_before(&slot.path, &held[pos - 1].path)) {
+            held[pos] = held[pos - 1];
+            pos--;
+        }
+        held[pos] = slot;
+        num_held++;
+
+        seL4_Word lo = pos;
+        seL4_Word hi = pos;
+        while(lo > 0 && cspace_same_cnode(&held[lo - 1].path, &slot.path) &&
+              held[lo - 1].path.offset + 1 == held[lo].path.offset) {
+            lo--;
+        }
+        while(hi + 1 < num_held && cspace_same_cnode(&held[hi + 1].path, &slot.path) &&
+              held[hi].path.offset + 1 == held[hi + 1].path.offset) {
+            hi++;
+        }
+        if(hi - lo + 1 >= count) {
+            run_start = lo;
+            found = true;
+        }
+    }
+
+    for(seL4_Word i = 0; i < num_held; i++) {
+        if(found && i >= run_start && i < run_start + count) {
+            slots[i - run_start] = held[i].cptr;
+        } else {
+            vka_cspace_free(vka, held[i].cptr);
+        }
+    }
+    if(found) {
+        *first = held[run_start].path;
+    } else {
+        ZF_LOGE("Failed to find %lu contiguous cslots", (long unsigned)count);
+    }
+
+    free(held);
+    return found ? 0 : -1;
+}
+
+
+void init_cspace_free_range(vka_t *vka, const seL4_CPtr *slots, seL4_Word count)
+{
+    for(seL4_Word i = 0; i < count; i++) {
+        vka_cspace_free(vka, slots[i]);
+    }
+}
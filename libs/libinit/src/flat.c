@@ -0,0 +1,341 @@
+/**
+ * @file flat.c
+ * @brief Flat init data format
+ *
+ * An alternative to packing InitData with protobuf. The parent still builds
+ * an InitData and packs it here into the layout described in layouts.h. The
+ * child reads that in place from its init data pages: there's nothing to
+ * unpack and nothing to allocate, lookups binary search the named sections.
+ *
+ * Parent and child are built for the same kernel, so every field is a
+ * seL4_Word and device caps can be handed out as a seL4_CPtr array directly.
+ */
+#include <autoconf.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <init/init.h>
+#include <init/internal.h>
+
+
+static const size_t flat_record_size[INIT_FLAT_NUM_SECTIONS] = {
+    [INIT_FLAT_UNTYPED] = sizeof(init_flat_untyped_t),
+    [INIT_FLAT_ENDPOINT] = sizeof(init_flat_endpoint_t),
+    [INIT_FLAT_NOTIFICATION] = sizeof(init_flat_endpoint_t),
+    [INIT_FLAT_SHMEM] = sizeof(init_flat_shmem_t),
+    [INIT_FLAT_IRQ] = sizeof(init_flat_irq_t),
+    [INIT_FLAT_DEVMEM] = sizeof(init_flat_devmem_t),
+    [INIT_FLAT_CONN_IDS] = sizeof(seL4_Word),
+};
+
+#define FLAT_FOR_EACH(TYPE, iter, head) \
+    for(const TYPE *iter = (head); iter != NULL; iter = iter->next)
+
+typedef struct flat_layout {
+    seL4_Word counts[INIT_FLAT_NUM_SECTIONS];
+    seL4_Word num_caps;
+    seL4_Word string_bytes;
+    seL4_Word size;
+} flat_layout_t;
+
+
+static inline const char *flat_name(const char *name)
+{
+    return (name != NULL) ? name : "";
+}
+
+
+static seL4_Word flat_devmem_num_caps(const DeviceMemoryData *devmem)
+{
+    if(devmem->n_caps32 == devmem->num_pages && sizeof(seL4_CPtr) == sizeof(uint32_t)) {
+        return devmem->n_caps32;
+    } else if(devmem->n_caps64 == devmem->num_pages && sizeof(seL4_CPtr) == sizeof(uint64_t)) {
+        return devmem->n_caps64;
+    }
+    return 0;
+}
+
+
+static void flat_measure(const InitData *data, flat_layout_t *layout)
+{
+    memset(layout, 0, sizeof(*layout));
+    layout->string_bytes = strlen(flat_name(data->proc_name)) + 1;
+
+    FLAT_FOR_EACH(UntypedData, ut, data->untyped_list_head) {
+        layout->counts[INIT_FLAT_UNTYPED]++;
+    }
+    FLAT_FOR_EACH(EndpointData, ep, data->ep_list_head) {
+        layout->counts[INIT_FLAT_ENDPOINT]++;
+        layout->string_bytes += strlen(flat_name(ep->name)) + 1;
+    }
+    FLAT_FOR_EACH(EndpointData, ntfn, data->notification_list_head) {
+        layout->counts[INIT_FLAT_NOTIFICATION]++;
+        layout->string_bytes += strlen(flat_name(ntfn->name)) + 1;
+    }
+    FLAT_FOR_EACH(SharedMemoryData, shmem, data->shmem_list_head) {
+        layout->counts[INIT_FLAT_SHMEM]++;
+        layout->string_bytes += strlen(flat_name(shmem->name)) + 1;
+    }
+    FLAT_FOR_EACH(IrqData, irq, data->irq_list_head) {
+        layout->counts[INIT_FLAT_IRQ]++;
+        layout->string_bytes += strlen(flat_name(irq->name)) + 1;
+    }
+    FLAT_FOR_EACH(DeviceMemoryData, devmem, data->devmem_list_head) {
+        layout->counts[INIT_FLAT_DEVMEM]++;
+        layout->num_caps += flat_devmem_num_caps(devmem);
+        layout->string_bytes += strlen(flat_name(devmem->name)) + 1;
+    }
+
+    layout->counts[INIT_FLAT_CONN_IDS] = data->n_conn_ids;
+
+    layout->size = sizeof(init_flat_header_t) +
+                   layout->num_caps * sizeof(seL4_Word) +
+                   layout->string_bytes;
+    for(int i = 0; i < INIT_FLAT_NUM_SECTIONS; i++) {
+        layout->size += layout->counts[i] * flat_record_size[i];
+    }
+}
+
+
+size_t init_flat_get_packed_size(const InitData *data)
+{
+    flat_layout_t layout;
+    flat_measure(data, &layout);
+    return layout.size;
+}
+
+
+typedef union flat_record {
+    init_flat_endpoint_t endpoint;
+    init_flat_shmem_t shmem;
+    init_flat_irq_t irq;
+    init_flat_devmem_t devmem;
+} flat_record_t;
+
+/**
+ * While packing, the name of a record still points at the InitData string.
+ *
+ * An insertion sort rather than qsort, since it has to be stable: records
+ * with the same name keep the order of the InitData lists, and the first of
+ * them is the one the protobuf lookups and the parent's conn IDs pick.
+ * Sections hold a handful of records.
+ */
+static void flat_sort_records(uintptr_t records, seL4_Word count, size_t record_size)
+{
+    flat_record_t key;
+
+    for(seL4_Word i = 1; i < count; i++) {
+        memcpy(&key, (void *)(records + i * record_size), record_size);
+        const char *name = (const char *)*(const seL4_Word *)&key;
+
+        seL4_Word j = i;
+        while(j > 0 &&
+              strcmp(name, (const char *)*(const seL4_Word *)(records + (j - 1) * record_size)) < 0) {
+            j--;
+        }
+        memmove((void *)(records + (j + 1) * record_size), (void *)(records + j * record_size),
+                (i - j) * record_size);
+        memcpy((void *)(records + j * record_size), &key, record_size);
+    }
+}
+
+
+static seL4_Word flat_put_string(void *out, seL4_Word *string_offset, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    seL4_Word offset = *string_offset;
+    memcpy((void *)((uintptr_t)out + offset), str, len);
+    *string_offset += len;
+    return offset;
+}
+
+
+/**
+ * Sort a named section, then move its names into the string table.
+ */
+static void flat_finish_section(init_flat_header_t *flat,
+                                init_flat_section_id_t id,
+                                seL4_Word *string_offset)
+{
+    init_flat_section_t *section = &flat->sections[id];
+    size_t record_size = flat_record_size[id];
+    uintptr_t records = (uintptr_t)flat + section->offset;
+
+    flat_sort_records(records, section->count, record_size);
+
+    for(seL4_Word i = 0; i < section->count; i++) {
+        seL4_Word *name = (seL4_Word *)(records + i * record_size);
+        *name = flat_put_string(flat, string_offset, (const char *)*name);
+    }
+}
+
+
+size_t init_flat_pack(const InitData *data, void *out)
+{
+    flat_layout_t layout;
+    flat_measure(data, &layout);
+
+    init_flat_header_t *flat = out;
+    memset(flat, 0, sizeof(*flat));
+    flat->magic = INIT_FLAT_MAGIC;
+    flat->size = layout.size;
+    flat->cnode_next_free = data->cnode_next_free;
+    flat->cnode_size_bits = data->cnode_size_bits;
+    flat->stack_size_pages = data->stack_size_pages;
+    flat->stack_vaddr = data->stack_vaddr;
+    flat->cpu_affinity = data->has_cpu_affinity ? data->cpu_affinity : 0;
+
+    seL4_Word offset = sizeof(init_flat_header_t);
+    for(int i = 0; i < INIT_FLAT_NUM_SECTIONS; i++) {
+        flat->sections[i].offset = offset;
+        flat->sections[i].count = layout.counts[i];
+        offset += layout.counts[i] * flat_record_size[i];
+    }
+    seL4_Word caps_offset = offset;
+    seL4_Word string_offset = caps_offset + layout.num_caps * sizeof(seL4_Word);
+
+    flat->proc_name = flat_put_string(flat, &string_offset, flat_name(data->proc_name));
+
+    init_flat_untyped_t *ut_rec = (init_flat_untyped_t *)INIT_FLAT_SECTION(flat, INIT_FLAT_UNTYPED,
+                                                                           init_flat_untyped_t);
+    FLAT_FOR_EACH(UntypedData, ut, data->untyped_list_head) {
+        ut_rec->cap = ut->cap;
+        ut_rec->size_bits = ut->size;
+        ut_rec->phys_addr = ut->phys_addr;
+        ut_rec++;
+    }
+
+    init_flat_endpoint_t *ep_rec = (init_flat_endpoint_t *)INIT_FLAT_SECTION(flat, INIT_FLAT_ENDPOINT,
+                                                                             init_flat_endpoint_t);
+    FLAT_FOR_EACH(EndpointData, ep, data->ep_list_head) {
+        ep_rec->name = (seL4_Word)flat_name(ep->name);
+        ep_rec->cap = ep->cap;
+        ep_rec++;
+    }
+
+    ep_rec = (init_flat_endpoint_t *)INIT_FLAT_SECTION(flat, INIT_FLAT_NOTIFICATION,
+                                                       init_flat_endpoint_t);
+    FLAT_FOR_EACH(EndpointData, ntfn, data->notification_list_head) {
+        ep_rec->name = (seL4_Word)flat_name(ntfn->name);
+        ep_rec->cap = ntfn->cap;
+        ep_rec++;
+    }
+
+    init_flat_shmem_t *shmem_rec = (init_flat_shmem_t *)INIT_FLAT_SECTION(flat, INIT_FLAT_SHMEM,
+                                                                          init_flat_shmem_t);
+    FLAT_FOR_EACH(SharedMemoryData, shmem, data->shmem_list_head) {
+        shmem_rec->name = (seL4_Word)flat_name(shmem->name);
+        shmem_rec->addr = shmem->addr;
+        shmem_rec->length_bytes = shmem->length_bytes;
+        shmem_rec++;
+    }
+
+    init_flat_irq_t *irq_rec = (init_flat_irq_t *)INIT_FLAT_SECTION(flat, INIT_FLAT_IRQ,
+                                                                    init_flat_irq_t);
+    FLAT_FOR_EACH(IrqData, irq, data->irq_list_head) {
+        irq_rec->name = (seL4_Word)flat_name(irq->name);
+        irq_rec->irq_cap = irq->irq_cap;
+        irq_rec->ep_cap = irq->ep_cap;
+        irq_rec->number = (seL4_Word)irq->number;
+        irq_rec++;
+    }
+
+    init_flat_devmem_t *devmem_rec = (init_flat_devmem_t *)INIT_FLAT_SECTION(flat, INIT_FLAT_DEVMEM,
+                                                                             init_flat_devmem_t);
+    FLAT_FOR_EACH(DeviceMemoryData, devmem, data->devmem_list_head) {
+        devmem_rec->name = (seL4_Word)flat_name(devmem->name);
+        devmem_rec->virt_addr = devmem->virt_addr;
+        devmem_rec->phys_addr = devmem->phys_addr;
+        devmem_rec->size_bits = devmem->size_bits;
+        devmem_rec->num_pages = devmem->num_pages;
+        devmem_rec->caps = 0;
+
+        seL4_Word num_caps = flat_devmem_num_caps(devmem);
+        if(num_caps > 0) {
+            seL4_Word *caps = (seL4_Word *)((uintptr_t)flat + caps_offset);
+            for(seL4_Word i = 0; i < num_caps; i++) {
+                caps[i] = (devmem->caps32 != NULL) ? devmem->caps32[i] : devmem->caps64[i];
+            }
+            devmem_rec->caps = caps_offset;
+            caps_offset += num_caps * sizeof(seL4_Word);
+        }
+        devmem_rec++;
+    }
+
+    seL4_Word *conn_ids = (seL4_Word *)INIT_FLAT_SECTION(flat, INIT_FLAT_CONN_IDS, seL4_Word);
+    for(size_t i = 0; i < data->n_conn_ids; i++) {
+        conn_ids[i] = data->conn_ids[i];
+    }
+
+    for(int i = 0; i < INIT_FLAT_NUM_SECTIONS; i++) {
+        if(i != INIT_FLAT_UNTYPED && i != INIT_FLAT_CONN_IDS) {
+            flat_finish_section(flat, i, &string_offset);
+        }
+    }
+
+    ZF_LOGF_IF(string_offset != layout.size, "Flat init data size mismatch");
+    return layout.size;
+}
+
+
+const init_flat_header_t *libinit_flat_open(const void *data, size_t size)
+{
+    const init_flat_header_t *flat = data;
+
+    if(data == NULL || size < sizeof(*flat) || flat->magic != INIT_FLAT_MAGIC) {
+        ZF_LOGE("Init data isn't in the flat format");
+        return NULL;
+    }
+    if(flat->size < sizeof(*flat) || flat->size > size ||
+       ((const char *)data)[flat->size - 1] != '\0') {
+        ZF_LOGE("Flat init data is truncated");
+        return NULL;
+    }
+
+    for(int i = 0; i < INIT_FLAT_NUM_SECTIONS; i++) {
+        const init_flat_section_t *section = &flat->sections[i];
+        if(section->offset % sizeof(seL4_Word) != 0 || section->offset > flat->size ||
+           section->count > (flat->size - section->offset) / flat_record_size[i]) {
+            ZF_LOGE("Flat init data section %d is out of bounds", i);
+            return NULL;
+        }
+    }
+
+    return flat;
+}
+
+
+const void *libinit_flat_find(const init_flat_header_t *flat,
+                              init_flat_section_id_t section,
+                              size_t record_size,
+                              const char *name)
+{
+    uintptr_t records = (uintptr_t)flat + flat->sections[section].offset;
+    seL4_Word low = 0;
+    seL4_Word high = flat->sections[section].count;
+
+    /* Lower bound, so of several records with the name the first is found */
+    while(low < high) {
+        seL4_Word mid = low + (high - low) / 2;
+        const void *record = (const void *)(records + mid * record_size);
+        if(strcmp(name, libinit_flat_string(flat, *(const seL4_Word *)record)) <= 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    if(low == flat->sections[section].count) {
+        return NULL;
+    }
+    const void *record = (const void *)(records + low * record_size);
+    if(strcmp(name, libinit_flat_string(flat, *(const seL4_Word *)record)) != 0) {
+        return NULL;
+    }
+    return record;
+}
@@ -0,0 +1,292 @@
+/**
+ * @file heap.c
+ * @brief Growable heap for child processes
+ *
+ * The parent reserves HEAP_RESERVE_SIZE bytes of our address space at
+ * HEAP_ADDR and only backs the top HEAP_SIZE bytes. We take over brk and
+ * anonymous mmap from libsel4muslcsys and keep the layout of its static
+ * morecore: brk grows up from the bottom of the range, mmap grows down from
+ * the top. Pages that aren't backed yet are committed from our own untypeds
+ * when brk or mmap first hands them out.
+ *
+ * Until init_process has set up our vspace, or if we were given no untypeds,
+ * only the parent's pages are available. brk fails and malloc falls back to
+ * mmap, which is served from the top.
+ *
+ * Committed pages stay committed. Unmapping the lowest mapping raises the
+ * mmap edge again, so the next mmap reuses those pages after zeroing them.
+ */
+#include <autoconf.h>
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <sel4/sel4.h>
+#include <vspace/vspace.h>
+#include <sel4utils/vspace.h>
+#include <muslcsys/vsyscall.h>
+#include <utils/util.h>
+
+#include <init/init.h>
+#include <init/internal.h>
+
+#ifdef CONFIG_LIB_INIT_GROWABLE_HEAP
+
+#ifdef __NR_mmap2
+#define HEAP_NR_MMAP __NR_mmap2
+#else
+#define HEAP_NR_MMAP __NR_mmap
+#endif
+
+/**
+ * [start, brk_committed) and [mmap_committed, end) are backed, the two meet
+ * once the heap is full.
+ */
+typedef struct init_heap {
+    bool active;
+    bool can_grow;
+
+    uintptr_t start;
+    uintptr_t end;
+
+    uintptr_t brk;
+    uintptr_t brk_committed;
+
+    uintptr_t mmap_low;         /* [mmap_low, end) is handed out */
+    uintptr_t mmap_lowest;      /* Everything below has never been handed out */
+    uintptr_t mmap_committed;
+
+    sel4utils_res_t res;        /* The part the parent didn't back */
+} init_heap_t;
+
+static init_heap_t heap = {0};
+
+static muslcsys_syscall_t heap_old_mmap = NULL;
+static muslcsys_syscall_t heap_old_munmap = NULL;
+
+static volatile int heap_lock_word = 0;
+
+static inline void heap_lock(void) {
+    while(__atomic_test_and_set(&heap_lock_word, __ATOMIC_ACQUIRE)) {
+        seL4_Yield();
+    }
+}
+
+static inline void heap_unlock(void) {
+    __atomic_clear(&heap_lock_word, __ATOMIC_RELEASE);
+}
+
+
+static int heap_commit_page(uintptr_t vaddr)
+{
+    if(!heap.can_grow) {
+        return -1;
+    }
+
+    reservation_t res = { .res = &heap.res };
+    int error = vspace_new_pages_at_vaddr(&init_objects.vspace,
+                                          (void *)vaddr,
+                                          1,
+                                          PAGE_BITS_4K,
+                                          res);
+    if(error) {
+        ZF_LOGE("Failed to grow the heap at %p. Do you have enough untyped memory?",
+                (void *)vaddr);
+        return -2;
+    }
+    return 0;
+}
+
+
+static long heap_sys_brk(va_list ap)
+{
+    uintptr_t newbrk = va_arg(ap, uintptr_t);
+
+    heap_lock();
+    if(newbrk >= heap.start && newbrk <= heap.mmap_low) {
+        uintptr_t needed = MIN(ROUND_UP(newbrk, PAGE_SIZE_4K), heap.mmap_committed);
+        while(heap.brk_committed < needed && heap_commit_page(heap.brk_committed) == 0) {
+            heap.brk_committed += PAGE_SIZE_4K;
+        }
+        if(heap.brk_committed >= needed) {
+            heap.brk = newbrk;
+        }
+    }
+    uintptr_t ret = heap.brk;
+    heap_unlock();
+
+    /* A break other than the one asked for tells malloc to use mmap */
+    return ret;
+}
+
+
+static void *heap_mmap_anonymous(size_t length)
+{
+    length = ROUND_UP(length, PAGE_SIZE_4K);
+
+    heap_lock();
+    if(length == 0 || length > heap.mmap_low - ROUND_UP(heap.brk, PAGE_SIZE_4K)) {
+        heap_unlock();
+        return NULL;
+    }
+
+    uintptr_t low = heap.mmap_low - length;
+    uintptr_t needed = MAX(low, heap.brk_committed);
+    while(heap.mmap_committed > needed &&
+          heap_commit_page(heap.mmap_committed - PAGE_SIZE_4K) == 0) {
+        heap.mmap_committed -= PAGE_SIZE_4K;
+    }
+    if(heap.mmap_committed > needed) {
+        heap_unlock();
+        return NULL;
+    }
+
+    /**
+     * Anything at or above mmap_lowest was handed out before and may be
+     * dirty, malloc relies on fresh mmaps being zero.
+     */
+    uintptr_t dirty_end = heap.mmap_low;
+    uintptr_t dirty_start = MAX(low, heap.mmap_lowest);
+    heap.mmap_low = low;
+    heap.mmap_lowest = MIN(heap.mmap_lowest, low);
+    heap_unlock();
+
+    if(dirty_start < dirty_end) {
+        memset((void *)dirty_start, 0, dirty_end - dirty_start);
+    }
+    return (void *)low;
+}
+
+
+static long heap_sys_mmap(va_list ap)
+{
+    va_list args;
+    va_copy(args, ap);
+    UNUSED void *addr = va_arg(args, void *);
+    size_t length = va_arg(args, size_t);
+    UNUSED int prot = va_arg(args, int);
+    int flags = va_arg(args, int);
+    va_end(args);
+
+    if(!(flags & MAP_ANONYMOUS) || (flags & MAP_FIXED)) {
+        return (heap_old_mmap != NULL) ? heap_old_mmap(ap) : -ENOMEM;
+    }
+
+    void *ret = heap_mmap_anonymous(length);
+    return (ret != NULL) ? (long)ret : -ENOMEM;
+}
+
+
+static long heap_sys_munmap(va_list ap)
+{
+    va_list args;
+    va_copy(args, ap);
+    uintptr_t addr = va_arg(args, uintptr_t);
+    size_t length = va_arg(args, size_t);
+    va_end(args);
+
+    if(addr < heap.start || addr >= heap.end) {
+        return (heap_old_munmap != NULL) ? heap_old_munmap(ap) : 0;
+    }
+
+    heap_lock();
+    if(addr == heap.mmap_low) {
+        heap.mmap_low = MIN(heap.end, addr + ROUND_UP(length, PAGE_SIZE_4K));
+    }
+    heap_unlock();
+
+    return 0;
+}
+
+
+int libinit_heap_setup(uintptr_t start, size_t reserve_size, size_t initial_size)
+{
+    if(start == 0 || start % PAGE_SIZE_4K != 0 || reserve_size % PAGE_SIZE_4K != 0 ||
+       initial_size % PAGE_SIZE_4K != 0 || initial_size > reserve_size) {
+        return -1;
+    }
+
+    heap.start = start;
+    heap.end = start + reserve_size;
+    heap.brk = start;
+    heap.brk_committed = start;
+    heap.mmap_low = heap.end;
+    heap.mmap_lowest = heap.end;
+    heap.mmap_committed = heap.end - initial_size;
+    heap.active = true;
+
+    muslcsys_install_syscall(__NR_brk, heap_sys_brk);
+    heap_old_mmap = muslcsys_install_syscall(HEAP_NR_MMAP, heap_sys_mmap);
+    heap_old_munmap = muslcsys_install_syscall(__NR_munmap, heap_sys_munmap);
+
+    return 0;
+}
+
+
+int libinit_heap_enable_growth(void)
+{
+    if(!heap.active || heap.mmap_committed == heap.start) {
+        return 0;
+    }
+
+    /**
+     * Runs before the vspace is wrapped in its lock. The reservation is
+     * static, malloc could recurse into brk here.
+     */
+    int error = sel4utils_reserve_range_at_no_alloc(&init_objects.vspace,
+                                                    &heap.res,
+                                                    (void *)heap.start,
+                                                    heap.mmap_committed - heap.start,
+                                                    seL4_ReadWrite,
+                                                    1 /* Cacheable */);
+    if(error) {
+        ZF_LOGE("Failed to reserve the unbacked part of the heap");
+        return -1;
+    }
+
+    heap_lock();
+    heap.can_grow = true;
+    heap_unlock();
+    return 0;
+}
+
+
+bool libinit_heap_get_usage(seL4_Word *used, seL4_Word *size)
+{
+    if(!heap.active) {
+        return false;
+    }
+
+    heap_lock();
+    *used = (heap.brk_committed - heap.start) + (heap.end - heap.mmap_committed);
+    if(size != NULL) {
+        *size = heap.end - heap.start;
+    }
+    heap_unlock();
+
+    return true;
+}
+
+#else
+
+int libinit_heap_setup(UNUSED uintptr_t start, UNUSED size_t reserve_size, UNUSED size_t initial_size)
+{
+    return -1;
+}
+
+int libinit_heap_enable_growth(void)
+{
+    return 0;
+}
+
+bool libinit_heap_get_usage(UNUSED seL4_Word *used, UNUSED seL4_Word *size)
+{
+    return false;
+}
+
+#endif /* CONFIG_LIB_INIT_GROWABLE_HEAP */
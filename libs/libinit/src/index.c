@@ -0,0 +1,319 @@
+/**
+ * @file index.c
+ * @brief Hash index over the names in the init data
+ *
+ * init_process resolves every endpoint, notification, shmem, IRQ and device
+ * memory name once into an init_name_t and hashes it into an open addressed
+ * table. Lookups then hash the name and usually compare a single string.
+ * The table is never freed or changed, so pointers into it make stable
+ * handles.
+ *
+ * If the table couldn't be allocated, lookups fall back to the init data
+ * itself.
+ */
+#include <autoconf.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <init/init.h>
+#include <init/internal.h>
+
+
+typedef struct init_name_index {
+    seL4_Word count;
+    seL4_Word mask;
+    uint32_t *slots;                /* Position in names + 1, 0 is empty */
+    init_name_t names[];
+} init_name_index_t;
+
+static init_name_index_t *name_index = NULL;
+
+typedef void (*index_visit_t)(const init_name_t *entry, void *cookie);
+
+
+static uint32_t index_hash(init_name_kind_t kind, const char *name)
+{
+    /* FNV-1a, seeded with the kind so equal names of different kinds differ */
+    uint32_t hash = 2166136261u ^ (uint32_t)kind;
+    while(*name != '\0') {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+static void index_entry_init(init_name_t *entry, init_name_kind_t kind, const char *name)
+{
+    memset(entry, 0, sizeof(*entry));
+    entry->kind = kind;
+    entry->name = (name != NULL) ? name : "";
+}
+
+
+#ifdef CONFIG_LIB_INIT_FLAT_INIT_DATA
+
+static const init_flat_section_id_t index_sections[INIT_NAME_NUM_KINDS] = {
+    [INIT_NAME_ENDPOINT] = INIT_FLAT_ENDPOINT,
+    [INIT_NAME_NOTIFICATION] = INIT_FLAT_NOTIFICATION,
+    [INIT_NAME_SHMEM] = INIT_FLAT_SHMEM,
+    [INIT_NAME_IRQ] = INIT_FLAT_IRQ,
+    [INIT_NAME_DEVMEM] = INIT_FLAT_DEVMEM,
+};
+
+static const size_t index_record_sizes[INIT_NAME_NUM_KINDS] = {
+    [INIT_NAME_ENDPOINT] = sizeof(init_flat_endpoint_t),
+    [INIT_NAME_NOTIFICATION] = sizeof(init_flat_endpoint_t),
+    [INIT_NAME_SHMEM] = sizeof(init_flat_shmem_t),
+    [INIT_NAME_IRQ] = sizeof(init_flat_irq_t),
+    [INIT_NAME_DEVMEM] = sizeof(init_flat_devmem_t),
+};
+
+
+static void index_fill(init_name_kind_t kind, const void *record, init_name_t *entry)
+{
+    const init_flat_header_t *flat = init_objects.init_flat;
+    index_entry_init(entry, kind, libinit_flat_string(flat, *(const seL4_Word *)record));
+
+    switch(kind) {
+    case INIT_NAME_ENDPOINT:
+    case INIT_NAME_NOTIFICATION:
+        entry->value.cap = ((const init_flat_endpoint_t *)record)->cap;
+        break;
+    case INIT_NAME_SHMEM:
+        entry->value.addr = (void*)((const init_flat_shmem_t *)record)->addr;
+        break;
+    case INIT_NAME_IRQ: {
+        const init_flat_irq_t *irq = record;
+        entry->value.irq.ep = irq->ep_cap;
+        entry->value.irq.irq = irq->irq_cap;
+        entry->value.irq.number = irq->number;
+        break;
+    }
+    case INIT_NAME_DEVMEM: {
+        const init_flat_devmem_t *devmem = record;
+        entry->value.devmem.vaddr = (void*)devmem->virt_addr;
+        entry->value.devmem.paddr = (void*)devmem->phys_addr;
+        entry->value.devmem.size_bits = devmem->size_bits;
+        entry->value.devmem.num_pages = devmem->num_pages;
+
+        /* The caps are read straight out of the init data pages */
+        if(devmem->caps != 0 && devmem->caps < flat->size &&
+           devmem->num_pages <= (flat->size - devmem->caps) / sizeof(seL4_CPtr)) {
+            entry->value.devmem.caps = (seL4_CPtr*)((uintptr_t)flat + devmem->caps);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+
+static void index_walk(index_visit_t visit, void *cookie)
+{
+    const init_flat_header_t *flat = init_objects.init_flat;
+    init_name_t entry;
+
+    for(int kind = 0; kind < INIT_NAME_NUM_KINDS; kind++) {
+        const init_flat_section_t *section = &flat->sections[index_sections[kind]];
+        for(seL4_Word i = 0; i < section->count; i++) {
+            index_fill(kind,
+                       (const void *)((uintptr_t)flat + section->offset + i * index_record_sizes[kind]),
+                       &entry);
+            visit(&entry, cookie);
+        }
+    }
+}
+
+
+static bool index_find_slow(init_name_kind_t kind, const char *name, init_name_t *out)
+{
+    const void *record = libinit_flat_find(init_objects.init_flat, index_sections[kind],
+                                           index_record_sizes[kind], name);
+    if(record == NULL) {
+        return false;
+    }
+    index_fill(kind, record, out);
+    return true;
+}
+
+#else
+
+static void index_walk(index_visit_t visit, void *cookie)
+{
+    InitData *data = init_objects.init_data;
+    init_name_t entry;
+
+    for(EndpointData *ep = data->ep_list_head; ep != NULL; ep = ep->next) {
+        index_entry_init(&entry, INIT_NAME_ENDPOINT, ep->name);
+        entry.value.cap = ep->cap;
+        visit(&entry, cookie);
+    }
+
+    for(EndpointData *ntfn = data->notification_list_head; ntfn != NULL; ntfn = ntfn->next) {
+        index_entry_init(&entry, INIT_NAME_NOTIFICATION, ntfn->name);
+        entry.value.cap = ntfn->cap;
+        visit(&entry, cookie);
+    }
+
+    for(SharedMemoryData *shmem = data->shmem_list_head; shmem != NULL; shmem = shmem->next) {
+        index_entry_init(&entry, INIT_NAME_SHMEM, shmem->name);
+        entry.value.addr = (void*)((seL4_Word)shmem->addr);
+        visit(&entry, cookie);
+    }
+
+    for(IrqData *irq = data->irq_list_head; irq != NULL; irq = irq->next) {
+        index_entry_init(&entry, INIT_NAME_IRQ, irq->name);
+        entry.value.irq.ep = irq->ep_cap;
+        entry.value.irq.irq = irq->irq_cap;
+        entry.value.irq.number = irq->number;
+        visit(&entry, cookie);
+    }
+
+    for(DeviceMemoryData *devmem = data->devmem_list_head; devmem != NULL; devmem = devmem->next) {
+        index_entry_init(&entry, INIT_NAME_DEVMEM, devmem->name);
+        entry.value.devmem.vaddr = (void*)((seL4_Word)devmem->virt_addr);
+        entry.value.devmem.paddr = (void*)((seL4_Word)devmem->phys_addr);
+        entry.value.devmem.size_bits = devmem->size_bits;
+        entry.value.devmem.num_pages = devmem->num_pages;
+
+        if(devmem->n_caps32 == devmem->num_pages && sizeof(seL4_CPtr) == sizeof(uint32_t)) {
+            entry.value.devmem.caps = (seL4_CPtr*)devmem->caps32;
+        } else if(devmem->n_caps64 == devmem->num_pages && sizeof(seL4_CPtr) == sizeof(uint64_t)) {
+            entry.value.devmem.caps = (seL4_CPtr*)devmem->caps64;
+        }
+        visit(&entry, cookie);
+    }
+}
+
+
+typedef struct index_match {
+    init_name_kind_t kind;
+    const char *name;
+    init_name_t *out;
+    bool found;
+} index_match_t;
+
+static void index_visit_match(const init_name_t *entry, void *cookie)
+{
+    index_match_t *match = cookie;
+    if(!match->found && entry->kind == match->kind && strcmp(entry->name, match->name) == 0) {
+        *match->out = *entry;
+        match->found = true;
+    }
+}
+
+static bool index_find_slow(init_name_kind_t kind, const char *name, init_name_t *out)
+{
+    index_match_t match = { kind, name, out, false };
+    index_walk(index_visit_match, &match);
+    return match.found;
+}
+
+#endif /* CONFIG_LIB_INIT_FLAT_INIT_DATA */
+
+
+static void index_visit_count(UNUSED const init_name_t *entry, void *cookie)
+{
+    (*(seL4_Word *)cookie)++;
+}
+
+
+/**
+ * The first entry with a name wins, the same one a walk over the init data finds.
+ */
+static void index_visit_insert(const init_name_t *entry, void *cookie)
+{
+    init_name_index_t *index = cookie;
+    uint32_t hash = index_hash(entry->kind, entry->name);
+
+    seL4_Word slot = hash & index->mask;
+    while(index->slots[slot] != 0) {
+        const init_name_t *other = &index->names[index->slots[slot] - 1];
+        if(other->hash == hash && other->kind == entry->kind &&
+           strcmp(other->name, entry->name) == 0) {
+            return;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+
+    init_name_t *name = &index->names[index->count++];
+    *name = *entry;
+    name->hash = hash;
+    index->slots[slot] = index->count;
+}
+
+
+int libinit_index_build(void)
+{
+    if(name_index != NULL) {
+        return 0;
+    }
+
+    seL4_Word count = 0;
+    index_walk(index_visit_count, &count);
+
+    /* At most half full, probes stay short */
+    seL4_Word num_slots = 8;
+    while(num_slots < 2 * count) {
+        num_slots <<= 1;
+    }
+
+    init_name_index_t *index = malloc(sizeof(init_name_index_t) +
+                                      count * sizeof(init_name_t) +
+                                      num_slots * sizeof(uint32_t));
+    if(index == NULL) {
+        ZF_LOGE("Failed to malloc the init data index");
+        return -1;
+    }
+    index->count = 0;
+    index->mask = num_slots - 1;
+    index->slots = (uint32_t *)&index->names[count];
+    memset(index->slots, 0, num_slots * sizeof(uint32_t));
+
+    index_walk(index_visit_insert, index);
+
+    __atomic_store_n(&name_index, index, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+const init_name_t *libinit_index_find(init_name_kind_t kind, const char *name)
+{
+    init_name_index_t *index = __atomic_load_n(&name_index, __ATOMIC_ACQUIRE);
+    if(index == NULL || name == NULL) {
+        return NULL;
+    }
+
+    uint32_t hash = index_hash(kind, name);
+    seL4_Word slot = hash & index->mask;
+    while(index->slots[slot] != 0) {
+        const init_name_t *entry = &index->names[index->slots[slot] - 1];
+        if(entry->hash == hash && entry->kind == kind && strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+
+    return NULL;
+}
+
+
+const init_name_t *libinit_index_lookup(init_name_kind_t kind, const char *name,
+                                        init_name_t *scratch)
+{
+    if(__atomic_load_n(&name_index, __ATOMIC_ACQUIRE) != NULL) {
+        return libinit_index_find(kind, name);
+    }
+    if(name == NULL || !index_find_slow(kind, name, scratch)) {
+        return NULL;
+    }
+    return scratch;
+}
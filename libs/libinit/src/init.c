@@ -79,6 +79,7 @@
 #include <cpio/cpio.h>
 
 #include <init/init.h>
+#include <init/internal.h>
 
 
 /**
@@ -118,6 +119,39 @@ static sel4utils_alloc_data_t vspace_bootstrap_data;
 /* Reservation for our heap */
 static sel4utils_res_t heap_res;
 
+/* Our main thread's stack as our parent laid it out, unknown in the root task */
+static seL4_Word main_stack_top = 0;
+static seL4_Word main_stack_size = 0;
+
+#ifndef CONFIG_LIB_INIT_FLAT_INIT_DATA
+/**
+ * The unpacked init data lives as long as we do. Unpacked nodes are a few
+ * times bigger than packed ones, so one block is usually enough.
+ */
+static init_arena_t init_data_arena;
+#define INIT_DATA_ARENA_BYTES(packed_size) (4 * (packed_size) + 1024)
+#endif
+
+#ifdef CONFIG_LIB_LOCK_WRAPPER_MAGAZINES
+/**
+ * Hash the calling thread's IPC buffer onto a vka magazine. Every thread has
+ * one from the start, unlike TLS, which threads that never set it share.
+ */
+static int init_vka_cache_index(void) {
+    uint32_t hash = (uint32_t)((uintptr_t)seL4_GetIPCBuffer() >> seL4_IPCBufferSizeBits) * 2654435761u;
+    return (hash >> 16) % CONFIG_LIB_LOCK_WRAPPER_NUM_MAGAZINES;
+}
+#endif
+
+#ifdef CONFIG_LIB_LOCK_WRAPPER_RANGE_VSPACE
+/* Put the range locked vspace in front, or carry on with just the locked one */
+static void init_setup_range_vspace(void) {
+    int error = rangevspace_replace(&init_objects.rangevspace, &init_objects.vspace, &init_objects.vka,
+                                    CONFIG_LIB_LOCK_WRAPPER_RANGE_VSPACE_WINDOW_MB * BIT(20));
+    ZF_LOGW_IF(error, "Failed to set up the range vspace, using the locked vspace only");
+}
+#endif
+
 static void print_coe_banner(void) {
     printf("\n"
            "   __________  ____   _____     ____\n"
@@ -255,6 +289,55 @@ static int remap_root_task_elf_regions() {
 }
 
 
+#ifndef CONFIG_LIB_INIT_FLAT_INIT_DATA
+/* Protobuf hands us 64 bit IDs, narrow them if our words are smaller */
+static void init_setup_conn_ids(InitData *data) {
+    if(data->n_conn_ids == 0) {
+        return;
+    }
+
+    if(sizeof(seL4_Word) == sizeof(uint64_t)) {
+        init_objects.conn_ids = (const seL4_Word *)data->conn_ids;
+    } else {
+        seL4_Word *conn_ids = init_arena_alloc(&init_data_arena, data->n_conn_ids * sizeof(seL4_Word));
+        if(conn_ids == NULL) {
+            ZF_LOGW("Connection IDs will be looked up by name");
+            return;
+        }
+        for(size_t i = 0; i < data->n_conn_ids; i++) {
+            conn_ids[i] = (seL4_Word)data->conn_ids[i];
+        }
+        init_objects.conn_ids = conn_ids;
+    }
+    init_objects.num_conn_ids = data->n_conn_ids;
+}
+#endif
+
+/* Give one of the untypeds from our parent to allocman */
+static seL4_Word init_add_untyped(seL4_CPtr cap, seL4_Word size_bits, uintptr_t *paddr) {
+    cspacepath_t path;
+    vka_cspace_make_path(&init_objects.vka, cap, &path);
+    size_t ut_size = (size_t)size_bits;
+
+    int error = allocman_utspace_add_uts(init_objects.allocman,
+                                         1,
+                                         &path,
+                                         &ut_size,
+                                         paddr, /* TODO optional! */
+                                         ALLOCMAN_UT_KERNEL);
+    ZF_LOGF_IF(error, "Failed to add untyped");
+    return 1lu << size_bits;
+}
+
+/* Append num_pages frames starting at vaddr to the existing frames list */
+static void init_add_existing_frames(void **existing_frames, int *j,
+                                     uintptr_t vaddr, seL4_Word num_pages, seL4_Word page_bits) {
+    for(seL4_Word i = 0; i < num_pages; i++, (*j)++) {
+        existing_frames[*j] = (void*)(vaddr + (i << page_bits));
+    }
+}
+
+
 int init_process(void) {
     int error;
     int i,j;
@@ -276,6 +359,29 @@ int init_process(void) {
      */
     morecore_area = (void*)strtol(getenv("HEAP_ADDR"), NULL, 16);
     morecore_size = atoi(getenv("HEAP_SIZE"));
+
+    /**
+     * A growable heap only has its top HEAP_SIZE bytes backed. Those are the
+     * frames we already have, the rest is committed as malloc reaches it.
+     */
+    char *heap_reserve_env = getenv("HEAP_RESERVE_SIZE");
+    size_t heap_reserve_size = (heap_reserve_env != NULL) ? atol(heap_reserve_env) : 0;
+    if(heap_reserve_size > morecore_size) {
+        error = libinit_heap_setup((uintptr_t)morecore_area, heap_reserve_size, morecore_size);
+        ZF_LOGW_IF(error, "Heap can't grow, only using the pages our parent mapped");
+        morecore_area += heap_reserve_size - morecore_size;
+    }
+
+#ifdef CONFIG_LIB_INIT_HEAP_WATERMARK
+    /**
+     * Paint the heap before anything can malloc from it.
+     */
+    for(seL4_Word *word = (seL4_Word*)morecore_area;
+        (uintptr_t)(word + 1) <= (uintptr_t)morecore_area + morecore_size;
+        word++) {
+        *word = INIT_WATERMARK_CANARY;
+    }
+#endif
     
     /* Malloc is available now */
 
@@ -297,9 +403,44 @@ int init_process(void) {
      * Unpack the init data from our parent process.
      */
     init_lock_objects();
-    init_objects.init_data = init_data__unpack(NULL, 
+#ifdef CONFIG_LIB_INIT_FLAT_INIT_DATA
+    /**
+     * Flat init data is read in place, its pages stay mapped as long as we run.
+     */
+    const init_flat_header_t *flat = libinit_flat_open(init_data_packed, init_data_packed_size);
+    ZF_LOGF_IF(flat == NULL, "Failed to open the init data.");
+    init_objects.init_flat = flat;
+    init_objects.proc_name = libinit_flat_string(flat, flat->proc_name);
+    seL4_Word cnode_size_bits = flat->cnode_size_bits;
+    seL4_Word cnode_next_free = flat->cnode_next_free;
+    seL4_Word stack_size_pages = flat->stack_size_pages;
+    seL4_Word stack_vaddr = flat->stack_vaddr;
+    init_objects.main_core = flat->cpu_affinity;
+    init_objects.conn_ids = INIT_FLAT_SECTION(flat, INIT_FLAT_CONN_IDS, seL4_Word);
+    init_objects.num_conn_ids = flat->sections[INIT_FLAT_CONN_IDS].count;
+#else
+    init_arena_init(&init_data_arena, INIT_DATA_ARENA_BYTES(init_data_packed_size));
+    init_objects.init_data = init_data__unpack(&init_data_arena.allocator,
                                                init_data_packed_size,
                                                init_data_packed);
+    ZF_LOGF_IF(init_objects.init_data == NULL, "Failed to unpack the init data.");
+    init_objects.proc_name = init_objects.init_data->proc_name;
+    seL4_Word cnode_size_bits = init_objects.init_data->cnode_size_bits;
+    seL4_Word cnode_next_free = init_objects.init_data->cnode_next_free;
+    seL4_Word stack_size_pages = init_objects.init_data->stack_size_pages;
+    seL4_Word stack_vaddr = init_objects.init_data->stack_vaddr;
+    init_objects.main_core = init_objects.init_data->has_cpu_affinity ?
+                             init_objects.init_data->cpu_affinity : 0;
+    init_setup_conn_ids(init_objects.init_data);
+#endif
+    main_stack_top = stack_vaddr;
+    main_stack_size = stack_size_pages << PAGE_BITS_4K;
+
+    /**
+     * Index every name once, lookups then don't walk the init data.
+     */
+    error = libinit_index_build();
+    ZF_LOGW_IF(error, "Init data lookups will search the init data instead of the index");
     
     /**
      * Setup the root_task/ancestor abstraction
@@ -312,7 +453,6 @@ int init_process(void) {
     init_objects.sync_notification_cap = INIT_CHILD_SYNC_NOTIFICATION_SLOT;
     init_objects.process_lock_cap = INIT_CHILD_PROCESS_LOCK_SLOT;
     init_objects.thread_lock_cap = INIT_CHILD_THREAD_LOCK_SLOT;
-    init_objects.proc_name = init_objects.init_data->proc_name;
     init_objects.initialized = 1;
 
 #ifdef CONFIG_DEBUG_BUILD
@@ -328,9 +468,9 @@ int init_process(void) {
      */
     init_objects.allocman = bootstrap_use_current_1level(
                                                   init_objects.cnode_cap,
-                                                  init_objects.init_data->cnode_size_bits,
-                                                  init_objects.init_data->cnode_next_free,
-                                                  BIT(init_objects.init_data->cnode_size_bits),
+                                                  cnode_size_bits,
+                                                  cnode_next_free,
+                                                  BIT(cnode_size_bits),
                                                   CONFIG_LIB_INIT_ALLOCMAN_STATIC_POOL_BYTES,
                                                   allocman_static_pool);
     ZF_LOGF_IF(init_objects.allocman == NULL, "Failed to bootstrap allocman.");
@@ -344,33 +484,32 @@ int init_process(void) {
     /* Surround Allocman with LockVKA */
     sync_mutex_init(&init_objects.vka_lock, INIT_CHILD_VKA_LOCK_SLOT);
     lockvka_replace(&init_objects.lockvka, &init_objects.vka, sync_mutex_make_interface(&init_objects.vka_lock));
+#ifdef CONFIG_LIB_LOCK_WRAPPER_MAGAZINES
+    cachevka_replace(&init_objects.cachevka, &init_objects.vka, &init_objects.lockvka, init_vka_cache_index);
+#endif
 
     /**
      * Parse untypeds
      */
     seL4_Word total_ut_memory = 0;
     seL4_Word total_ut_count = 0;
+#ifdef CONFIG_LIB_INIT_FLAT_INIT_DATA
+    const init_flat_untyped_t *uts = INIT_FLAT_SECTION(flat, INIT_FLAT_UNTYPED, init_flat_untyped_t);
+    for(i = 0; i < flat->sections[INIT_FLAT_UNTYPED].count; i++) {
+        total_ut_memory += init_add_untyped(uts[i].cap, uts[i].size_bits,
+                                            (uintptr_t *)&uts[i].phys_addr);
+        total_ut_count++;
+    }
+#else
     UntypedData *iter = init_objects.init_data->untyped_list_head;
     while(iter != NULL) {
-        /**
-         * Give our untyped objects to allocman
-         */
-        cspacepath_t path;
-        vka_cspace_make_path(&init_objects.vka, iter->cap, &path);
-        size_t ut_size = (size_t)iter->size;
-
-        error = allocman_utspace_add_uts(init_objects.allocman,
-                                         1,
-                                         &path,
-                                         &ut_size,
-                                         (uintptr_t *)&iter->phys_addr, /* TODO optional! */
-                                         ALLOCMAN_UT_KERNEL);
-        ZF_LOGF_IF(error, "Failed to add untyped");
-        total_ut_memory += (1lu << iter->size);
+        total_ut_memory += init_add_untyped(iter->cap, iter->size,
+                                            (uintptr_t *)&iter->phys_addr);
         total_ut_count++;
 
         iter = iter->next;
     }
+#endif
     //ZF_LOGV("Added %lu untyped objects to allocman, totalling: %luK",
     //        (unsigned long) total_ut_count,
     //        (unsigned long) total_ut_memory / 1024);
@@ -383,26 +522,37 @@ int init_process(void) {
     /**
      * Setup an existing frames list.
      */
-    seL4_Word init_data_pages = ROUND_UP(init_data_packed_size, PAGE_SIZE_4K);
-    seL4_Word num_frames = init_objects.init_data->stack_size_pages +
+    seL4_Word init_data_pages = ROUND_UP(init_data_packed_size, PAGE_SIZE_4K) / PAGE_SIZE_4K;
+    seL4_Word num_frames = stack_size_pages +
                            init_data_pages +
                            (morecore_size / PAGE_SIZE_4K) + /* TODO assuming 4k alignment */
                            1; /* IPC buffer */
 
+    /* Count num frames */
+#ifdef CONFIG_LIB_INIT_FLAT_INIT_DATA
+    const init_flat_shmem_t *shmems = INIT_FLAT_SECTION(flat, INIT_FLAT_SHMEM, init_flat_shmem_t);
+    const init_flat_devmem_t *devmems = INIT_FLAT_SECTION(flat, INIT_FLAT_DEVMEM, init_flat_devmem_t);
+    for(i = 0; i < flat->sections[INIT_FLAT_SHMEM].count; i++) {
+        num_frames += shmems[i].length_bytes / PAGE_SIZE_4K;
+    }
+    for(i = 0; i < flat->sections[INIT_FLAT_DEVMEM].count; i++) {
+        num_frames += devmems[i].num_pages;
+    }
+#else
     SharedMemoryData *shmem_iter = init_objects.init_data->shmem_list_head;
     DeviceMemoryData *devmem_iter = init_objects.init_data->devmem_list_head;
     
-    /* Count num frames */
     while(shmem_iter != NULL) {
-        num_frames++;
+        num_frames += shmem_iter->length_bytes / PAGE_SIZE_4K;
         shmem_iter = shmem_iter->next;
     } 
     while(devmem_iter != NULL) {
-        num_frames++;
+        num_frames += devmem_iter->num_pages;
         devmem_iter = devmem_iter->next;
     }
     shmem_iter = init_objects.init_data->shmem_list_head;
     devmem_iter = init_objects.init_data->devmem_list_head;
+#endif
 
     /**
      * Allocate an array to hold existing frame addresses.
@@ -419,36 +569,41 @@ int init_process(void) {
      * Initialize the existing_frames array
      */
     j = 0;
-    for(i = 0; i < init_data_pages; i++, j++) {
-        existing_frames[j] = (void*)((uintptr_t)init_data_packed + (i << PAGE_BITS_4K));
-    }
-    for(i = 0; i < morecore_size / PAGE_SIZE_4K; i++, j++) {
-        existing_frames[j] = (void*)((uintptr_t)morecore_area + (i << PAGE_BITS_4K));
-    }
-    for(i = 0; i < init_objects.init_data->stack_size_pages; i++, j++) {
+    init_add_existing_frames(existing_frames, &j, (uintptr_t)init_data_packed,
+                             init_data_pages, PAGE_BITS_4K);
+    init_add_existing_frames(existing_frames, &j, (uintptr_t)morecore_area,
+                             morecore_size / PAGE_SIZE_4K, PAGE_BITS_4K);
+    for(i = 0; i < stack_size_pages; i++, j++) {
         /**
          * This stack_vaddr points to the top of the stack so we have to subtract.
          * I am unsure if this works in the edge cases. TODO test.
          */
-        existing_frames[j] = (void*)((uintptr_t)init_objects.init_data->stack_vaddr -
-                                                (i << PAGE_BITS_4K));
+        existing_frames[j] = (void*)((uintptr_t)stack_vaddr - (i << PAGE_BITS_4K));
     }
 
+#ifdef CONFIG_LIB_INIT_FLAT_INIT_DATA
+    for(i = 0; i < flat->sections[INIT_FLAT_SHMEM].count; i++) {
+        ZF_LOGW_IF(shmems[i].length_bytes%PAGE_SIZE_4K != 0, "Invalid length of shmem");
+        init_add_existing_frames(existing_frames, &j, shmems[i].addr,
+                                 shmems[i].length_bytes / PAGE_SIZE_4K, PAGE_BITS_4K);
+    }
+    for(i = 0; i < flat->sections[INIT_FLAT_DEVMEM].count; i++) {
+        init_add_existing_frames(existing_frames, &j, devmems[i].virt_addr,
+                                 devmems[i].num_pages, devmems[i].size_bits);
+    }
+#else
     while(shmem_iter != NULL) {
         ZF_LOGW_IF(shmem_iter->length_bytes%PAGE_SIZE_4K != 0, "Invalid length of shmem");
-
-        for(i = 0; i < (shmem_iter->length_bytes/PAGE_SIZE_4K); i++, j++) {
-            existing_frames[j] = (void*)((uintptr_t)shmem_iter->addr + (i << PAGE_BITS_4K));
-        }
+        init_add_existing_frames(existing_frames, &j, shmem_iter->addr,
+                                 shmem_iter->length_bytes / PAGE_SIZE_4K, PAGE_BITS_4K);
         shmem_iter = shmem_iter->next;
     } 
     while(devmem_iter != NULL) {
-        for(i = 0; i < devmem_iter->num_pages; i++, j++) {
-            existing_frames[j] = (void*)((uintptr_t)devmem_iter->virt_addr +
-                                                    (i << devmem_iter->size_bits));
-        }
+        init_add_existing_frames(existing_frames, &j, devmem_iter->virt_addr,
+                                 devmem_iter->num_pages, devmem_iter->size_bits);
         devmem_iter = devmem_iter->next;
     }
+#endif
     existing_frames[j++] = (void *)seL4_GetIPCBuffer();
 
     ZF_LOGW_IF(j != num_frames, "Not all of the existing frames were copied.");
@@ -471,7 +626,10 @@ int init_process(void) {
             init_unlock_objects();
             return -4;
         }
-        
+
+        /* Claim the rest of the heap before anything else reserves in it */
+        error = libinit_heap_enable_growth();
+        ZF_LOGW_IF(error, "The heap can't grow past what our parent mapped");
     }
 
     /**
@@ -499,6 +657,12 @@ int init_process(void) {
                 "objects in the future.");
     }
 
+#ifdef CONFIG_LIB_LOCK_WRAPPER_RANGE_VSPACE
+    if(total_ut_memory > 0) {
+        init_setup_range_vspace();
+    }
+#endif
+
     error = init_set_thread_local_storage(NULL);
     if(error) {
         ZF_LOGE("Failed to set thread local storage");
@@ -594,6 +758,9 @@ int init_root_task(void) {
     }
     sync_mutex_init(&init_objects.vka_lock, vka_lock_notification.cptr);
     lockvka_replace(&init_objects.lockvka, &init_objects.vka, sync_mutex_make_interface(&init_objects.vka_lock));
+#ifdef CONFIG_LIB_LOCK_WRAPPER_MAGAZINES
+    cachevka_replace(&init_objects.cachevka, &init_objects.vka, &init_objects.lockvka, init_vka_cache_index);
+#endif
 
     /* At this point we are a process with untyped memory and the vka to use it */
     init_objects.has_untypeds = 1;
@@ -671,6 +838,10 @@ int init_root_task(void) {
         return -8;
     }
 
+#ifdef CONFIG_LIB_LOCK_WRAPPER_RANGE_VSPACE
+    init_setup_range_vspace();
+#endif
+
 
     /* All the allocator layers are now configured. 
      * For release builds we need to setup the serial driver.
@@ -722,5 +893,104 @@ int init_root_task(void) {
 }
 
 
+int init_get_heap_high_water(seL4_Word *used, seL4_Word *size)
+{
+    if(used == NULL) {
+        ZF_LOGE("Null used pointer passed.");
+        return -1;
+    }
 
+    if(!init_objects.initialized) {
+        ZF_LOGE("Init objects have not been initialized.");
+        return -2;
+    }
 
+    if(libinit_heap_get_usage(used, size)) {
+        /**
+         * Growable heap: pages are committed when first handed out and
+         * never released, so the committed pages are the peak.
+         */
+        return 0;
+    }
+
+    if(morecore_area == NULL) {
+        /**
+         * Root task: brk maps pages on demand and never unmaps them, so the
+         * mapped pages are the peak.
+         */
+        seL4_Word mapped = 0;
+        for(seL4_Word i = 0; i < CONFIG_LIB_INIT_ROOT_TASK_HEAP_SPACE / PAGE_SIZE_4K; i++) {
+            void *page = (void*)((uintptr_t)muslc_brk_reservation_start + (i << PAGE_BITS_4K));
+            if(vspace_get_cap(&init_objects.vspace, page) != seL4_CapNull) {
+                mapped++;
+            }
+        }
+        *used = mapped << PAGE_BITS_4K;
+        if(size != NULL) {
+            *size = CONFIG_LIB_INIT_ROOT_TASK_HEAP_SPACE;
+        }
+        return 0;
+    }
+
+#ifdef CONFIG_LIB_INIT_HEAP_WATERMARK
+    /**
+     * brk grows up from the bottom and anonymous mmaps grow down from the
+     * top, so the untouched part is the longest run of canary words.
+     */
+    seL4_Word longest = 0;
+    seL4_Word run = 0;
+    seL4_Word num_words = morecore_size / sizeof(seL4_Word);
+    seL4_Word *words = (seL4_Word*)morecore_area;
+    for(seL4_Word i = 0; i < num_words; i++) {
+        if(words[i] == INIT_WATERMARK_CANARY) {
+            run++;
+            if(run > longest) {
+                longest = run;
+            }
+        } else {
+            run = 0;
+        }
+    }
+    *used = morecore_size - longest * sizeof(seL4_Word);
+    if(size != NULL) {
+        *size = morecore_size;
+    }
+    return 0;
+#else
+    ZF_LOGW("Enable CONFIG_LIB_INIT_HEAP_WATERMARK to track the heap of child processes.");
+    return -3;
+#endif
+}
+
+
+int init_get_main_stack_high_water(seL4_Word *used, seL4_Word *size)
+{
+    if(used == NULL) {
+        ZF_LOGE("Null used pointer passed.");
+        return -1;
+    }
+
+    if(main_stack_size == 0) {
+        ZF_LOGW("The root task's stack belongs to the runtime, its bounds are unknown.");
+        return -2;
+    }
+
+#ifdef CONFIG_LIB_THREAD_STACK_WATERMARK
+    /**
+     * Our parent painted the stack before we ran, count untouched words up
+     * from the bottom.
+     */
+    seL4_Word *word = (seL4_Word*)(main_stack_top - main_stack_size);
+    while((uintptr_t)word < main_stack_top && *word == INIT_WATERMARK_CANARY) {
+        word++;
+    }
+    *used = main_stack_top - (uintptr_t)word;
+    if(size != NULL) {
+        *size = main_stack_size;
+    }
+    return 0;
+#else
+    ZF_LOGW("Enable CONFIG_LIB_THREAD_STACK_WATERMARK to track the main thread's stack.");
+    return -3;
+#endif
+}
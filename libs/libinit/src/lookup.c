@@ -1,6 +1,8 @@
 /**
  * @file lookup.c
  * @brief Implmentation of lookup functions for the init data
+ *
+ * Names are resolved through the index built by init_process, see index.c.
  */
 #include <autoconf.h>
 
@@ -9,34 +11,38 @@
 
 #include <sel4/sel4.h>
 #include <init/init.h>
+#include <init/internal.h>
 
-#define LOOKUP(RET, SUFFIX, TYPE, LIST, FIELD)                                  \
+#ifdef CONFIG_LIB_INIT_FLAT_INIT_DATA
+#define INIT_DATA_PRESENT() (init_objects.init_flat != NULL)
+#else
+#define INIT_DATA_PRESENT() (init_objects.init_data != NULL)
+#endif
+
+#define LOOKUP(RET, SUFFIX, KIND, FIELD)                                        \
     RET init_lookup_##SUFFIX(const char * name)                                 \
     {                                                                           \
-        if(!init_check_initialized() || !init_objects.init_data) {              \
+        if(!init_check_initialized() || !INIT_DATA_PRESENT()) {                 \
             ZF_LOGE("Invalid usage of init library");                           \
             return 0;                                                           \
         }                                                                       \
-        TYPE *iter = init_objects.init_data->LIST;                              \
-        ZF_LOGD_IF(iter == NULL, "No elements in list when looking up.");       \
-        while(iter) {                                                           \
-            if(strcmp(name, iter->name) == 0) {                                 \
-                return (RET) ((seL4_Word) iter->FIELD);                         \
-            }                                                                   \
-            iter = iter->next;                                                  \
+        init_name_t scratch;                                                    \
+        const init_name_t *entry = libinit_index_lookup(KIND, name, &scratch);  \
+        if(entry == NULL) {                                                     \
+            ZF_LOGD("Unable to locate init data with the given name");          \
+            return 0;                                                           \
         }                                                                       \
-        ZF_LOGD("Unable to locate init data with the given name");              \
-        return 0;                                                               \
+        return (RET) entry->value.FIELD;                                        \
     }
 
-LOOKUP(seL4_CPtr,   endpoint,       EndpointData,       ep_list_head,           cap);
-LOOKUP(seL4_CPtr,   notification,   EndpointData,       notification_list_head, cap);
-LOOKUP(void*,       shmem,          SharedMemoryData,   shmem_list_head,        addr);
-LOOKUP(void*,       devmem_addr,    DeviceMemoryData,   devmem_list_head,       virt_addr);
+LOOKUP(seL4_CPtr,   endpoint,       INIT_NAME_ENDPOINT,     cap);
+LOOKUP(seL4_CPtr,   notification,   INIT_NAME_NOTIFICATION, cap);
+LOOKUP(void*,       shmem,          INIT_NAME_SHMEM,        addr);
+LOOKUP(void*,       devmem_addr,    INIT_NAME_DEVMEM,       devmem.vaddr);
 
 int init_lookup_irq(const char * name, init_irq_info_t *info)
 {
-    if(!init_check_initialized() || !init_objects.init_data) {
+    if(!init_check_initialized() || !INIT_DATA_PRESENT()) {
         ZF_LOGE("Invalid usage of init library");
         return -1;
     }
@@ -46,26 +52,21 @@ int init_lookup_irq(const char * name, init_irq_info_t *info)
         return -2;
     }
 
-    IrqData * iter = init_objects.init_data->irq_list_head;
-    ZF_LOGD_IF(iter == NULL, "No elements in list when looking up.");
-
-    while(iter) {
-        if(strcmp(name, iter->name) == 0) {
-             info->ep = iter->ep_cap;
-             info->irq = iter->irq_cap;
-             info->number = iter->number;
-            return 0;
-        }
-        iter = iter->next;
+    init_name_t scratch;
+    const init_name_t *entry = libinit_index_lookup(INIT_NAME_IRQ, name, &scratch);
+    if(entry == NULL) {
+        ZF_LOGD("Unable to locate init data with the given name");
+        return -3;
     }
-    ZF_LOGD("Unable to locate init data with the given name");
-    return -3;
+
+    *info = entry->value.irq;
+    return 0;
 }
 
 
 int init_lookup_devmem_info(const char * name, init_devmem_info_t *info)
 {
-    if(!init_objects.initialized || !init_objects.init_data) {
+    if(!init_objects.initialized || !INIT_DATA_PRESENT()) {
         ZF_LOGE("Invalid usage of init library");
         return -1;
     }
@@ -75,29 +76,60 @@ int init_lookup_devmem_info(const char * name, init_devmem_info_t *info)
         return -2;
     }
 
-    DeviceMemoryData * iter = init_objects.init_data->devmem_list_head;
-    ZF_LOGD_IF(iter == NULL, "No elements in list when looking up.");
-
-    while(iter) {
-        if(strcmp(name, iter->name) == 0) {
-            info->vaddr = (void*) ((seL4_Word) iter->virt_addr);
-            info->paddr = (void*) ((seL4_Word) iter->phys_addr);
-            info->size_bits = iter->size_bits;
-            info->num_pages = iter->num_pages;
-
-            if(iter->n_caps32 == iter->num_pages && sizeof(seL4_CPtr) == sizeof(uint32_t)) {
-                info->caps = (seL4_CPtr*)iter->caps32;
-            } else if(iter->n_caps64 == iter->num_pages && sizeof(seL4_CPtr) == sizeof(uint64_t)) {
-                info->caps = (seL4_CPtr*)iter->caps64;
-            } else {
-                info->caps = NULL;
-            }
-
-            return 0;
-        }
-        iter = iter->next;
+    init_name_t scratch;
+    const init_name_t *entry = libinit_index_lookup(INIT_NAME_DEVMEM, name, &scratch);
+    if(entry == NULL) {
+        ZF_LOGD("Unable to locate init data with the given name");
+        return -3;
+    }
+
+    *info = entry->value.devmem;
+    return 0;
+}
+
+
+seL4_Word init_lookup_conn_name(init_name_kind_t kind, const char *name)
+{
+    if(!init_check_initialized() || !INIT_DATA_PRESENT()) {
+        ZF_LOGE("Invalid usage of init library");
+        return 0;
+    }
+
+    init_name_t scratch;
+    const init_name_t *entry = libinit_index_lookup(kind, name, &scratch);
+    if(entry == NULL) {
+        ZF_LOGD("Unable to locate init data with the given name");
+        return 0;
+    }
+
+    switch(kind) {
+    case INIT_NAME_ENDPOINT:
+    case INIT_NAME_NOTIFICATION:
+        return entry->value.cap;
+    case INIT_NAME_SHMEM:
+        return (seL4_Word)entry->value.addr;
+    case INIT_NAME_DEVMEM:
+        return (seL4_Word)entry->value.devmem.vaddr;
+    default:
+        ZF_LOGE("Connections can't be of this kind");
+        return 0;
     }
-    ZF_LOGD("Unable to locate init data with the given name");
-    return -3;
 }
 
+
+init_handle_t init_lookup_handle(init_name_kind_t kind, const char *name)
+{
+    if(!init_check_initialized() || !INIT_DATA_PRESENT()) {
+        ZF_LOGE("Invalid usage of init library");
+        return NULL;
+    }
+
+    if((unsigned)kind >= INIT_NAME_NUM_KINDS) {
+        ZF_LOGE("Invalid name kind");
+        return NULL;
+    }
+
+    init_handle_t handle = libinit_index_find(kind, name);
+    ZF_LOGD_IF(handle == NULL, "Unable to locate init data with the given name");
+    return handle;
+}
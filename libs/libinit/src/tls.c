@@ -14,6 +14,11 @@
 
 /**
  * TODO: Move these implementations into arch folders/files.
+ *
+ * On x86 the FS base already holds musl's thread pointer, so replacing it
+ * would break errno and everything else in libc TLS. Instead we use the
+ * userData word of the thread's IPC buffer, which the kernel keeps per
+ * thread and libsel4 reaches through the GS segment.
  */
 
 int init_set_thread_local_storage(void *storage)
@@ -28,14 +33,9 @@ int init_set_thread_local_storage(void *storage)
 //#error "Libinit requires use of TPIDRURW register for AARCH 32. Please disable CONFIG_IPC_BUF_TPIDRURW."
 //#endif /* CONFIG_IPC_BUF_TPIDRURW */
 #endif /* CONFIG_ARCH_AARCH32 */
-#ifdef CONFIG_ARCH_X86_64
-    /* TODO */
-    ZF_LOGW("Not implemented yet!");
-#endif /* CONFIG_ARCH_X86_64 */
-#ifdef CONFIG_ARCH_IA32
-    /* TODO */
-    ZF_LOGW("Not implemented yet!");
-#endif /* CONFIG_ARCH_IA32 */
+#ifdef CONFIG_ARCH_X86
+    seL4_SetUserData((seL4_Word)storage);
+#endif /* CONFIG_ARCH_X86 */
     return 0;
 }
 
@@ -53,14 +53,9 @@ void *init_get_thread_local_storage(void)
 //#error "Libinit requires use of TPIDRURW register for AARCH 32. Please disable CONFIG_IPC_BUF_TPIDRURW."
 //#endif /* CONFIG_IPC_BUF_TPIDRURW */
 #endif /* CONFIG_ARCH_AARCH32 */
-#ifdef CONFIG_ARCH_X86_64
-    /* TODO */
-    ZF_LOGE("Not implemented yet!");
-#endif /* CONFIG_ARCH_X86_64 */
-#ifdef CONFIG_ARCH_IA32
-    /* TODO */
-    ZF_LOGE("Not implemented yet!");
-#endif /* CONFIG_ARCH_IA32 */
+#ifdef CONFIG_ARCH_X86
+    ret = (void*)seL4_GetUserData();
+#endif /* CONFIG_ARCH_X86 */
     return ret;
 }
 
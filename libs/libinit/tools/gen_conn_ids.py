@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""
+Generate integer IDs for a system's connection names.
+
+Reads a list of connections, one per line as "<kind> <name>", where kind is
+endpoint, notification, shmem or devmem, and names use only letters, digits,
+'_', '.' and '-'. Blank lines and lines starting with '#' are ignored. Writes a C header that gives every connection an ID:
+
+    #define CONN_ECHO1_EP       0
+    #define CONN_ECHO1_EP_KIND  INIT_NAME_ENDPOINT
+    #define CONN_ECHO1_EP_NAME  "echo1-ep"
+
+and a CONN_ID_TABLE initializer for the parent:
+
+    static const init_conn_id_t conn_ids[] = CONN_ID_TABLE;
+    process_set_conn_ids(conn_ids, CONN_COUNT);
+
+Children then look connections up with init_conn_cap(CONN_ECHO1_EP) or
+init_conn_addr(...), which fall back to the string name if the parent
+didn't fill in the ID.
+
+usage: gen_conn_ids.py [--prefix CONN_] <connections> <header>
+"""
+
+import argparse
+import os
+import re
+import sys
+
+KINDS = {
+    "endpoint": "INIT_NAME_ENDPOINT",
+    "notification": "INIT_NAME_NOTIFICATION",
+    "shmem": "INIT_NAME_SHMEM",
+    "devmem": "INIT_NAME_DEVMEM",
+}
+
+# Names go into C string literals as they are
+NAME = re.compile(r"[A-Za-z0-9_.-]+$")
+
+
+def parse(path):
+    conns = []
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            line = line.split("#", 1)[0].strip()
+            if not line:
+                continue
+            fields = line.split()
+            if len(fields) != 2 or fields[0] not in KINDS:
+                sys.exit("%s:%d: expected '<%s> <name>'" % (path, lineno, "|".join(sorted(KINDS))))
+            if not NAME.match(fields[1]):
+                sys.exit("%s:%d: name '%s' may only use letters, digits, '_', '.' and '-'" %
+                         (path, lineno, fields[1]))
+            conns.append((fields[0], fields[1], lineno))
+    return conns
+
+
+def identifier(prefix, name):
+    return prefix + re.sub(r"[^A-Za-z0-9]", "_", name).upper()
+
+
+def generate(conns, prefix, source, header_path):
+    seen = {}
+    lines = [
+        "/**",
+        " * @file %s" % os.path.basename(header_path),
+        " * @brief Connection IDs, generated by gen_conn_ids.py from %s. Don't edit." % os.path.basename(source),
+        " */",
+        "",
+        "#pragma once",
+        "",
+        "#include <init/init.h>",
+        "",
+    ]
+    table = []
+    for conn_id, (kind, name, lineno) in enumerate(conns):
+        ident = identifier(prefix, name)
+        if ident in seen:
+            sys.exit("%s:%d: %s clashes with line %d" % (source, lineno, ident, seen[ident]))
+        seen[ident] = lineno
+        lines += [
+            "#define %-40s %d" % (ident, conn_id),
+            "#define %-40s %s" % (ident + "_KIND", KINDS[kind]),
+            "#define %-40s \"%s\"" % (ident + "_NAME", name),
+            "",
+        ]
+        table.append("    { %s, \"%s\" }," % (KINDS[kind], name))
+
+    lines += ["#define %-40s %d" % (prefix + "COUNT", len(conns)), ""]
+    lines += ["#define %s { \\" % (prefix + "ID_TABLE")]
+    lines += [entry + " \\" for entry in table]
+    lines += ["}", ""]
+    return "\n".join(lines)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Generate integer IDs for connection names")
+    parser.add_argument("--prefix", default="CONN_", help="prefix of the generated macros")
+    parser.add_argument("connections", help="list of '<kind> <name>' lines")
+    parser.add_argument("header", help="header to write")
+    args = parser.parse_args()
+
+    header = generate(parse(args.connections), args.prefix, args.connections, args.header)
+
+    # Leave an unchanged header alone so make doesn't rebuild everything
+    if os.path.exists(args.header):
+        with open(args.header) as f:
+            if f.read() == header:
+                sys.exit(0)
+    with open(args.header, "w") as f:
+        f.write(header)
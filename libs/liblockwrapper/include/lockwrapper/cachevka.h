@@ -0,0 +1,53 @@
+/**
+ *  @file cachevka.h
+ * 
+ *  @brief Per thread kernel object caches in front of a lockvka
+ *
+ *  Endpoints, notifications, TCBs, 4K frames and free cslots are handed out
+ *  from small per thread magazines without touching the lockvka lock. Empty
+ *  magazines are refilled, and full ones drained, half a magazine at a time
+ *  under a single lock acquisition.
+ **/
+#pragma once
+
+#include <lockwrapper/wrappers.h>
+
+#ifdef CONFIG_LIB_LOCK_WRAPPER_MAGAZINES
+
+/**
+ * @brief Initialize a vka object from a cachevka
+ *
+ * @param       out_vka             VKA to be initialized with caching functions and data
+ * @param       cachevka            cachevka object to use in the initialization
+ */
+void cachevka_make_vka(vka_t *out_vka, cachevka_t *cachevka);
+
+/**
+ * @brief Put a cachevka in front of a lockvka
+ *
+ * @param       cachevka            cachevka to be initialized
+ * @param       lockvka             lockvka to refill from and drain to
+ * @param       get_index           returns the calling thread's magazine, may be NULL
+ */
+void cachevka_attach(cachevka_t *cachevka, lockvka_t *lockvka, int (*get_index)(void));
+
+/**
+ * @brief Modify a vka made by lockvka_replace so it goes through a cachevka
+ *
+ * @param       cachevka            cachevka to be initialized
+ * @param       inout_vka           vka built by lockvka_replace
+ * @param       lockvka             the lockvka behind inout_vka
+ * @param       get_index           returns the calling thread's magazine, may be NULL
+ */
+static inline void cachevka_replace(cachevka_t *cachevka, vka_t *inout_vka,
+                                    lockvka_t *lockvka, int (*get_index)(void)) {
+    cachevka_attach(cachevka, lockvka, get_index);
+    cachevka_make_vka(inout_vka, cachevka);
+}
+
+/**
+ * @brief Return every cached object, slot and pending free to the lockvka
+ */
+void cachevka_drain_all(cachevka_t *cachevka);
+
+#endif /* CONFIG_LIB_LOCK_WRAPPER_MAGAZINES */
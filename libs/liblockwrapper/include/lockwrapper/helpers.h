@@ -10,12 +10,23 @@
 #pragma once
 
 #include <lockwrapper/types.h>
+#include <lockwrapper/wrappers.h>
 
 #define ERROR_CHECK(lock, object, operation) assert(lock != NULL && object != NULL && object->operation != NULL)
+
+/**
+ * Decide once whether to lock so the unlock always matches, even if another
+ * thread is started while the action runs.
+ */
 #define LOCKED(lock, operation, action) do { \
-    lock->mutex_lock(lock->data); \
+    bool _lockwrapper_locked = lockwrapper_needs_locking(); \
+    if(_lockwrapper_locked) { \
+        lock->mutex_lock(lock->data); \
+    } \
     action;\
-    lock->mutex_unlock(lock->data); \
+    if(_lockwrapper_locked) { \
+        lock->mutex_unlock(lock->data); \
+    } \
 } while(0)
 
 #define LOCKWRAPPER_CALL_OPS_RETURN(type, lock, object, operation,...) do { \
@@ -1,4 +1,6 @@
 #pragma once
 
 #include <lockwrapper/lockvka.h>
-#include <lockwrapper/lockvspace.h>
\ No newline at end of file
+#include <lockwrapper/lockvspace.h>
+#include <lockwrapper/cachevka.h>
+#include <lockwrapper/rangevspace.h>
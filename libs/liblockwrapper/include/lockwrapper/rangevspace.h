@@ -0,0 +1,55 @@
+/**
+ *  @file rangevspace.h
+ *
+ *  @brief Range locked vspace in front of a lockvspace
+ *
+ *  A window of the parent vspace is managed natively. Reservations in it are
+ *  kept in an interval tree, so finding the reservation for an address is
+ *  O(log n), and every reservation has its own lock, so threads mapping into
+ *  different reservations run in parallel. The tree lock is only held for
+ *  tree updates, never across a syscall.
+ **/
+#pragma once
+
+#include <lockwrapper/wrappers.h>
+
+#ifdef CONFIG_LIB_LOCK_WRAPPER_RANGE_VSPACE
+
+/**
+ * @brief Initialize a vspace object from a rangevspace
+ *
+ * @param       out_vspace          vspace to be initialized with range locked functions
+ * @param       rangevspace         rangevspace object to use in the initialization
+ */
+void rangevspace_make_vspace(vspace_t *out_vspace, rangevspace_t *rangevspace);
+
+/**
+ * @brief Reserve the window in the parent vspace and set up the trees
+ *
+ * @param       rangevspace         rangevspace to be initialized
+ * @param       parent_vspace       vspace to carve the window from, and to forward everything else to
+ * @param       vka                 vka for frames and paging structures, must be thread safe
+ * @param       window_bytes        size of the window
+ * @return                          0 on success
+ */
+int rangevspace_attach(rangevspace_t *rangevspace, vspace_t parent_vspace, vka_t *vka, size_t window_bytes);
+
+/**
+ * @brief Modify a vspace made by lockvspace_replace so it goes through a rangevspace
+ *
+ * @param       rangevspace         rangevspace to be initialized
+ * @param       inout_vspace        vspace built by lockvspace_replace
+ * @param       vka                 vka for frames and paging structures, must be thread safe
+ * @param       window_bytes        size of the window
+ * @return                          0 on success, inout_vspace is untouched on failure
+ */
+static inline int rangevspace_replace(rangevspace_t *rangevspace, vspace_t *inout_vspace,
+                                      vka_t *vka, size_t window_bytes) {
+    int error = rangevspace_attach(rangevspace, *inout_vspace, vka, window_bytes);
+    if(!error) {
+        rangevspace_make_vspace(inout_vspace, rangevspace);
+    }
+    return error;
+}
+
+#endif /* CONFIG_LIB_LOCK_WRAPPER_RANGE_VSPACE */
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <autoconf.h>
 #include <sel4/sel4.h>
 #include <vka/vka.h>
 #include <vspace/vspace.h>
@@ -22,4 +23,118 @@ typedef struct lockvka{
 typedef struct lockvspace{
     vspace_t parent_vspace;
     lock_interface_t lock;
-} lockvspace_t;
\ No newline at end of file
+} lockvspace_t;
+
+#ifdef CONFIG_LIB_LOCK_WRAPPER_MAGAZINES
+/**
+ * Object types kept pre-retyped in the magazines
+ */
+typedef enum {
+    CACHEVKA_ENDPOINT = 0,
+    CACHEVKA_NOTIFICATION,
+    CACHEVKA_TCB,
+    CACHEVKA_FRAME_4K,
+    CACHEVKA_NUM_CLASSES
+} cachevka_class_t;
+
+typedef struct cachevka_object {
+    seL4_CPtr slot;
+    seL4_Word cookie;
+} cachevka_object_t;
+
+typedef struct cachevka_free {
+    seL4_Word type;
+    seL4_Word size_bits;
+    seL4_Word cookie;
+} cachevka_free_t;
+
+typedef struct cachevka_magazine {
+    volatile int lock;
+
+    seL4_Word num_objects[CACHEVKA_NUM_CLASSES];
+    cachevka_object_t objects[CACHEVKA_NUM_CLASSES][CONFIG_LIB_LOCK_WRAPPER_MAGAZINE_SIZE];
+
+    seL4_Word num_slots;
+    seL4_CPtr slots[CONFIG_LIB_LOCK_WRAPPER_MAGAZINE_SIZE];
+
+    seL4_Word num_frees;
+    cachevka_free_t frees[CONFIG_LIB_LOCK_WRAPPER_MAGAZINE_SIZE];
+} cachevka_magazine_t;
+
+typedef struct cachevka {
+    lockvka_t *lockvka;
+    seL4_Word class_type[CACHEVKA_NUM_CLASSES];
+    seL4_Word class_size_bits[CACHEVKA_NUM_CLASSES];
+
+    /* Picks the magazine for the calling thread */
+    int (*get_index)(void);
+    cachevka_magazine_t magazines[CONFIG_LIB_LOCK_WRAPPER_NUM_MAGAZINES];
+} cachevka_t;
+#endif /* CONFIG_LIB_LOCK_WRAPPER_MAGAZINES */
+
+#ifdef CONFIG_LIB_LOCK_WRAPPER_RANGE_VSPACE
+/**
+ * AVL node for an address range [start, end). Both trees are keyed by start
+ * address. Each node also keeps the largest end (max_end) and the largest
+ * range size (max_size) of its subtree. The region tree is an interval tree
+ * through max_end. The free space tree prunes its fit search through
+ * max_size.
+ */
+typedef struct rangevspace_node {
+    struct rangevspace_node *left;
+    struct rangevspace_node *right;
+    int height;
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t max_end;
+    uintptr_t max_size;
+} rangevspace_node_t;
+
+/**
+ * A reservation inside the window. It stays in the tree until it has been
+ * freed AND every page mapped in it has been unmapped.
+ */
+typedef struct rangevspace_region {
+    /* Tells our reservations apart from the parent's */
+    seL4_Word magic;
+    rangevspace_node_t node;
+
+    volatile int lock;
+    int refs;
+    bool reserved;
+    bool retired;
+
+    seL4_CapRights_t rights;
+    int cacheable;
+    seL4_Word size_bits;
+    seL4_Word num_mapped;
+    seL4_Word num_slots;
+    seL4_CPtr *caps;
+    uintptr_t *cookies;
+} rangevspace_region_t;
+
+/**
+ * Paging structures the range vspace had to create
+ */
+typedef struct rangevspace_paging {
+    struct rangevspace_paging *next;
+    vka_object_t obj;
+} rangevspace_paging_t;
+
+typedef struct rangevspace {
+    vspace_t parent_vspace;
+    vka_t *vka;
+    seL4_CPtr root_cap;
+
+    reservation_t window;
+    uintptr_t base;
+    uintptr_t top;
+
+    /* Guards both trees, never held across a syscall */
+    volatile int tree_lock;
+    rangevspace_node_t *regions;
+    rangevspace_node_t *free_ranges;
+
+    rangevspace_paging_t *paging;
+} rangevspace_t;
+#endif /* CONFIG_LIB_LOCK_WRAPPER_RANGE_VSPACE */
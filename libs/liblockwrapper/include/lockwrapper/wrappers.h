@@ -5,6 +5,7 @@
  **/
 #pragma once
 
+#include <autoconf.h>
 #include <lockwrapper/types.h>
 #include <sync/mutex.h>
 #include <sync/recursive_mutex.h>
@@ -23,4 +24,49 @@ lock_interface_t sync_mutex_make_interface(sync_mutex_t * m);
  * @param       m                       pointer to sync mutex (DO NOT FREE MUTEX)
  * @return      lock_interface_t        interface implementing lock_interface_t
  */
-lock_interface_t sync_recursive_mutex_make_interface(sync_recursive_mutex_t * m);
\ No newline at end of file
+lock_interface_t sync_recursive_mutex_make_interface(sync_recursive_mutex_t * m);
+
+
+/**
+ * Number of threads in this process that may call into the wrappers.
+ * Starts at one for the initial thread.
+ */
+extern int lockwrapper_live_threads;
+
+/**
+ * @brief Record that a new thread is about to run in this process.
+ *
+ * Must be called before the thread is resumed, so that the wrappers are
+ * already locking by the time it can reach them.
+ */
+void lockwrapper_thread_started(void);
+
+/**
+ * @brief Record that a thread has been stopped for good.
+ */
+void lockwrapper_thread_stopped(void);
+
+/**
+ * @brief Whether wrapped calls need their lock right now.
+ */
+static inline bool lockwrapper_needs_locking(void) {
+#ifdef CONFIG_LIB_LOCK_WRAPPER_SINGLE_THREAD_FAST_PATH
+    return __atomic_load_n(&lockwrapper_live_threads, __ATOMIC_ACQUIRE) > 1;
+#else
+    return true;
+#endif
+}
+
+/**
+ * @brief Short critical section lock for wrapper bookkeeping, the cachevka
+ * magazines and the rangevspace trees and regions.
+ */
+static inline void lockwrapper_spin_lock(volatile int *lock) {
+    while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+        seL4_Yield();
+    }
+}
+
+static inline void lockwrapper_spin_unlock(volatile int *lock) {
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+}
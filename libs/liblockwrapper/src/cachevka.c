@@ -0,0 +1,306 @@
+#include <autoconf.h>
+
+#ifdef CONFIG_LIB_LOCK_WRAPPER_MAGAZINES
+
+#include <assert.h>
+#include <string.h>
+
+#include <vka/kobject_t.h>
+#include <lockwrapper/cachevka.h>
+#include <lockwrapper/lockvka.h>
+
+#define MAGAZINE_SIZE CONFIG_LIB_LOCK_WRAPPER_MAGAZINE_SIZE
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
+
+/**
+ * The vka behind the lockvka. Only call it while holding the lockvka lock.
+ */
+static inline vka_t *cachevka_inner_vka(cachevka_t *cachevka) {
+    return &cachevka->lockvka->parent_vka;
+}
+
+/**
+ * Honour the single threaded fast path the same way LOCKED does.
+ */
+static inline bool cachevka_parent_lock(cachevka_t *cachevka) {
+    bool locked = lockwrapper_needs_locking();
+    if(locked) {
+        lockvka_lock(cachevka->lockvka);
+    }
+    return locked;
+}
+
+static inline void cachevka_parent_unlock(cachevka_t *cachevka, bool locked) {
+    if(locked) {
+        lockvka_unlock(cachevka->lockvka);
+    }
+}
+
+static inline cachevka_magazine_t *cachevka_magazine_lock(cachevka_t *cachevka) {
+    int index = cachevka->get_index == NULL ? 0 : cachevka->get_index();
+    cachevka_magazine_t *magazine = &cachevka->magazines[index % CONFIG_LIB_LOCK_WRAPPER_NUM_MAGAZINES];
+    lockwrapper_spin_lock(&magazine->lock);
+    return magazine;
+}
+
+static inline void cachevka_magazine_unlock(cachevka_magazine_t *magazine) {
+    lockwrapper_spin_unlock(&magazine->lock);
+}
+
+static int cachevka_find_class(cachevka_t *cachevka, seL4_Word type, seL4_Word size_bits) {
+    for(int i = 0; i < CACHEVKA_NUM_CLASSES; i++) {
+        if(cachevka->class_type[i] == type && cachevka->class_size_bits[i] == size_bits) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Assumes the parent lock is held
+ */
+static void cachevka_drain_frees_unsafe(cachevka_t *cachevka, cachevka_magazine_t *magazine) {
+    vka_t *inner = cachevka_inner_vka(cachevka);
+    while(magazine->num_frees > 0) {
+        cachevka_free_t *entry = &magazine->frees[--magazine->num_frees];
+        inner->utspace_free(inner->data, entry->type, entry->size_bits, entry->cookie);
+    }
+}
+
+/**
+ * Assumes the parent lock is held
+ */
+static void cachevka_drain_slots_unsafe(cachevka_t *cachevka, cachevka_magazine_t *magazine, seL4_Word keep) {
+    vka_t *inner = cachevka_inner_vka(cachevka);
+    while(magazine->num_slots > keep) {
+        inner->cspace_free(inner->data, magazine->slots[--magazine->num_slots]);
+    }
+}
+
+/**
+ * Retype a batch of objects into fresh slots. Pending frees go back first so
+ * their memory can be reused. Assumes the magazine is locked.
+ */
+static void cachevka_refill_objects(cachevka_t *cachevka, cachevka_magazine_t *magazine, int class) {
+    vka_t *inner = cachevka_inner_vka(cachevka);
+    seL4_Word type = cachevka->class_type[class];
+    seL4_Word size_bits = cachevka->class_size_bits[class];
+
+    bool locked = cachevka_parent_lock(cachevka);
+    cachevka_drain_frees_unsafe(cachevka, magazine);
+
+    while(magazine->num_objects[class] < MAGAZINE_BATCH) {
+        cachevka_object_t *entry = &magazine->objects[class][magazine->num_objects[class]];
+        cspacepath_t path;
+
+        if(magazine->num_slots > 0) {
+            entry->slot = magazine->slots[--magazine->num_slots];
+        } else if(inner->cspace_alloc(inner->data, &entry->slot)) {
+            break;
+        }
+
+        inner->cspace_make_path(inner->data, entry->slot, &path);
+        if(inner->utspace_alloc(inner->data, &path, type, size_bits, &entry->cookie)) {
+            magazine->slots[magazine->num_slots++] = entry->slot;
+            break;
+        }
+        magazine->num_objects[class]++;
+    }
+
+    cachevka_parent_unlock(cachevka, locked);
+}
+
+
+static int cachevka_cspace_alloc(void *data, seL4_CPtr *res) {
+    cachevka_t *cachevka = (cachevka_t *) data;
+    vka_t *inner = cachevka_inner_vka(cachevka);
+    int error = 0;
+
+    cachevka_magazine_t *magazine = cachevka_magazine_lock(cachevka);
+    if(magazine->num_slots == 0) {
+        bool locked = cachevka_parent_lock(cachevka);
+        while(magazine->num_slots < MAGAZINE_BATCH) {
+            seL4_CPtr slot;
+            if(inner->cspace_alloc(inner->data, &slot)) {
+                break;
+            }
+            magazine->slots[magazine->num_slots++] = slot;
+        }
+        cachevka_parent_unlock(cachevka, locked);
+    }
+
+    if(magazine->num_slots > 0) {
+        *res = magazine->slots[--magazine->num_slots];
+    } else {
+        error = -1;
+    }
+    cachevka_magazine_unlock(magazine);
+    return error;
+}
+
+static void cachevka_cspace_free(void *data, seL4_CPtr slot) {
+    cachevka_t *cachevka = (cachevka_t *) data;
+
+    cachevka_magazine_t *magazine = cachevka_magazine_lock(cachevka);
+    if(magazine->num_slots == MAGAZINE_SIZE) {
+        bool locked = cachevka_parent_lock(cachevka);
+        cachevka_drain_slots_unsafe(cachevka, magazine, MAGAZINE_BATCH);
+        cachevka_parent_unlock(cachevka, locked);
+    }
+    magazine->slots[magazine->num_slots++] = slot;
+    cachevka_magazine_unlock(magazine);
+}
+
+static void cachevka_cspace_make_path(void *data, seL4_CPtr slot, cspacepath_t *res) {
+    cachevka_t *cachevka = (cachevka_t *) data;
+    vka_cspace_make_path(&cachevka->lockvka->parent_vka, slot, res);
+}
+
+static int cachevka_utspace_alloc(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits, seL4_Word *res) {
+    cachevka_t *cachevka = (cachevka_t *) data;
+    vka_t locked_vka;
+    lockvka_make_vka(&locked_vka, cachevka->lockvka);
+
+    int class = cachevka_find_class(cachevka, type, size_bits);
+    if(class < 0) {
+        return locked_vka.utspace_alloc(locked_vka.data, dest, type, size_bits, res);
+    }
+
+    cachevka_magazine_t *magazine = cachevka_magazine_lock(cachevka);
+    if(magazine->num_objects[class] == 0) {
+        cachevka_refill_objects(cachevka, magazine, class);
+    }
+
+    if(magazine->num_objects[class] == 0) {
+        cachevka_magazine_unlock(magazine);
+        return -1;
+    }
+
+    /**
+     * Move the cached object into the caller's slot and keep the
+     * now empty cache slot for later.
+     */
+    cachevka_object_t *entry = &magazine->objects[class][--magazine->num_objects[class]];
+    cspacepath_t src;
+    vka_cspace_make_path(&cachevka->lockvka->parent_vka, entry->slot, &src);
+    int error = seL4_CNode_Move(dest->root, dest->capPtr, dest->capDepth,
+                                src.root, src.capPtr, src.capDepth);
+    if(error) {
+        magazine->num_objects[class]++;
+        cachevka_magazine_unlock(magazine);
+        return error;
+    }
+
+    *res = entry->cookie;
+    if(magazine->num_slots < MAGAZINE_SIZE) {
+        magazine->slots[magazine->num_slots++] = entry->slot;
+        cachevka_magazine_unlock(magazine);
+    } else {
+        cachevka_magazine_unlock(magazine);
+        locked_vka.cspace_free(locked_vka.data, entry->slot);
+    }
+    return 0;
+}
+
+static int cachevka_utspace_alloc_maybe_device(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits, bool can_use_dev, seL4_Word *res) {
+    cachevka_t *cachevka = (cachevka_t *) data;
+    if(!can_use_dev) {
+        return cachevka_utspace_alloc(data, dest, type, size_bits, res);
+    }
+    vka_t locked_vka;
+    lockvka_make_vka(&locked_vka, cachevka->lockvka);
+    return locked_vka.utspace_alloc_maybe_device(locked_vka.data, dest, type, size_bits, can_use_dev, res);
+}
+
+static int cachevka_utspace_alloc_at(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits, uintptr_t paddr, seL4_Word *cookie) {
+    cachevka_t *cachevka = (cachevka_t *) data;
+    vka_t locked_vka;
+    lockvka_make_vka(&locked_vka, cachevka->lockvka);
+    return locked_vka.utspace_alloc_at(locked_vka.data, dest, type, size_bits, paddr, cookie);
+}
+
+static void cachevka_utspace_free(void *data, seL4_Word type, seL4_Word size_bits, seL4_Word target) {
+    cachevka_t *cachevka = (cachevka_t *) data;
+
+    cachevka_magazine_t *magazine = cachevka_magazine_lock(cachevka);
+    if(magazine->num_frees == MAGAZINE_SIZE) {
+        bool locked = cachevka_parent_lock(cachevka);
+        cachevka_drain_frees_unsafe(cachevka, magazine);
+        cachevka_parent_unlock(cachevka, locked);
+    }
+    magazine->frees[magazine->num_frees++] = (cachevka_free_t) {
+        .type = type,
+        .size_bits = size_bits,
+        .cookie = target,
+    };
+    cachevka_magazine_unlock(magazine);
+}
+
+static uintptr_t cachevka_utspace_paddr(void *data, seL4_Word target, seL4_Word type, seL4_Word size_bits) {
+    cachevka_t *cachevka = (cachevka_t *) data;
+    vka_t locked_vka;
+    lockvka_make_vka(&locked_vka, cachevka->lockvka);
+    return locked_vka.utspace_paddr(locked_vka.data, target, type, size_bits);
+}
+
+void cachevka_make_vka(vka_t *out_vka, cachevka_t *cachevka) {
+    assert(out_vka);
+    assert(cachevka);
+
+    out_vka->data = (void *) cachevka;
+    out_vka->cspace_alloc = &cachevka_cspace_alloc;
+    out_vka->cspace_make_path = &cachevka_cspace_make_path;
+    out_vka->utspace_alloc = &cachevka_utspace_alloc;
+    out_vka->utspace_alloc_maybe_device = &cachevka_utspace_alloc_maybe_device;
+    out_vka->utspace_alloc_at = &cachevka_utspace_alloc_at;
+    out_vka->cspace_free = &cachevka_cspace_free;
+    out_vka->utspace_free = &cachevka_utspace_free;
+    out_vka->utspace_paddr = &cachevka_utspace_paddr;
+}
+
+void cachevka_attach(cachevka_t *cachevka, lockvka_t *lockvka, int (*get_index)(void)) {
+    assert(cachevka);
+    assert(lockvka);
+
+    memset(cachevka, 0, sizeof(*cachevka));
+    cachevka->lockvka = lockvka;
+    cachevka->get_index = get_index;
+
+    cachevka->class_type[CACHEVKA_ENDPOINT] = seL4_EndpointObject;
+    cachevka->class_size_bits[CACHEVKA_ENDPOINT] = seL4_EndpointBits;
+    cachevka->class_type[CACHEVKA_NOTIFICATION] = seL4_NotificationObject;
+    cachevka->class_size_bits[CACHEVKA_NOTIFICATION] = seL4_NotificationBits;
+    cachevka->class_type[CACHEVKA_TCB] = seL4_TCBObject;
+    cachevka->class_size_bits[CACHEVKA_TCB] = seL4_TCBBits;
+    cachevka->class_type[CACHEVKA_FRAME_4K] = kobject_get_type(KOBJECT_FRAME, seL4_PageBits);
+    cachevka->class_size_bits[CACHEVKA_FRAME_4K] = seL4_PageBits;
+}
+
+void cachevka_drain_all(cachevka_t *cachevka) {
+    vka_t *inner = cachevka_inner_vka(cachevka);
+
+    for(int i = 0; i < CONFIG_LIB_LOCK_WRAPPER_NUM_MAGAZINES; i++) {
+        cachevka_magazine_t *magazine = &cachevka->magazines[i];
+        lockwrapper_spin_lock(&magazine->lock);
+
+        bool locked = cachevka_parent_lock(cachevka);
+        for(int class = 0; class < CACHEVKA_NUM_CLASSES; class++) {
+            while(magazine->num_objects[class] > 0) {
+                cachevka_object_t *entry = &magazine->objects[class][--magazine->num_objects[class]];
+                cspacepath_t path;
+                inner->cspace_make_path(inner->data, entry->slot, &path);
+                seL4_CNode_Delete(path.root, path.capPtr, path.capDepth);
+                inner->utspace_free(inner->data, cachevka->class_type[class],
+                                    cachevka->class_size_bits[class], entry->cookie);
+                inner->cspace_free(inner->data, entry->slot);
+            }
+        }
+        cachevka_drain_frees_unsafe(cachevka, magazine);
+        cachevka_drain_slots_unsafe(cachevka, magazine, 0);
+        cachevka_parent_unlock(cachevka, locked);
+
+        cachevka_magazine_unlock(magazine);
+    }
+}
+
+#endif /* CONFIG_LIB_LOCK_WRAPPER_MAGAZINES */
@@ -0,0 +1,913 @@
+#include <autoconf.h>
+
+#ifdef CONFIG_LIB_LOCK_WRAPPER_RANGE_VSPACE
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vka/capops.h>
+#include <vka/kobject_t.h>
+#include <vspace/mapping.h>
+#include <sel4utils/mapping.h>
+#include <utils/util.h>
+
+#include <lockwrapper/rangevspace.h>
+
+/**
+ * Odd, so it can never be mistaken for the page aligned start address at
+ * the top of a parent (sel4utils) reservation.
+ */
+#define RANGEVSPACE_MAGIC ((seL4_Word)0x52564e31)
+
+#define REGION_OF_NODE(n) ((rangevspace_region_t *)((uintptr_t)(n) - offsetof(rangevspace_region_t, node)))
+
+
+static inline rangevspace_t *rangevspace_from_vspace(vspace_t *vspace) {
+    assert(vspace && vspace->data);
+    return (rangevspace_t *) vspace->data;
+}
+
+static inline bool rangevspace_in_window(rangevspace_t *rangevspace, uintptr_t vaddr) {
+    return vaddr >= rangevspace->base && vaddr < rangevspace->top;
+}
+
+static inline rangevspace_region_t *rangevspace_region_of(reservation_t res) {
+    rangevspace_region_t *region = (rangevspace_region_t *) res.res;
+    return (region != NULL && region->magic == RANGEVSPACE_MAGIC) ? region : NULL;
+}
+
+
+/******************************************************************************
+ * Augmented AVL tree
+ *****************************************************************************/
+static inline int node_height(rangevspace_node_t *node) {
+    return node == NULL ? 0 : node->height;
+}
+
+static inline uintptr_t node_max_end(rangevspace_node_t *node) {
+    return node == NULL ? 0 : node->max_end;
+}
+
+static inline uintptr_t node_max_size(rangevspace_node_t *node) {
+    return node == NULL ? 0 : node->max_size;
+}
+
+static void node_update(rangevspace_node_t *node) {
+    node->height = 1 + MAX(node_height(node->left), node_height(node->right));
+    node->max_end = MAX(node->end, MAX(node_max_end(node->left), node_max_end(node->right)));
+    node->max_size = MAX(node->end - node->start,
+                         MAX(node_max_size(node->left), node_max_size(node->right)));
+}
+
+static rangevspace_node_t *node_rotate_right(rangevspace_node_t *node) {
+    rangevspace_node_t *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    node_update(node);
+    node_update(left);
+    return left;
+}
+
+static rangevspace_node_t *node_rotate_left(rangevspace_node_t *node) {
+    rangevspace_node_t *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    node_update(node);
+    node_update(right);
+    return right;
+}
+
+static rangevspace_node_t *node_balance(rangevspace_node_t *node) {
+    node_update(node);
+    int balance = node_height(node->left) - node_height(node->right);
+
+    if(balance > 1) {
+        if(node_height(node->left->left) < node_height(node->left->right)) {
+            node->left = node_rotate_left(node->left);
+        }
+        return node_rotate_right(node);
+    }
+    if(balance < -1) {
+        if(node_height(node->right->right) < node_height(node->right->left)) {
+            node->right = node_rotate_right(node->right);
+        }
+        return node_rotate_left(node);
+    }
+    return node;
+}
+
+static rangevspace_node_t *tree_insert(rangevspace_node_t *root, rangevspace_node_t *node) {
+    if(root == NULL) {
+        node->left = NULL;
+        node->right = NULL;
+        node_update(node);
+        return node;
+    }
+    if(node->start < root->start) {
+        root->left = tree_insert(root->left, node);
+    } else {
+        root->right = tree_insert(root->right, node);
+    }
+    return node_balance(root);
+}
+
+static rangevspace_node_t *tree_remove_min(rangevspace_node_t *root, rangevspace_node_t **min) {
+    if(root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+    root->left = tree_remove_min(root->left, min);
+    return node_balance(root);
+}
+
+static rangevspace_node_t *tree_remove(rangevspace_node_t *root, rangevspace_node_t *node) {
+    if(root == NULL) {
+        return NULL;
+    }
+    if(node->start < root->start) {
+        root->left = tree_remove(root->left, node);
+    } else if(node->start > root->start) {
+        root->right = tree_remove(root->right, node);
+    } else {
+        rangevspace_node_t *left = root->left;
+        rangevspace_node_t *right = root->right;
+        rangevspace_node_t *min;
+        if(right == NULL) {
+            return left;
+        }
+        right = tree_remove_min(right, &min);
+        min->left = left;
+        min->right = right;
+        return node_balance(min);
+    }
+    return node_balance(root);
+}
+
+/**
+ * The range holding vaddr. Ranges in a tree never overlap, and max_end
+ * prunes subtrees that end before vaddr.
+ */
+static rangevspace_node_t *tree_find(rangevspace_node_t *node, uintptr_t vaddr) {
+    while(node != NULL && node->max_end > vaddr) {
+        if(vaddr < node->start) {
+            node = node->left;
+        } else if(vaddr < node->end) {
+            return node;
+        } else {
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+static inline bool node_fits(rangevspace_node_t *node, uintptr_t bytes, uintptr_t align) {
+    uintptr_t start = ROUND_UP(node->start, align);
+    return start >= node->start && start < node->end && node->end - start >= bytes;
+}
+
+/**
+ * Lowest range with room for bytes at the given alignment.
+ */
+static rangevspace_node_t *tree_first_fit_slow(rangevspace_node_t *node, uintptr_t bytes, uintptr_t align) {
+    if(node == NULL || node->max_size < bytes) {
+        return NULL;
+    }
+    rangevspace_node_t *found = tree_first_fit_slow(node->left, bytes, align);
+    if(found != NULL) {
+        return found;
+    }
+    if(node_fits(node, bytes, align)) {
+        return node;
+    }
+    return tree_first_fit_slow(node->right, bytes, align);
+}
+
+/**
+ * A range of at least bytes + align - 1 fits at any alignment, so a subtree
+ * whose max_size reaches that always holds a fit and the search never has to
+ * back out of it. That is one walk down the tree. It can pass over a smaller
+ * range that happens to be aligned, the exhaustive search is only the
+ * fallback when no range is big enough for that guarantee.
+ */
+static rangevspace_node_t *tree_first_fit(rangevspace_node_t *node, uintptr_t bytes, uintptr_t align) {
+    uintptr_t sure = bytes + align - 1;
+    rangevspace_node_t *root = node;
+
+    if(sure >= bytes) {
+        while(node != NULL && node->max_size >= sure) {
+            if(node_max_size(node->left) >= sure) {
+                node = node->left;
+            } else if(node_fits(node, bytes, align)) {
+                return node;
+            } else {
+                node = node->right;
+            }
+        }
+    }
+    return tree_first_fit_slow(root, bytes, align);
+}
+
+
+/******************************************************************************
+ * Free space, all of these assume the tree lock is held
+ *****************************************************************************/
+
+/**
+ * Cut [start, end) out of the free range holding it. Splitting may use the
+ * spare node, and an exact fit leaves a node unused. Both are freed by the
+ * caller once the tree lock is dropped.
+ */
+static int free_range_take(rangevspace_t *rangevspace, uintptr_t start, uintptr_t end,
+                           rangevspace_node_t **spare, rangevspace_node_t **unused) {
+    rangevspace_node_t *range = tree_find(rangevspace->free_ranges, start);
+    if(range == NULL || end > range->end) {
+        return -1;
+    }
+
+    rangevspace->free_ranges = tree_remove(rangevspace->free_ranges, range);
+    uintptr_t range_start = range->start;
+    uintptr_t range_end = range->end;
+
+    if(range_start < start) {
+        range->end = start;
+        rangevspace->free_ranges = tree_insert(rangevspace->free_ranges, range);
+        range = NULL;
+    }
+    if(end < range_end) {
+        if(range == NULL) {
+            range = *spare;
+            *spare = NULL;
+        }
+        range->start = end;
+        range->end = range_end;
+        rangevspace->free_ranges = tree_insert(rangevspace->free_ranges, range);
+        range = NULL;
+    }
+
+    *unused = range;
+    return 0;
+}
+
+/**
+ * Give [start, end) back, merging with free neighbours.
+ */
+static void free_range_give(rangevspace_t *rangevspace, uintptr_t start, uintptr_t end,
+                            rangevspace_node_t **spare, rangevspace_node_t **unused) {
+    rangevspace_node_t *before = start > rangevspace->base ? tree_find(rangevspace->free_ranges, start - 1) : NULL;
+    rangevspace_node_t *after = tree_find(rangevspace->free_ranges, end);
+    rangevspace_node_t *range;
+
+    *unused = NULL;
+    if(before != NULL) {
+        rangevspace->free_ranges = tree_remove(rangevspace->free_ranges, before);
+        range = before;
+        range->end = end;
+        if(after != NULL) {
+            rangevspace->free_ranges = tree_remove(rangevspace->free_ranges, after);
+            range->end = after->end;
+            *unused = after;
+        }
+    } else if(after != NULL) {
+        rangevspace->free_ranges = tree_remove(rangevspace->free_ranges, after);
+        range = after;
+        range->start = start;
+    } else {
+        range = *spare;
+        *spare = NULL;
+        range->start = start;
+        range->end = end;
+    }
+    rangevspace->free_ranges = tree_insert(rangevspace->free_ranges, range);
+}
+
+
+/******************************************************************************
+ * Regions
+ *****************************************************************************/
+static void region_destroy(rangevspace_region_t *region) {
+    free(region->caps);
+    free(region->cookies);
+    free(region);
+}
+
+static inline void region_get(rangevspace_region_t *region) {
+    __atomic_add_fetch(&region->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+static inline void region_put(rangevspace_region_t *region) {
+    if(__atomic_sub_fetch(&region->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        region_destroy(region);
+    }
+}
+
+/**
+ * Reserve bytes at vaddr, or anywhere in the window if vaddr is 0.
+ * The tree holds the only reference to the new region.
+ */
+static rangevspace_region_t *region_reserve(rangevspace_t *rangevspace, uintptr_t vaddr, size_t bytes,
+                                            seL4_Word size_bits, seL4_CapRights_t rights, int cacheable) {
+    bytes = ROUND_UP(bytes, BIT(size_bits));
+    if(bytes == 0 || (vaddr & MASK(size_bits)) != 0) {
+        return NULL;
+    }
+
+    rangevspace_region_t *region = calloc(1, sizeof(rangevspace_region_t));
+    rangevspace_node_t *spare = malloc(sizeof(rangevspace_node_t));
+    rangevspace_node_t *unused = NULL;
+    if(region == NULL || spare == NULL) {
+        goto fail;
+    }
+
+    region->num_slots = bytes >> size_bits;
+    region->caps = calloc(region->num_slots, sizeof(seL4_CPtr));
+    region->cookies = calloc(region->num_slots, sizeof(uintptr_t));
+    if(region->caps == NULL || region->cookies == NULL) {
+        goto fail;
+    }
+
+    region->magic = RANGEVSPACE_MAGIC;
+    region->refs = 1;
+    region->reserved = true;
+    region->rights = rights;
+    region->cacheable = cacheable;
+    region->size_bits = size_bits;
+
+    lockwrapper_spin_lock(&rangevspace->tree_lock);
+    if(vaddr == 0) {
+        rangevspace_node_t *range = tree_first_fit(rangevspace->free_ranges, bytes, BIT(size_bits));
+        vaddr = range == NULL ? 0 : ROUND_UP(range->start, BIT(size_bits));
+    }
+    if(vaddr == 0 || free_range_take(rangevspace, vaddr, vaddr + bytes, &spare, &unused)) {
+        lockwrapper_spin_unlock(&rangevspace->tree_lock);
+        goto fail;
+    }
+    region->node.start = vaddr;
+    region->node.end = vaddr + bytes;
+    rangevspace->regions = tree_insert(rangevspace->regions, &region->node);
+    lockwrapper_spin_unlock(&rangevspace->tree_lock);
+
+    free(spare);
+    free(unused);
+    return region;
+
+fail:
+    if(region != NULL) {
+        region_destroy(region);
+    }
+    free(spare);
+    return NULL;
+}
+
+/**
+ * Takes a reference on the region holding vaddr
+ */
+static rangevspace_region_t *region_lookup(rangevspace_t *rangevspace, uintptr_t vaddr) {
+    rangevspace_region_t *region = NULL;
+
+    lockwrapper_spin_lock(&rangevspace->tree_lock);
+    rangevspace_node_t *node = tree_find(rangevspace->regions, vaddr);
+    if(node != NULL) {
+        region = REGION_OF_NODE(node);
+        region_get(region);
+    }
+    lockwrapper_spin_unlock(&rangevspace->tree_lock);
+
+    return region;
+}
+
+/**
+ * Once the reservation is freed and the last page unmapped, give the range
+ * back. Returns true if the caller must drop the tree's reference after
+ * releasing the region lock, which it must hold here.
+ */
+static bool region_maybe_retire(rangevspace_t *rangevspace, rangevspace_region_t *region) {
+    if(region->reserved || region->num_mapped > 0 || region->retired) {
+        return false;
+    }
+
+    rangevspace_node_t *spare = malloc(sizeof(rangevspace_node_t));
+    rangevspace_node_t *unused = NULL;
+    if(spare == NULL) {
+        ZF_LOGE("Out of memory, leaking %p-%p", (void *)region->node.start, (void *)region->node.end);
+        return false;
+    }
+
+    region->retired = true;
+    lockwrapper_spin_lock(&rangevspace->tree_lock);
+    rangevspace->regions = tree_remove(rangevspace->regions, &region->node);
+    free_range_give(rangevspace, region->node.start, region->node.end, &spare, &unused);
+    lockwrapper_spin_unlock(&rangevspace->tree_lock);
+
+    free(spare);
+    free(unused);
+    return true;
+}
+
+static void region_release(rangevspace_t *rangevspace, rangevspace_region_t *region) {
+    lockwrapper_spin_lock(&region->lock);
+    region->reserved = false;
+    bool retired = region_maybe_retire(rangevspace, region);
+    lockwrapper_spin_unlock(&region->lock);
+
+    if(retired) {
+        region_put(region);
+    }
+}
+
+/**
+ * Slot of the first page of [vaddr, vaddr + num_pages pages), if the range
+ * lies in the region. Assumes the region lock is held.
+ */
+static int region_check_range(rangevspace_region_t *region, uintptr_t vaddr, size_t num_pages,
+                              size_t size_bits, seL4_Word *slot) {
+    if(size_bits < region->size_bits || (vaddr & MASK(size_bits)) != 0) {
+        return -1;
+    }
+    if(vaddr < region->node.start || num_pages > (region->node.end - vaddr) >> size_bits) {
+        return -1;
+    }
+    *slot = (vaddr - region->node.start) >> region->size_bits;
+    return 0;
+}
+
+/**
+ * Map one page, creating any missing paging structures. Two threads may
+ * race to create the same one, the loser frees its copy and retries.
+ */
+static int rangevspace_map_page(rangevspace_t *rangevspace, seL4_CPtr cap, uintptr_t vaddr,
+                                seL4_CapRights_t rights, int cacheable) {
+    seL4_ARCH_VMAttributes attr = cacheable ? seL4_ARCH_Default_VMAttributes :
+                                              seL4_ARCH_Uncached_VMAttributes;
+    while(1) {
+        int error = seL4_ARCH_Page_Map(cap, rangevspace->root_cap, vaddr, rights, attr);
+        if(error != seL4_FailedLookup) {
+            return error;
+        }
+
+        vspace_map_obj_t obj;
+        error = vspace_get_map_obj(seL4_MappingFailedLookupLevel(), &obj);
+        if(error) {
+            return error;
+        }
+
+        rangevspace_paging_t *paging = malloc(sizeof(rangevspace_paging_t));
+        if(paging == NULL) {
+            return -1;
+        }
+        error = vka_alloc_object(rangevspace->vka, obj.type, obj.size_bits, &paging->obj);
+        if(error) {
+            free(paging);
+            return error;
+        }
+        error = vspace_map_obj(&obj, paging->obj.cptr, rangevspace->root_cap, vaddr,
+                               seL4_ARCH_Default_VMAttributes);
+        if(error) {
+            vka_free_object(rangevspace->vka, &paging->obj);
+            free(paging);
+            if(error == seL4_DeleteFirst) {
+                continue;
+            }
+            return error;
+        }
+
+        paging->next = __atomic_load_n(&rangevspace->paging, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&rangevspace->paging, &paging->next, paging, false,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+}
+
+/**
+ * Assumes the region lock is held
+ */
+static void region_unmap_slot(rangevspace_region_t *region, seL4_Word slot, size_t size_bits, vka_t *free_vka) {
+    seL4_CPtr cap = region->caps[slot];
+    if(cap == seL4_CapNull) {
+        return;
+    }
+
+    seL4_ARCH_Page_Unmap(cap);
+    if(free_vka != VSPACE_PRESERVE) {
+        cspacepath_t path;
+        vka_cspace_make_path(free_vka, cap, &path);
+        vka_cnode_delete(&path);
+        if(region->cookies[slot] != 0) {
+            vka_utspace_free(free_vka, kobject_get_type(KOBJECT_FRAME, size_bits), size_bits,
+                             region->cookies[slot]);
+        }
+        vka_cspace_free(free_vka, cap);
+    }
+
+    region->caps[slot] = seL4_CapNull;
+    region->cookies[slot] = 0;
+    region->num_mapped--;
+}
+
+/**
+ * Map caps, or new frames if caps is NULL, into a reservation.
+ */
+static int region_map(rangevspace_t *rangevspace, rangevspace_region_t *region,
+                      seL4_CPtr caps[], uintptr_t cookies[], uintptr_t vaddr,
+                      size_t num_pages, size_t size_bits, bool can_use_dev) {
+    seL4_Word first;
+    size_t i;
+    int error = 0;
+
+    lockwrapper_spin_lock(&region->lock);
+    if(!region->reserved || region_check_range(region, vaddr, num_pages, size_bits, &first)) {
+        lockwrapper_spin_unlock(&region->lock);
+        ZF_LOGE("Mapping %p is outside its reservation", (void *)vaddr);
+        return -1;
+    }
+
+    seL4_Word stride = BIT(size_bits - region->size_bits);
+    for(i = 0; i < num_pages; i++) {
+        seL4_Word slot = first + i * stride;
+        vka_object_t frame = {0};
+        seL4_CPtr cap;
+        uintptr_t cookie = 0;
+
+        if(region->caps[slot] != seL4_CapNull) {
+            error = seL4_DeleteFirst;
+            break;
+        }
+
+        if(caps == NULL) {
+            error = vka_alloc_frame_maybe_device(rangevspace->vka, size_bits, can_use_dev, &frame);
+            if(error) {
+                break;
+            }
+            cap = frame.cptr;
+            cookie = frame.ut;
+        } else {
+            cap = caps[i];
+            cookie = cookies == NULL ? 0 : cookies[i];
+        }
+
+        error = rangevspace_map_page(rangevspace, cap, vaddr + (i << size_bits),
+                                     region->rights, region->cacheable);
+        if(error) {
+            if(caps == NULL) {
+                vka_free_object(rangevspace->vka, &frame);
+            }
+            break;
+        }
+
+        region->caps[slot] = cap;
+        region->cookies[slot] = cookie;
+        region->num_mapped++;
+    }
+
+    if(error) {
+        while(i-- > 0) {
+            region_unmap_slot(region, first + i * stride, size_bits,
+                              caps == NULL ? rangevspace->vka : VSPACE_PRESERVE);
+        }
+    }
+    lockwrapper_spin_unlock(&region->lock);
+
+    return error;
+}
+
+
+/******************************************************************************
+ * vspace interface
+ *****************************************************************************/
+static int rangevspace_map_pages_at_vaddr(vspace_t *vspace, seL4_CPtr caps[], uintptr_t cookies[],
+                                          void *vaddr, size_t num_pages,
+                                          size_t size_bits, reservation_t reservation) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+    rangevspace_region_t *region = rangevspace_region_of(reservation);
+    if(region == NULL) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        return parent->map_pages_at_vaddr(parent, caps, cookies, vaddr, num_pages, size_bits, reservation);
+    }
+    return region_map(rangevspace, region, caps, cookies, (uintptr_t)vaddr, num_pages, size_bits, false);
+}
+
+static int rangevspace_new_pages_at_vaddr(vspace_t *vspace, void *vaddr, size_t num_pages,
+                                          size_t size_bits, reservation_t reservation, bool can_use_dev) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+    rangevspace_region_t *region = rangevspace_region_of(reservation);
+    if(region == NULL) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        return parent->new_pages_at_vaddr(parent, vaddr, num_pages, size_bits, reservation, can_use_dev);
+    }
+    return region_map(rangevspace, region, NULL, NULL, (uintptr_t)vaddr, num_pages, size_bits, can_use_dev);
+}
+
+static void *rangevspace_map_pages(vspace_t *vspace, seL4_CPtr caps[], uintptr_t cookies[],
+                                   seL4_CapRights_t rights, size_t num_pages, size_t size_bits,
+                                   int cacheable) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+    rangevspace_region_t *region = region_reserve(rangevspace, 0, num_pages << size_bits,
+                                                  size_bits, rights, cacheable);
+    if(region == NULL) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        return parent->map_pages(parent, caps, cookies, rights, num_pages, size_bits, cacheable);
+    }
+
+    void *vaddr = (void *) region->node.start;
+    if(region_map(rangevspace, region, caps, cookies, (uintptr_t)vaddr, num_pages, size_bits, false)) {
+        vaddr = NULL;
+    }
+
+    /* The pages keep the range in use without the reservation */
+    region_release(rangevspace, region);
+    return vaddr;
+}
+
+static void *rangevspace_new_pages(vspace_t *vspace, seL4_CapRights_t rights, size_t num_pages, size_t size_bits) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+    rangevspace_region_t *region = region_reserve(rangevspace, 0, num_pages << size_bits,
+                                                  size_bits, rights, true);
+    if(region == NULL) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        return parent->new_pages(parent, rights, num_pages, size_bits);
+    }
+
+    void *vaddr = (void *) region->node.start;
+    if(region_map(rangevspace, region, NULL, NULL, (uintptr_t)vaddr, num_pages, size_bits, false)) {
+        vaddr = NULL;
+    }
+
+    region_release(rangevspace, region);
+    return vaddr;
+}
+
+static void rangevspace_unmap_pages(vspace_t *vspace, void *vaddr, size_t num_pages,
+                                    size_t size_bits, vka_t *free_vka) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+    if(!rangevspace_in_window(rangevspace, (uintptr_t)vaddr)) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        parent->unmap_pages(parent, vaddr, num_pages, size_bits, free_vka);
+        return;
+    }
+
+    rangevspace_region_t *region = region_lookup(rangevspace, (uintptr_t)vaddr);
+    if(region == NULL) {
+        ZF_LOGE("Nothing mapped at %p", vaddr);
+        return;
+    }
+
+    seL4_Word first;
+    lockwrapper_spin_lock(&region->lock);
+    if(region_check_range(region, (uintptr_t)vaddr, num_pages, size_bits, &first) == 0) {
+        seL4_Word stride = BIT(size_bits - region->size_bits);
+        for(size_t i = 0; i < num_pages; i++) {
+            region_unmap_slot(region, first + i * stride, size_bits, free_vka);
+        }
+    } else {
+        ZF_LOGE("Unmap of %p crosses the end of its reservation", vaddr);
+    }
+    bool retired = region_maybe_retire(rangevspace, region);
+    lockwrapper_spin_unlock(&region->lock);
+
+    if(retired) {
+        region_put(region);
+    }
+    region_put(region);
+}
+
+static reservation_t rangevspace_reserve_range_aligned(vspace_t *vspace, size_t bytes, size_t size_bits,
+                                                       seL4_CapRights_t rights, int cacheable, void **vaddr) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+    rangevspace_region_t *region = region_reserve(rangevspace, 0, bytes, size_bits, rights, cacheable);
+    if(region == NULL) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        return parent->reserve_range_aligned(parent, bytes, size_bits, rights, cacheable, vaddr);
+    }
+
+    *vaddr = (void *) region->node.start;
+    return (reservation_t) { .res = region };
+}
+
+static reservation_t rangevspace_reserve_range_at(vspace_t *vspace, void *vaddr,
+                                                  size_t bytes, seL4_CapRights_t rights, int cacheable) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+    uintptr_t start = (uintptr_t) vaddr;
+
+    if(start + bytes <= rangevspace->base || start >= rangevspace->top) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        return parent->reserve_range_at(parent, vaddr, bytes, rights, cacheable);
+    }
+
+    rangevspace_region_t *region = region_reserve(rangevspace, start, bytes, seL4_PageBits, rights, cacheable);
+    return (reservation_t) { .res = region };
+}
+
+static void rangevspace_free_reservation(vspace_t *vspace, reservation_t reservation) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+    rangevspace_region_t *region = rangevspace_region_of(reservation);
+    if(region == NULL) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        parent->free_reservation(parent, reservation);
+        return;
+    }
+    region_release(rangevspace, region);
+}
+
+static void rangevspace_free_reservation_by_vaddr(vspace_t *vspace, void *vaddr) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+    if(!rangevspace_in_window(rangevspace, (uintptr_t)vaddr)) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        parent->free_reservation_by_vaddr(parent, vaddr);
+        return;
+    }
+
+    rangevspace_region_t *region = region_lookup(rangevspace, (uintptr_t)vaddr);
+    if(region != NULL) {
+        region_release(rangevspace, region);
+        region_put(region);
+    }
+}
+
+static seL4_CPtr rangevspace_get_cap(vspace_t *vspace, void *vaddr) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+    if(!rangevspace_in_window(rangevspace, (uintptr_t)vaddr)) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        return parent->get_cap(parent, vaddr);
+    }
+
+    seL4_CPtr cap = seL4_CapNull;
+    rangevspace_region_t *region = region_lookup(rangevspace, (uintptr_t)vaddr);
+    if(region != NULL) {
+        lockwrapper_spin_lock(&region->lock);
+        cap = region->caps[((uintptr_t)vaddr - region->node.start) >> region->size_bits];
+        lockwrapper_spin_unlock(&region->lock);
+        region_put(region);
+    }
+    return cap;
+}
+
+static uintptr_t rangevspace_get_cookie(vspace_t *vspace, void *vaddr) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+    if(!rangevspace_in_window(rangevspace, (uintptr_t)vaddr)) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        return parent->get_cookie(parent, vaddr);
+    }
+
+    uintptr_t cookie = 0;
+    rangevspace_region_t *region = region_lookup(rangevspace, (uintptr_t)vaddr);
+    if(region != NULL) {
+        lockwrapper_spin_lock(&region->lock);
+        cookie = region->cookies[((uintptr_t)vaddr - region->node.start) >> region->size_bits];
+        lockwrapper_spin_unlock(&region->lock);
+        region_put(region);
+    }
+    return cookie;
+}
+
+static seL4_CPtr rangevspace_get_root(vspace_t *vspace) {
+    return rangevspace_from_vspace(vspace)->root_cap;
+}
+
+static int rangevspace_share_mem_at_vaddr(vspace_t *from, vspace_t *to, void *start, int num_pages,
+                                          size_t size_bits, void *vaddr, reservation_t res) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(from);
+    if(!rangevspace_in_window(rangevspace, (uintptr_t)start)) {
+        vspace_t *parent = &rangevspace->parent_vspace;
+        return parent->share_mem_at_vaddr(parent, to, start, num_pages, size_bits, vaddr, res);
+    }
+
+    int i;
+    int error = 0;
+    for(i = 0; i < num_pages; i++) {
+        cspacepath_t src, dest;
+        seL4_CPtr cap = rangevspace_get_cap(from, (void *)((uintptr_t)start + (i << size_bits)));
+        if(cap == seL4_CapNull) {
+            error = -1;
+            break;
+        }
+
+        vka_cspace_make_path(rangevspace->vka, cap, &src);
+        error = vka_cspace_alloc_path(rangevspace->vka, &dest);
+        if(error) {
+            break;
+        }
+        error = vka_cnode_copy(&dest, &src, seL4_AllRights);
+        if(error) {
+            vka_cspace_free(rangevspace->vka, dest.capPtr);
+            break;
+        }
+
+        error = vspace_map_pages_at_vaddr(to, &dest.capPtr, NULL,
+                                          (void *)((uintptr_t)vaddr + (i << size_bits)),
+                                          1, size_bits, res);
+        if(error) {
+            vka_cnode_delete(&dest);
+            vka_cspace_free(rangevspace->vka, dest.capPtr);
+            break;
+        }
+    }
+
+    if(error && i > 0) {
+        vspace_unmap_pages(to, vaddr, i, size_bits, rangevspace->vka);
+    }
+    return error;
+}
+
+/**
+ * Postorder so children are gone before their parent node is freed
+ */
+static void rangevspace_tear_down_regions(rangevspace_node_t *node, vka_t *free_vka) {
+    if(node == NULL) {
+        return;
+    }
+    rangevspace_tear_down_regions(node->left, free_vka);
+    rangevspace_tear_down_regions(node->right, free_vka);
+
+    rangevspace_region_t *region = REGION_OF_NODE(node);
+    for(seL4_Word slot = 0; slot < region->num_slots; slot++) {
+        region_unmap_slot(region, slot, region->size_bits, free_vka);
+    }
+    region_destroy(region);
+}
+
+static void rangevspace_tear_down_ranges(rangevspace_node_t *node) {
+    if(node == NULL) {
+        return;
+    }
+    rangevspace_tear_down_ranges(node->left);
+    rangevspace_tear_down_ranges(node->right);
+    free(node);
+}
+
+static void rangevspace_tear_down(vspace_t *vspace, vka_t *free_vka) {
+    rangevspace_t *rangevspace = rangevspace_from_vspace(vspace);
+
+    rangevspace_tear_down_regions(rangevspace->regions, free_vka);
+    rangevspace_tear_down_ranges(rangevspace->free_ranges);
+    rangevspace->regions = NULL;
+    rangevspace->free_ranges = NULL;
+
+    while(rangevspace->paging != NULL) {
+        rangevspace_paging_t *paging = rangevspace->paging;
+        rangevspace->paging = paging->next;
+        vka_free_object(rangevspace->vka, &paging->obj);
+        free(paging);
+    }
+
+    vspace_t *parent = &rangevspace->parent_vspace;
+    parent->free_reservation(parent, rangevspace->window);
+    parent->tear_down(parent, free_vka);
+}
+
+void rangevspace_make_vspace(vspace_t *out_vspace, rangevspace_t *rangevspace) {
+    assert(out_vspace);
+    assert(rangevspace);
+
+    /* Keep the parent's sync_data so lockvspace_lock still works on the result */
+    *out_vspace = rangevspace->parent_vspace;
+
+    out_vspace->data = (void *) rangevspace;
+    out_vspace->new_pages = &rangevspace_new_pages;
+    out_vspace->map_pages = &rangevspace_map_pages;
+    out_vspace->new_pages_at_vaddr = &rangevspace_new_pages_at_vaddr;
+    out_vspace->map_pages_at_vaddr = &rangevspace_map_pages_at_vaddr;
+    out_vspace->unmap_pages = &rangevspace_unmap_pages;
+    out_vspace->tear_down = &rangevspace_tear_down;
+    out_vspace->reserve_range_aligned = &rangevspace_reserve_range_aligned;
+    out_vspace->reserve_range_at = &rangevspace_reserve_range_at;
+    out_vspace->free_reservation = &rangevspace_free_reservation;
+    out_vspace->free_reservation_by_vaddr = &rangevspace_free_reservation_by_vaddr;
+    out_vspace->get_cap = &rangevspace_get_cap;
+    out_vspace->get_root = &rangevspace_get_root;
+    out_vspace->get_cookie = &rangevspace_get_cookie;
+    out_vspace->share_mem_at_vaddr = &rangevspace_share_mem_at_vaddr;
+}
+
+int rangevspace_attach(rangevspace_t *rangevspace, vspace_t parent_vspace, vka_t *vka, size_t window_bytes) {
+    assert(rangevspace);
+    assert(vka);
+
+    memset(rangevspace, 0, sizeof(rangevspace_t));
+    rangevspace->parent_vspace = parent_vspace;
+    rangevspace->vka = vka;
+    rangevspace->root_cap = vspace_get_root(&rangevspace->parent_vspace);
+
+    window_bytes = ROUND_UP(window_bytes, BIT(seL4_LargePageBits));
+    void *base = NULL;
+    rangevspace->window = vspace_reserve_range_aligned(&rangevspace->parent_vspace, window_bytes,
+                                                       seL4_LargePageBits, seL4_AllRights, 1, &base);
+    if(rangevspace->window.res == NULL) {
+        ZF_LOGE("Failed to reserve a %zu byte window for the range vspace", window_bytes);
+        return -1;
+    }
+    rangevspace->base = (uintptr_t) base;
+    rangevspace->top = rangevspace->base + window_bytes;
+
+    rangevspace_node_t *range = malloc(sizeof(rangevspace_node_t));
+    if(range == NULL) {
+        vspace_free_reservation(&rangevspace->parent_vspace, rangevspace->window);
+        return -2;
+    }
+    range->start = rangevspace->base;
+    range->end = rangevspace->top;
+    rangevspace->free_ranges = tree_insert(NULL, range);
+
+    return 0;
+}
+
+#endif /* CONFIG_LIB_LOCK_WRAPPER_RANGE_VSPACE */
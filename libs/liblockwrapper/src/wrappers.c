@@ -1,5 +1,18 @@
+#include <assert.h>
 #include <lockwrapper/wrappers.h>
 
+int lockwrapper_live_threads = 1;
+
+void lockwrapper_thread_started(void) {
+    __atomic_add_fetch(&lockwrapper_live_threads, 1, __ATOMIC_SEQ_CST);
+}
+
+void lockwrapper_thread_stopped(void) {
+    int remaining = __atomic_sub_fetch(&lockwrapper_live_threads, 1, __ATOMIC_SEQ_CST);
+    assert(remaining >= 1);
+    (void)remaining;
+}
+
 static int sync_mutex_lock_generic(void * m) {
     return sync_mutex_lock((sync_mutex_t *) m);
 }
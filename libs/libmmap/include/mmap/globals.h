@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <autoconf.h>
 #include <sel4/sel4.h>
 #include <utils/util.h>
 
@@ -14,4 +15,13 @@ extern const mmap_entry_attr_t mmap_attr_4k_code;
 extern const mmap_entry_attr_t mmap_attr_4k_data;
 extern const mmap_entry_attr_t mmap_attr_4k_readonly;
 extern const mmap_entry_attr_t mmap_attr_4k_device;
+extern const mmap_entry_attr_t mmap_attr_4k_write_combine;
+extern const mmap_entry_attr_t mmap_attr_4k_device_ordered;
+extern const mmap_entry_attr_t mmap_attr_large_write_combine;
+extern const mmap_entry_attr_t mmap_attr_large_data;
+extern const mmap_entry_attr_t mmap_attr_large_readonly;
+#ifdef CONFIG_ARCH_AARCH32
+extern const mmap_entry_attr_t mmap_attr_section_data;
+#endif
+extern const mmap_entry_attr_t mmap_attr_auto_data;
 
@@ -0,0 +1,212 @@
+/**
+ * @file internal.h
+ * @brief Internal definitions shared between the libmmap source files
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <stdbool.h>
+
+#include <sel4/sel4.h>
+#include <vka/vka.h>
+#include <vspace/vspace.h>
+#include <sel4utils/mapping.h>
+
+#include "types.h"
+
+
+static inline void* addr_at_page(void* addr, seL4_Word page, seL4_Word bits) {
+    return (void*)((uintptr_t)addr + (page << bits));
+}
+
+/**
+ * Whether the final mapping is plain cached memory
+ */
+static inline bool libmmap_attr_cached(const mmap_entry_attr_t *attr) {
+    return attr->mem_type == MMAP_MEM_DEFAULT && attr->cacheable;
+}
+
+/**
+ * The cacheable flag to reserve with. sel4utils only knows cached and
+ * uncached, anything else is fixed up by libmmap_remap_fix_attrs.
+ */
+static inline bool libmmap_reserve_cacheable(const mmap_entry_attr_t *attr) {
+    switch(attr->mem_type) {
+    case MMAP_MEM_DEVICE:
+        return false;
+#ifdef CONFIG_ARCH_ARM
+    case MMAP_MEM_WRITE_COMBINE:
+    case MMAP_MEM_WRITE_THROUGH:
+        return true;
+#endif
+    default:
+        return attr->cacheable;
+    }
+}
+
+/**
+ * Whether libmmap_remap_fix_attrs has anything to do for attr.
+ * Lets the mapping loops skip the second pass over their frames entirely.
+ */
+static inline bool libmmap_remap_needed(const mmap_entry_attr_t *attr) {
+#ifdef CONFIG_ARCH_ARM
+    return !attr->executable;
+#else
+    return attr->mem_type == MMAP_MEM_WRITE_COMBINE || attr->mem_type == MMAP_MEM_WRITE_THROUGH;
+#endif
+}
+
+/**
+ * VM attributes for attr's memory type and executable bit
+ */
+seL4_ARCH_VMAttributes libmmap_vm_attrs(const mmap_entry_attr_t *attr);
+
+/**
+ * This is a temporary solution to the fact that sel4utils/vspace doesn't
+ * expose executable permissions or memory types beyond cached/uncached.
+ */
+int libmmap_remap_fix_attrs(seL4_CPtr page,
+                            seL4_CPtr vspace_root_cap,
+                            const mmap_entry_attr_t *attr);
+
+/**
+ * Largest frame size that starts at addr and ends at or before end.
+ * Mapping and unmapping both walk a range with this, so they agree.
+ */
+seL4_Word libmmap_page_bits_at(uintptr_t addr, uintptr_t end);
+
+/**
+ * Size of the frame mapped at addr, whose cap is cap. The vspace records a
+ * large frame's cap against every 4K page it covers, so the largest aligned
+ * block that has cap at both ends is the frame.
+ */
+seL4_Word libmmap_frame_bits_at(vspace_t *vspace, uintptr_t addr, seL4_CPtr cap);
+
+/**
+ * Allocate a frame for vspace. Colored vspaces get a copy of a frame from the
+ * color pool, with no cookie. Otherwise it comes from the recycled frame pool
+ * if it has one that fits, and frame->ut is a real allocator cookie.
+ */
+int libmmap_alloc_frame(vspace_t *vspace,
+                        const mmap_entry_attr_t *attr,
+                        seL4_Word page_size_bits,
+                        vka_object_t *frame);
+
+/**
+ * Whether the pool for this frame size would take another frame. Only a hint,
+ * libmmap_frame_pool_push can still refuse.
+ */
+bool libmmap_frame_pool_has_room(seL4_Word page_size_bits);
+
+/**
+ * Hand an unmapped, zeroed frame to the pool. Fails if the pool is full.
+ */
+int libmmap_frame_pool_push(const vka_object_t *frame);
+
+/**
+ * Whether frames of this size for vspace come from the color pool
+ */
+bool libmmap_color_wanted(vspace_t *vspace, seL4_Word page_size_bits);
+
+/**
+ * Take a frame of one of vspace's colors, growing the pool if needed
+ */
+int libmmap_color_alloc_frame(vspace_t *vspace, vka_object_t *frame);
+
+/**
+ * Give back a frame from libmmap_color_alloc_frame that was never mapped, or
+ * was already unmapped. Returns false for any other cap.
+ */
+bool libmmap_color_free_frame(vspace_t *vspace, seL4_CPtr copy);
+
+/**
+ * Free a frame from libmmap_alloc_frame that didn't get used
+ */
+void libmmap_free_frame(vspace_t *vspace, vka_object_t *frame);
+
+/**
+ * If the page at vaddr is a colored frame, unmap it and give it back to the
+ * color pool. Returns false, touching nothing, for any other page.
+ */
+bool libmmap_color_reclaim(vspace_t *vspace, void *vaddr);
+
+/**
+ * Allocate a single frame and map it at vaddr inside an existing reservation.
+ */
+int libmmap_commit_page(vspace_t *vspace,
+                        seL4_CPtr vspace_root_cap,
+                        const mmap_entry_attr_t *attr,
+                        void *vaddr,
+                        reservation_t res);
+
+/**
+ * A reservation whose frames are committed on first touch.
+ * [start, end) is the usable range, the guard page sits below start.
+ */
+typedef struct mmap_lazy_region {
+    struct mmap_lazy_region *next;
+    vspace_t *vspace;
+    seL4_CPtr vspace_root_cap;
+    mmap_entry_attr_t attr;
+    reservation_t res;
+    uintptr_t res_start;
+    uintptr_t start;
+    uintptr_t end;
+    seL4_Word committed_pages;
+    uintptr_t lowest_committed;
+    seL4_Word fault_around_pages; /* Power of two, pages committed per fault */
+    seL4_Word refs;               /* Faults being handled in the region */
+    bool dead;                    /* Released, freed when refs drops to 0 */
+} mmap_lazy_region_t;
+
+/**
+ * Drop the bookkeeping of every lazy region inside [start, end). The pages
+ * themselves are left to the caller.
+ */
+void libmmap_lazy_forget(vspace_t *vspace, uintptr_t start, uintptr_t end);
+
+
+/**
+ * Retype an untyped into count frames, one seL4_Untyped_Retype per run of
+ * contiguous slots. Frames come out in physical address order. Slots from
+ * init_cspace_alloc_range make that a single call.
+ * retype_calls, if given, is incremented for every retype.
+ */
+int libmmap_retype_frames(seL4_CPtr untyped,
+                          seL4_Word page_size_bits,
+                          seL4_CPtr *slots,
+                          seL4_Word count,
+                          seL4_Word *retype_calls);
+
+/**
+ * One untyped that frames of a batched mapping were retyped from
+ */
+typedef struct mmap_batch_untyped {
+    struct mmap_batch_untyped *next;
+    vka_object_t untyped;
+} mmap_batch_untyped_t;
+
+/**
+ * A mapping made by mmap_new_pages_batched_custom. Its frames have no
+ * allocator cookies of their own, so the untypeds are given back once
+ * every page of [start, start + num_pages) has been unmapped.
+ */
+typedef struct mmap_batch {
+    struct mmap_batch *next;
+    vspace_t *vspace;
+    uintptr_t start;
+    seL4_Word page_size_bits;
+    seL4_Word num_pages;
+    seL4_Word mapped_pages;
+    mmap_batch_untyped_t *untypeds;
+    seL4_CPtr *slots;       /* Frame cap of every page, seL4_CapNull once the vspace freed it */
+} mmap_batch_t;
+
+/**
+ * Account for pages of a batched mapping being unmapped, and free its
+ * untypeds when none are left. slots_freed says whether the unmap gave the
+ * frames' slots back (a vka rather than VSPACE_PRESERVE). Does nothing for
+ * other mappings.
+ */
+void libmmap_batch_unmapped(vspace_t *vspace, void *vaddr, seL4_Word num_pages, bool slots_freed);
@@ -63,8 +63,115 @@ int mmap_existing_pages_custom(vspace_t *vspace,
                                void **vaddr,
                                reservation_t *res);
 
+int mmap_new_pages_batched_custom(vspace_t *vspace,
+                                  seL4_CPtr vspace_root_cap,
+                                  seL4_Word num_pages,
+                                  const mmap_entry_attr_t *attr,
+                                  seL4_CPtr *caps,
+                                  void **vaddr,
+                                  reservation_t *res,
+                                  mmap_batch_stats_t *stats);
+
+int mmap_unmap_pages_custom(vspace_t *vspace,
+                            void *vaddr,
+                            seL4_Word num_pages,
+                            const mmap_entry_attr_t *attr,
+                            vka_t *free);
+
+int mmap_free_pages(seL4_Word num_pages,
+                    const mmap_entry_attr_t *attr,
+                    void *vaddr,
+                    reservation_t res);
+
+int mmap_free_pages_custom(vspace_t *vspace,
+                           seL4_Word num_pages,
+                           const mmap_entry_attr_t *attr,
+                           void *vaddr,
+                           reservation_t res);
+
+seL4_Word mmap_frame_pool_drain(void);
+
+int mmap_color_set_vspace(vspace_t *vspace, seL4_Word colors);
+
+void mmap_color_release_vspace(vspace_t *vspace);
+
+int mmap_dma_alloc_region(size_t bytes,
+                          bool cacheable,
+                          mmap_dma_region_t *region);
+
+int mmap_dma_free_region(mmap_dma_region_t *region);
+
+int mmap_dma_pool_create(mmap_dma_pool_t *pool,
+                         size_t buf_size,
+                         seL4_Word num_bufs,
+                         bool cacheable);
+
+int mmap_dma_pool_destroy(mmap_dma_pool_t *pool);
+
+mmap_dma_buf_t *mmap_dma_pool_alloc(mmap_dma_pool_t *pool);
+
+void mmap_dma_pool_free(mmap_dma_pool_t *pool, mmap_dma_buf_t *buf);
+
+int mmap_cache_op(void *vaddr, size_t bytes, mmap_cache_op_t op);
+
+int mmap_cache_op_custom(vspace_t *vspace,
+                         void *vaddr,
+                         size_t bytes,
+                         mmap_cache_op_t op);
+
+int mmap_cache_op_batch_custom(vspace_t *vspace,
+                               const mmap_cache_range_t *ranges,
+                               seL4_Word num_ranges,
+                               mmap_cache_op_t op,
+                               mmap_cache_stats_t *stats);
+
+void *mmap_malloc(size_t size);
+
+void mmap_free(void *ptr);
+
+void *mmap_calloc(size_t num, size_t size);
+
+void *mmap_realloc(void *ptr, size_t size);
+
+void *mmap_memalign(size_t align, size_t size);
+
+size_t mmap_malloc_usable_size(void *ptr);
+
 int mmap_new_stack_custom(vspace_t *vspace,
                           seL4_CPtr vspace_root_cap,
                           seL4_Word num_pages,
                           void **vaddr,
                           reservation_t *res);
+
+int mmap_new_heap_custom(vspace_t *vspace,
+                         seL4_CPtr vspace_root_cap,
+                         seL4_Word reserve_pages,
+                         seL4_Word commit_pages,
+                         void **vaddr,
+                         reservation_t *res);
+
+int mmap_new_stack_lazy_custom(vspace_t *vspace,
+                               seL4_CPtr vspace_root_cap,
+                               seL4_Word num_pages,
+                               seL4_Word commit_pages,
+                               void **vaddr,
+                               reservation_t *res);
+
+int mmap_new_pages_lazy(seL4_Word num_pages,
+                        const mmap_entry_attr_t *attr,
+                        void **vaddr,
+                        reservation_t *res);
+
+int mmap_new_pages_lazy_custom(vspace_t *vspace,
+                               seL4_CPtr vspace_root_cap,
+                               seL4_Word num_pages,
+                               const mmap_entry_attr_t *attr,
+                               seL4_Word fault_around_pages,
+                               void **vaddr,
+                               reservation_t *res);
+
+int mmap_lazy_handle_fault(void *fault_addr);
+
+int mmap_lazy_get_stats(void *vaddr, mmap_lazy_stats_t *stats);
+
+int mmap_lazy_release(void *vaddr);
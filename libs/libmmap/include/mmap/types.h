@@ -5,8 +5,23 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <sel4/sel4.h>
 #include <vka/vka.h>
+#include <vspace/vspace.h>
+
+
+/**
+ * Memory type of a mapping, beyond the plain cacheable bit
+ */
+typedef enum mmap_mem_type {
+    MMAP_MEM_DEFAULT = 0,           /* Cached or uncached as the cacheable bit says */
+    MMAP_MEM_WRITE_COMBINE,         /* Framebuffers, streaming writes to a device */
+    MMAP_MEM_WRITE_THROUGH,
+    MMAP_MEM_DEVICE,                /* Device registers, uncached and strictly ordered */
+} mmap_mem_type_t;
 
 
 typedef struct mmap_entry_attr {
@@ -15,5 +30,96 @@ typedef struct mmap_entry_attr {
     unsigned int writable        : 1;
     unsigned int executable      : 1;
     unsigned int cacheable       : 1;
+    /**
+     * Map with the largest frames that fit each aligned part of the range.
+     * num_pages still counts page_size_bits sized pages.
+     */
+    unsigned int auto_page_size  : 1;
+    /**
+     * An mmap_mem_type_t. On ARM the kernel has no write combining or write
+     * through type, those are mapped cached and the writer must clean them
+     * with mmap_cache_op before a device reads.
+     */
+    unsigned int mem_type        : 2;
 } mmap_entry_attr_t;
 
+
+/**
+ * Usage of a demand paged region, see mmap_lazy_get_stats
+ */
+typedef struct mmap_lazy_stats {
+    seL4_Word size_pages;       /* Pages reserved, not counting the guard page */
+    seL4_Word committed_pages;  /* Pages currently backed by a frame */
+    seL4_Word high_water_pages; /* Deepest page touched, counted from the top */
+} mmap_lazy_stats_t;
+
+
+/**
+ * Per call statistics of a batched mapping, see mmap_new_pages_batched_custom
+ */
+typedef struct mmap_batch_stats {
+    seL4_Word frames;           /* Frames mapped */
+    seL4_Word untypeds;         /* Untypeds the frames were retyped from */
+    seL4_Word retype_calls;     /* seL4_Untyped_Retype invocations */
+    seL4_Word map_calls;        /* vspace map calls, each covers one untyped worth of frames */
+    seL4_Word remap_calls;      /* Extra page remaps needed to set execute never */
+    seL4_Word alloc_retries;    /* Untyped allocations retried at half the size */
+} mmap_batch_stats_t;
+
+
+/**
+ * Physically contiguous memory mapped into our vspace, see mmap_dma_alloc_region.
+ * On ARM an uncached region is device memory, so it only takes naturally
+ * aligned accesses, see dma.c.
+ */
+typedef struct mmap_dma_region {
+    void *vaddr;
+    uintptr_t paddr;
+    size_t size;
+    bool cacheable;
+    vka_object_t untyped;
+    seL4_CPtr *caps;
+    reservation_t res;
+} mmap_dma_region_t;
+
+/**
+ * One buffer of a DMA pool. vaddr and paddr address the same memory.
+ */
+typedef struct mmap_dma_buf {
+    void *vaddr;
+    uintptr_t paddr;
+    uint32_t next;              /* Freelist link, index + 1, 0 ends the list */
+} mmap_dma_buf_t;
+
+/**
+ * Fixed size DMA buffers carved out of contiguous regions, see mmap_dma_pool_create
+ */
+typedef struct mmap_dma_pool {
+    size_t buf_size;
+    seL4_Word num_bufs;
+    seL4_Word num_regions;
+    mmap_dma_region_t *regions;
+    mmap_dma_buf_t *bufs;
+    uint64_t free_head;         /* ABA tag in the top half, buffer index + 1 in the bottom */
+} mmap_dma_pool_t;
+
+
+typedef enum mmap_cache_op {
+    MMAP_CACHE_CLEAN,               /* Write dirty lines back, before a device reads */
+    MMAP_CACHE_INVALIDATE,          /* Drop lines, after a device writes */
+    MMAP_CACHE_CLEAN_INVALIDATE,
+    MMAP_CACHE_UNIFY_INSTRUCTION,   /* Make freshly written code visible to fetch */
+} mmap_cache_op_t;
+
+typedef struct mmap_cache_range {
+    void *vaddr;
+    size_t bytes;
+} mmap_cache_range_t;
+
+/**
+ * What a cache operation cost, see mmap_cache_op_batch_custom
+ */
+typedef struct mmap_cache_stats {
+    seL4_Word kernel_calls;     /* Per frame clean/invalidate calls */
+    seL4_Word full_flushes;     /* Whole cache flushes used instead */
+} mmap_cache_stats_t;
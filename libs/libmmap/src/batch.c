@@ -0,0 +1,351 @@
+/**
+ * @file batch.c
+ * @brief Batched frame allocation for libmmap
+ *
+ * Instead of one allocator call per frame, a batched mapping allocates the
+ * biggest untyped that fits the rest of the range, retypes it into a
+ * contiguous range of slots with a single seL4_Untyped_Retype and maps the
+ * whole run with one vspace call. If the allocator can't find an untyped of
+ * that size it retries at half the size, down to a single frame.
+ *
+ * The frames share their untyped, so they carry no allocator cookie and can't
+ * be freed one by one. The untypeds are revoked and freed when the last page
+ * of the mapping goes through mmap_unmap_pages_custom, together with the
+ * slots of any frame that was unmapped with VSPACE_PRESERVE.
+ */
+#include <autoconf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <vka/vka.h>
+#include <vka/capops.h>
+#include <vka/kobject_t.h>
+#include <vspace/vspace.h>
+#include <utils/util.h>
+
+#include <init/init.h>
+#include <mmap/mmap.h>
+#include <mmap/internal.h>
+
+
+/**
+ * The list of live batched mappings, only touched on map and unmap.
+ */
+static mmap_batch_t *batch_list = NULL;
+static volatile int batch_list_lock = 0;
+
+static inline void batch_lock(void) {
+    while(__atomic_test_and_set(&batch_list_lock, __ATOMIC_ACQUIRE)) {
+        seL4_Yield();
+    }
+}
+
+static inline void batch_unlock(void) {
+    __atomic_clear(&batch_list_lock, __ATOMIC_RELEASE);
+}
+
+
+int libmmap_retype_frames(seL4_CPtr untyped,
+                          seL4_Word page_size_bits,
+                          seL4_CPtr *slots,
+                          seL4_Word count,
+                          seL4_Word *retype_calls)
+{
+    seL4_Word type = kobject_get_type(KOBJECT_FRAME, page_size_bits);
+    seL4_Word done = 0;
+
+    while(done < count) {
+        cspacepath_t start;
+        vka_cspace_make_path(&init_objects.vka, slots[done], &start);
+
+        seL4_Word run = 1;
+        while(done + run < count) {
+            cspacepath_t next;
+            vka_cspace_make_path(&init_objects.vka, slots[done + run], &next);
+            if(next.root != start.root || next.dest != start.dest ||
+               next.destDepth != start.destDepth || next.offset != start.offset + run) {
+                break;
+            }
+            run++;
+        }
+
+        int error = seL4_Untyped_Retype(untyped, type, page_size_bits,
+                                        start.root, start.dest, start.destDepth,
+                                        start.offset, run);
+        if(error) {
+            ZF_LOGE("Failed to retype %lu frames", (long)run);
+            return error;
+        }
+        if(retype_calls != NULL) {
+            (*retype_calls)++;
+        }
+        done += run;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Revoke and free every untyped of a batch. This deletes any frame cap that
+ * is still around, so the frames must already be unmapped. The slots of
+ * the first num_slots frames that the vspace didn't free go too.
+ */
+static void batch_free(mmap_batch_t *batch, seL4_Word num_slots)
+{
+    mmap_batch_untyped_t *list = batch->untypeds;
+    while(list != NULL) {
+        mmap_batch_untyped_t *next = list->next;
+        cspacepath_t path;
+        vka_cspace_make_path(&init_objects.vka, list->untyped.cptr, &path);
+        vka_cnode_revoke(&path);
+        vka_free_object(&init_objects.vka, &list->untyped);
+        free(list);
+        list = next;
+    }
+    batch->untypeds = NULL;
+
+    for(seL4_Word i = 0; i < num_slots; i++) {
+        if(batch->slots[i] != seL4_CapNull) {
+            vka_cspace_free(&init_objects.vka, batch->slots[i]);
+        }
+    }
+    free(batch->slots);
+    free(batch);
+}
+
+
+/**
+ * Allocate the untyped for the next run of frames, halving the run until the
+ * allocator can satisfy it. Returns the number of frames it covers, 0 on failure.
+ */
+static seL4_Word batch_alloc_untyped(seL4_Word page_size_bits,
+                                     seL4_Word pages_left,
+                                     vka_object_t *untyped,
+                                     mmap_batch_stats_t *stats)
+{
+    seL4_Word max_bits = MIN(CONFIG_LIB_MMAP_BATCH_MAX_BITS, seL4_MaxUntypedBits);
+    seL4_Word run_bits = 0;
+
+    while(run_bits + 1 + page_size_bits <= max_bits && BIT(run_bits + 1) <= pages_left) {
+        run_bits++;
+    }
+
+    while(true) {
+        if(vka_alloc_untyped(&init_objects.vka, page_size_bits + run_bits, untyped) == 0) {
+            return BIT(run_bits);
+        }
+        if(run_bits == 0) {
+            return 0;
+        }
+        stats->alloc_retries++;
+        run_bits--;
+    }
+}
+
+
+/**
+ * @brief Map num_pages new frames, retyping them in bulk
+ *
+ * Same contract as mmap_new_pages_custom, except the frames must be released
+ * with mmap_unmap_pages_custom. Their memory goes back to the allocator once
+ * every page of the mapping has been unmapped, so unmapping with
+ * VSPACE_PRESERVE and holding on to the caps doesn't keep the frames alive.
+ * auto_page_size is ignored, the whole range uses attr->page_size_bits.
+ *
+ * @param stats     Optional, filled with what this call did
+ */
+int mmap_new_pages_batched_custom(vspace_t *vspace,
+                                  seL4_CPtr vspace_root_cap,
+                                  seL4_Word num_pages,
+                                  const mmap_entry_attr_t *attr,
+                                  seL4_CPtr *caps,
+                                  void **vaddr,
+                                  reservation_t *res,
+                                  mmap_batch_stats_t *stats)
+{
+    int error;
+    mmap_batch_stats_t local_stats;
+
+    if(!init_check_initialized()) {
+       ZF_LOGW("Init objects (vka, vspace) have not been setup.\n"
+               "Run init_process or init_root_task to setup.");
+       return -1;
+    }
+
+    if(vspace == NULL || attr == NULL) {
+        ZF_LOGE("Null argument passed.");
+        return -2;
+    }
+
+    if(vaddr == NULL || res == NULL) {
+        ZF_LOGE("Null vaddr pointer passed.");
+        return -3;
+    }
+
+    if(stats == NULL) {
+        stats = &local_stats;
+    }
+    memset(stats, 0, sizeof(mmap_batch_stats_t));
+
+    seL4_Word bits = attr->page_size_bits;
+    seL4_CapRights_t rights = seL4_CapRights_new(false, attr->readable, attr->writable);
+
+    *res = vspace_reserve_range_aligned(vspace,
+                                        num_pages * BIT(bits),
+                                        bits,
+                                        rights,
+                                        libmmap_reserve_cacheable(attr),
+                                        vaddr);
+    if(res->res == NULL || *vaddr == NULL) {
+        ZF_LOGE("Failed to reserve space for the page mapping.");
+        return -3;
+    }
+
+    mmap_batch_t *batch = calloc(1, sizeof(mmap_batch_t));
+    seL4_CPtr *frame_caps = malloc(sizeof(seL4_CPtr) * num_pages);
+    if(batch == NULL || frame_caps == NULL) {
+        ZF_LOGE("Failed to allocate batch bookkeeping");
+        free(batch);
+        free(frame_caps);
+        vspace_free_reservation(vspace, *res);
+        res->res = NULL;
+        return -4;
+    }
+    batch->slots = frame_caps;
+
+    batch->vspace = vspace;
+    batch->start = (uintptr_t)*vaddr;
+    batch->page_size_bits = bits;
+    batch->num_pages = num_pages;
+
+    seL4_Word done = 0;
+    seL4_Word slots = 0;
+    while(done < num_pages) {
+        mmap_batch_untyped_t *ut = calloc(1, sizeof(mmap_batch_untyped_t));
+        if(ut == NULL) {
+            ZF_LOGE("Failed to allocate batch bookkeeping");
+            error = -4;
+            goto unmap_pages;
+        }
+
+        seL4_Word run = batch_alloc_untyped(bits, num_pages - done, &ut->untyped, stats);
+        if(run == 0) {
+            ZF_LOGE("Failed to allocate frame object. Do you have enough untyped memory?");
+            free(ut);
+            error = -4;
+            goto unmap_pages;
+        }
+        ut->next = batch->untypeds;
+        batch->untypeds = ut;
+        stats->untypeds++;
+
+        /* One range of slots per untyped, so the retype is a single call */
+        cspacepath_t first;
+        error = init_cspace_alloc_range(&init_objects.vka, run, &frame_caps[done], &first);
+        if(error) {
+            ZF_LOGE("Failed to allocate cslots for %lu frames", (long unsigned)run);
+            error = -4;
+            goto unmap_pages;
+        }
+        slots = done + run;
+
+        error = libmmap_retype_frames(ut->untyped.cptr, bits, &frame_caps[done], run,
+                                      &stats->retype_calls);
+        if(error) {
+            error = -4;
+            goto unmap_pages;
+        }
+
+        /**
+         * Cookies are left at 0, the frames are not individually freeable.
+         */
+        error = vspace_map_pages_at_vaddr(vspace,
+                                          &frame_caps[done],
+                                          NULL,
+                                          addr_at_page(*vaddr, done, bits),
+                                          run,
+                                          bits,
+                                          *res);
+        stats->map_calls++;
+        if(error) {
+            ZF_LOGE("Failed to map %lu pages at %lu",
+                    (long unsigned)run, (long unsigned)addr_at_page(*vaddr, done, bits));
+            error = -5;
+            done += run;
+            goto unmap_pages;
+        }
+
+        for(seL4_Word i = done; libmmap_remap_needed(attr) && i < done + run; i++) {
+            error = libmmap_remap_fix_attrs(frame_caps[i], vspace_root_cap, attr);
+            stats->remap_calls++;
+            if(error) {
+                ZF_LOGE("Failed to set the memory attributes for %lu",
+                        (long unsigned)addr_at_page(*vaddr, i, bits));
+                error = -6;
+                done += run;
+                goto unmap_pages;
+            }
+        }
+
+        done += run;
+        stats->frames = done;
+    }
+
+    batch->mapped_pages = num_pages;
+    batch_lock();
+    batch->next = batch_list;
+    batch_list = batch;
+    batch_unlock();
+
+    if(caps != NULL) {
+        memcpy(caps, frame_caps, sizeof(seL4_CPtr) * num_pages);
+    }
+    return 0;
+
+unmap_pages:
+    vspace_unmap_pages(vspace, *vaddr, done, bits, VSPACE_PRESERVE);
+    batch_free(batch, slots);
+    vspace_free_reservation(vspace, *res);
+    res->res = NULL;
+    return error;
+}
+
+
+void libmmap_batch_unmapped(vspace_t *vspace, void *vaddr, seL4_Word num_pages, bool slots_freed)
+{
+    uintptr_t addr = (uintptr_t)vaddr;
+    mmap_batch_t *done = NULL;
+
+    batch_lock();
+    for(mmap_batch_t **iter = &batch_list; *iter != NULL; iter = &(*iter)->next) {
+        mmap_batch_t *batch = *iter;
+        uintptr_t end = batch->start + (batch->num_pages << batch->page_size_bits);
+        if(batch->vspace != vspace || addr < batch->start || addr >= end) {
+            continue;
+        }
+
+        seL4_Word pages = MIN(num_pages, (end - addr) >> batch->page_size_bits);
+        if(slots_freed) {
+            /* The vspace gave these slots back already */
+            seL4_Word first = (addr - batch->start) >> batch->page_size_bits;
+            for(seL4_Word i = first; i < first + pages; i++) {
+                batch->slots[i] = seL4_CapNull;
+            }
+        }
+        batch->mapped_pages -= MIN(pages, batch->mapped_pages);
+        if(batch->mapped_pages == 0) {
+            *iter = batch->next;
+            done = batch;
+        }
+        break;
+    }
+    batch_unlock();
+
+    if(done != NULL) {
+        batch_free(done, done->num_pages);
+    }
+}
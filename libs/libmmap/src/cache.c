@@ -0,0 +1,190 @@
+/**
+ * @file cache.c
+ * @brief Data cache maintenance over virtual address ranges
+ *
+ * The kernel cleans and invalidates one frame per call. A range is split at
+ * frame boundaries, not page boundaries, so a range inside a large frame is
+ * one call. A batch of ranges is sorted and overlapping or touching ranges
+ * are merged first, so back to back buffers in one frame share a call. Gaps
+ * are never bridged, an invalidate must not drop lines it wasn't given.
+ *
+ * Past CONFIG_LIB_MMAP_CACHE_FULL_FLUSH_KB a clean is cheaper as a flush of
+ * the whole cache, when the kernel offers one (benchmark builds). Pure
+ * invalidates never take that path, writing back unrelated dirty lines over
+ * memory a device just filled would lose its data.
+ *
+ * Architectures without these calls have DMA coherent caches, every
+ * operation succeeds without doing anything.
+ */
+#include <autoconf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sel4/sel4.h>
+#include <vspace/vspace.h>
+#include <utils/util.h>
+
+#include <init/init.h>
+#include <mmap/mmap.h>
+#include <mmap/internal.h>
+
+
+#ifdef CONFIG_ARCH_ARM
+
+static int cache_frame_op(seL4_CPtr frame, seL4_Word start, seL4_Word end, mmap_cache_op_t op)
+{
+    switch(op) {
+    case MMAP_CACHE_CLEAN:
+        return seL4_ARM_Page_Clean_Data(frame, start, end);
+    case MMAP_CACHE_INVALIDATE:
+        return seL4_ARM_Page_Invalidate_Data(frame, start, end);
+    case MMAP_CACHE_CLEAN_INVALIDATE:
+        return seL4_ARM_Page_CleanInvalidate_Data(frame, start, end);
+    case MMAP_CACHE_UNIFY_INSTRUCTION:
+        return seL4_ARM_Page_Unify_Instruction(frame, start, end);
+    }
+    return -1;
+}
+
+
+/**
+ * One kernel call per frame the range touches.
+ */
+static int cache_range_op(vspace_t *vspace, uintptr_t addr, uintptr_t end,
+                          mmap_cache_op_t op, mmap_cache_stats_t *stats)
+{
+    while(addr < end) {
+        seL4_CPtr cap = vspace_get_cap(vspace, (void *)addr);
+        if(cap == seL4_CapNull) {
+            ZF_LOGE("Cache operation on unmapped address %p", (void *)addr);
+            return -3;
+        }
+
+        seL4_Word bits = libmmap_frame_bits_at(vspace, addr, cap);
+        uintptr_t base = ROUND_DOWN(addr, BIT(bits));
+        uintptr_t stop = MIN(end, base + BIT(bits));
+
+        int error = cache_frame_op(cap, addr - base, stop - base, op);
+        if(error) {
+            ZF_LOGE("Cache operation failed at %p", (void *)addr);
+            return -4;
+        }
+        stats->kernel_calls++;
+        addr = stop;
+    }
+    return 0;
+}
+
+
+static bool cache_try_full_flush(size_t bytes, mmap_cache_op_t op, mmap_cache_stats_t *stats)
+{
+#ifdef CONFIG_ENABLE_BENCHMARKS
+    if(op != MMAP_CACHE_INVALIDATE && op != MMAP_CACHE_UNIFY_INSTRUCTION &&
+       bytes >= (size_t)CONFIG_LIB_MMAP_CACHE_FULL_FLUSH_KB * 1024) {
+        seL4_BenchmarkFlushCaches();
+        stats->full_flushes++;
+        return true;
+    }
+#endif
+    return false;
+}
+
+
+static int cache_compare_ranges(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)((const mmap_cache_range_t *)a)->vaddr;
+    uintptr_t y = (uintptr_t)((const mmap_cache_range_t *)b)->vaddr;
+    return (x > y) - (x < y);
+}
+
+#endif /* CONFIG_ARCH_ARM */
+
+
+int mmap_cache_op_batch_custom(vspace_t *vspace,
+                               const mmap_cache_range_t *ranges,
+                               seL4_Word num_ranges,
+                               mmap_cache_op_t op,
+                               mmap_cache_stats_t *stats)
+{
+    mmap_cache_stats_t local_stats;
+
+    if(vspace == NULL || (ranges == NULL && num_ranges != 0)) {
+        ZF_LOGE("Null argument passed.");
+        return -2;
+    }
+
+    if(stats == NULL) {
+        stats = &local_stats;
+    }
+    stats->kernel_calls = 0;
+    stats->full_flushes = 0;
+
+#ifdef CONFIG_ARCH_ARM
+    size_t total = 0;
+    for(seL4_Word i = 0; i < num_ranges; i++) {
+        total += ranges[i].bytes;
+    }
+    if(total == 0 || cache_try_full_flush(total, op, stats)) {
+        return 0;
+    }
+
+    mmap_cache_range_t single;
+    mmap_cache_range_t *sorted = &single;
+    if(num_ranges == 1) {
+        single = ranges[0];
+    } else {
+        sorted = malloc(sizeof(mmap_cache_range_t) * num_ranges);
+        if(sorted == NULL) {
+            ZF_LOGE("Failed to malloc the range list");
+            return -4;
+        }
+        memcpy(sorted, ranges, sizeof(mmap_cache_range_t) * num_ranges);
+        qsort(sorted, num_ranges, sizeof(mmap_cache_range_t), cache_compare_ranges);
+    }
+
+    /**
+     * Merge overlapping and touching ranges, then do each merged run.
+     */
+    int error = 0;
+    uintptr_t start = (uintptr_t)sorted[0].vaddr;
+    uintptr_t end = start + sorted[0].bytes;
+    for(seL4_Word i = 1; i <= num_ranges && !error; i++) {
+        uintptr_t next = (i < num_ranges) ? (uintptr_t)sorted[i].vaddr : UINTPTR_MAX;
+        if(i < num_ranges && next <= end) {
+            end = MAX(end, next + sorted[i].bytes);
+            continue;
+        }
+        error = cache_range_op(vspace, start, end, op, stats);
+        if(i < num_ranges) {
+            start = next;
+            end = next + sorted[i].bytes;
+        }
+    }
+
+    if(sorted != &single) {
+        free(sorted);
+    }
+    return error;
+#else
+    return 0;
+#endif
+}
+
+
+int mmap_cache_op_custom(vspace_t *vspace,
+                         void *vaddr,
+                         size_t bytes,
+                         mmap_cache_op_t op)
+{
+    mmap_cache_range_t range = { .vaddr = vaddr, .bytes = bytes };
+    return mmap_cache_op_batch_custom(vspace, &range, 1, op, NULL);
+}
+
+
+int mmap_cache_op(void *vaddr, size_t bytes, mmap_cache_op_t op)
+{
+    return mmap_cache_op_custom(&init_objects.vspace, vaddr, bytes, op);
+}
@@ -0,0 +1,539 @@
+/**
+ * @file color.c
+ * @brief Cache colored frame allocation for libmmap
+ *
+ * A frame's color is the part of its physical page number that indexes the
+ * shared cache, bits [seL4_PageBits, seL4_PageBits + CONFIG_LIB_MMAP_CACHE_COLOR_BITS).
+ * Two vspaces whose frames have disjoint colors can't evict each other.
+ *
+ * The pool grows by one naturally aligned untyped of exactly one frame per
+ * color, so retyping it yields a frame of every color and frame i of a chunk
+ * has color i. Frames sit on per color free lists, shared by every vspace.
+ *
+ * The pool keeps the original frame caps. A vspace maps a copy, so however the
+ * mapping goes away (mmap_free_pages, or a child's vspace_tear_down) the
+ * original is still there to revoke and hand out again.
+ *
+ * Frames are zeroed through a cached mapping and then cleaned to memory, a
+ * vspace may map them uncached. Once every frame of a chunk is back, the
+ * chunk goes back to the allocator, except for one kept as a spare so a
+ * vspace freeing and mapping a page in turn doesn't retype every time. A
+ * frame that can't be zeroed is retired instead, and its chunk goes back as
+ * soon as the rest of it is free.
+ */
+#include <autoconf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <vka/vka.h>
+#include <vka/capops.h>
+#include <vka/kobject_t.h>
+#include <vspace/vspace.h>
+#include <utils/util.h>
+#include <sel4utils/mapping.h>
+
+#include <init/init.h>
+#include <mmap/mmap.h>
+#include <mmap/internal.h>
+
+#ifdef CONFIG_LIB_MMAP_CACHE_COLORS
+
+#define NUM_COLORS BIT(CONFIG_LIB_MMAP_CACHE_COLOR_BITS)
+#define CHUNK_BITS (seL4_PageBits + CONFIG_LIB_MMAP_CACHE_COLOR_BITS)
+
+typedef struct color_frame {
+    struct color_frame *next;   /* Next free frame of the same color */
+    struct color_chunk *chunk;
+    seL4_CPtr cap;              /* Original cap, never mapped */
+    vspace_t *owner;            /* Vspace the copy is mapped into, NULL when free */
+} color_frame_t;
+
+typedef struct color_chunk {
+    struct color_chunk *next;
+    vka_object_t untyped;
+    uintptr_t paddr;
+    seL4_Word num_free;         /* Frames on the free lists */
+    seL4_Word num_retired;      /* Frames that couldn't be zeroed, never handed out again */
+    seL4_CPtr slots[NUM_COLORS];
+    color_frame_t frames[NUM_COLORS];
+} color_chunk_t;
+
+typedef struct color_vspace {
+    struct color_vspace *next;
+    vspace_t *vspace;
+    seL4_Word colors;
+    seL4_Word next_color;       /* Round robin over the mask */
+} color_vspace_t;
+
+static color_chunk_t *color_chunks = NULL;
+static color_frame_t *color_free[NUM_COLORS];
+static color_vspace_t *color_vspaces = NULL;
+static seL4_Word color_spare_chunks = 0;    /* Chunks with every frame free */
+
+static volatile int color_pool_lock = 0;
+
+static inline void color_lock(void) {
+    while(__atomic_test_and_set(&color_pool_lock, __ATOMIC_ACQUIRE)) {
+        seL4_Yield();
+    }
+}
+
+static inline void color_unlock(void) {
+    __atomic_clear(&color_pool_lock, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Assumes the color lock is held
+ */
+static color_vspace_t *color_find_vspace(vspace_t *vspace)
+{
+    for(color_vspace_t *iter = color_vspaces; iter != NULL; iter = iter->next) {
+        if(iter->vspace == vspace) {
+            return iter;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Assumes the color lock is held
+ */
+static color_frame_t *color_find_frame(uintptr_t paddr, color_chunk_t **chunk_out)
+{
+    for(color_chunk_t *chunk = color_chunks; chunk != NULL; chunk = chunk->next) {
+        if(paddr >= chunk->paddr && paddr < chunk->paddr + BIT(CHUNK_BITS)) {
+            *chunk_out = chunk;
+            return &chunk->frames[(paddr - chunk->paddr) >> seL4_PageBits];
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Split one more untyped into a frame of every color.
+ */
+static int color_grow(void)
+{
+    color_chunk_t *chunk = calloc(1, sizeof(color_chunk_t));
+    if(chunk == NULL) {
+        ZF_LOGE("Failed to malloc color chunk");
+        return -1;
+    }
+
+    if(vka_alloc_untyped(&init_objects.vka, CHUNK_BITS, &chunk->untyped)) {
+        ZF_LOGE("Failed to allocate an untyped for %lu colors", (long)NUM_COLORS);
+        goto free_chunk;
+    }
+
+    cspacepath_t first;
+    if(init_cspace_alloc_range(&init_objects.vka, NUM_COLORS, chunk->slots, &first)) {
+        ZF_LOGE("Failed to allocate cslots for the colored frames");
+        goto free_untyped;
+    }
+
+    if(libmmap_retype_frames(chunk->untyped.cptr, seL4_PageBits, chunk->slots, NUM_COLORS, NULL)) {
+        ZF_LOGE("Failed to retype the colored frames");
+        goto free_slots;
+    }
+
+    seL4_ARCH_Page_GetAddress_t addr = seL4_ARCH_Page_GetAddress(chunk->slots[0]);
+    if(addr.error) {
+        ZF_LOGE("Failed to get the physical address of a colored frame");
+        goto free_slots;
+    }
+    chunk->paddr = addr.paddr;
+
+    color_lock();
+    chunk->next = color_chunks;
+    color_chunks = chunk;
+    for(seL4_Word i = 0; i < NUM_COLORS; i++) {
+        chunk->frames[i].chunk = chunk;
+        chunk->frames[i].cap = chunk->slots[i];
+        chunk->frames[i].next = color_free[i];
+        color_free[i] = &chunk->frames[i];
+    }
+    chunk->num_free = NUM_COLORS;
+    color_spare_chunks++;
+    color_unlock();
+
+    return 0;
+
+free_slots:
+    {
+        cspacepath_t ut_path;
+        vka_cspace_make_path(&init_objects.vka, chunk->untyped.cptr, &ut_path);
+        vka_cnode_revoke(&ut_path);
+    }
+    init_cspace_free_range(&init_objects.vka, chunk->slots, NUM_COLORS);
+free_untyped:
+    vka_free_object(&init_objects.vka, &chunk->untyped);
+free_chunk:
+    free(chunk);
+    return -1;
+}
+
+
+/**
+ * Give a chunk whose frames are all free back to the allocator. The caller
+ * has already taken it off the chunk and free lists.
+ */
+static void color_release_chunk(color_chunk_t *chunk)
+{
+    cspacepath_t ut_path;
+    vka_cspace_make_path(&init_objects.vka, chunk->untyped.cptr, &ut_path);
+    vka_cnode_revoke(&ut_path);
+    init_cspace_free_range(&init_objects.vka, chunk->slots, NUM_COLORS);
+    vka_free_object(&init_objects.vka, &chunk->untyped);
+    free(chunk);
+}
+
+
+/**
+ * Take every frame of a chunk off the free lists and the chunk off the chunk
+ * list. Assumes the color lock is held and every frame is free or retired.
+ */
+static void color_unlink_chunk(color_chunk_t *chunk)
+{
+    for(seL4_Word i = 0; i < NUM_COLORS; i++) {
+        for(color_frame_t **iter = &color_free[i]; *iter != NULL; iter = &(*iter)->next) {
+            if(*iter == &chunk->frames[i]) {
+                *iter = chunk->frames[i].next;
+                break;
+            }
+        }
+    }
+    for(color_chunk_t **iter = &color_chunks; *iter != NULL; iter = &(*iter)->next) {
+        if(*iter == chunk) {
+            *iter = chunk->next;
+            break;
+        }
+    }
+}
+
+
+/**
+ * Take a frame of one of the colors in the mask, rotating through them so a
+ * range spreads over the whole partition. Assumes the color lock is held.
+ */
+static color_frame_t *color_take(color_vspace_t *cv)
+{
+    for(seL4_Word tries = 0; tries < NUM_COLORS; tries++) {
+        seL4_Word color = cv->next_color;
+        cv->next_color = (cv->next_color + 1) % NUM_COLORS;
+
+        if((cv->colors & BIT(color)) && color_free[color] != NULL) {
+            color_frame_t *frame = color_free[color];
+            color_free[color] = frame->next;
+            frame->next = NULL;
+            frame->owner = cv->vspace;
+            if(frame->chunk->num_free-- == NUM_COLORS) {
+                color_spare_chunks--;
+            }
+            return frame;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Revoke every mapped copy of a frame, zero it and put it back on its list.
+ * The zeroes are cleaned past the cache, the next owner may map it uncached.
+ *
+ * A frame that can't be zeroed still holds its last owner's data. It is
+ * retired rather than handed out again, and its chunk is released once
+ * every other frame is back, retyping the untyped clears it.
+ */
+static void color_put_back(color_frame_t *frame, seL4_Word color)
+{
+    cspacepath_t path;
+    vka_cspace_make_path(&init_objects.vka, frame->cap, &path);
+    vka_cnode_revoke(&path);
+
+    bool clean = false;
+    seL4_CPtr cap = frame->cap;
+    void *vaddr = vspace_map_pages(&init_objects.vspace, &cap, NULL, seL4_AllRights,
+                                   1, seL4_PageBits, 1);
+    if(vaddr == NULL) {
+        ZF_LOGE("Failed to map a colored frame for clearing, retiring it");
+    } else {
+        memset(vaddr, 0, BIT(seL4_PageBits));
+        int error = mmap_cache_op_custom(&init_objects.vspace, vaddr, BIT(seL4_PageBits),
+                                         MMAP_CACHE_CLEAN_INVALIDATE);
+        vspace_unmap_pages(&init_objects.vspace, vaddr, 1, seL4_PageBits, VSPACE_PRESERVE);
+        if(error) {
+            ZF_LOGE("Failed to clean a colored frame, retiring it");
+        } else {
+            clean = true;
+        }
+    }
+
+    if(!clean) {
+        vka_cnode_delete(&path);
+    }
+
+    color_chunk_t *chunk = frame->chunk;
+    color_lock();
+    frame->owner = NULL;
+    if(clean) {
+        frame->next = color_free[color];
+        color_free[color] = frame;
+        chunk->num_free++;
+    } else {
+        chunk->num_retired++;
+    }
+
+    /* A chunk with a retired frame is never kept as the spare */
+    bool release = false;
+    if(chunk->num_free + chunk->num_retired == NUM_COLORS) {
+        release = chunk->num_retired > 0 || color_spare_chunks > 0;
+        if(release) {
+            color_unlink_chunk(chunk);
+        } else {
+            color_spare_chunks++;
+        }
+    }
+    color_unlock();
+
+    if(release) {
+        color_release_chunk(chunk);
+    }
+}
+
+
+int mmap_color_set_vspace(vspace_t *vspace, seL4_Word colors)
+{
+    if(vspace == NULL) {
+        ZF_LOGE("Null vspace pointer passed.");
+        return -2;
+    }
+
+    if(NUM_COLORS < seL4_WordBits) {
+        colors &= MASK(NUM_COLORS);
+    }
+
+    color_lock();
+    color_vspace_t *cv = color_find_vspace(vspace);
+    if(cv == NULL && colors != 0) {
+        cv = calloc(1, sizeof(color_vspace_t));
+        if(cv == NULL) {
+            color_unlock();
+            ZF_LOGE("Failed to malloc color bookkeeping");
+            return -4;
+        }
+        cv->vspace = vspace;
+        cv->next = color_vspaces;
+        color_vspaces = cv;
+    }
+    if(cv != NULL) {
+        cv->colors = colors;
+    }
+    color_unlock();
+
+    return 0;
+}
+
+
+void mmap_color_release_vspace(vspace_t *vspace)
+{
+    color_lock();
+    for(color_vspace_t **iter = &color_vspaces; *iter != NULL; iter = &(*iter)->next) {
+        if((*iter)->vspace == vspace) {
+            color_vspace_t *dead = *iter;
+            *iter = dead->next;
+            free(dead);
+            break;
+        }
+    }
+    color_unlock();
+
+    /**
+     * Frames are put back one at a time without the lock, restart the walk
+     * after each one.
+     */
+    bool found = true;
+    while(found) {
+        found = false;
+        color_lock();
+        for(color_chunk_t *chunk = color_chunks; chunk != NULL && !found; chunk = chunk->next) {
+            for(seL4_Word i = 0; i < NUM_COLORS; i++) {
+                if(chunk->frames[i].owner == vspace) {
+                    color_frame_t *frame = &chunk->frames[i];
+                    frame->owner = NULL;
+                    color_unlock();
+                    color_put_back(frame, i);
+                    found = true;
+                    break;
+                }
+            }
+        }
+        if(!found) {
+            color_unlock();
+        }
+    }
+}
+
+
+bool libmmap_color_wanted(vspace_t *vspace, seL4_Word page_size_bits)
+{
+    if(page_size_bits != seL4_PageBits) {
+        return false;
+    }
+
+    color_lock();
+    color_vspace_t *cv = color_find_vspace(vspace);
+    bool wanted = cv != NULL && cv->colors != 0;
+    color_unlock();
+
+    return wanted;
+}
+
+
+int libmmap_color_alloc_frame(vspace_t *vspace, vka_object_t *frame)
+{
+    color_lock();
+    color_vspace_t *cv = color_find_vspace(vspace);
+    if(cv == NULL) {
+        color_unlock();
+        return -1;
+    }
+
+    color_frame_t *cf = color_take(cv);
+    while(cf == NULL) {
+        color_unlock();
+        if(color_grow()) {
+            return -1;
+        }
+        color_lock();
+        cv = color_find_vspace(vspace);
+        if(cv == NULL) {
+            color_unlock();
+            return -1;
+        }
+        cf = color_take(cv);
+    }
+    color_unlock();
+
+    /**
+     * Hand out a copy, the original stays with the pool.
+     */
+    cspacepath_t src, dst;
+    vka_cspace_make_path(&init_objects.vka, cf->cap, &src);
+    int error = vka_cspace_alloc_path(&init_objects.vka, &dst);
+    if(!error) {
+        error = vka_cnode_copy(&dst, &src, seL4_AllRights);
+        if(error) {
+            vka_cspace_free(&init_objects.vka, dst.capPtr);
+        }
+    }
+    if(error) {
+        ZF_LOGE("Failed to copy a colored frame cap");
+        color_lock();
+        cf->owner = NULL;
+        color_unlock();
+        return -1;
+    }
+
+    frame->cptr = dst.capPtr;
+    frame->ut = 0;
+    frame->type = kobject_get_type(KOBJECT_FRAME, seL4_PageBits);
+    frame->size_bits = seL4_PageBits;
+    return 0;
+}
+
+
+/**
+ * Find the pool frame a copy was made from, if vspace owns it, and take it
+ * away from vspace so only one caller puts it back.
+ */
+static color_frame_t *color_lookup_owned(vspace_t *vspace, seL4_CPtr copy, seL4_Word *color)
+{
+    seL4_ARCH_Page_GetAddress_t addr = seL4_ARCH_Page_GetAddress(copy);
+    if(addr.error) {
+        return NULL;
+    }
+
+    color_chunk_t *chunk;
+    color_lock();
+    color_frame_t *frame = color_find_frame(addr.paddr, &chunk);
+    if(frame == NULL || frame->owner != vspace) {
+        color_unlock();
+        return NULL;
+    }
+    *color = frame - chunk->frames;
+    frame->owner = NULL;
+    color_unlock();
+
+    return frame;
+}
+
+
+bool libmmap_color_free_frame(vspace_t *vspace, seL4_CPtr copy)
+{
+    seL4_Word color;
+    color_frame_t *frame = color_lookup_owned(vspace, copy, &color);
+    if(frame == NULL) {
+        return false;
+    }
+
+    /* Revoking the original deletes the copy, its slot is still ours to free */
+    color_put_back(frame, color);
+    vka_cspace_free(&init_objects.vka, copy);
+    return true;
+}
+
+
+bool libmmap_color_reclaim(vspace_t *vspace, void *vaddr)
+{
+    seL4_Word color;
+    seL4_CPtr copy = vspace_get_cap(vspace, vaddr);
+    color_frame_t *frame = color_lookup_owned(vspace, copy, &color);
+    if(frame == NULL) {
+        return false;
+    }
+
+    vspace_unmap_pages(vspace, vaddr, 1, seL4_PageBits, VSPACE_PRESERVE);
+    color_put_back(frame, color);
+    vka_cspace_free(&init_objects.vka, copy);
+    return true;
+}
+
+#else
+
+int mmap_color_set_vspace(UNUSED vspace_t *vspace, UNUSED seL4_Word colors)
+{
+    ZF_LOGE("Cache coloring needs CONFIG_LIB_MMAP_CACHE_COLORS");
+    return -1;
+}
+
+void mmap_color_release_vspace(UNUSED vspace_t *vspace)
+{
+}
+
+bool libmmap_color_wanted(UNUSED vspace_t *vspace, UNUSED seL4_Word page_size_bits)
+{
+    return false;
+}
+
+int libmmap_color_alloc_frame(UNUSED vspace_t *vspace, UNUSED vka_object_t *frame)
+{
+    return -1;
+}
+
+bool libmmap_color_free_frame(UNUSED vspace_t *vspace, UNUSED seL4_CPtr copy)
+{
+    return false;
+}
+
+bool libmmap_color_reclaim(UNUSED vspace_t *vspace, UNUSED void *vaddr)
+{
+    return false;
+}
+
+#endif /* CONFIG_LIB_MMAP_CACHE_COLORS */
@@ -0,0 +1,301 @@
+/**
+ * @file dma.c
+ * @brief Physically contiguous memory for drivers
+ *
+ * A DMA region is one untyped retyped into a contiguous range of slots as 4K
+ * frames, with a single call, so the frames are physically contiguous and the
+ * region's paddr is its first frame's. Regions are mapped into our own
+ * vspace, cached or uncached.
+ *
+ * @warning seL4 on ARM has no normal uncached memory type, an uncached
+ * region is mapped as device memory. Only naturally aligned loads and stores
+ * work on it: unaligned accesses, exclusives (atomics) and DC ZVA fault, and
+ * libc's memcpy and memset may use any of them. Copy into uncached buffers
+ * with aligned word accesses, or use a cached region and mmap_cache_op.
+ *
+ * A DMA pool splits regions into fixed size, power of two buffers and keeps
+ * the free ones on a lock-free stack. Everything is allocated when the pool
+ * is created, so taking and returning a buffer is a single compare and swap.
+ */
+#include <autoconf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <vka/vka.h>
+#include <vka/capops.h>
+#include <vspace/vspace.h>
+#include <utils/util.h>
+#include <sel4utils/mapping.h>
+
+#include <init/init.h>
+#include <mmap/mmap.h>
+#include <mmap/internal.h>
+
+
+#define DMA_MIN_BUF_BITS 6      /* Keep buffers on separate cache lines */
+
+
+static void dma_free_frames(mmap_dma_region_t *region, seL4_Word num_slots)
+{
+    cspacepath_t path;
+    vka_cspace_make_path(&init_objects.vka, region->untyped.cptr, &path);
+    vka_cnode_revoke(&path);
+
+    init_cspace_free_range(&init_objects.vka, region->caps, num_slots);
+    free(region->caps);
+    region->caps = NULL;
+    vka_free_object(&init_objects.vka, &region->untyped);
+}
+
+
+int mmap_dma_alloc_region(size_t bytes,
+                          bool cacheable,
+                          mmap_dma_region_t *region)
+{
+    int error;
+    seL4_Word num_slots = 0;
+
+    if(!init_check_initialized()) {
+       ZF_LOGW("Init objects (vka, vspace) have not been setup.\n"
+               "Run init_process or init_root_task to setup.");
+       return -1;
+    }
+
+    if(region == NULL || bytes == 0) {
+        ZF_LOGE("Invalid argument passed.");
+        return -2;
+    }
+
+    seL4_Word size_bits = seL4_PageBits;
+    while(BIT(size_bits) < bytes) {
+        size_bits++;
+    }
+    if(size_bits > seL4_MaxUntypedBits) {
+        ZF_LOGE("DMA region of %lu bytes is too big", (long)bytes);
+        return -2;
+    }
+
+    memset(region, 0, sizeof(mmap_dma_region_t));
+    region->size = BIT(size_bits);
+    region->cacheable = cacheable;
+    seL4_Word num_pages = BIT(size_bits - seL4_PageBits);
+
+    region->caps = malloc(sizeof(seL4_CPtr) * num_pages);
+    if(region->caps == NULL) {
+        ZF_LOGE("Failed to malloc the DMA frame caps");
+        return -4;
+    }
+
+    error = vka_alloc_untyped(&init_objects.vka, size_bits, &region->untyped);
+    if(error) {
+        ZF_LOGE("Failed to allocate a %lu byte untyped for DMA", (long)region->size);
+        free(region->caps);
+        region->caps = NULL;
+        return -4;
+    }
+
+    cspacepath_t first;
+    error = init_cspace_alloc_range(&init_objects.vka, num_pages, region->caps, &first);
+    if(error) {
+        ZF_LOGE("Failed to allocate cslots for the DMA frames");
+        error = -4;
+        goto free_frames;
+    }
+    num_slots = num_pages;
+
+    error = libmmap_retype_frames(region->untyped.cptr, seL4_PageBits,
+                                  region->caps, num_pages, NULL);
+    if(error) {
+        error = -4;
+        goto free_frames;
+    }
+
+    seL4_ARCH_Page_GetAddress_t addr = seL4_ARCH_Page_GetAddress(region->caps[0]);
+    if(addr.error) {
+        ZF_LOGE("Failed to get the physical address of a DMA region");
+        error = -5;
+        goto free_frames;
+    }
+    region->paddr = addr.paddr;
+
+    error = mmap_existing_pages_custom(&init_objects.vspace,
+                                       init_objects.page_dir_cap,
+                                       num_pages,
+                                       cacheable ? &mmap_attr_4k_data : &mmap_attr_4k_device,
+                                       region->caps,
+                                       &region->vaddr,
+                                       &region->res);
+    if(error) {
+        ZF_LOGE("Failed to map a DMA region");
+        error = -5;
+        goto free_frames;
+    }
+
+    return 0;
+
+free_frames:
+    dma_free_frames(region, num_slots);
+    return error;
+}
+
+
+int mmap_dma_free_region(mmap_dma_region_t *region)
+{
+    if(region == NULL || region->caps == NULL) {
+        ZF_LOGE("Invalid DMA region passed.");
+        return -2;
+    }
+
+    seL4_Word num_pages = region->size >> seL4_PageBits;
+    vspace_unmap_pages(&init_objects.vspace, region->vaddr, num_pages,
+                       seL4_PageBits, VSPACE_PRESERVE);
+    vspace_free_reservation(&init_objects.vspace, region->res);
+    dma_free_frames(region, num_pages);
+    return 0;
+}
+
+
+/**
+ * Rounds buf_size up to a power of two of at least a cache line.
+ */
+int mmap_dma_pool_create(mmap_dma_pool_t *pool,
+                         size_t buf_size,
+                         seL4_Word num_bufs,
+                         bool cacheable)
+{
+    int error;
+    seL4_Word r = 0;
+
+    if(pool == NULL || buf_size == 0 || num_bufs == 0 || num_bufs >= UINT32_MAX) {
+        ZF_LOGE("Invalid argument passed.");
+        return -2;
+    }
+
+    seL4_Word buf_bits = DMA_MIN_BUF_BITS;
+    while(BIT(buf_bits) < buf_size) {
+        buf_bits++;
+    }
+
+    if(buf_bits > seL4_MaxUntypedBits) {
+        ZF_LOGE("DMA buffers of %lu bytes are too big", (long)buf_size);
+        return -2;
+    }
+
+    /**
+     * As few regions as possible, a buffer bigger than the region limit gets
+     * a region of its own.
+     */
+    seL4_Word region_bits = MAX(seL4_PageBits, buf_bits);
+    while(region_bits < CONFIG_LIB_MMAP_DMA_REGION_BITS &&
+          BIT(region_bits - buf_bits) < num_bufs) {
+        region_bits++;
+    }
+
+    seL4_Word bufs_per_region = BIT(region_bits - buf_bits);
+
+    memset(pool, 0, sizeof(mmap_dma_pool_t));
+    pool->buf_size = BIT(buf_bits);
+    pool->num_bufs = num_bufs;
+    pool->num_regions = DIV_ROUND_UP(num_bufs, bufs_per_region);
+
+    pool->regions = calloc(pool->num_regions, sizeof(mmap_dma_region_t));
+    pool->bufs = calloc(num_bufs, sizeof(mmap_dma_buf_t));
+    if(pool->regions == NULL || pool->bufs == NULL) {
+        ZF_LOGE("Failed to malloc DMA pool bookkeeping");
+        error = -4;
+        goto free_bookkeeping;
+    }
+
+    for(r = 0; r < pool->num_regions; r++) {
+        error = mmap_dma_alloc_region(BIT(region_bits), cacheable, &pool->regions[r]);
+        if(error) {
+            goto free_regions;
+        }
+    }
+
+    /**
+     * Chain every buffer onto the free list, lowest address on top.
+     */
+    for(seL4_Word b = 0; b < num_bufs; b++) {
+        mmap_dma_region_t *region = &pool->regions[b / bufs_per_region];
+        seL4_Word offset = (b % bufs_per_region) << buf_bits;
+        pool->bufs[b].vaddr = (void *)((uintptr_t)region->vaddr + offset);
+        pool->bufs[b].paddr = region->paddr + offset;
+        pool->bufs[b].next = (b + 1 < num_bufs) ? b + 2 : 0;
+    }
+    pool->free_head = 1;
+
+    return 0;
+
+free_regions:
+    while(r-- > 0) {
+        mmap_dma_free_region(&pool->regions[r]);
+    }
+free_bookkeeping:
+    free(pool->regions);
+    free(pool->bufs);
+    memset(pool, 0, sizeof(mmap_dma_pool_t));
+    return error;
+}
+
+
+/**
+ * Every buffer must have been given back.
+ */
+int mmap_dma_pool_destroy(mmap_dma_pool_t *pool)
+{
+    if(pool == NULL || pool->bufs == NULL) {
+        ZF_LOGE("Invalid DMA pool passed.");
+        return -2;
+    }
+
+    for(seL4_Word r = 0; r < pool->num_regions; r++) {
+        mmap_dma_free_region(&pool->regions[r]);
+    }
+    free(pool->regions);
+    free(pool->bufs);
+    memset(pool, 0, sizeof(mmap_dma_pool_t));
+    return 0;
+}
+
+
+/**
+ * The tag in the top half of free_head changes on every update, so a head
+ * that was popped and pushed back between our load and our swap still
+ * fails the compare.
+ */
+mmap_dma_buf_t *mmap_dma_pool_alloc(mmap_dma_pool_t *pool)
+{
+    uint64_t old = __atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    uint32_t index;
+
+    do {
+        index = (uint32_t)old;
+        if(index == 0) {
+            return NULL;
+        }
+        uint32_t next = __atomic_load_n(&pool->bufs[index - 1].next, __ATOMIC_RELAXED);
+        new = (((old >> 32) + 1) << 32) | next;
+    } while(!__atomic_compare_exchange_n(&pool->free_head, &old, new, true,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return &pool->bufs[index - 1];
+}
+
+
+void mmap_dma_pool_free(mmap_dma_pool_t *pool, mmap_dma_buf_t *buf)
+{
+    uint32_t index = (buf - pool->bufs) + 1;
+    uint64_t old = __atomic_load_n(&pool->free_head, __ATOMIC_RELAXED);
+    uint64_t new;
+
+    do {
+        __atomic_store_n(&buf->next, (uint32_t)old, __ATOMIC_RELAXED);
+        new = (((old >> 32) + 1) << 32) | index;
+    } while(!__atomic_compare_exchange_n(&pool->free_head, &old, new, true,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,437 @@
+/**
+ * @file lazy.c
+ * @brief Demand paged (lazily committed) regions for libmmap
+ *
+ * A lazy region only reserves its virtual address range up front. Frames are
+ * allocated and mapped by mmap_lazy_handle_fault the first time a page is
+ * touched, together with up to fault_around_pages - 1 neighbours in the same
+ * aligned window. Something has to call that function, this is normally the
+ * fault handler thread from libthread, see thread_fault_handler_start.
+ *
+ * @warning The fault path takes the vka and vspace locks. A thread that
+ * faults on a lazy page while holding either of them deadlocks with the
+ * fault handler. Lazy stacks are exposed to this, since every vka or vspace
+ * call runs on the caller's stack with the lock held: a thread with a lazy
+ * stack must only call into the allocators from within its committed pages.
+ * Give such threads enough commit_pages for their deepest allocator call,
+ * or use an eager stack for threads that allocate.
+ *
+ * Regions are reference counted while the fault path uses them, so a region
+ * released or forgotten during a fault is freed once that fault is done.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <sel4/sel4.h>
+#include <vka/vka.h>
+#include <vspace/vspace.h>
+#include <utils/util.h>
+
+#include <init/init.h>
+#include <mmap/mmap.h>
+#include <mmap/internal.h>
+
+
+/**
+ * The list of lazy regions. This is walked by the fault handler, so it is
+ * protected by a plain spinlock instead of the notification based init lock.
+ */
+static mmap_lazy_region_t *lazy_region_list = NULL;
+static volatile int lazy_region_lock = 0;
+
+static inline void lazy_lock(void) {
+    while(__atomic_test_and_set(&lazy_region_lock, __ATOMIC_ACQUIRE)) {
+        seL4_Yield();
+    }
+}
+
+static inline void lazy_unlock(void) {
+    __atomic_clear(&lazy_region_lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * Drop a reference taken by mmap_lazy_handle_fault, freeing the region if it
+ * was released in the meantime.
+ */
+static void lazy_put_region(mmap_lazy_region_t *region)
+{
+    lazy_lock();
+    bool last = --region->refs == 0 && region->dead;
+    lazy_unlock();
+
+    if(last) {
+        free(region);
+    }
+}
+
+/**
+ * Mark a region that was just unlinked as dead. The caller frees it if no
+ * fault is using it, otherwise the last lazy_put_region does.
+ * Assumes the lazy lock is held, returns whether the caller should free it.
+ */
+static bool lazy_kill_region(mmap_lazy_region_t *region)
+{
+    region->dead = true;
+    return region->refs == 0;
+}
+
+/**
+ * Assumes the lazy lock is held
+ */
+static mmap_lazy_region_t *lazy_find_region(uintptr_t addr, mmap_lazy_region_t ***prev_next)
+{
+    mmap_lazy_region_t **iter = &lazy_region_list;
+    while(*iter != NULL) {
+        if(addr >= (*iter)->res_start && addr < (*iter)->end) {
+            if(prev_next != NULL) {
+                *prev_next = iter;
+            }
+            return *iter;
+        }
+        iter = &(*iter)->next;
+    }
+    return NULL;
+}
+
+
+int mmap_new_stack_lazy_custom(vspace_t *vspace,
+                               seL4_CPtr vspace_root_cap,
+                               seL4_Word num_pages,
+                               seL4_Word commit_pages,
+                               void **vaddr,
+                               reservation_t *res)
+{
+    int error;
+
+    if(!init_check_initialized()) {
+       ZF_LOGW("Init objects (vka, vspace) have not been setup.\n"
+               "Run init_process or init_root_task to setup.");
+       return -1;
+    }
+
+    if(vspace == NULL) {
+        ZF_LOGE("Null vspace pointer passed.");
+        return -2;
+    }
+
+    if(vaddr == NULL || res == NULL) {
+        ZF_LOGE("Null vaddr or reservation pointer passed.");
+        return -3;
+    }
+
+    if(commit_pages == 0 || commit_pages >= num_pages) {
+        /* Nothing would be left to demand page */
+        return mmap_new_stack_custom(vspace, vspace_root_cap, num_pages, vaddr, res);
+    }
+
+    mmap_lazy_region_t *region = calloc(1, sizeof(mmap_lazy_region_t));
+    if(region == NULL) {
+        ZF_LOGE("Failed to malloc lazy region");
+        return -4;
+    }
+
+    region->vspace = vspace;
+    region->vspace_root_cap = vspace_root_cap;
+    region->attr = mmap_attr_4k_data;
+    region->fault_around_pages = 1;
+    seL4_Word bits = region->attr.page_size_bits;
+    seL4_CapRights_t rights = seL4_CapRights_new(false, region->attr.readable, region->attr.writable);
+
+    /**
+     * Reserve the whole stack plus the guard page, but don't back it yet.
+     */
+    void *res_start;
+    *res = vspace_reserve_range(vspace,
+                                (num_pages + 1) * BIT(bits),
+                                rights,
+                                libmmap_reserve_cacheable(&region->attr),
+                                &res_start);
+    if(res->res == NULL || res_start == NULL) {
+        ZF_LOGE("Failed to reserve space for the stack.");
+        free(region);
+        return -3;
+    }
+
+    region->res = *res;
+    region->res_start = (uintptr_t)res_start;
+    region->start = (uintptr_t)addr_at_page(res_start, 1, bits); /* skip the guard */
+    region->end = (uintptr_t)addr_at_page(res_start, num_pages + 1, bits);
+    region->lowest_committed = region->end;
+
+    /**
+     * Commit the top of the stack now, the thread will start executing there.
+     */
+    for(seL4_Word i = 1; i <= commit_pages; i++) {
+        void *page_addr = (void*)(region->end - (i << bits));
+        error = libmmap_commit_page(vspace, vspace_root_cap, &region->attr, page_addr, *res);
+        if(error) {
+            vspace_unmap_pages(vspace, (void*)region->start, num_pages, bits, &init_objects.vka);
+            vspace_free_reservation(vspace, *res);
+            free(region);
+            return error;
+        }
+        region->committed_pages++;
+        region->lowest_committed = (uintptr_t)page_addr;
+    }
+
+    lazy_lock();
+    region->next = lazy_region_list;
+    lazy_region_list = region;
+    lazy_unlock();
+
+    *vaddr = (void*)region->end;
+    return 0;
+}
+
+
+/**
+ * Nothing is committed up front. fault_around_pages is rounded down to a
+ * power of two, 0 uses CONFIG_LIB_MMAP_LAZY_FAULT_AROUND_PAGES.
+ * auto_page_size is ignored, every fault maps attr->page_size_bits frames.
+ */
+int mmap_new_pages_lazy_custom(vspace_t *vspace,
+                               seL4_CPtr vspace_root_cap,
+                               seL4_Word num_pages,
+                               const mmap_entry_attr_t *attr,
+                               seL4_Word fault_around_pages,
+                               void **vaddr,
+                               reservation_t *res)
+{
+    if(!init_check_initialized()) {
+       ZF_LOGW("Init objects (vka, vspace) have not been setup.\n"
+               "Run init_process or init_root_task to setup.");
+       return -1;
+    }
+
+    if(vspace == NULL || attr == NULL) {
+        ZF_LOGE("Null argument passed.");
+        return -2;
+    }
+
+    if(vaddr == NULL || res == NULL) {
+        ZF_LOGE("Null vaddr or reservation pointer passed.");
+        return -3;
+    }
+
+    mmap_lazy_region_t *region = calloc(1, sizeof(mmap_lazy_region_t));
+    if(region == NULL) {
+        ZF_LOGE("Failed to malloc lazy region");
+        return -4;
+    }
+
+    if(fault_around_pages == 0) {
+        fault_around_pages = CONFIG_LIB_MMAP_LAZY_FAULT_AROUND_PAGES;
+    }
+    region->fault_around_pages = 1;
+    while(region->fault_around_pages * 2 <= fault_around_pages) {
+        region->fault_around_pages *= 2;
+    }
+
+    region->vspace = vspace;
+    region->vspace_root_cap = vspace_root_cap;
+    region->attr = *attr;
+    region->attr.auto_page_size = 0;
+    seL4_Word bits = region->attr.page_size_bits;
+    seL4_CapRights_t rights = seL4_CapRights_new(false, attr->readable, attr->writable);
+
+    *res = vspace_reserve_range_aligned(vspace,
+                                        num_pages * BIT(bits),
+                                        bits,
+                                        rights,
+                                        libmmap_reserve_cacheable(attr),
+                                        vaddr);
+    if(res->res == NULL || *vaddr == NULL) {
+        ZF_LOGE("Failed to reserve space for the page mapping.");
+        free(region);
+        return -3;
+    }
+
+    region->res = *res;
+    region->res_start = (uintptr_t)*vaddr;
+    region->start = region->res_start; /* no guard page */
+    region->end = (uintptr_t)addr_at_page(*vaddr, num_pages, bits);
+    region->lowest_committed = region->end;
+
+    lazy_lock();
+    region->next = lazy_region_list;
+    lazy_region_list = region;
+    lazy_unlock();
+
+    return 0;
+}
+
+
+int mmap_new_pages_lazy(seL4_Word num_pages,
+                        const mmap_entry_attr_t *attr,
+                        void **vaddr,
+                        reservation_t *res)
+{
+    return mmap_new_pages_lazy_custom(&init_objects.vspace,
+                                      init_objects.page_dir_cap,
+                                      num_pages,
+                                      attr,
+                                      0,
+                                      vaddr,
+                                      res);
+}
+
+
+int mmap_lazy_handle_fault(void *fault_addr)
+{
+    int error = 0;
+
+    /**
+     * The region is used without the lazy lock held, since committing takes
+     * the vka and vspace locks. The reference keeps it from being freed.
+     */
+    lazy_lock();
+    mmap_lazy_region_t *region = lazy_find_region((uintptr_t)fault_addr, NULL);
+    if(region != NULL) {
+        region->refs++;
+    }
+    lazy_unlock();
+
+    if(region == NULL) {
+        ZF_LOGD("Fault at %p is not in a lazy region", fault_addr);
+        return -1;
+    }
+
+    if((uintptr_t)fault_addr < region->start) {
+        ZF_LOGE("Stack overflow: fault at %p hit the guard page", fault_addr);
+        error = -2;
+        goto put_region;
+    }
+
+    seL4_Word bits = region->attr.page_size_bits;
+    uintptr_t page_addr = ROUND_DOWN((uintptr_t)fault_addr, BIT(bits));
+
+    /**
+     * Commit the aligned window around the faulting page, clipped to the
+     * region. The faulting page must succeed, its neighbours are best effort.
+     */
+    uintptr_t window = region->fault_around_pages << bits;
+    uintptr_t first = region->start + ROUND_DOWN(page_addr - region->start, window);
+    uintptr_t last = MIN(first + window, region->end);
+
+    for(uintptr_t addr = first; addr < last; addr += BIT(bits)) {
+        /**
+         * The region may have been released while we were committing.
+         */
+        if(__atomic_load_n(&region->dead, __ATOMIC_ACQUIRE)) {
+            error = -4;
+            break;
+        }
+
+        /**
+         * Another thread may have already faulted the page in.
+         */
+        if(vspace_get_cap(region->vspace, (void*)addr) != seL4_CapNull) {
+            continue;
+        }
+
+        int commit_error = libmmap_commit_page(region->vspace,
+                                               region->vspace_root_cap,
+                                               &region->attr,
+                                               (void*)addr,
+                                               region->res);
+        if(commit_error) {
+            if(addr == page_addr) {
+                ZF_LOGE("Failed to commit page at %p", (void*)addr);
+                error = -3;
+                break;
+            }
+            ZF_LOGW("Failed to fault around %p", (void*)addr);
+            continue;
+        }
+
+        lazy_lock();
+        region->committed_pages++;
+        if(addr < region->lowest_committed) {
+            region->lowest_committed = addr;
+        }
+        lazy_unlock();
+    }
+
+put_region:
+    lazy_put_region(region);
+    return error;
+}
+
+
+/**
+ * vaddr is the stack top returned by mmap_new_stack_lazy_custom, which is one
+ * past the end of the region, so look up the byte below it.
+ */
+int mmap_lazy_get_stats(void *vaddr, mmap_lazy_stats_t *stats)
+{
+    if(stats == NULL) {
+        ZF_LOGE("Null stats pointer passed.");
+        return -1;
+    }
+
+    lazy_lock();
+    mmap_lazy_region_t *region = lazy_find_region((uintptr_t)vaddr - 1, NULL);
+    if(region == NULL) {
+        lazy_unlock();
+        return -2;
+    }
+
+    seL4_Word bits = region->attr.page_size_bits;
+    stats->size_pages = (region->end - region->start) >> bits;
+    stats->committed_pages = region->committed_pages;
+    stats->high_water_pages = (region->end - region->lowest_committed) >> bits;
+    lazy_unlock();
+
+    return 0;
+}
+
+
+int mmap_lazy_release(void *vaddr)
+{
+    mmap_lazy_region_t **prev_next;
+
+    lazy_lock();
+    mmap_lazy_region_t *region = lazy_find_region((uintptr_t)vaddr - 1, &prev_next);
+    if(region == NULL) {
+        lazy_unlock();
+        ZF_LOGE("No lazy region found at %p", vaddr);
+        return -1;
+    }
+    *prev_next = region->next;
+    bool unused = lazy_kill_region(region);
+    lazy_unlock();
+
+    if(unused) {
+        free(region);
+    }
+    return 0;
+}
+
+
+void libmmap_lazy_forget(vspace_t *vspace, uintptr_t start, uintptr_t end)
+{
+    mmap_lazy_region_t *dead = NULL;
+
+    lazy_lock();
+    mmap_lazy_region_t **iter = &lazy_region_list;
+    while(*iter != NULL) {
+        mmap_lazy_region_t *region = *iter;
+        if(region->vspace == vspace && region->start >= start && region->end <= end) {
+            *iter = region->next;
+            if(lazy_kill_region(region)) {
+                region->next = dead;
+                dead = region;
+            }
+            continue;
+        }
+        iter = &region->next;
+    }
+    lazy_unlock();
+
+    while(dead != NULL) {
+        mmap_lazy_region_t *next = dead->next;
+        free(dead);
+        dead = next;
+    }
+}
@@ -0,0 +1,697 @@
+/**
+ * @file malloc.c
+ * @brief Thread caching malloc for libinit processes
+ *
+ * Memory is split into chunks of 2^CONFIG_LIB_MMAP_MALLOC_CHUNK_BITS bytes,
+ * aligned to their size, so masking a pointer finds the header of the run it
+ * came from. A run is either one chunk of small objects of one size class or
+ * several chunks holding a single large allocation.
+ *
+ * Small objects go through three levels:
+ *  - A cache per thread, hashed from the thread's IPC buffer address, which
+ *    every thread has even when its TLS pointer is NULL. A hit only takes
+ *    that cache's lock, which nobody else wants unless two threads hash
+ *    together.
+ *  - A central free list per size class, which refills and drains the caches
+ *    a batch at a time.
+ *  - The chunk heap, a first fit list of free chunk runs that coalesces on
+ *    free and grows by anonymous mmap from the process' morecore.
+ *
+ * No lock is held while calling out of this file. The mmap behind the chunk
+ * heap may itself call malloc, so a nested grow is given a reserved static
+ * chunk instead of growing again.
+ *
+ * Runs that become empty go back to the chunk heap, memory is never given
+ * back to the morecore.
+ */
+#include <autoconf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <init/init.h>
+#include <mmap/mmap.h>
+#include <mmap/internal.h>
+
+#ifdef CONFIG_LIB_MMAP_MALLOC
+
+#define MALLOC_CHUNK_BITS   CONFIG_LIB_MMAP_MALLOC_CHUNK_BITS
+#define MALLOC_CHUNK_SIZE   BIT(MALLOC_CHUNK_BITS)
+#define MALLOC_CHUNK_MASK   (MALLOC_CHUNK_SIZE - 1)
+#define MALLOC_ALIGN        16
+
+/**
+ * 16 byte steps up to 128, then four classes per power of two up to an
+ * eighth of a chunk, so a run holds at least seven objects.
+ */
+#define MALLOC_MAX_SMALL    (MALLOC_CHUNK_SIZE / 8)
+#define MALLOC_NUM_CLASSES  (8 + 4 * (MALLOC_CHUNK_BITS - 10))
+#define MALLOC_LARGE        MALLOC_NUM_CLASSES
+
+typedef struct malloc_run {
+    seL4_Word size_class;           /* MALLOC_LARGE for a single allocation */
+    seL4_Word num_chunks;
+    struct malloc_run *next;        /* Chunk heap or central partial list */
+    struct malloc_run *prev;
+
+    /* Small runs only */
+    seL4_Word in_use;
+    seL4_Word capacity;
+    void *free_list;
+    uintptr_t bump;
+    bool partial;
+} malloc_run_t;
+
+/* Rounded to a cache line so objects stay cache line aligned in their run */
+#define MALLOC_HEADER_SIZE  ROUND_UP(sizeof(malloc_run_t), 64)
+compile_time_assert(malloc_header_holds_run,
+                    MALLOC_HEADER_SIZE >= sizeof(malloc_run_t) && MALLOC_HEADER_SIZE % 64 == 0);
+
+typedef struct malloc_cache_list {
+    void *head;
+    seL4_Word count;
+} malloc_cache_list_t;
+
+typedef struct malloc_cache {
+    volatile int lock;
+    malloc_cache_list_t lists[MALLOC_NUM_CLASSES];
+} __attribute__((aligned(64))) malloc_cache_t;
+
+typedef struct malloc_central {
+    volatile int lock;
+    malloc_run_t *partial;          /* Runs with free objects */
+} __attribute__((aligned(64))) malloc_central_t;
+
+static malloc_cache_t malloc_caches[CONFIG_LIB_MMAP_MALLOC_CACHES];
+static malloc_central_t malloc_central[MALLOC_NUM_CLASSES];
+
+static malloc_run_t *chunk_heap = NULL;     /* Free runs, address order */
+static volatile int chunk_heap_lock = 0;
+static bool chunk_heap_growing = false;
+static uintptr_t chunk_heap_grower = 0;
+
+static uint8_t malloc_reserve[MALLOC_CHUNK_SIZE] __attribute__((aligned(MALLOC_CHUNK_SIZE)));
+static bool malloc_reserve_used = false;
+
+
+static inline void malloc_lock(volatile int *lock) {
+    while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+        seL4_Yield();
+    }
+}
+
+static inline void malloc_unlock(volatile int *lock) {
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+
+static inline seL4_Word malloc_size_class(size_t size) {
+    if(size <= 128) {
+        return (size <= MALLOC_ALIGN) ? 0 : (size - 1) / 16;
+    }
+    seL4_Word p = (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(size - 1);
+    return 8 + (p - 7) * 4 + ((size - 1 - BIT(p)) >> (p - 2));
+}
+
+static inline size_t malloc_class_size(seL4_Word size_class) {
+    if(size_class < 8) {
+        return (size_class + 1) * 16;
+    }
+    seL4_Word p = 7 + (size_class - 8) / 4;
+    return BIT(p) + ((size_class - 8) % 4 + 1) * BIT(p - 2);
+}
+
+/**
+ * Objects moved between a cache and the central list at once, a cache holds
+ * at most two batches of a class.
+ */
+static inline seL4_Word malloc_batch(seL4_Word size_class) {
+    return MAX(2, MIN(32, 4096 / malloc_class_size(size_class)));
+}
+
+static inline malloc_run_t *malloc_run_of(void *ptr) {
+    return (malloc_run_t *)((uintptr_t)ptr & ~(uintptr_t)MALLOC_CHUNK_MASK);
+}
+
+/**
+ * Identifies the calling thread. Unlike the TLS pointer, which may be NULL,
+ * every thread has its own IPC buffer.
+ */
+static inline uintptr_t malloc_thread_id(void) {
+    return (uintptr_t)seL4_GetIPCBuffer();
+}
+
+static inline malloc_cache_t *malloc_cache(void) {
+    /* IPC buffers are usually a page apart, mix the bits before the modulo */
+    uint32_t hash = (uint32_t)(malloc_thread_id() >> seL4_IPCBufferSizeBits) * 2654435761u;
+    return &malloc_caches[(hash >> 16) % CONFIG_LIB_MMAP_MALLOC_CACHES];
+}
+
+
+/**
+ * Put a run back on the chunk heap, merging it with its neighbours.
+ * Called with the chunk heap locked.
+ */
+static void chunk_heap_insert(malloc_run_t *run)
+{
+    malloc_run_t *prev = NULL;
+    malloc_run_t *next = chunk_heap;
+    while(next != NULL && next < run) {
+        prev = next;
+        next = next->next;
+    }
+
+    if(next != NULL && (uintptr_t)run + (run->num_chunks << MALLOC_CHUNK_BITS) == (uintptr_t)next) {
+        run->num_chunks += next->num_chunks;
+        next = next->next;
+    }
+    run->next = next;
+
+    if(prev != NULL && (uintptr_t)prev + (prev->num_chunks << MALLOC_CHUNK_BITS) == (uintptr_t)run) {
+        prev->num_chunks += run->num_chunks;
+        prev->next = run->next;
+    } else if(prev != NULL) {
+        prev->next = run;
+    } else {
+        chunk_heap = run;
+    }
+}
+
+
+/**
+ * First fit, splitting off the front. Called with the chunk heap locked.
+ */
+static malloc_run_t *chunk_heap_take(seL4_Word num_chunks)
+{
+    for(malloc_run_t **iter = &chunk_heap; *iter != NULL; iter = &(*iter)->next) {
+        malloc_run_t *run = *iter;
+        if(run->num_chunks < num_chunks) {
+            continue;
+        }
+
+        if(run->num_chunks == num_chunks) {
+            *iter = run->next;
+        } else {
+            malloc_run_t *rest = (malloc_run_t *)((uintptr_t)run + (num_chunks << MALLOC_CHUNK_BITS));
+            rest->num_chunks = run->num_chunks - num_chunks;
+            rest->next = run->next;
+            *iter = rest;
+        }
+        run->num_chunks = num_chunks;
+        return run;
+    }
+    return NULL;
+}
+
+
+/**
+ * Map a new region, aligned up to a chunk, and hand its chunks to the heap.
+ */
+static bool chunk_heap_grow(seL4_Word num_chunks)
+{
+    size_t bytes = MAX(num_chunks << MALLOC_CHUNK_BITS,
+                       (size_t)CONFIG_LIB_MMAP_MALLOC_REGION_KB * 1024);
+    bytes += MALLOC_CHUNK_SIZE - PAGE_SIZE_4K;
+
+    void *region = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) {
+        return false;
+    }
+
+    uintptr_t start = ROUND_UP((uintptr_t)region, MALLOC_CHUNK_SIZE);
+    malloc_run_t *run = (malloc_run_t *)start;
+    run->num_chunks = ((uintptr_t)region + bytes - start) >> MALLOC_CHUNK_BITS;
+
+    malloc_lock(&chunk_heap_lock);
+    chunk_heap_insert(run);
+    malloc_unlock(&chunk_heap_lock);
+    return true;
+}
+
+
+static malloc_run_t *chunk_heap_alloc(seL4_Word num_chunks)
+{
+    uintptr_t self = malloc_thread_id();
+
+    while(true) {
+        malloc_lock(&chunk_heap_lock);
+        malloc_run_t *run = chunk_heap_take(num_chunks);
+        if(run != NULL) {
+            malloc_unlock(&chunk_heap_lock);
+            return run;
+        }
+
+        if(chunk_heap_growing) {
+            bool nested = (chunk_heap_grower == self);
+            if(nested && num_chunks == 1 && !malloc_reserve_used) {
+                malloc_reserve_used = true;
+                malloc_unlock(&chunk_heap_lock);
+                run = (malloc_run_t *)malloc_reserve;
+                run->num_chunks = 1;
+                return run;
+            }
+            malloc_unlock(&chunk_heap_lock);
+            if(nested) {
+                return NULL;
+            }
+            /* Someone else is mapping more, wait for them */
+            seL4_Yield();
+            continue;
+        }
+
+        chunk_heap_growing = true;
+        chunk_heap_grower = self;
+        malloc_unlock(&chunk_heap_lock);
+
+        bool grew = chunk_heap_grow(num_chunks);
+
+        malloc_lock(&chunk_heap_lock);
+        chunk_heap_growing = false;
+        malloc_unlock(&chunk_heap_lock);
+        if(!grew) {
+            return NULL;
+        }
+    }
+}
+
+
+static void chunk_heap_free(malloc_run_t *run)
+{
+    malloc_lock(&chunk_heap_lock);
+    chunk_heap_insert(run);
+    malloc_unlock(&chunk_heap_lock);
+}
+
+
+/**
+ * Unlink a run from its class's partial list. Called with the class locked.
+ */
+static void central_unlink(malloc_central_t *central, malloc_run_t *run)
+{
+    if(run->prev != NULL) {
+        run->prev->next = run->next;
+    } else {
+        central->partial = run->next;
+    }
+    if(run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+    run->partial = false;
+}
+
+static void central_link(malloc_central_t *central, malloc_run_t *run)
+{
+    run->prev = NULL;
+    run->next = central->partial;
+    if(central->partial != NULL) {
+        central->partial->prev = run;
+    }
+    central->partial = run;
+    run->partial = true;
+}
+
+
+/**
+ * Take up to count objects of a class as a linked list. Returns how many.
+ */
+static seL4_Word central_fetch(seL4_Word size_class, seL4_Word count, void **list)
+{
+    malloc_central_t *central = &malloc_central[size_class];
+    size_t size = malloc_class_size(size_class);
+    seL4_Word got = 0;
+    *list = NULL;
+
+    malloc_lock(&central->lock);
+    while(got < count) {
+        malloc_run_t *run = central->partial;
+        if(run == NULL) {
+            malloc_unlock(&central->lock);
+            run = chunk_heap_alloc(1);
+            if(run == NULL) {
+                return got;
+            }
+            run->size_class = size_class;
+            run->in_use = 0;
+            run->capacity = (MALLOC_CHUNK_SIZE - MALLOC_HEADER_SIZE) / size;
+            run->free_list = NULL;
+            run->bump = (uintptr_t)run + MALLOC_HEADER_SIZE;
+            malloc_lock(&central->lock);
+            central_link(central, run);
+        }
+
+        while(got < count && run->in_use < run->capacity) {
+            void *obj = run->free_list;
+            if(obj != NULL) {
+                run->free_list = *(void **)obj;
+            } else {
+                obj = (void *)run->bump;
+                run->bump += size;
+            }
+            *(void **)obj = *list;
+            *list = obj;
+            run->in_use++;
+            got++;
+        }
+        if(run->in_use == run->capacity) {
+            central_unlink(central, run);
+        }
+    }
+    malloc_unlock(&central->lock);
+
+    return got;
+}
+
+
+/**
+ * Give back count objects of a class. Runs left empty go to the chunk heap,
+ * unless it's the only run with free objects.
+ */
+static void central_release(seL4_Word size_class, void *list, seL4_Word count)
+{
+    malloc_central_t *central = &malloc_central[size_class];
+    malloc_run_t *empty = NULL;
+
+    malloc_lock(&central->lock);
+    for(seL4_Word i = 0; i < count && list != NULL; i++) {
+        void *obj = list;
+        list = *(void **)obj;
+
+        malloc_run_t *run = malloc_run_of(obj);
+        *(void **)obj = run->free_list;
+        run->free_list = obj;
+        run->in_use--;
+
+        if(!run->partial) {
+            central_link(central, run);
+        }
+        if(run->in_use == 0 && (run->next != NULL || run->prev != NULL)) {
+            central_unlink(central, run);
+            run->next = empty;
+            empty = run;
+        }
+    }
+    malloc_unlock(&central->lock);
+
+    while(empty != NULL) {
+        malloc_run_t *next = empty->next;
+        chunk_heap_free(empty);
+        empty = next;
+    }
+}
+
+
+static void *malloc_small(seL4_Word size_class)
+{
+    malloc_cache_t *cache = malloc_cache();
+    malloc_cache_list_t *cached = &cache->lists[size_class];
+
+    malloc_lock(&cache->lock);
+    void *obj = cached->head;
+    if(obj != NULL) {
+        cached->head = *(void **)obj;
+        cached->count--;
+        malloc_unlock(&cache->lock);
+        return obj;
+    }
+    malloc_unlock(&cache->lock);
+
+    void *list;
+    seL4_Word got = central_fetch(size_class, malloc_batch(size_class), &list);
+    if(got == 0) {
+        return NULL;
+    }
+
+    obj = list;
+    list = *(void **)obj;
+    if(got > 1) {
+        void *tail = list;
+        while(*(void **)tail != NULL) {
+            tail = *(void **)tail;
+        }
+        malloc_lock(&cache->lock);
+        *(void **)tail = cached->head;
+        cached->head = list;
+        cached->count += got - 1;
+        malloc_unlock(&cache->lock);
+    }
+    return obj;
+}
+
+
+static void free_small(seL4_Word size_class, void *obj)
+{
+    malloc_cache_t *cache = malloc_cache();
+    malloc_cache_list_t *cached = &cache->lists[size_class];
+    seL4_Word batch = malloc_batch(size_class);
+    void *drain = NULL;
+
+    malloc_lock(&cache->lock);
+    *(void **)obj = cached->head;
+    cached->head = obj;
+    cached->count++;
+    if(cached->count > 2 * batch) {
+        drain = cached->head;
+        void *last = drain;
+        for(seL4_Word i = 1; i < batch; i++) {
+            last = *(void **)last;
+        }
+        cached->head = *(void **)last;
+        cached->count -= batch;
+        *(void **)last = NULL;
+    }
+    malloc_unlock(&cache->lock);
+
+    if(drain != NULL) {
+        central_release(size_class, drain, batch);
+    }
+}
+
+
+/**
+ * The pointer sits at offset bytes into the first chunk of its own run.
+ */
+static void *malloc_large(size_t size, size_t offset)
+{
+    if(size > SIZE_MAX - offset - MALLOC_CHUNK_SIZE) {
+        return NULL;
+    }
+
+    malloc_run_t *run = chunk_heap_alloc(DIV_ROUND_UP(size + offset, MALLOC_CHUNK_SIZE));
+    if(run == NULL) {
+        return NULL;
+    }
+    run->size_class = MALLOC_LARGE;
+    return (void *)((uintptr_t)run + offset);
+}
+
+
+void *mmap_malloc(size_t size)
+{
+    void *ptr;
+    if(size <= MALLOC_MAX_SMALL) {
+        ptr = malloc_small(malloc_size_class(size));
+    } else {
+        ptr = malloc_large(size, MALLOC_HEADER_SIZE);
+    }
+    if(ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+
+void mmap_free(void *ptr)
+{
+    if(ptr == NULL) {
+        return;
+    }
+
+    malloc_run_t *run = malloc_run_of(ptr);
+    if(run->size_class == MALLOC_LARGE) {
+        chunk_heap_free(run);
+    } else {
+        free_small(run->size_class, ptr);
+    }
+}
+
+
+size_t mmap_malloc_usable_size(void *ptr)
+{
+    if(ptr == NULL) {
+        return 0;
+    }
+
+    malloc_run_t *run = malloc_run_of(ptr);
+    if(run->size_class == MALLOC_LARGE) {
+        return (run->num_chunks << MALLOC_CHUNK_BITS) - ((uintptr_t)ptr - (uintptr_t)run);
+    }
+    return malloc_class_size(run->size_class);
+}
+
+
+void *mmap_calloc(size_t num, size_t size)
+{
+    if(size != 0 && num > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *ptr = mmap_malloc(num * size);
+    if(ptr != NULL) {
+        memset(ptr, 0, num * size);
+    }
+    return ptr;
+}
+
+
+void *mmap_realloc(void *ptr, size_t size)
+{
+    if(ptr == NULL) {
+        return mmap_malloc(size);
+    }
+
+    size_t usable = mmap_malloc_usable_size(ptr);
+    if(size <= usable && (size > MALLOC_MAX_SMALL || malloc_size_class(size) ==
+                                                     malloc_run_of(ptr)->size_class)) {
+        return ptr;
+    }
+
+    void *new = mmap_malloc(size);
+    if(new != NULL) {
+        memcpy(new, ptr, MIN(size, usable));
+        mmap_free(ptr);
+    }
+    return new;
+}
+
+
+/**
+ * Up to a cache line, the first class that is a multiple of the alignment
+ * keeps every object aligned. Anything bigger gets its own run.
+ */
+void *mmap_memalign(size_t align, size_t size)
+{
+    if(align == 0 || (align & (align - 1)) != 0 || align > MALLOC_CHUNK_SIZE / 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(align <= MALLOC_ALIGN) {
+        return mmap_malloc(size);
+    }
+
+    if(align <= MALLOC_HEADER_SIZE && size <= MALLOC_MAX_SMALL) {
+        seL4_Word size_class = malloc_size_class(MAX(size, align));
+        while(size_class < MALLOC_NUM_CLASSES && malloc_class_size(size_class) % align != 0) {
+            size_class++;
+        }
+        if(size_class < MALLOC_NUM_CLASSES) {
+            void *ptr = malloc_small(size_class);
+            if(ptr == NULL) {
+                errno = ENOMEM;
+            }
+            return ptr;
+        }
+    }
+
+    void *ptr = malloc_large(size, ROUND_UP(MALLOC_HEADER_SIZE, align));
+    if(ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+
+/**
+ * Linked with --wrap for each of these symbols, every malloc in the process,
+ * libc's own included, comes here.
+ */
+void *__wrap_malloc(size_t size)
+{
+    return mmap_malloc(size);
+}
+
+void __wrap_free(void *ptr)
+{
+    mmap_free(ptr);
+}
+
+void *__wrap_calloc(size_t num, size_t size)
+{
+    return mmap_calloc(num, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    return mmap_realloc(ptr, size);
+}
+
+void *__wrap_memalign(size_t align, size_t size)
+{
+    return mmap_memalign(align, size);
+}
+
+void *__wrap_aligned_alloc(size_t align, size_t size)
+{
+    return mmap_memalign(align, size);
+}
+
+int __wrap_posix_memalign(void **res, size_t align, size_t size)
+{
+    if(align < sizeof(void *)) {
+        return EINVAL;
+    }
+    void *ptr = mmap_memalign(align, size);
+    if(ptr == NULL) {
+        return errno;
+    }
+    *res = ptr;
+    return 0;
+}
+
+size_t __wrap_malloc_usable_size(void *ptr)
+{
+    return mmap_malloc_usable_size(ptr);
+}
+
+#else
+
+void *mmap_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+void mmap_free(void *ptr)
+{
+    free(ptr);
+}
+
+void *mmap_calloc(size_t num, size_t size)
+{
+    return calloc(num, size);
+}
+
+void *mmap_realloc(void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+void *mmap_memalign(size_t align, size_t size)
+{
+    return aligned_alloc(align, size);
+}
+
+size_t mmap_malloc_usable_size(UNUSED void *ptr)
+{
+    ZF_LOGE("mmap_malloc_usable_size needs CONFIG_LIB_MMAP_MALLOC");
+    return 0;
+}
+
+#endif /* CONFIG_LIB_MMAP_MALLOC */
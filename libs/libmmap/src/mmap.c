@@ -4,6 +4,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sel4/sel4.h>
 #include <vka/vka.h>
@@ -13,6 +14,7 @@
 
 #include <init/init.h>
 #include <mmap/mmap.h>
+#include <mmap/internal.h>
 
 
 const mmap_entry_attr_t mmap_attr_4k_code = {
@@ -47,42 +49,220 @@ const mmap_entry_attr_t mmap_attr_4k_device = {
     .cacheable       = 0,
 };
 
+const mmap_entry_attr_t mmap_attr_4k_write_combine = {
+    .page_size_bits  = PAGE_BITS_4K,
+    .readable        = 1,
+    .writable        = 1,
+    .executable      = 0,
+    .cacheable       = 0,
+    .mem_type        = MMAP_MEM_WRITE_COMBINE,
+};
+
+const mmap_entry_attr_t mmap_attr_4k_device_ordered = {
+    .page_size_bits  = PAGE_BITS_4K,
+    .readable        = 1,
+    .writable        = 1,
+    .executable      = 0,
+    .cacheable       = 0,
+    .mem_type        = MMAP_MEM_DEVICE,
+};
+
+const mmap_entry_attr_t mmap_attr_large_write_combine = {
+    .page_size_bits  = seL4_LargePageBits,
+    .readable        = 1,
+    .writable        = 1,
+    .executable      = 0,
+    .cacheable       = 0,
+    .mem_type        = MMAP_MEM_WRITE_COMBINE,
+};
+
+const mmap_entry_attr_t mmap_attr_large_data = {
+    .page_size_bits  = seL4_LargePageBits,
+    .readable        = 1,
+    .writable        = 1,
+    .executable      = 0,
+    .cacheable       = 1,
+};
+
+const mmap_entry_attr_t mmap_attr_large_readonly = {
+    .page_size_bits  = seL4_LargePageBits,
+    .readable        = 1,
+    .writable        = 0,
+    .executable      = 0,
+    .cacheable       = 1,
+};
+
+#ifdef CONFIG_ARCH_AARCH32
+const mmap_entry_attr_t mmap_attr_section_data = {
+    .page_size_bits  = seL4_SectionBits,
+    .readable        = 1,
+    .writable        = 1,
+    .executable      = 0,
+    .cacheable       = 1,
+};
+#endif
+
+const mmap_entry_attr_t mmap_attr_auto_data = {
+    .page_size_bits  = PAGE_BITS_4K,
+    .readable        = 1,
+    .writable        = 1,
+    .executable      = 0,
+    .cacheable       = 1,
+    .auto_page_size  = 1,
+};
 
-static int remap_fix_executable_perms(seL4_CPtr page,
-                                      seL4_CPtr vspace_root_cap,
-                                      const mmap_entry_attr_t *attr)
+
+/**
+ * Frame sizes tried by auto_page_size mappings, largest first
+ */
+static const seL4_Word libmmap_page_sizes[] = {
+#ifdef CONFIG_ARCH_AARCH32
+    seL4_SectionBits,
+#endif
+    seL4_LargePageBits,
+    seL4_PageBits,
+};
+
+
+seL4_Word libmmap_page_bits_at(uintptr_t addr, uintptr_t end)
 {
-    int error;
-#ifdef CONFIG_ARCH_ARM
-        if(!attr->executable) {
-            seL4_ARCH_VMAttributes vm_attrs = attr->cacheable ? seL4_ARCH_Default_VMAttributes :
-                                                        seL4_ARCH_Uncached_VMAttributes;
-            vm_attrs |= seL4_ARM_ExecuteNever;
+    for(int i = 0; i < ARRAY_SIZE(libmmap_page_sizes); i++) {
+        seL4_Word bits = libmmap_page_sizes[i];
+        if(IS_ALIGNED(addr, bits) && end - addr >= BIT(bits)) {
+            return bits;
+        }
+    }
+    return seL4_PageBits;
+}
 
-            seL4_CapRights_t rights = seL4_CapRights_new(false, attr->readable, attr->writable);
 
-            error = seL4_ARCH_Page_Remap(page,
-                                         vspace_root_cap,
-                                         rights,
-                                         vm_attrs);
-            if(error) {
-                ZF_LOGE("Failed to remap page");
-                return -1;
-            }
+seL4_Word libmmap_frame_bits_at(vspace_t *vspace, uintptr_t addr, seL4_CPtr cap)
+{
+    for(int i = 0; i < ARRAY_SIZE(libmmap_page_sizes) - 1; i++) {
+        seL4_Word bits = libmmap_page_sizes[i];
+        uintptr_t base = ROUND_DOWN(addr, BIT(bits));
+        if(vspace_get_cap(vspace, (void *)base) == cap &&
+           vspace_get_cap(vspace, (void *)(base + BIT(bits) - BIT(seL4_PageBits))) == cap) {
+            return bits;
         }
+    }
+    return seL4_PageBits;
+}
+
+
+seL4_ARCH_VMAttributes libmmap_vm_attrs(const mmap_entry_attr_t *attr)
+{
+    seL4_ARCH_VMAttributes vm_attrs;
+
+    switch(attr->mem_type) {
+#ifdef CONFIG_ARCH_X86
+    case MMAP_MEM_WRITE_COMBINE:
+        vm_attrs = seL4_X86_WriteCombining;
+        break;
+    case MMAP_MEM_WRITE_THROUGH:
+        vm_attrs = seL4_X86_WriteThrough;
+        break;
+    case MMAP_MEM_DEVICE:
+        vm_attrs = seL4_X86_Uncacheable;
+        break;
 #else
-        ZF_LOGW_IF(!attr->executable,
-                   "Unable to set the executable perms for non-ARM architectures");
+    /**
+     * The kernel only maps normal cached or device memory on ARM, these get
+     * cached mappings and the writer cleans with mmap_cache_op.
+     */
+    case MMAP_MEM_WRITE_COMBINE:
+    case MMAP_MEM_WRITE_THROUGH:
+        vm_attrs = seL4_ARCH_Default_VMAttributes;
+        break;
+    case MMAP_MEM_DEVICE:
+        vm_attrs = seL4_ARCH_Uncached_VMAttributes;
+        break;
 #endif
-    return 0;
+    default:
+        vm_attrs = attr->cacheable ? seL4_ARCH_Default_VMAttributes :
+                                     seL4_ARCH_Uncached_VMAttributes;
+        break;
+    }
+
+#ifdef CONFIG_ARCH_ARM
+    if(!attr->executable) {
+        vm_attrs |= seL4_ARM_ExecuteNever;
+    }
+#endif
+    return vm_attrs;
 }
 
 
-static inline void* addr_at_page(void* addr, seL4_Word page, seL4_Word bits) {
-    return (void*)((uintptr_t)addr + (page << bits));
+int libmmap_remap_fix_attrs(seL4_CPtr page,
+                            seL4_CPtr vspace_root_cap,
+                            const mmap_entry_attr_t *attr)
+{
+    if(!libmmap_remap_needed(attr)) {
+        return 0;
+    }
+
+    seL4_CapRights_t rights = seL4_CapRights_new(false, attr->readable, attr->writable);
+
+    int error = seL4_ARCH_Page_Remap(page,
+                                     vspace_root_cap,
+                                     rights,
+                                     libmmap_vm_attrs(attr));
+    if(error) {
+        ZF_LOGE("Failed to remap page");
+        return -1;
+    }
+    return 0;
 }
 
 
+int libmmap_commit_page(vspace_t *vspace,
+                        seL4_CPtr vspace_root_cap,
+                        const mmap_entry_attr_t *attr,
+                        void *vaddr,
+                        reservation_t res)
+{
+    int error;
+    vka_object_t frame_obj;
+
+    error = libmmap_alloc_frame(vspace,
+                                attr,
+                                attr->page_size_bits,
+                                &frame_obj);
+    if(error) {
+        ZF_LOGE("Failed to allocate frame object. Do you have enough untyped memory?");
+        return -4;
+    }
+
+    /**
+     * Map it into the page directory
+     */
+    error = vspace_map_pages_at_vaddr(vspace,
+                                      &frame_obj.cptr,
+                                      &frame_obj.ut,
+                                      vaddr,
+                                      1, /* map a page at a time */
+                                      attr->page_size_bits,
+                                      res);
+    if(error) {
+        ZF_LOGE("Failed to map a page at %lu",
+                (long unsigned)vaddr);
+        libmmap_free_frame(vspace, &frame_obj);
+        return -5;
+    }
+
+    error = libmmap_remap_fix_attrs(frame_obj.cptr,
+                                    vspace_root_cap,
+                                    attr);
+    if(error) {
+        ZF_LOGE("Failed to set the memory attributes for %lu",
+                (long unsigned)vaddr);
+        vspace_unmap_pages(vspace, vaddr, 1, attr->page_size_bits, VSPACE_PRESERVE);
+        libmmap_free_frame(vspace, &frame_obj);
+        return -6;
+    }
+
+    return 0;
+}
 
 
 int mmap_new_stack_custom(vspace_t *vspace,
@@ -119,7 +299,7 @@ int mmap_new_stack_custom(vspace_t *vspace,
     *res = vspace_reserve_range(vspace,
                                 (num_pages + 1) * BIT(attr->page_size_bits),
                                 rights,
-                                attr->cacheable,
+                                libmmap_reserve_cacheable(attr),
                                 vaddr);
     if(res->res == NULL || *vaddr == NULL) {
         ZF_LOGE("Failed to reserve space for the page mapping.");
@@ -130,48 +310,131 @@ int mmap_new_stack_custom(vspace_t *vspace,
      * Don't allocate the stack gaurd page, start at 1.
      */
     for(int i = 1; i <= num_pages; i++) {
-        vka_object_t frame_obj;
-        error = vka_alloc_frame(&init_objects.vka,
-                                attr->page_size_bits,
-                                &frame_obj);
+        error = libmmap_commit_page(vspace,
+                                    vspace_root_cap,
+                                    attr,
+                                    addr_at_page(*vaddr, i, attr->page_size_bits),
+                                    *res);
         if(error) {
-            ZF_LOGE("Failed to allocate frame object. Do you have enough untyped memory?");
-            return -4;
+            return error;
         }
+    }
+
+    /**
+     * We want to give the stack top back.
+     */
+    *vaddr = addr_at_page(*vaddr, num_pages + 1, attr->page_size_bits);
+    return 0;
+}
 
-        void *page_addr =  addr_at_page(*vaddr, i, attr->page_size_bits);
 
-        /**
-         * Map it into the page directory
-         */
-        error = vspace_map_pages_at_vaddr(vspace,
-                                          &frame_obj.cptr,
-                                          &frame_obj.ut,
-                                          page_addr,
-                                          1, /* map a page at a time */
-                                          attr->page_size_bits,
-                                          *res);
+/**
+ * @brief Reserve a heap of reserve_pages and back only its top commit_pages
+ *
+ * For a child whose libinit grows the heap into the rest of the range.
+ * vaddr gets the bottom of the range.
+ */
+int mmap_new_heap_custom(vspace_t *vspace,
+                         seL4_CPtr vspace_root_cap,
+                         seL4_Word reserve_pages,
+                         seL4_Word commit_pages,
+                         void **vaddr,
+                         reservation_t *res)
+{
+    int error;
+
+    if(!init_check_initialized()) {
+       ZF_LOGW("Init objects (vka, vspace) have not been setup.\n"
+               "Run init_process or init_root_task to setup.");
+       return -1;
+    }
+
+    if(vspace == NULL) {
+        ZF_LOGE("Null vspace pointer passed.");
+        return -2;
+    }
+
+    if(vaddr == NULL || res == NULL || commit_pages > reserve_pages) {
+        ZF_LOGE("Invalid argument passed.");
+        return -3;
+    }
+
+    const mmap_entry_attr_t *attr = &mmap_attr_4k_data;
+    seL4_CapRights_t rights = seL4_CapRights_new(false, attr->readable, attr->writable);
+
+    *res = vspace_reserve_range(vspace,
+                                reserve_pages * BIT(attr->page_size_bits),
+                                rights,
+                                libmmap_reserve_cacheable(attr),
+                                vaddr);
+    if(res->res == NULL || *vaddr == NULL) {
+        ZF_LOGE("Failed to reserve space for the heap.");
+        return -3;
+    }
+
+    for(seL4_Word i = reserve_pages - commit_pages; i < reserve_pages; i++) {
+        error = libmmap_commit_page(vspace,
+                                    vspace_root_cap,
+                                    attr,
+                                    addr_at_page(*vaddr, i, attr->page_size_bits),
+                                    *res);
         if(error) {
-            ZF_LOGE("Failed to map a page at %lu",
-                    (long unsigned)page_addr);
-            return -5;
+            /* Gives back the pages committed so far, uncommitted ones are skipped */
+            mmap_free_pages_custom(vspace, reserve_pages, attr, *vaddr, *res);
+            res->res = NULL;
+            *vaddr = NULL;
+            return error;
         }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reserve a range aligned for the biggest frame that fits in it, then cover
+ * it greedily with the largest frame that fits at each address.
+ */
+static int mmap_auto_pages_custom(vspace_t *vspace,
+                                  seL4_CPtr vspace_root_cap,
+                                  seL4_Word bytes,
+                                  const mmap_entry_attr_t *attr,
+                                  void **vaddr,
+                                  reservation_t *res)
+{
+    int error;
+    seL4_CapRights_t rights = seL4_CapRights_new(false, attr->readable, attr->writable);
+
+    seL4_Word align_bits = libmmap_page_bits_at(0, bytes);
+    *res = vspace_reserve_range_aligned(vspace,
+                                        bytes,
+                                        align_bits,
+                                        rights,
+                                        libmmap_reserve_cacheable(attr),
+                                        vaddr);
+    if(res->res == NULL || *vaddr == NULL) {
+        ZF_LOGE("Failed to reserve space for the page mapping.");
+        return -3;
+    }
 
+    uintptr_t start = (uintptr_t)*vaddr;
+    uintptr_t end = start + bytes;
+    uintptr_t addr = start;
+    while(addr < end) {
+        mmap_entry_attr_t page_attr = *attr;
+        page_attr.page_size_bits = libmmap_page_bits_at(addr, end);
 
-        error = remap_fix_executable_perms(frame_obj.cptr,
-                                           vspace_root_cap,
-                                           attr);
+        error = libmmap_commit_page(vspace, vspace_root_cap, &page_attr, (void *)addr, *res);
         if(error) {
-            ZF_LOGE("Failed to set the executable permissions for %lu",
-                    (long unsigned)page_addr);
-            return -6;
+            mmap_unmap_pages_custom(vspace, *vaddr, (addr - start) >> attr->page_size_bits,
+                                    attr, &init_objects.vka);
+            vspace_free_reservation(vspace, *res);
+            res->res = NULL;
+            return error;
         }
+        addr += BIT(page_attr.page_size_bits);
     }
 
-    /**
-     * We want to give the stack top back.
-     */
-    *vaddr = addr_at_page(*vaddr, num_pages + 1, attr->page_size_bits);
     return 0;
 }
 
@@ -210,89 +473,150 @@ static int mmap_device_pages_custom(vspace_t *vspace,
         return -3;
     }
 
+    /**
+     * Mixed frame sizes can't be described by a caps array, or backed by a
+     * contiguous device region, so those keep the fixed page size.
+     */
+    if(attr->auto_page_size && caps == NULL && paddr == NULL) {
+        return mmap_auto_pages_custom(vspace,
+                                      vspace_root_cap,
+                                      num_pages * BIT(attr->page_size_bits),
+                                      attr,
+                                      vaddr,
+                                      res);
+    }
+
     seL4_CapRights_t rights = seL4_CapRights_new(false, attr->readable, attr->writable);
 
     /**
-     * Make reservation for our pages
+     * Make reservation for our pages, aligned so large frames can be mapped
      */
-    *res = vspace_reserve_range(vspace,
-                                num_pages * BIT(attr->page_size_bits),
-                                rights,
-                                attr->cacheable,
-                                vaddr);
+    *res = vspace_reserve_range_aligned(vspace,
+                                        num_pages * BIT(attr->page_size_bits),
+                                        attr->page_size_bits,
+                                        rights,
+                                        libmmap_reserve_cacheable(attr),
+                                        vaddr);
     if(res->res == NULL || *vaddr == NULL) {
         ZF_LOGE("Failed to reserve space for the page mapping.");
         return -3;
     }
 
-    for(int i = 0; i < num_pages; i++) {
-        /**
-         * 
-         * Allocate a single frame, if null paddr is used, then we 
-         * fallback to using any physical frame.
-         * If "use_existing_frames" is set, then we just use the caps array.
-         */
-        vka_object_t frame_obj;
-        if(use_existing_caps) {
-            frame_obj.cptr = caps[i];
-        } else if(paddr != NULL) { 
-            seL4_Word current_paddr = (seL4_Word)paddr+(i << attr->page_size_bits);
-            error = vka_alloc_object_at_maybe_dev(&init_objects.vka,
-                                                  kobject_get_type(KOBJECT_FRAME,
-                                                                   attr->page_size_bits),
-                                                  attr->page_size_bits,
-                                                  current_paddr,
-                                                  true, /* can use device uts */
-                                                  &frame_obj);
-        } else {
-            error = vka_alloc_frame(&init_objects.vka,
-                                    attr->page_size_bits,
-                                    &frame_obj);
-        }
-        if(error) {
-            ZF_LOGE("Failed to allocate frame object. Do you have enough untyped memory?");
-            return -4;
+    /**
+     * Allocate every frame first so the whole range can be mapped with a
+     * single vspace call instead of one call (and one lock round trip) per page.
+     */
+    seL4_CPtr *frame_caps = caps;
+    uintptr_t *cookies = NULL;
+    int i = 0;
+
+    if(frame_caps == NULL) {
+        frame_caps = malloc(sizeof(seL4_CPtr) * num_pages);
+        if(frame_caps == NULL) {
+            ZF_LOGE("Failed to allocate the frame caps array");
+            error = -4;
+            goto free_reservation;
         }
-        
-        /**
-         * If the caller passed a caps array we need to give the cap for this frame
-         */
-        if(caps != NULL && !use_existing_caps) {
-            caps[i] = frame_obj.cptr;
+    }
+
+    if(!use_existing_caps) {
+        cookies = malloc(sizeof(uintptr_t) * num_pages);
+        if(cookies == NULL) {
+            ZF_LOGE("Failed to allocate the frame cookies array");
+            error = -4;
+            goto free_arrays;
         }
 
-        /**
-         * Map it into the page directory
-         */
-        error = vspace_map_pages_at_vaddr(vspace,
-                                          &frame_obj.cptr,
-                                          (use_existing_caps) ? NULL : &frame_obj.ut,
-                                          addr_at_page(*vaddr, i, attr->page_size_bits),
-                                          1, /* map a page at a time */
-                                          attr->page_size_bits,
-                                          *res);
-        if(error) { /* TODO add more sophisticated error checking */
-            ZF_LOGE("Failed to map a page at %lu",
-                    (long unsigned)addr_at_page(*vaddr, i, attr->page_size_bits));
-            return -5;
+        for(i = 0; i < num_pages; i++) {
+            /**
+             * If null paddr is used, then we fallback to using any physical frame.
+             */
+            vka_object_t frame_obj;
+            if(paddr != NULL) {
+                seL4_Word current_paddr = (seL4_Word)paddr+(i << attr->page_size_bits);
+                error = vka_alloc_object_at_maybe_dev(&init_objects.vka,
+                                                      kobject_get_type(KOBJECT_FRAME,
+                                                                       attr->page_size_bits),
+                                                      attr->page_size_bits,
+                                                      current_paddr,
+                                                      true, /* can use device uts */
+                                                      &frame_obj);
+            } else {
+                error = libmmap_alloc_frame(vspace,
+                                            attr,
+                                            attr->page_size_bits,
+                                            &frame_obj);
+            }
+            if(error) {
+                ZF_LOGE("Failed to allocate frame object. Do you have enough untyped memory?");
+                error = -4;
+                goto free_frames;
+            }
+            frame_caps[i] = frame_obj.cptr;
+            cookies[i] = frame_obj.ut;
         }
+    }
 
-        /**
-         * This is a temporary solution to the fact that sel4utils/vspace doesn't
-         * expose executable permissions.
-         */
-        error = remap_fix_executable_perms(frame_obj.cptr,
-                                           vspace_root_cap,
-                                           attr);
+    /**
+     * Map it into the page directory
+     */
+    error = vspace_map_pages_at_vaddr(vspace,
+                                      frame_caps,
+                                      cookies,
+                                      *vaddr,
+                                      num_pages,
+                                      attr->page_size_bits,
+                                      *res);
+    if(error) {
+        ZF_LOGE("Failed to map %lu pages at %lu",
+                (long unsigned)num_pages, (long unsigned)*vaddr);
+        error = -5;
+        goto unmap_pages;
+    }
+
+    /**
+     * This is a temporary solution to the fact that sel4utils/vspace doesn't
+     * expose executable permissions or memory types.
+     */
+    for(int j = 0; libmmap_remap_needed(attr) && j < num_pages; j++) {
+        error = libmmap_remap_fix_attrs(frame_caps[j],
+                                        vspace_root_cap,
+                                        attr);
         if(error) {
-            ZF_LOGE("Failed to set the executable permissions for %lu",
-                    (long unsigned)addr_at_page(*vaddr, i, attr->page_size_bits));
-            return -6;
+            ZF_LOGE("Failed to set the memory attributes for %lu",
+                    (long unsigned)addr_at_page(*vaddr, j, attr->page_size_bits));
+            error = -6;
+            goto unmap_pages;
         }
-
     }
 
+    free(cookies);
+    if(caps == NULL) {
+        free(frame_caps);
+    }
     return 0;
+
+unmap_pages:
+    vspace_unmap_pages(vspace, *vaddr, num_pages, attr->page_size_bits, VSPACE_PRESERVE);
+free_frames:
+    for(int j = 0; !use_existing_caps && j < i; j++) {
+        vka_object_t frame_obj = {
+            .cptr = frame_caps[j],
+            .ut = cookies[j],
+            .type = kobject_get_type(KOBJECT_FRAME, attr->page_size_bits),
+            .size_bits = attr->page_size_bits,
+        };
+        libmmap_free_frame(vspace, &frame_obj);
+    }
+free_arrays:
+    free(cookies);
+    if(caps == NULL) {
+        free(frame_caps);
+    }
+free_reservation:
+    vspace_free_reservation(vspace, *res);
+    res->res = NULL;
+    return error;
 }
 
 
@@ -380,4 +704,123 @@ int mmap_existing_pages_custom(vspace_t *vspace,
 }
 
 
+int mmap_unmap_pages_custom(vspace_t *vspace,
+                            void *vaddr,
+                            seL4_Word num_pages,
+                            const mmap_entry_attr_t *attr,
+                            vka_t *free)
+{
+    if(vspace == NULL || attr == NULL) {
+        ZF_LOGE("Null argument passed.");
+        return -2;
+    }
+
+    if(!attr->auto_page_size) {
+        vspace_unmap_pages(vspace, vaddr, num_pages, attr->page_size_bits, free);
+    } else {
+        /**
+         * Walk the range the same way mmap_auto_pages_custom mapped it
+         */
+        uintptr_t addr = (uintptr_t)vaddr;
+        uintptr_t end = addr + (num_pages << attr->page_size_bits);
+        while(addr < end) {
+            seL4_Word bits = libmmap_page_bits_at(addr, end);
+            vspace_unmap_pages(vspace, (void *)addr, 1, bits, free);
+            addr += BIT(bits);
+        }
+    }
+
+    libmmap_batch_unmapped(vspace, vaddr, num_pages, free != VSPACE_PRESERVE);
+    return 0;
+}
+
+
+/**
+ * Unmap one frame and either recycle it or give it back to the allocator.
+ * Pages that were never committed (lazy regions) are skipped.
+ */
+static void mmap_free_page(vspace_t *vspace,
+                           void *vaddr,
+                           seL4_Word page_size_bits,
+                           bool recycle)
+{
+    vka_object_t frame = {
+        .cptr = vspace_get_cap(vspace, vaddr),
+        .ut = vspace_get_cookie(vspace, vaddr),
+        .type = kobject_get_type(KOBJECT_FRAME, page_size_bits),
+        .size_bits = page_size_bits,
+    };
+    if(frame.cptr == seL4_CapNull) {
+        return;
+    }
+
+    if(frame.ut == 0 && libmmap_color_reclaim(vspace, vaddr)) {
+        return;
+    }
+
+    /**
+     * Frames without a cookie came from a batch or from the caller, they
+     * can't be handed out again on their own.
+     */
+    if(recycle && frame.ut != 0 && libmmap_frame_pool_has_room(page_size_bits)) {
+        memset(vaddr, 0, BIT(page_size_bits));
+        vspace_unmap_pages(vspace, vaddr, 1, page_size_bits, VSPACE_PRESERVE);
+        if(libmmap_frame_pool_push(&frame)) {
+            vka_free_object(&init_objects.vka, &frame);
+        }
+        return;
+    }
+
+    vspace_unmap_pages(vspace, vaddr, 1, page_size_bits, &init_objects.vka);
+}
+
+
+/**
+ * Release pages from mmap_new_pages_custom or mmap_new_pages_batched_custom
+ * together with their reservation. Frames can only be zeroed, and so
+ * recycled, when they are mapped writable and cached in our own vspace.
+ * Pages from mmap_existing_pages_custom belong to the caller, use
+ * mmap_unmap_pages_custom with VSPACE_PRESERVE for those instead.
+ */
+int mmap_free_pages_custom(vspace_t *vspace,
+                           seL4_Word num_pages,
+                           const mmap_entry_attr_t *attr,
+                           void *vaddr,
+                           reservation_t res)
+{
+    if(vspace == NULL || attr == NULL) {
+        ZF_LOGE("Null argument passed.");
+        return -2;
+    }
+
+    bool recycle = vspace == &init_objects.vspace && attr->writable && libmmap_attr_cached(attr);
+
+    uintptr_t addr = (uintptr_t)vaddr;
+    uintptr_t end = addr + (num_pages << attr->page_size_bits);
+    while(addr < end) {
+        seL4_Word bits = attr->auto_page_size ? libmmap_page_bits_at(addr, end) :
+                                                attr->page_size_bits;
+        mmap_free_page(vspace, (void *)addr, bits, recycle);
+        addr += BIT(bits);
+    }
+    libmmap_batch_unmapped(vspace, vaddr, num_pages, true);
+    libmmap_lazy_forget(vspace, (uintptr_t)vaddr, end);
 
+    if(res.res != NULL) {
+        vspace_free_reservation(vspace, res);
+    }
+    return 0;
+}
+
+
+int mmap_free_pages(seL4_Word num_pages,
+                    const mmap_entry_attr_t *attr,
+                    void *vaddr,
+                    reservation_t res)
+{
+    return mmap_free_pages_custom(&init_objects.vspace,
+                                  num_pages,
+                                  attr,
+                                  vaddr,
+                                  res);
+}
@@ -0,0 +1,163 @@
+/**
+ * @file pool.c
+ * @brief Recycled frame pool for libmmap
+ *
+ * mmap_free_pages zeroes cacheable frames it unmaps from our own vspace and
+ * keeps them here, with the cookie they were originally allocated with, so
+ * the next allocation of that size skips the allocator. A frame from the pool
+ * is indistinguishable from a fresh one, whoever ends up freeing it through
+ * the vka returns it to the right untyped.
+ *
+ * Every frame size has its own pool, each holding at most
+ * CONFIG_LIB_MMAP_FRAME_POOL_KB worth of frames.
+ */
+#include <autoconf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sel4/sel4.h>
+#include <vka/vka.h>
+#include <vka/kobject_t.h>
+#include <utils/util.h>
+
+#include <init/init.h>
+#include <mmap/mmap.h>
+#include <mmap/internal.h>
+
+
+#define POOL_BYTES ((seL4_Word)CONFIG_LIB_MMAP_FRAME_POOL_KB * 1024)
+
+typedef struct mmap_frame_pool {
+    seL4_Word page_size_bits;
+    seL4_Word count;
+    seL4_Word capacity;
+    vka_object_t *frames;
+} mmap_frame_pool_t;
+
+static vka_object_t pool_frames_page[(POOL_BYTES >> seL4_PageBits) + 1];
+static vka_object_t pool_frames_large[(POOL_BYTES >> seL4_LargePageBits) + 1];
+
+static mmap_frame_pool_t frame_pools[] = {
+    { seL4_PageBits, 0, POOL_BYTES >> seL4_PageBits, pool_frames_page },
+    { seL4_LargePageBits, 0, POOL_BYTES >> seL4_LargePageBits, pool_frames_large },
+};
+
+/**
+ * Taken from the lazy fault path too, so a spinlock like the lazy list.
+ */
+static volatile int frame_pool_lock = 0;
+
+static inline void pool_lock(void) {
+    while(__atomic_test_and_set(&frame_pool_lock, __ATOMIC_ACQUIRE)) {
+        seL4_Yield();
+    }
+}
+
+static inline void pool_unlock(void) {
+    __atomic_clear(&frame_pool_lock, __ATOMIC_RELEASE);
+}
+
+
+static mmap_frame_pool_t *pool_for_bits(seL4_Word page_size_bits)
+{
+    for(int i = 0; i < ARRAY_SIZE(frame_pools); i++) {
+        if(frame_pools[i].page_size_bits == page_size_bits) {
+            return &frame_pools[i];
+        }
+    }
+    return NULL;
+}
+
+
+int libmmap_alloc_frame(vspace_t *vspace,
+                        const mmap_entry_attr_t *attr,
+                        seL4_Word page_size_bits,
+                        vka_object_t *frame)
+{
+    if(libmmap_color_wanted(vspace, page_size_bits)) {
+        return libmmap_color_alloc_frame(vspace, frame);
+    }
+
+    /**
+     * Pooled frames were zeroed through a cached mapping, dirty lines could
+     * still be written back under an uncached mapping.
+     */
+    mmap_frame_pool_t *pool = libmmap_attr_cached(attr) ? pool_for_bits(page_size_bits) : NULL;
+    if(pool != NULL) {
+        pool_lock();
+        if(pool->count > 0) {
+            *frame = pool->frames[--pool->count];
+            pool_unlock();
+            return 0;
+        }
+        pool_unlock();
+    }
+
+    return vka_alloc_frame(&init_objects.vka, page_size_bits, frame);
+}
+
+
+void libmmap_free_frame(vspace_t *vspace, vka_object_t *frame)
+{
+    if(frame->ut == 0 && libmmap_color_free_frame(vspace, frame->cptr)) {
+        return;
+    }
+    vka_free_object(&init_objects.vka, frame);
+}
+
+
+bool libmmap_frame_pool_has_room(seL4_Word page_size_bits)
+{
+    mmap_frame_pool_t *pool = pool_for_bits(page_size_bits);
+    return pool != NULL && pool->count < pool->capacity;
+}
+
+
+int libmmap_frame_pool_push(const vka_object_t *frame)
+{
+    mmap_frame_pool_t *pool = pool_for_bits(frame->size_bits);
+    if(pool == NULL) {
+        return -1;
+    }
+
+    pool_lock();
+    if(pool->count >= pool->capacity) {
+        pool_unlock();
+        return -1;
+    }
+    pool->frames[pool->count++] = *frame;
+    pool_unlock();
+
+    return 0;
+}
+
+
+/**
+ * @brief Give every pooled frame back to the allocator
+ *
+ * @return  number of frames freed
+ */
+seL4_Word mmap_frame_pool_drain(void)
+{
+    seL4_Word freed = 0;
+
+    for(int i = 0; i < ARRAY_SIZE(frame_pools); i++) {
+        mmap_frame_pool_t *pool = &frame_pools[i];
+        while(true) {
+            vka_object_t frame;
+            pool_lock();
+            if(pool->count == 0) {
+                pool_unlock();
+                break;
+            }
+            frame = pool->frames[--pool->count];
+            pool_unlock();
+
+            vka_free_object(&init_objects.vka, &frame);
+            freed++;
+        }
+    }
+
+    return freed;
+}
@@ -10,6 +10,9 @@
 
 #include "types.h"
 
+/* First block of a process's init data arena, enough for a few dozen connections */
+#define LIBPROCESS_INIT_DATA_ARENA_BYTES 4096
+
 /* Definition of generic linked list operations */
 #define LINKED_LIST_PREPEND(object, head) do { \
     object->next = head; \
@@ -44,5 +47,20 @@ int libprocess_delete_cap_last_slot(process_handle_t *handle);
 void libprocess_next_free_path(cspacepath_t *dst, process_handle_t *handle);
 
 
+/* Every created process that isn't destroyed yet, guarded by the libprocess lock */
+extern process_handle_t *libprocess_process_list;
+
+void libprocess_list_remove(process_handle_t *handle);
+void libprocess_paint_stack(process_handle_t *handle);
+
+
 void libprocess_free_objects(process_object_t *list);
 void libprocess_revoke_objects(process_object_t *list);
+
+#ifdef CONFIG_LIB_PROCESS_SLABS
+/**
+ * Slab used for connection objects of this type, or NULL if there is none.
+ * Assumes the libprocess lock is held.
+ */
+process_slab_t *libprocess_conn_slab(seL4_Word type, seL4_Word size_bits);
+#endif
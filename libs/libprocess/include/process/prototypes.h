@@ -62,6 +62,20 @@ int process_create(const char *elf_file_name,
 int process_run(process_handle_t *handle, int argc, char *argv[]);
 
 
+/**
+ * @brief Set the connection IDs generated by libinit's tools/gen_conn_ids.py
+ *
+ * From then on process_run fills in the cap or address of every connection
+ * a child has by its ID. The child can then find it with a single array load
+ * instead of a string lookup. The table isn't copied and has to stay around.
+ *
+ * @param ids       CONN_ID_TABLE from the generated header
+ * @param count     CONN_COUNT from the generated header
+ * @return          Error code
+ */
+int process_set_conn_ids(const init_conn_id_t *ids, seL4_Word count);
+
+
 /**
  * @brief destory a process and cleanup its resources.
  *
@@ -71,6 +85,26 @@ int process_run(process_handle_t *handle, int argc, char *argv[]);
 int process_destroy(process_handle_t *handle);
 
 
+/**
+ * @brief Get the peak stack and heap usage of a child process.
+ *
+ * The main stack is painted at creation when CONFIG_LIB_THREAD_STACK_WATERMARK
+ * is set. The heap is painted by the child when CONFIG_LIB_INIT_HEAP_WATERMARK
+ * is set, and only a fixed size heap can be read from here. A growable heap is
+ * committed by the child, call init_get_heap_high_water there instead.
+ *
+ * @param       handle  Target process
+ * @param[out]  usage   Peaks, fields without a measurement are marked unknown
+ * @return              Error code
+ */
+int process_get_memory_usage(process_handle_t *handle, process_memory_usage_t *usage);
+
+/**
+ * @brief Print the peak stack and heap usage of every live child process.
+ */
+void process_print_memory_usage(void);
+
+
 /****** Interprocess Connections/Communication ******/
 
 
@@ -121,6 +155,83 @@ int process_connect(process_handle_t *handle,
                     process_conn_ret_t *ret);
 
 
+/****** Kernel Object Slabs ******/
+
+
+/**
+ * @brief Setup an empty slab for one kernel object type and size.
+ *
+ * No memory is retyped until the first allocation or reservation.
+ *
+ * @param[out]  slab        The slab to initialize
+ * @param       type        seL4 object type, e.g. seL4_EndpointObject
+ * @param       size_bits   Object size in bits, e.g. seL4_EndpointBits
+ * @return                  Error code
+ */
+int process_slab_init(process_slab_t *slab, seL4_Word type, seL4_Word size_bits);
+
+
+/**
+ * @brief Make sure at least count objects can be allocated without a retype.
+ *
+ * Use before a real time phase so that process_slab_alloc never has to
+ * touch untyped memory. All missing objects are retyped in one go.
+ *
+ * @param   slab    Target slab
+ * @param   count   Number of free objects wanted
+ * @return          Error code
+ */
+int process_slab_reserve(process_slab_t *slab, seL4_Word count);
+
+
+/**
+ * @brief Take an object from a slab, refilling it if empty.
+ *
+ * @param       slab    Source slab
+ * @param[out]  obj     The object, free it with process_slab_free, not vka_free_object.
+ *                      obj->ut is the cookie of the untyped of its whole block.
+ * @return              Error code
+ */
+int process_slab_alloc(process_slab_t *slab, vka_object_t *obj);
+
+
+/**
+ * @brief Give an object back to its slab.
+ *
+ * Caps derived from the object are revoked. Frames are zeroed so the next
+ * user does not see old contents.
+ *
+ * @param   slab    The slab the object came from
+ * @param   obj     The object to return
+ * @return          Error code
+ */
+int process_slab_free(process_slab_t *slab, vka_object_t *obj);
+
+
+/**
+ * @brief Return all of a slab's memory to the vka.
+ *
+ * @warning Every object must have been freed back to the slab.
+ *
+ * @param   slab    Target slab
+ * @return          Error code
+ */
+int process_slab_destroy(process_slab_t *slab);
+
+
+#ifdef CONFIG_LIB_PROCESS_SLABS
+/**
+ * @brief Return the memory of the connection object slabs to the vka.
+ *
+ * Call on teardown, once every connection object has been freed. The slabs
+ * are set up again by the next connection object.
+ *
+ * @return  Error code, nothing is freed if objects are still in use
+ */
+int process_destroy_conn_slabs(void);
+#endif
+
+
 /****** Untyped Memory Configuration ******/
 
 
@@ -164,23 +164,80 @@ typedef struct process_object {
 } process_object_t;
 
 
+/**
+ * One untyped retyped into many objects of the same type by a slab.
+ */
+typedef struct process_slab_block {
+    struct process_slab_block *next;
+    vka_object_t untyped;
+    seL4_Word num_objects;
+    seL4_CPtr *slots;
+} process_slab_block_t;
+
+
+/**
+ * A free slab object and the block it was retyped from
+ */
+typedef struct process_slab_entry {
+    seL4_CPtr cptr;
+    process_slab_block_t *block;
+} process_slab_entry_t;
+
+
+/**
+ * @brief A pool of pre-retyped kernel objects of a single type and size.
+ *
+ * Free objects are kept on a stack of caps. Objects keep their slot for
+ * the life of the slab and only go back to untyped memory on destroy.
+ */
+typedef struct process_slab {
+    seL4_Word type;
+    seL4_Word size_bits;
+
+    seL4_Word num_total;
+    seL4_Word num_free;
+    seL4_Word free_capacity;
+    process_slab_entry_t *free_objects;
+
+    process_slab_block_t *blocks;
+} process_slab_t;
+
+
 /**
  * A set of attributes used to create a process
  */
 typedef struct process_attr {
     seL4_Word heap_size_pages;
+
+    /**
+     * Address space reserved for the heap. When bigger than heap_size_pages
+     * only heap_size_pages are mapped up front and the child's libinit grows
+     * into the rest from its own untypeds. Needs CONFIG_LIB_INIT_GROWABLE_HEAP
+     * in the child.
+     */
+    seL4_Word heap_reserve_pages;
     seL4_Word stack_size_pages;
 
     seL4_Word priority;
     seL4_Word max_priority;
     int cpu_affinity;
 
+    /* Scheduling context of the main thread, budget_us == 0 means none */
+    seL4_Word budget_us;
+    seL4_Word period_us;
+
     seL4_Word cnode_size_bits;
 
     bool create_fault_ep;
     seL4_CPtr existing_fault_ep;
 
     bool give_asid_pool;
+
+    /**
+     * Mask of cache colors for the frames libmmap maps into the child
+     * (heap, stack, init data), 0 for any frame. Needs CONFIG_LIB_MMAP_CACHE_COLORS.
+     */
+    seL4_Word cache_colors;
 } process_attr_t;
 
 
@@ -198,6 +255,11 @@ typedef struct process_handle {
      */
     InitData init_data;
 
+    /**
+     * Backs every node of init_data, freed in one go once it's packed.
+     */
+    init_arena_t init_data_arena;
+
     /**
      * We load the elf at creation time, so we need to track this information for process_run
      */
@@ -256,4 +318,19 @@ typedef struct process_handle {
      */
     process_shared_objects_ref_t *shared_objects;
 
+    struct process_handle *next; /* list of live processes, see process_print_memory_usage */
+
 } process_handle_t;
+
+
+/**
+ * @brief Peak memory use of a child process, see process_get_memory_usage.
+ */
+typedef struct process_memory_usage {
+    seL4_Word stack_size;
+    seL4_Word stack_used;
+    bool stack_known;   /* The parent painted the main stack */
+    seL4_Word heap_size;
+    seL4_Word heap_used;
+    bool heap_known;    /* The child painted a fixed size heap */
+} process_memory_usage_t;
@@ -57,14 +57,17 @@ static int copy_irq_to_proc(process_handle_t *handle,
 {
     libprocess_prologue();
 
-    IrqData *irq_data = malloc(sizeof(IrqData));
+    IrqData *irq_data = init_arena_alloc(&handle->init_data_arena, sizeof(IrqData));
     libprocess_guard(irq_data == NULL, -1, libprocess_epilogue,
-                     "Failed to malloc Irq Data");
+                     "Failed to allocate Irq Data");
 
     irq_data__init(irq_data);
-    irq_data->name = strndup(conn_name, CONFIG_LIBPROCESS_MAX_STR_LEN);
+    irq_data->name = init_arena_strndup(&handle->init_data_arena, conn_name,
+                                        CONFIG_LIBPROCESS_MAX_STR_LEN);
+    libprocess_guard(irq_data->name == NULL, -1, libprocess_epilogue,
+                     "Failed to allocate Irq name");
     irq_data->irq_cap = libprocess_copy_cap_next_slot(handle, irq_cap, seL4_AllRights);
-    libprocess_guard(irq_data->irq_cap == seL4_CapNull, -2, free_data, "Failed to copy IRQ cap");
+    libprocess_guard(irq_data->irq_cap == seL4_CapNull, -2, libprocess_epilogue, "Failed to copy IRQ cap");
     irq_data->ep_cap = libprocess_copy_cap_next_slot(handle, ep_cap, seL4_AllRights);
     libprocess_guard(irq_data->ep_cap == seL4_CapNull, -2, uncopy_irq_cap, "Failed to copy EP cap");
     irq_data->number = irq_number;
@@ -73,8 +76,6 @@ static int copy_irq_to_proc(process_handle_t *handle,
     libprocess_return_success();
     uncopy_irq_cap:
         libprocess_delete_cap_last_slot(handle);
-    free_data:
-        free(irq_data);
     libprocess_epilogue();
 }
 
@@ -92,12 +93,16 @@ static int copy_devmem_to_proc(process_handle_t *handle,
     libprocess_prologue();
     int current_cap = 0;
 
-    DeviceMemoryData *devmem_data = malloc(sizeof(DeviceMemoryData));
+    DeviceMemoryData *devmem_data = init_arena_alloc(&handle->init_data_arena,
+                                                     sizeof(DeviceMemoryData));
     libprocess_guard(devmem_data == NULL, -1, libprocess_epilogue, 
-                     "Failed to malloc device memory data");
+                     "Failed to allocate device memory data");
 
     device_memory_data__init(devmem_data);
-    devmem_data->name = strndup(device_name, CONFIG_LIBPROCESS_MAX_STR_LEN);
+    devmem_data->name = init_arena_strndup(&handle->init_data_arena, device_name,
+                                           CONFIG_LIBPROCESS_MAX_STR_LEN);
+    libprocess_guard(devmem_data->name == NULL, -1, libprocess_epilogue,
+                     "Failed to allocate device memory name");
     devmem_data->virt_addr = (seL4_Word)vaddr;
     devmem_data->phys_addr = (seL4_Word)paddr; 
     devmem_data->size_bits = page_bits;
@@ -105,9 +110,9 @@ static int copy_devmem_to_proc(process_handle_t *handle,
 
     seL4_CPtr *new_caps = NULL;
     if(caps != NULL) {
-        new_caps = malloc(sizeof(seL4_CPtr)*num_pages);
-        libprocess_guard(new_caps == NULL, -9, free_data, 
-                         "Failed to malloc new space for device caps");
+        new_caps = init_arena_alloc(&handle->init_data_arena, sizeof(seL4_CPtr)*num_pages);
+        libprocess_guard(new_caps == NULL, -9, libprocess_epilogue, 
+                         "Failed to allocate new space for device caps");
 
         for(current_cap = 0; current_cap < num_pages; current_cap++) {
             new_caps[current_cap] = libprocess_copy_cap_next_slot(handle, caps[current_cap], seL4_AllRights); 
@@ -133,9 +138,6 @@ static int copy_devmem_to_proc(process_handle_t *handle,
     uncopy_caps:
         --current_cap; // current_cap failed and does not need uncopying
         for(; current_cap >= 0; --current_cap) { libprocess_delete_cap_last_slot(handle); }
-        free(new_caps);
-    free_data:
-        free(devmem_data);
     libprocess_epilogue();
 }
 
@@ -478,7 +480,7 @@ int process_give_untyped_resources(process_handle_t *handle,
         libprocess_set_status(vka_alloc_untyped(&init_objects.vka, size_bits, &ut->obj));
         libprocess_guard(libprocess_get_status(), -6, failed_vka, "Failed to allocate ut object");
     
-        ut_data = malloc(sizeof(UntypedData));
+        ut_data = init_arena_alloc(&handle->init_data_arena, sizeof(UntypedData));
         libprocess_check_malloc(ut_data, failed_data_malloc);
     
         untyped_data__init(ut_data);
@@ -499,7 +501,6 @@ int process_give_untyped_resources(process_handle_t *handle,
         LINKED_LIST_POP(ut_data, handle->init_data.untyped_list_head);
         libprocess_delete_cap_last_slot(handle);
     failed_cap_copy:
-        free(ut_data);
     failed_data_malloc:
         vka_free_object(&init_objects.vka, &ut->obj);
     failed_vka:
@@ -12,6 +12,7 @@
 
 #include <sel4/sel4.h>
 #include <vka/capops.h>
+#include <vka/kobject_t.h>
 #include <utils/util.h>
 #include <vspace/vspace.h>
 #include <sel4utils/vspace.h>
@@ -26,13 +27,41 @@
 #include <process/internal.h>
 
 
+/**
+ * Connection objects come from the libprocess slabs when one exists for
+ * their type, and straight from the vka otherwise.
+ */
+static int conn_alloc_object(seL4_Word type, seL4_Word size_bits, vka_object_t *obj)
+{
+#ifdef CONFIG_LIB_PROCESS_SLABS
+    process_slab_t *slab = libprocess_conn_slab(type, size_bits);
+    if(slab != NULL) {
+        return process_slab_alloc(slab, obj);
+    }
+#endif
+    return vka_alloc_object(&init_objects.vka, type, size_bits, obj);
+}
+
+static void conn_free_object(vka_object_t *obj)
+{
+#ifdef CONFIG_LIB_PROCESS_SLABS
+    process_slab_t *slab = libprocess_conn_slab(obj->type, obj->size_bits);
+    if(slab != NULL) {
+        process_slab_free(slab, obj);
+        return;
+    }
+#endif
+    vka_free_object(&init_objects.vka, obj);
+}
+
+
 static int init_ep_obj(process_ep_conn_t *conn)
 {
     libprocess_prologue();
 
     libprocess_check_arg(conn);
 
-    libprocess_set_status(vka_alloc_endpoint(&init_objects.vka, &conn->vka_obj));
+    libprocess_set_status(conn_alloc_object(seL4_EndpointObject, seL4_EndpointBits, &conn->vka_obj));
     libprocess_guard(libprocess_get_status(), -1, libprocess_epilogue, "Failed to alloc ep");
 
     libprocess_return_success();
@@ -44,7 +73,7 @@ static int init_notif_obj(process_ep_conn_t *conn)
     libprocess_prologue();
     libprocess_check_arg(conn);
 
-    libprocess_set_status(vka_alloc_notification(&init_objects.vka, &conn->vka_obj));
+    libprocess_set_status(conn_alloc_object(seL4_NotificationObject, seL4_NotificationBits, &conn->vka_obj));
     libprocess_guard(libprocess_get_status(), -1, libprocess_epilogue, "Failed to alloc notif");
 
     libprocess_return_success();
@@ -70,10 +99,22 @@ static int init_shmem_obj(process_shmem_conn_t *conn,
     conn->vka_obj_list = malloc(sizeof(vka_object_t)*conn->num_pages);
     libprocess_check_malloc(conn->vka_obj_list, libprocess_epilogue);
 
+    seL4_Word frame_type = kobject_get_type(KOBJECT_FRAME, conn->page_bits);
+
+#ifdef CONFIG_LIB_PROCESS_SLABS
+    /* Retype the whole buffer at once rather than page by page */
+    process_slab_t *slab = libprocess_conn_slab(frame_type, conn->page_bits);
+    if(slab != NULL) {
+        libprocess_set_status(process_slab_reserve(slab, conn->num_pages));
+        libprocess_guard(libprocess_get_status(), -1, failed_reserve,
+                         "Failed to reserve shared memory frames");
+    }
+#endif
+
     for(i = 0; i < conn->num_pages; i++) {
-        libprocess_set_status(vka_alloc_frame(&init_objects.vka,
-                                              conn->page_bits,
-                                              &conn->vka_obj_list[i]));
+        libprocess_set_status(conn_alloc_object(frame_type,
+                                                conn->page_bits,
+                                                &conn->vka_obj_list[i]));
 
         libprocess_guard(libprocess_get_status(), -1, failed_alloc_frame,
                          "Failed to allocate a page of memory from vka");
@@ -83,8 +124,11 @@ static int init_shmem_obj(process_shmem_conn_t *conn,
 
 failed_alloc_frame:
     for(i = i-1; i >= 0; i--) {
-        vka_free_object(&init_objects.vka, &conn->vka_obj_list[i]);
+        conn_free_object(&conn->vka_obj_list[i]);
     }
+#ifdef CONFIG_LIB_PROCESS_SLABS
+failed_reserve:
+#endif
     free(conn->vka_obj_list);
 
     libprocess_epilogue();
@@ -163,7 +207,7 @@ static int cleanup_ep_obj(process_ep_conn_t *conn)
     libprocess_prologue();
     libprocess_check_arg(conn);
 
-    vka_free_object(&init_objects.vka, &conn->vka_obj);
+    conn_free_object(&conn->vka_obj);
 
     libprocess_return_success();
     libprocess_epilogue();
@@ -184,7 +228,7 @@ static int cleanup_shmem_obj(process_shmem_conn_t *conn)
     }
 
     for(int i = 0; i < conn->num_pages; i++) {
-        vka_free_object(&init_objects.vka, &conn->vka_obj_list[i]);
+        conn_free_object(&conn->vka_obj_list[i]);
     }
 
     free(conn->vka_obj_list);
@@ -243,9 +287,9 @@ static inline int copy_cptr_to_proc(process_handle_t *handle,
 {
     libprocess_prologue();
 
-    EndpointData *ep_data = malloc(sizeof(EndpointData));
+    EndpointData *ep_data = init_arena_alloc(&handle->init_data_arena, sizeof(EndpointData));
     libprocess_guard(ep_data == NULL, -1, libprocess_epilogue,
-                     "Failed to malloc Endpoint Data");
+                     "Failed to allocate Endpoint Data");
 
     endpoint_data__init(ep_data);
     ep_data->name = (char *)conn_name; /* protobuf uses non const strings */
@@ -255,13 +299,11 @@ static inline int copy_cptr_to_proc(process_handle_t *handle,
     } else {
         ep_data->cap = libprocess_mint_cap_next_slot(handle, ep_cap, perms, attr->badge);
     }
-    libprocess_guard(ep_data->cap == seL4_CapNull, -2, free_endpoint,
+    libprocess_guard(ep_data->cap == seL4_CapNull, -2, libprocess_epilogue,
                      "Failed to copy ep cap");
 
     LINKED_LIST_PREPEND(ep_data, *current_list_head);
     libprocess_return_success();
-    free_endpoint:
-        free(ep_data);
     libprocess_epilogue();
 }
 
@@ -368,7 +410,8 @@ static int copy_shmem_to_proc(process_handle_t *handle,
 
     process_shmem_conn_t *conn = &obj->obj.shmem;
 
-    SharedMemoryData *shmem_data = malloc(sizeof(SharedMemoryData));
+    SharedMemoryData *shmem_data = init_arena_alloc(&handle->init_data_arena,
+                                                    sizeof(SharedMemoryData));
     libprocess_check_malloc(shmem_data, libprocess_epilogue);
 
     void *vaddr;
@@ -379,7 +422,7 @@ static int copy_shmem_to_proc(process_handle_t *handle,
                                              handle->page_dir.cptr,
                                              &res,
                                              &vaddr));
-    libprocess_guard(libprocess_get_status(), -1, failed,
+    libprocess_guard(libprocess_get_status(), -1, libprocess_epilogue,
                      "Failed to copy shmem");
 
     shared_memory_data__init(shmem_data);
@@ -389,10 +432,6 @@ static int copy_shmem_to_proc(process_handle_t *handle,
 
     LINKED_LIST_PREPEND(shmem_data, handle->init_data.shmem_list_head);
     libprocess_return_success();
-
-failed:
-    free(shmem_data);
-
     libprocess_epilogue();
 }
 
@@ -131,6 +131,14 @@ int process_create(const char *elf_file_name,
     lockvspace_unlock(&init_objects.vspace, &init_objects.lockvspace);
     libprocess_guard(error, -7, get_vspace_fail, "Failed to create child process vspace object");
 
+    /**
+     * Frames libmmap maps into the child come from its cache colors
+     */
+    if(handle->attrs.cache_colors != 0) {
+        error = mmap_color_set_vspace(&handle->vspace, handle->attrs.cache_colors);
+        libprocess_guard(error, -7, elf_load_fail, "Failed to assign cache colors");
+    }
+
     /**
      * Load the elf file into the new address space
      */ 
@@ -156,15 +164,25 @@ int process_create(const char *elf_file_name,
 
     /**
      * Allocate a heap and map it into the process's page directory.
+     * A growable heap only gets its top heap_size_pages mapped.
      */
     reservation_t heap_res;
-    error = mmap_new_pages_custom(&handle->vspace,
-                                  handle->page_dir.cptr,
-                                  handle->attrs.heap_size_pages,
-                                  &mmap_attr_4k_data,
-                                  NULL,
-                                  &handle->heap_vaddr,
-                                  &heap_res);
+    if(handle->attrs.heap_reserve_pages > handle->attrs.heap_size_pages) {
+        error = mmap_new_heap_custom(&handle->vspace,
+                                     handle->page_dir.cptr,
+                                     handle->attrs.heap_reserve_pages,
+                                     handle->attrs.heap_size_pages,
+                                     &handle->heap_vaddr,
+                                     &heap_res);
+    } else {
+        error = mmap_new_pages_custom(&handle->vspace,
+                                      handle->page_dir.cptr,
+                                      handle->attrs.heap_size_pages,
+                                      &mmap_attr_4k_data,
+                                      NULL,
+                                      &handle->heap_vaddr,
+                                      &heap_res);
+    }
     libprocess_guard(error, -10, map_heap_fail, "Failed to map in the heap.");
 
     handle->cnode_root_data = api_make_guard_skip_word(seL4_WordBits - handle->attrs.cnode_size_bits);
@@ -177,6 +195,8 @@ int process_create(const char *elf_file_name,
         .priority = handle->attrs.priority,
         .max_priority = handle->attrs.max_priority,
         .cpu_affinity = handle->attrs.cpu_affinity,
+        .budget_us = handle->attrs.budget_us,
+        .period_us = handle->attrs.period_us,
     };
     handle->main_thread = thread_handle_create_custom(handle->cnode.cptr,
                                                       handle->cnode_root_data,
@@ -257,6 +277,7 @@ int process_create(const char *elf_file_name,
 
     handle->cnode_next_free = INIT_CHILD_FIRST_FREE_SLOT;
     init_data__init(&handle->init_data);
+    init_arena_init(&handle->init_data_arena, LIBPROCESS_INIT_DATA_ARENA_BYTES);
 
 #ifdef CONFIG_DEBUG_BUILD
     seL4_DebugNameThread(handle->main_thread->tcb.cptr, handle->name);
@@ -265,7 +286,11 @@ int process_create(const char *elf_file_name,
     handle->init_data.cnode_size_bits = handle->attrs.cnode_size_bits;
     handle->init_data.stack_size_pages = handle->attrs.stack_size_pages; 
     handle->init_data.stack_vaddr = (seL4_Word)handle->main_thread->stack_vaddr;
+    handle->init_data.has_cpu_affinity = true;
+    handle->init_data.cpu_affinity = handle->main_thread->cpu_affinity;
 
+    libprocess_paint_stack(handle);
+    LINKED_LIST_PREPEND(handle, libprocess_process_list);
 
     libprocess_return_success();
 
@@ -277,6 +302,7 @@ int process_create(const char *elf_file_name,
     elf_phdrs_fail:
     elf_load_fail:
         vspace_tear_down(&handle->vspace, VSPACE_FREE);
+        mmap_color_release_vspace(&handle->vspace);
         libprocess_free_objects(handle->vspace_allocation_list);
     get_vspace_fail:
         vka_free_object(&init_objects.vka, &handle->thread_lock_notification);
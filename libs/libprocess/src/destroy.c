@@ -36,6 +36,7 @@ int process_destroy(process_handle_t *handle)
     libprocess_guard(handle->state == PROCESS_DESTROYED, -6, libprocess_epilogue,
                      "Process has already been destroyed");
     handle->state = PROCESS_DESTROYED;
+    libprocess_list_remove(handle);
 
     error = thread_destroy_free_handle_custom(&handle->main_thread, &handle->vspace);
     ZF_LOGE_IF(error, "Failed to destroy thread");
@@ -53,6 +54,7 @@ int process_destroy(process_handle_t *handle)
      * Free the heap, code, data
      */
     vspace_tear_down(&handle->vspace, VSPACE_FREE);
+    mmap_color_release_vspace(&handle->vspace);
     
     /**
      * Free page tables allocated by vspace
@@ -71,6 +73,11 @@ int process_destroy(process_handle_t *handle)
     vka_free_object(&init_objects.vka, &handle->process_lock_notification);
     vka_free_object(&init_objects.vka, &handle->thread_lock_notification);
 
+    /**
+     * Init data of a process that never ran
+     */
+    init_arena_destroy(&handle->init_data_arena);
+
     if(handle->attrs.create_fault_ep && handle->fault_ep.cptr != seL4_CapNull) {
         vka_free_object(&init_objects.vka, &handle->fault_ep);
     }
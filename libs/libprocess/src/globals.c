@@ -10,14 +10,18 @@
 
 const process_attr_t process_default_attrs = {
     .heap_size_pages    = CONFIG_LIB_PROCESS_DEFAULT_HEAP_SIZE_PAGES,
+    .heap_reserve_pages = CONFIG_LIB_PROCESS_DEFAULT_HEAP_RESERVE_PAGES,
     .stack_size_pages   = CONFIG_LIB_PROCESS_DEFAULT_STACK_SIZE_PAGES,
     .priority           = CONFIG_LIB_PROCESS_DEFAULT_PRIORITY,
     .max_priority       = CONFIG_LIB_PROCESS_DEFAULT_MAX_PRIORITY,
     .cpu_affinity       = CONFIG_LIB_PROCESS_DEFAULT_CPU_AFFINITY,
+    .budget_us          = 0,
+    .period_us          = 0,
     .cnode_size_bits    = CONFIG_LIB_PROCESS_DEFAULT_CNODE_SIZE_BITS,
     .give_asid_pool     = CONFIG_LIB_PROCESS_DEFAULT_GIVE_ASID_POOL,
     .create_fault_ep    = CONFIG_LIB_PROCESS_DEFAULT_CREATE_FAULT_EP,
     .existing_fault_ep  = seL4_CapNull,
+    .cache_colors       = 0,
 };
 
 const process_conn_perms_t process_rw = {.r=1, .w=1, .x=0, .g=0};
@@ -24,44 +24,98 @@
 #include <process/process.h>
 #include <process/sync.h>
 
-#define FREE_INIT_LIST(TYPE, LIST) do { \
-    TYPE *lst = LIST; \
-    while(lst != NULL) { \
-        TYPE *tmp = lst; \
-        lst = lst->next; \
-        free(tmp); \
-    } \
-} while(0) 
-
-static void free_init_data(InitData* data) {
-    FREE_INIT_LIST(UntypedData, data->untyped_list_head);
-    FREE_INIT_LIST(EndpointData, data->ep_list_head);
-    FREE_INIT_LIST(EndpointData, data->notification_list_head);
-    FREE_INIT_LIST(SharedMemoryData, data->shmem_list_head);
-
-    {
-        IrqData *lst = data->irq_list_head;
-        while(lst != NULL) {
-            free(lst->name);
-            IrqData *tmp = lst;
-            lst = lst->next;
-            free(tmp);
+/**
+ * Every node and string in the init data came from the handle's arena.
+ */
+static void free_init_data(process_handle_t *handle) {
+    init_arena_destroy(&handle->init_data_arena);
+    init_data__init(&handle->init_data);
+}
+
+/**
+ * Shared by every process we run, see process_set_conn_ids.
+ */
+static const init_conn_id_t *conn_id_table = NULL;
+static seL4_Word conn_id_count = 0;
+
+int process_set_conn_ids(const init_conn_id_t *ids, seL4_Word count)
+{
+    libprocess_prologue();
+
+    libprocess_guard(ids == NULL && count > 0, -1, libprocess_epilogue,
+                     "NULL connection ID table");
+
+    conn_id_table = ids;
+    conn_id_count = count;
+
+    libprocess_return_success();
+    libprocess_epilogue();
+}
+
+/**
+ * The cap or address the child will see for a connection, 0 if it has none.
+ * Matches the child's string lookup, the first entry with the name wins.
+ */
+static uint64_t conn_id_value(const InitData *data, const init_conn_id_t *conn)
+{
+    switch(conn->kind) {
+    case INIT_NAME_ENDPOINT:
+    case INIT_NAME_NOTIFICATION: {
+        EndpointData *ep = (conn->kind == INIT_NAME_ENDPOINT) ? data->ep_list_head
+                                                              : data->notification_list_head;
+        for(; ep != NULL; ep = ep->next) {
+            if(strcmp(ep->name, conn->name) == 0) {
+                return ep->cap;
+            }
         }
+        break;
+    }
+    case INIT_NAME_SHMEM:
+        for(SharedMemoryData *shmem = data->shmem_list_head; shmem != NULL; shmem = shmem->next) {
+            if(strcmp(shmem->name, conn->name) == 0) {
+                return shmem->addr;
+            }
+        }
+        break;
+    case INIT_NAME_DEVMEM:
+        for(DeviceMemoryData *devmem = data->devmem_list_head; devmem != NULL; devmem = devmem->next) {
+            if(strcmp(devmem->name, conn->name) == 0) {
+                return devmem->virt_addr;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/**
+ * IDs past the last connection the child has are left out, it looks those
+ * up by name and finds nothing either way.
+ */
+static int fill_conn_ids(process_handle_t *handle)
+{
+    if(conn_id_count == 0) {
+        return 0;
+    }
+
+    uint64_t *ids = init_arena_alloc(&handle->init_data_arena, conn_id_count * sizeof(uint64_t));
+    if(ids == NULL) {
+        return -1;
     }
 
-    {
-        DeviceMemoryData *lst = data->devmem_list_head;
-        while(lst != NULL) {
-            if(lst->caps32 != NULL) free(lst->caps32);
-            if(lst->caps64 != NULL) free(lst->caps64);
-            free(lst->name);
-            DeviceMemoryData *tmp = lst;
-            lst = lst->next;
-            free(tmp);
+    size_t count = 0;
+    for(seL4_Word i = 0; i < conn_id_count; i++) {
+        ids[i] = conn_id_value(&handle->init_data, &conn_id_table[i]);
+        if(ids[i] != 0) {
+            count = i + 1;
         }
     }
 
-    init_data__init(data);
+    handle->init_data.conn_ids = ids;
+    handle->init_data.n_conn_ids = count;
+    return 0;
 }
 
 static inline int 
@@ -110,11 +164,18 @@ int process_run(process_handle_t *handle, int argc, char *argv[])
 
     handle->init_data.cnode_next_free = handle->cnode_next_free;
 
+    error = fill_conn_ids(handle);
+    ZF_LOGW_IF(error, "Failed to fill in connection IDs, the child will look them up by name");
+
 
     /**
      * Copy the init data into the child memory space
      */
+#ifdef CONFIG_LIB_INIT_FLAT_INIT_DATA
+    seL4_Word raw_size = init_flat_get_packed_size(&handle->init_data);
+#else
     seL4_Word raw_size = init_data__get_packed_size(&handle->init_data);
+#endif
     seL4_Word init_data_len = ROUND_UP(raw_size, PAGE_SIZE_4K);
     //ZF_LOGV("Starting process with init data size: %lu", (long unsigned)raw_size);
 
@@ -144,23 +205,25 @@ int process_run(process_handle_t *handle, int argc, char *argv[])
     /**
      * Then write the packed data
      */
+#ifdef CONFIG_LIB_INIT_FLAT_INIT_DATA
+    init_flat_pack(&handle->init_data, packed_init_data);
+#else
     init_data__pack(&handle->init_data, packed_init_data);
+#endif
 
     /**
      * We don't need the data in our address space anymore, unmap
      */
-    lockvspace_lock(&init_objects.vspace, &init_objects.lockvspace);
-    sel4utils_unmap_pages(&init_objects.lockvspace.parent_vspace,
-                          packed_init_data,
-                          init_data_len / PAGE_SIZE_4K,
-                          PAGE_BITS_4K,
-                          &init_objects.vka);
-    lockvspace_unlock(&init_objects.vspace, &init_objects.lockvspace);
+    vspace_unmap_pages(&init_objects.vspace,
+                       packed_init_data,
+                       init_data_len / PAGE_SIZE_4K,
+                       PAGE_BITS_4K,
+                       &init_objects.vka);
 
     /**
-     * free all the init data);
+     * free all the init data
      */
-    free_init_data(&handle->init_data);
+    free_init_data(handle);
     
     /**
      * Our child process expects the stack to look like this:
@@ -192,6 +255,19 @@ int process_run(process_handle_t *handle, int argc, char *argv[])
     libprocess_guard(libprocess_get_status() == -1, -6, libprocess_epilogue, 
                      "Failed to allocate environment variable for child");
 
+    /**
+     * Only a growable heap gets a reserve, its absence tells the child the
+     * heap is fixed.
+     */
+    AUTOFREE char *heap_reserve_env = NULL;
+    if(handle->attrs.heap_reserve_pages > handle->attrs.heap_size_pages) {
+        libprocess_set_status(asprintf(&heap_reserve_env,
+                              "HEAP_RESERVE_SIZE=%lu",
+                              (long unsigned)handle->attrs.heap_reserve_pages * PAGE_SIZE_4K));
+        libprocess_guard(libprocess_get_status() == -1, -6, libprocess_epilogue, 
+                         "Failed to allocate environment variable for child");
+    }
+
     AUTOFREE char *init_data_addr_env;
     libprocess_set_status(asprintf(&init_data_addr_env,
                                    "INIT_DATA_ADDR=0x%"PRIxPTR"",
@@ -207,8 +283,9 @@ int process_run(process_handle_t *handle, int argc, char *argv[])
                      "Failed to allocate environment variable for child");
 
 
-    char *envp[] = {heap_addr_env, heap_size_env, init_data_addr_env, init_data_size_env};
-    int envc = sizeof(envp)/sizeof(envp[0]);
+    char *envp[] = {heap_addr_env, heap_size_env, init_data_addr_env, init_data_size_env,
+                    heap_reserve_env};
+    int envc = sizeof(envp)/sizeof(envp[0]) - (heap_reserve_env == NULL ? 1 : 0);
 
     uintptr_t initial_stack_pointer = (uintptr_t)handle->main_thread->stack_vaddr - sizeof(seL4_Word); 
     /**
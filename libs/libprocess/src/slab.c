@@ -0,0 +1,288 @@
+/**
+ * @file slab.c
+ * @brief Pools of pre-retyped kernel objects
+ *
+ * A slab grows by allocating one untyped big enough for a power of two
+ * objects and a contiguous range of slots for them, and retypes all of them
+ * with a single seL4_Untyped_Retype. Objects are handed out from a stack of
+ * free caps and keep their slot until the slab is destroyed.
+ */
+#include <autoconf.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <sel4/sel4.h>
+#include <vka/capops.h>
+#include <vka/kobject_t.h>
+#include <utils/util.h>
+#include <vspace/vspace.h>
+
+#include <init/init.h>
+#include <process/process.h>
+#include <process/sync.h>
+#include <process/internal.h>
+
+
+static inline bool slab_is_frame(process_slab_t *slab)
+{
+    return slab->type == kobject_get_type(KOBJECT_FRAME, slab->size_bits);
+}
+
+
+static void slab_free_block(process_slab_block_t *block)
+{
+    cspacepath_t ut_path;
+    vka_cspace_make_path(&init_objects.vka, block->untyped.cptr, &ut_path);
+
+    /* Deletes every object retyped from this block */
+    vka_cnode_revoke(&ut_path);
+
+    init_cspace_free_range(&init_objects.vka, block->slots, block->num_objects);
+    vka_free_object(&init_objects.vka, &block->untyped);
+    free(block->slots);
+    free(block);
+}
+
+
+/**
+ * Add at least count objects to the slab.
+ */
+static int slab_grow(process_slab_t *slab, seL4_Word count)
+{
+    libprocess_prologue();
+
+    seL4_Word block_bits = CONFIG_LIB_PROCESS_SLAB_BLOCK_BITS;
+    while(BIT(block_bits) < count) {
+        block_bits++;
+    }
+    libprocess_guard(slab->size_bits + block_bits > seL4_MaxUntypedBits, -1, libprocess_epilogue,
+                     "Slab block of 2^%lu objects is too big", (long)block_bits);
+
+    process_slab_block_t *block = calloc(1, sizeof(process_slab_block_t));
+    libprocess_check_malloc(block, libprocess_epilogue);
+
+    block->num_objects = BIT(block_bits);
+    block->slots = malloc(sizeof(seL4_CPtr) * block->num_objects);
+    libprocess_check_malloc(block->slots, free_block);
+
+    process_slab_entry_t *free_objects = realloc(slab->free_objects,
+                                                 sizeof(process_slab_entry_t) *
+                                                 (slab->num_total + block->num_objects));
+    libprocess_check_malloc(free_objects, free_slots_array);
+    slab->free_objects = free_objects;
+    slab->free_capacity = slab->num_total + block->num_objects;
+
+    libprocess_set_status(vka_alloc_untyped(&init_objects.vka, slab->size_bits + block_bits,
+                                            &block->untyped));
+    libprocess_guard(libprocess_get_status(), -1, free_slots_array,
+                     "Failed to allocate untyped for slab");
+
+    /* One range of slots, so the whole block is a single retype */
+    cspacepath_t start;
+    libprocess_set_status(init_cspace_alloc_range(&init_objects.vka, block->num_objects,
+                                                  block->slots, &start));
+    libprocess_guard(libprocess_get_status(), -1, free_untyped,
+                     "Failed to allocate cslots for slab");
+
+    libprocess_set_status(seL4_Untyped_Retype(block->untyped.cptr, slab->type, slab->size_bits,
+                                              start.root, start.dest, start.destDepth,
+                                              start.offset, block->num_objects));
+    libprocess_guard(libprocess_get_status(), -1, free_slot_range,
+                     "Failed to retype %lu objects of type %lu",
+                     (long)block->num_objects, (long)slab->type);
+
+    for(seL4_Word i = 0; i < block->num_objects; i++) {
+        slab->free_objects[slab->num_free].cptr = block->slots[i];
+        slab->free_objects[slab->num_free].block = block;
+        slab->num_free++;
+    }
+    slab->num_total += block->num_objects;
+    LINKED_LIST_PREPEND(block, slab->blocks);
+
+    libprocess_return_success();
+
+free_slot_range:
+    init_cspace_free_range(&init_objects.vka, block->slots, block->num_objects);
+free_untyped:
+    vka_free_object(&init_objects.vka, &block->untyped);
+free_slots_array:
+    free(block->slots);
+free_block:
+    free(block);
+    libprocess_return_value(_libprocess_status);
+    libprocess_epilogue();
+}
+
+
+int process_slab_init(process_slab_t *slab, seL4_Word type, seL4_Word size_bits)
+{
+    libprocess_prologue();
+    libprocess_check_arg(slab);
+
+    memset(slab, 0, sizeof(process_slab_t));
+    slab->type = type;
+    slab->size_bits = size_bits;
+
+    libprocess_return_success();
+    libprocess_epilogue();
+}
+
+
+int process_slab_reserve(process_slab_t *slab, seL4_Word count)
+{
+    libprocess_prologue();
+    libprocess_check_initialized();
+    libprocess_check_arg(slab);
+
+    if(slab->num_free < count) {
+        libprocess_set_status(slab_grow(slab, count - slab->num_free));
+        libprocess_guard(libprocess_get_status(), -1, libprocess_epilogue,
+                         "Failed to reserve %lu slab objects", (long)count);
+    }
+
+    libprocess_return_success();
+    libprocess_epilogue();
+}
+
+
+int process_slab_alloc(process_slab_t *slab, vka_object_t *obj)
+{
+    libprocess_prologue();
+    libprocess_check_initialized();
+    libprocess_check_arg(slab);
+    libprocess_check_arg(obj);
+
+    if(slab->num_free == 0) {
+        libprocess_set_status(slab_grow(slab, 1));
+        libprocess_guard(libprocess_get_status(), -1, libprocess_epilogue,
+                         "Failed to refill slab");
+    }
+
+    /* ut is the cookie of the block's untyped, it says which block the object is from */
+    process_slab_entry_t *entry = &slab->free_objects[--slab->num_free];
+    obj->cptr = entry->cptr;
+    obj->ut = entry->block->untyped.ut;
+    obj->type = slab->type;
+    obj->size_bits = slab->size_bits;
+
+    libprocess_return_success();
+    libprocess_epilogue();
+}
+
+
+int process_slab_free(process_slab_t *slab, vka_object_t *obj)
+{
+    libprocess_prologue();
+    libprocess_check_arg(slab);
+    libprocess_check_arg(obj);
+
+    libprocess_guard(obj->type != slab->type || obj->size_bits != slab->size_bits, -1,
+                     libprocess_epilogue, "Object does not belong to this slab");
+    libprocess_guard(slab->num_free >= slab->num_total, -1, libprocess_epilogue,
+                     "Slab is already full, double free?");
+
+    process_slab_block_t *block = slab->blocks;
+    while(block != NULL && block->untyped.ut != obj->ut) {
+        block = block->next;
+    }
+    libprocess_guard(block == NULL, -1, libprocess_epilogue,
+                     "Object was not allocated from this slab");
+
+    cspacepath_t path;
+    vka_cspace_make_path(&init_objects.vka, obj->cptr, &path);
+    libprocess_set_status(vka_cnode_revoke(&path));
+    libprocess_guard(libprocess_get_status(), -1, libprocess_epilogue,
+                     "Failed to revoke slab object");
+
+    if(slab_is_frame(slab)) {
+        seL4_CPtr cap = obj->cptr;
+        void *vaddr = vspace_map_pages(&init_objects.vspace, &cap, NULL, seL4_AllRights,
+                                       1, slab->size_bits, 1);
+        libprocess_guard(vaddr == NULL, -1, libprocess_epilogue,
+                         "Failed to map slab frame for clearing");
+        memset(vaddr, 0, BIT(slab->size_bits));
+        vspace_unmap_pages(&init_objects.vspace, vaddr, 1, slab->size_bits, VSPACE_PRESERVE);
+    }
+
+    slab->free_objects[slab->num_free].cptr = obj->cptr;
+    slab->free_objects[slab->num_free].block = block;
+    slab->num_free++;
+    obj->cptr = seL4_CapNull;
+    obj->ut = 0;
+
+    libprocess_return_success();
+    libprocess_epilogue();
+}
+
+
+int process_slab_destroy(process_slab_t *slab)
+{
+    libprocess_prologue();
+    libprocess_check_arg(slab);
+
+    libprocess_guard(slab->num_free != slab->num_total, -1, libprocess_epilogue,
+                     "%lu slab objects are still in use",
+                     (long)(slab->num_total - slab->num_free));
+
+    while(slab->blocks != NULL) {
+        process_slab_block_t *block;
+        LINKED_LIST_POP(block, slab->blocks);
+        slab_free_block(block);
+    }
+
+    free(slab->free_objects);
+    memset(slab, 0, sizeof(process_slab_t));
+
+    libprocess_return_success();
+    libprocess_epilogue();
+}
+
+
+#ifdef CONFIG_LIB_PROCESS_SLABS
+
+static bool conn_slabs_initialized = false;
+static process_slab_t conn_slabs[3];
+
+/**
+ * Assumes the libprocess lock is held
+ */
+process_slab_t *libprocess_conn_slab(seL4_Word type, seL4_Word size_bits)
+{
+    if(!conn_slabs_initialized) {
+        process_slab_init(&conn_slabs[0], seL4_EndpointObject, seL4_EndpointBits);
+        process_slab_init(&conn_slabs[1], seL4_NotificationObject, seL4_NotificationBits);
+        process_slab_init(&conn_slabs[2], kobject_get_type(KOBJECT_FRAME, seL4_PageBits), seL4_PageBits);
+        conn_slabs_initialized = true;
+    }
+
+    for(int i = 0; i < ARRAY_SIZE(conn_slabs); i++) {
+        if(conn_slabs[i].type == type && conn_slabs[i].size_bits == size_bits) {
+            return &conn_slabs[i];
+        }
+    }
+    return NULL;
+}
+
+
+int process_destroy_conn_slabs(void)
+{
+    libprocess_prologue();
+
+    if(conn_slabs_initialized) {
+        for(int i = 0; i < ARRAY_SIZE(conn_slabs); i++) {
+            libprocess_guard(conn_slabs[i].num_free != conn_slabs[i].num_total, -1,
+                             libprocess_epilogue, "Connection objects are still in use");
+        }
+        for(int i = 0; i < ARRAY_SIZE(conn_slabs); i++) {
+            process_slab_destroy(&conn_slabs[i]);
+        }
+        conn_slabs_initialized = false;
+    }
+
+    libprocess_return_success();
+    libprocess_epilogue();
+}
+
+#endif /* CONFIG_LIB_PROCESS_SLABS */
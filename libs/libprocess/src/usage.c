@@ -0,0 +1,171 @@
+/**
+ * @file usage.c
+ * @brief Peak stack and heap usage of child processes
+ *
+ * A child's stack and heap are mapped into our vspace just long enough to
+ * look for INIT_WATERMARK_CANARY. Only pages we mapped for the child are
+ * known to our copy of its vspace, anything the child mapped itself is not.
+ */
+#define _GNU_SOURCE
+#include <autoconf.h>
+
+#include <stdio.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+#include <vspace/vspace.h>
+
+#include <init/init.h>
+#include <process/process.h>
+#include <process/sync.h>
+#include <process/internal.h>
+
+process_handle_t *libprocess_process_list = NULL;
+
+
+void libprocess_list_remove(process_handle_t *handle)
+{
+    process_handle_t **iter = &libprocess_process_list;
+    while(*iter != NULL && *iter != handle) {
+        iter = &(*iter)->next;
+    }
+    if(*iter != NULL) {
+        *iter = handle->next;
+    }
+    handle->next = NULL;
+}
+
+
+static seL4_Word *usage_share(process_handle_t *handle, uintptr_t vaddr, seL4_Word num_pages)
+{
+    return vspace_share_mem(&handle->vspace,
+                            &init_objects.vspace,
+                            (void*)vaddr,
+                            num_pages,
+                            PAGE_BITS_4K,
+                            seL4_AllRights,
+                            1);
+}
+
+static void usage_unshare(seL4_Word *words, seL4_Word num_pages)
+{
+    vspace_unmap_pages(&init_objects.vspace, words, num_pages, PAGE_BITS_4K, &init_objects.vka);
+}
+
+
+void libprocess_paint_stack(process_handle_t *handle)
+{
+#ifdef CONFIG_LIB_THREAD_STACK_WATERMARK
+    thread_handle_t *thread = handle->main_thread;
+    seL4_Word size = thread->stack_size_pages << PAGE_BITS_4K;
+
+    seL4_Word *words = usage_share(handle, (uintptr_t)thread->stack_vaddr - size,
+                                   thread->stack_size_pages);
+    if(words == NULL) {
+        ZF_LOGW("Failed to share the stack of %s, its peak won't be known", handle->name);
+        return;
+    }
+    for(seL4_Word i = 0; i < size / sizeof(seL4_Word); i++) {
+        words[i] = INIT_WATERMARK_CANARY;
+    }
+    usage_unshare(words, thread->stack_size_pages);
+    thread->stack_painted = true;
+#endif
+}
+
+
+int process_get_memory_usage(process_handle_t *handle, process_memory_usage_t *usage)
+{
+    libprocess_prologue();
+
+    libprocess_check_arg(handle);
+    libprocess_check_arg(usage);
+    libprocess_guard(handle->state == PROCESS_DESTROYED, -6, libprocess_epilogue,
+                     "Process has been destroyed");
+
+    thread_handle_t *thread = handle->main_thread;
+    usage->stack_size = thread->stack_size_pages << PAGE_BITS_4K;
+    usage->stack_used = 0;
+    usage->stack_known = false;
+    usage->heap_size = handle->attrs.heap_size_pages << PAGE_BITS_4K;
+    usage->heap_used = 0;
+    usage->heap_known = false;
+
+    if(thread->stack_painted) {
+        seL4_Word *words = usage_share(handle, (uintptr_t)thread->stack_vaddr - usage->stack_size,
+                                       thread->stack_size_pages);
+        libprocess_guard(words == NULL, -7, libprocess_epilogue,
+                         "Failed to share the stack of %s", handle->name);
+
+        /* The stack grows down, so count untouched words up from the bottom */
+        seL4_Word i = 0;
+        while(i < usage->stack_size / sizeof(seL4_Word) && words[i] == INIT_WATERMARK_CANARY) {
+            i++;
+        }
+        usage->stack_used = usage->stack_size - i * sizeof(seL4_Word);
+        usage->stack_known = true;
+        usage_unshare(words, thread->stack_size_pages);
+    }
+
+#ifdef CONFIG_LIB_INIT_HEAP_WATERMARK
+    if(handle->state == PROCESS_RUNNING &&
+       handle->attrs.heap_reserve_pages <= handle->attrs.heap_size_pages) {
+        seL4_Word *words = usage_share(handle, (uintptr_t)handle->heap_vaddr,
+                                       handle->attrs.heap_size_pages);
+        libprocess_guard(words == NULL, -8, libprocess_epilogue,
+                         "Failed to share the heap of %s", handle->name);
+
+        /**
+         * Same as init_get_heap_high_water: brk grows up and anonymous mmaps
+         * grow down, the untouched part is the longest run of canary words.
+         */
+        seL4_Word longest = 0;
+        seL4_Word run = 0;
+        for(seL4_Word i = 0; i < usage->heap_size / sizeof(seL4_Word); i++) {
+            run = (words[i] == INIT_WATERMARK_CANARY) ? run + 1 : 0;
+            longest = MAX(longest, run);
+        }
+        usage->heap_used = usage->heap_size - longest * sizeof(seL4_Word);
+        usage->heap_known = true;
+        usage_unshare(words, handle->attrs.heap_size_pages);
+    }
+#endif
+
+    libprocess_return_success();
+    libprocess_epilogue();
+}
+
+
+void process_print_memory_usage(void)
+{
+    process_memory_usage_t usage;
+
+    libprocess_lock_acquire();
+
+    printf("%s child memory usage:\n", init_objects.proc_name);
+    printf("+------------------+--------------+--------------+--------------+--------------+\n");
+    printf("| process          | stack (bytes)| peak (bytes) | heap (bytes) | peak (bytes) |\n");
+    printf("+------------------+--------------+--------------+--------------+--------------+\n");
+    for(process_handle_t *iter = libprocess_process_list; iter != NULL; iter = iter->next) {
+        if(process_get_memory_usage(iter, &usage) != 0) {
+            printf("| %-16.16s |          n/a |          n/a |          n/a |          n/a |\n",
+                   iter->name);
+            continue;
+        }
+        printf("| %-16.16s | %12lu |", iter->name, (long unsigned)usage.stack_size);
+        if(usage.stack_known) {
+            printf(" %12lu |", (long unsigned)usage.stack_used);
+        } else {
+            printf("          n/a |");
+        }
+        printf(" %12lu |", (long unsigned)usage.heap_size);
+        if(usage.heap_known) {
+            printf(" %12lu |\n", (long unsigned)usage.heap_used);
+        } else {
+            printf("          n/a |\n");
+        }
+    }
+    printf("+------------------+--------------+--------------+--------------+--------------+\n");
+
+    libprocess_lock_release();
+}
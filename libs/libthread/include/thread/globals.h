@@ -13,3 +13,4 @@
 
 extern const thread_attr_t thread_defaults_1MB_stack;
 extern const thread_attr_t thread_defaults_64KB_stack;
+extern const thread_attr_t thread_defaults_1MB_lazy_stack;
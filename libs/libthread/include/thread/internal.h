@@ -0,0 +1,66 @@
+/**
+ * @file internal.h
+ * @brief Internal definitions for libthread
+ */
+
+#pragma once
+
+
+#include <sel4/sel4.h>
+
+#include "types.h"
+
+/**
+ * Get the endpoint of the lazy stack fault handler, starting it on first use.
+ * Assumes that libthread lock is held.
+ *
+ * @return The endpoint, or seL4_CapNull on failure
+ */
+seL4_CPtr libthread_fault_handler_get_ep(void);
+
+/**
+ * The fault handler's endpoint if it has been started, seL4_CapNull otherwise.
+ * Assumes that libthread lock is held.
+ */
+seL4_CPtr libthread_fault_handler_running_ep(void);
+
+/**
+ * Every live handle, linked through next. Protected by the libthread lock.
+ */
+extern thread_handle_t *libthread_thread_list;
+
+/**
+ * Move a thread to a core without changing whether it is pinned.
+ * Assumes that libthread lock is held.
+ */
+int libthread_migrate_unsafe(thread_handle_t *handle, int core);
+
+/**
+ * Give a new thread a scheduling context when attr asks for a budget.
+ * Assumes that libthread lock is held.
+ */
+int libthread_sched_context_setup_unsafe(thread_handle_t *handle, const thread_attr_t *attr);
+
+/**
+ * Move a thread to a core by reconfiguring its scheduling context with that
+ * core's sched control cap. RT kernels have no seL4_TCB_SetAffinity.
+ * Assumes that libthread lock is held.
+ */
+int libthread_sched_context_move_unsafe(thread_handle_t *handle, int core);
+
+/**
+ * Free a thread's scheduling context, if it has one.
+ * Assumes that libthread lock is held.
+ */
+void libthread_sched_context_free_unsafe(thread_handle_t *handle);
+
+/**
+ * Run the TLS key destructors for a thread that is exiting.
+ */
+void libthread_tls_run_destructors(thread_handle_t *handle);
+
+/**
+ * Free the stacks of a destroyed thread's unfinished fibers, its fiber
+ * notification and the scheduler itself. sched may be NULL.
+ */
+void libthread_fiber_sched_destroy(fiber_sched_t *sched);
@@ -26,6 +26,7 @@
 
 #pragma once
 
+#include <autoconf.h>
 #include <sel4/sel4.h>
 #include <vka/vka.h>
 #include <vspace/vspace.h>
@@ -93,6 +94,45 @@ int thread_set_current_local_storage(thread_handle_t *handle);
  */
 thread_handle_t *thread_get_current_local_storage();
 
+/**
+ * @brief Allocate a thread local storage key.
+ *
+ * Every thread starts with a NULL value for the key. When a thread returns
+ * from its start routine the destructor is called on any non-NULL value.
+ *
+ * @param[out]  key         The new key
+ * @param       destructor  Called on thread exit, may be NULL
+ * @return                  Error code
+ */
+int thread_key_create(thread_key_t *key, thread_key_destructor_t destructor);
+
+/**
+ * @brief Release a key. Values still stored under it are not destroyed.
+ *
+ * A key created later with the same index reads NULL in every thread.
+ *
+ * @param   key     Key to release
+ * @return          Error code
+ */
+int thread_key_delete(thread_key_t key);
+
+/**
+ * @brief Set the current thread's value for a key. Doesn't take any locks.
+ *
+ * @param   key     Key from thread_key_create
+ * @param   value   Value to store
+ * @return          Error code
+ */
+int thread_setspecific(thread_key_t key, void *value);
+
+/**
+ * @brief Get the current thread's value for a key. Doesn't take any locks.
+ *
+ * @param   key     Key from thread_key_create
+ * @return          The value, or NULL if unset or the key is invalid
+ */
+void *thread_getspecific(thread_key_t key);
+
 /**
  * @brief Get the handle for the current thread
  *
@@ -119,10 +159,171 @@ thread_handle_t *thread_handle_create_custom(seL4_CPtr cnode,
 
 int thread_destroy_free_handle(thread_handle_t **handle);
 
+/**
+ * @brief Change a thread's priority.
+ *
+ * @param   handle      Target thread handle
+ * @param   priority    New priority, bounded by this process' MCP
+ * @return              Error code
+ */
+int thread_set_priority(thread_handle_t *handle, seL4_Word priority);
+
+/**
+ * @brief Move a thread to another core.
+ *
+ * The thread is pinned afterwards and won't be moved by the balancer.
+ *
+ * @param   handle  Target thread handle
+ * @param   core    Destination core
+ * @return          Error code
+ */
+int thread_set_affinity(thread_handle_t *handle, int core);
+
+/**
+ * @brief Wait for the current thread's next release.
+ *
+ * Call at the end of each job of a periodic thread created with a budget
+ * and period. Updates the thread's scheduling stats.
+ *
+ * @return  Error code
+ */
+int thread_wait_next_period(void);
+
+/**
+ * @brief Get the release, overrun and deadline miss counters of a periodic
+ * thread.
+ *
+ * @param       handle  Target thread handle
+ * @param[out]  stats   Copy of the counters
+ * @return              Error code
+ */
+int thread_get_sched_stats(thread_handle_t *handle, thread_sched_stats_t *stats);
+
+/**
+ * @brief Start a thread which periodically moves unpinned threads off
+ * overloaded cores.
+ *
+ * Needs CONFIG_BENCHMARK_TRACK_UTILISATION to sample per thread load.
+ *
+ * @param   period_ms   Time between samples
+ * @return              Error code
+ */
+int thread_balancer_start(seL4_Word period_ms);
+
+/**
+ * @brief Start the thread that commits demand paged memory on first touch.
+ *
+ * Started automatically for threads with a lazy stack. Call it before
+ * touching memory from mmap_new_pages_lazy. Threads only reach it if their
+ * fault endpoint is the handler's: those with a lazy stack, or any thread
+ * created after it started with CONFIG_LIB_THREAD_FAULT_HANDLER_PROCESS_EP.
+ *
+ * @return              Error code
+ */
+int thread_fault_handler_start(void);
+
+/**
+ * @brief Get the deepest point a thread's stack has reached.
+ *
+ * Demand paged stacks (stack_commit_pages != 0) are tracked to the page.
+ * Other stacks in the current vspace are tracked to the word when
+ * CONFIG_LIB_THREAD_STACK_WATERMARK paints them at creation.
+ *
+ * @param       handle  Target thread handle
+ * @param[out]  bytes   Peak bytes used, counted from the stack top
+ * @return              Error code
+ */
+int thread_get_stack_high_water(thread_handle_t *handle, seL4_Word *bytes);
+
+/**
+ * @brief Print the peak stack usage of the main thread and every live thread,
+ * and the peak heap usage of this process.
+ *
+ * process_print_memory_usage covers child processes.
+ */
+void thread_print_memory_usage(void);
+
 int thread_destroy_free_handle_custom(thread_handle_t **handle,
                                       vspace_t *vspace);
 
+#ifdef CONFIG_LIB_THREAD_FIBERS
+/**
+ * @brief Create a fiber on the current thread's scheduler.
+ *
+ * The fiber does not run until this thread calls fiber_run.
+ *
+ * @param   routine     Function to run
+ * @param   arg         Argument to pass to the routine
+ * @return              The fiber, or NULL on failure
+ */
+fiber_t *fiber_create(fiber_routine_t routine, void *arg);
+
+/**
+ * @brief Run this thread's fibers until all of them have finished.
+ *
+ * @return  Error code
+ */
+int fiber_run(void);
+
+/**
+ * @brief Give up the processor to the next runnable fiber.
+ *
+ * Outside of a fiber this is a seL4_Yield.
+ */
+void fiber_yield(void);
+
+/**
+ * @brief Block the current fiber until a notification is signalled.
+ *
+ * Other fibers on the same thread keep running. The notification cap must
+ * be badged with a non-zero badge, an unbadged signal can't be seen by
+ * seL4_Poll. Outside of a fiber this is a seL4_Wait.
+ *
+ * fiber_run can only block the thread when every waiting fiber waits on the
+ * same notification. Fibers waiting on different ones are polled between
+ * yields, use fiber_wait_bits for those.
+ *
+ * Waiting on fiber_get_notification's notification is fiber_wait_bits with
+ * every bit, the scheduler takes its signals for its own waiters.
+ *
+ * @param       notification    Notification to wait on
+ * @param[out]  badge           Received badge, may be NULL
+ */
+void fiber_wait(seL4_CPtr notification, seL4_Word *badge);
+
+/**
+ * @brief Get the currently executing fiber.
+ *
+ * @return The fiber, or NULL when not called from a fiber
+ */
+fiber_t *fiber_get_current(void);
+
+/**
+ * @brief Get this thread's fiber notification, allocating it on first use.
+ *
+ * Give each event source a copy badged with its own bits. Fibers waiting on
+ * it with fiber_wait_bits let fiber_run block the thread in seL4_Wait until
+ * one of them is signalled.
+ *
+ * @return The notification, or seL4_CapNull on failure
+ */
+seL4_CPtr fiber_get_notification(void);
+
+/**
+ * @brief Block the current fiber until any of mask's badge bits are
+ * signalled on fiber_get_notification.
+ *
+ * Bits no fiber is waiting for are kept until one asks for them. Outside of
+ * a fiber this waits on the notification directly.
+ *
+ * @param       mask    Badge bits to wait for, non-zero
+ * @param[out]  bits    The bits of mask that were signalled, may be NULL
+ * @return              Error code
+ */
+int fiber_wait_bits(seL4_Word mask, seL4_Word *bits);
+#endif /* CONFIG_LIB_THREAD_FIBERS */
+
+
 /* ~~~ TODO: API PHASE 2 ~~~ */
 /* debugging, listing */
-//void thread_print_threads(void);
 
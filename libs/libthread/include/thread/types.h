@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <autoconf.h>
 #include <sel4/sel4.h>
 #include <vka/vka.h>
 #include <atomic_sync/sync.h>
@@ -12,11 +13,48 @@
 
 typedef struct thread_attr {
     seL4_Word stack_size_pages;
+    /**
+     * 0 maps the whole stack up front. Otherwise only this many pages are,
+     * and the thread must not fault in the rest while it holds the vka or
+     * vspace lock, since the fault handler needs them.
+     */
+    seL4_Word stack_commit_pages;
     seL4_Word priority;
     seL4_Word max_priority;
     int cpu_affinity;
+
+    /**
+     * Scheduling context (CONFIG_KERNEL_RT). budget_us == 0 means none.
+     */
+    seL4_Word budget_us;
+    seL4_Word period_us;
 } thread_attr_t;
 
+/**
+ * Counters kept by thread_wait_next_period
+ */
+typedef struct thread_sched_stats {
+    seL4_Word releases;         /* jobs completed */
+    seL4_Word budget_overruns;  /* jobs that wanted more than one budget */
+    seL4_Word deadline_misses;  /* periods by which jobs finished late */
+} thread_sched_stats_t;
+
+/**
+ * Index into every thread's TLS slot array, see thread_key_create
+ */
+typedef int thread_key_t;
+
+typedef void (*thread_key_destructor_t)(void *value);
+
+/**
+ * A thread's value for one key. The value only counts while generation
+ * matches the key's, so a deleted and re-created key starts out NULL.
+ */
+typedef struct thread_tls_slot {
+    void *value;
+    seL4_Word generation;
+} thread_tls_slot_t;
+
 typedef enum {
     THREAD_INIT = 0,
     THREAD_RUNNING = 1,
@@ -25,9 +63,18 @@ typedef enum {
 
 typedef struct thread_handle {
     //int lock;
+    struct thread_handle *next; /* list of live threads, see thread_print_memory_usage */
 
     int thread_id;
     thread_state_t state;
+    bool started;       /* counted in lockwrapper_live_threads */
+
+    seL4_Word priority;
+    int cpu_affinity;   /* core the thread was last placed on */
+    bool pinned;        /* placed explicitly, the balancer leaves it alone */
+#ifdef CONFIG_BENCHMARK_TRACK_UTILISATION
+    uint64_t utilisation; /* cycles used in the last balancer period */
+#endif
 
     vka_object_t tcb;
     vka_object_t sync_notification;
@@ -40,9 +87,61 @@ typedef struct thread_handle {
     void *stack_vaddr;
     seL4_Word stack_size_pages;
     reservation_t stack_res;
+    bool lazy_stack;
+    bool stack_painted;
 
     void *ipc_buffer_vaddr;
     seL4_CPtr ipc_buffer_cap;
     reservation_t ipc_buffer_res;
+
+    struct fiber_sched *fiber_sched; /* created on first fiber_create */
+
+    thread_tls_slot_t tls_slots[CONFIG_LIB_THREAD_TLS_SLOTS];
+
+    vka_object_t sched_context;
+    seL4_Word budget_us;
+    seL4_Word period_us;
+    thread_sched_stats_t sched_stats;
     
 } thread_handle_t;
+
+/******************************************************************************
+ *  Fibers: cooperative user level threads multiplexed on one thread_handle_t
+ *****************************************************************************/
+
+typedef void (*fiber_routine_t)(void *arg);
+
+typedef enum {
+    FIBER_RUNNABLE = 0,
+    FIBER_BLOCKED = 1,
+    FIBER_DONE = 2
+} fiber_state_t;
+
+/**
+ * A fiber lives at the top of its own pooled stack, so creating one doesn't
+ * touch malloc.
+ */
+typedef struct fiber {
+    struct fiber *next;
+    void *sp;                   /* saved stack pointer while switched out */
+    void *stack_base;           /* lowest address of the stack slot */
+    fiber_state_t state;
+    fiber_routine_t routine;
+    void *arg;
+
+    seL4_CPtr wait_notification;
+    seL4_Word wait_mask;        /* bits of fiber_wait_bits, 0 for fiber_wait */
+    seL4_Word wait_badge;
+} fiber_t;
+
+typedef struct fiber_sched {
+    fiber_t *current;
+    fiber_t *run_head;
+    fiber_t *run_tail;
+    fiber_t *wait_head;
+    void *host_sp;              /* saved stack pointer of fiber_run */
+    seL4_Word num_fibers;
+
+    vka_object_t notification;  /* see fiber_get_notification, allocated on first use */
+    seL4_Word pending;          /* bits received on it that no fiber has taken yet */
+} fiber_sched_t;
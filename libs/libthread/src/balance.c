@@ -0,0 +1,176 @@
+/**
+ * @file balance.c
+ * @brief Core load balancer for libthread
+ *
+ * The balancer thread samples how many cycles each thread used over the
+ * last period, sums them per core, and moves one unpinned thread from the
+ * busiest core to the idlest one when the two are far enough apart. Moving
+ * at most one thread per period keeps it from oscillating.
+ *
+ * Per thread utilisation comes from the kernel benchmark support, so this
+ * only works with CONFIG_BENCHMARK_TRACK_UTILISATION.
+ *
+ * The main thread has no handle. Its load counts towards its core, but it
+ * is never the one moved.
+ */
+#include <autoconf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <thread/thread.h>
+#include <thread/sync.h>
+#include <thread/internal.h>
+#include <init/init.h>
+
+#ifdef CONFIG_BENCHMARK_TRACK_UTILISATION
+#include <sel4/benchmark_utilisation_types.h>
+
+/**
+ * Don't bother moving anything unless the busiest core did at least this
+ * many more cycles than the idlest, as a fraction of the busiest (1/4).
+ */
+#define BALANCE_IMBALANCE_SHIFT 2
+
+static thread_handle_t *balancer_handle = NULL;
+
+
+static uint64_t balance_sample_tcb(seL4_CPtr tcb)
+{
+    uint64_t *ipc_buffer = (uint64_t*)&seL4_GetIPCBuffer()->msg[0];
+
+    seL4_BenchmarkGetThreadUtilisation(tcb);
+    uint64_t utilisation = ipc_buffer[BENCHMARK_TCB_UTILISATION];
+    seL4_BenchmarkResetThreadUtilisation(tcb);
+
+    return utilisation;
+}
+
+
+static void balance_once(void)
+{
+    uint64_t core_load[CONFIG_MAX_NUM_NODES] = {0};
+
+    libthread_lock_acquire();
+
+    core_load[init_objects.main_core] += balance_sample_tcb(init_objects.tcb_cap);
+
+    for(thread_handle_t *iter = libthread_thread_list; iter != NULL; iter = iter->next) {
+        if(iter == balancer_handle || iter->state != THREAD_RUNNING) {
+            iter->utilisation = 0;
+            continue;
+        }
+        iter->utilisation = balance_sample_tcb(iter->tcb.cptr);
+        core_load[iter->cpu_affinity] += iter->utilisation;
+    }
+
+    int busiest = 0;
+    int idlest = 0;
+    for(int i = 1; i < CONFIG_MAX_NUM_NODES; i++) {
+        if(core_load[i] > core_load[busiest]) {
+            busiest = i;
+        }
+        if(core_load[i] < core_load[idlest]) {
+            idlest = i;
+        }
+    }
+
+    uint64_t imbalance = core_load[busiest] - core_load[idlest];
+    if(busiest == idlest || imbalance < (core_load[busiest] >> BALANCE_IMBALANCE_SHIFT)) {
+        libthread_lock_release();
+        return;
+    }
+
+    /**
+     * Moving a thread with utilisation u leaves an imbalance of
+     * |imbalance - 2u|, so pick the thread that gets closest to zero.
+     */
+    thread_handle_t *candidate = NULL;
+    uint64_t best_remaining = imbalance;
+    for(thread_handle_t *iter = libthread_thread_list; iter != NULL; iter = iter->next) {
+        if(iter->pinned || iter->cpu_affinity != busiest || iter->utilisation == 0) {
+            continue;
+        }
+#ifdef CONFIG_KERNEL_RT
+        /* Only a thread's own scheduling context can be moved */
+        if(iter->budget_us == 0) {
+            continue;
+        }
+#endif
+        uint64_t moved = iter->utilisation * 2;
+        uint64_t remaining = moved > imbalance ? moved - imbalance : imbalance - moved;
+        if(remaining < best_remaining) {
+            best_remaining = remaining;
+            candidate = iter;
+        }
+    }
+
+    if(candidate != NULL) {
+        int error = libthread_migrate_unsafe(candidate, idlest);
+        ZF_LOGW_IF(error, "Failed to migrate thread %i", candidate->thread_id);
+        ZF_LOGD_IF(!error, "Migrated thread %i from core %i to core %i",
+                   candidate->thread_id, busiest, idlest);
+    }
+
+    libthread_lock_release();
+}
+
+
+static void *balancer_routine(void *arg)
+{
+    seL4_Word period_ms = (seL4_Word)arg;
+    struct timespec period = {
+        .tv_sec = period_ms / 1000,
+        .tv_nsec = (period_ms % 1000) * 1000000,
+    };
+
+    while(1) {
+        nanosleep(&period, NULL);
+        balance_once();
+    }
+
+    return NULL;
+}
+
+
+int thread_balancer_start(seL4_Word period_ms)
+{
+    libthread_prologue(int, 0);
+
+    libthread_guard(balancer_handle != NULL, -1, libthread_epilogue,
+                    "Balancer already running");
+
+    libthread_guard(period_ms == 0, -2, libthread_epilogue,
+                    "Balancer period must be non-zero");
+
+    thread_handle_t *handle = thread_handle_create(&thread_defaults_64KB_stack);
+    libthread_guard(handle == NULL, -3, libthread_epilogue,
+                    "Failed to create balancer thread");
+
+    handle->pinned = true;
+
+    libthread_set_status(thread_start(handle, balancer_routine, (void*)period_ms));
+    libthread_guard(libthread_get_status(), -4, start_fail,
+                    "Failed to start balancer thread");
+
+    balancer_handle = handle;
+
+    libthread_return_success();
+    start_fail:
+        thread_destroy_free_handle_custom(&handle, &init_objects.vspace);
+    libthread_epilogue();
+}
+
+#else
+
+int thread_balancer_start(UNUSED seL4_Word period_ms)
+{
+    ZF_LOGE("The balancer needs CONFIG_BENCHMARK_TRACK_UTILISATION");
+    return -1;
+}
+
+#endif /* CONFIG_BENCHMARK_TRACK_UTILISATION */
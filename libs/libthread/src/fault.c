@@ -0,0 +1,155 @@
+/**
+ * @file fault.c
+ * @brief Fault handler thread backing demand paged memory
+ *
+ * Threads with a lazy stack get this thread's endpoint as their fault ep.
+ * VM faults inside a lazy region (stacks and mmap_new_pages_lazy) are
+ * resolved by libmmap and the faulting thread is resumed. Any other fault is
+ * logged, passed on to the process fault endpoint if there is one, and the
+ * thread stays blocked.
+ *
+ * The handler always receives on an endpoint of its own. The process fault
+ * endpoint (init_objects.fault_cap) belongs to the parent and is left alone,
+ * it is also the handler thread's own fault endpoint, so a fault in the
+ * handler never waits on the handler.
+ *
+ * With CONFIG_LIB_THREAD_FAULT_HANDLER_PROCESS_EP every thread created
+ * after the handler has started uses the handler's endpoint, not only those
+ * with a lazy stack.
+ */
+#include <autoconf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sel4/sel4.h>
+#include <vka/vka.h>
+#include <vka/capops.h>
+#include <utils/util.h>
+
+#include <thread/thread.h>
+#include <thread/sync.h>
+#include <mmap/mmap.h>
+#include <init/init.h>
+
+#include <thread/internal.h>
+
+
+static thread_handle_t *fault_handler_thread = NULL;
+static vka_object_t fault_handler_ep = {0};
+
+
+/**
+ * Pass a fault we can't resolve on to the process fault endpoint. Never
+ * blocks, if nobody is listening there the message is dropped.
+ */
+static void fault_handler_forward(seL4_MessageInfo_t tag)
+{
+    if(init_objects.fault_cap != seL4_CapNull) {
+        seL4_NBSend(init_objects.fault_cap, tag);
+    }
+}
+
+
+static void *libthread_fault_handler_routine(UNUSED void *arg)
+{
+    seL4_Word badge;
+    seL4_MessageInfo_t tag = seL4_Recv(fault_handler_ep.cptr, &badge);
+
+    while(1) {
+        seL4_Word label = seL4_MessageInfo_get_label(tag);
+
+        if(label == seL4_Fault_VMFault) {
+            void *fault_addr = (void*)seL4_GetMR(seL4_VMFault_Addr);
+            if(mmap_lazy_handle_fault(fault_addr) == 0) {
+                /**
+                 * An empty reply restarts the faulting instruction.
+                 */
+                tag = seL4_ReplyRecv(fault_handler_ep.cptr,
+                                     seL4_MessageInfo_new(0, 0, 0, 0),
+                                     &badge);
+                continue;
+            }
+            ZF_LOGE("Unhandled VM fault at %p, ip %p",
+                    fault_addr,
+                    (void*)seL4_GetMR(seL4_VMFault_IP));
+        } else {
+            ZF_LOGE("Unhandled fault, label %lu", (long unsigned)label);
+        }
+
+        /**
+         * Don't reply, leave the faulting thread blocked.
+         */
+        fault_handler_forward(tag);
+        tag = seL4_Recv(fault_handler_ep.cptr, &badge);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Assumes that libthread lock is held
+ */
+seL4_CPtr libthread_fault_handler_get_ep(void)
+{
+    int error;
+
+    if(fault_handler_thread != NULL) {
+        return fault_handler_ep.cptr;
+    }
+
+    error = vka_alloc_endpoint(&init_objects.vka, &fault_handler_ep);
+    if(error) {
+        ZF_LOGE("Failed to allocate fault handler endpoint");
+        return seL4_CapNull;
+    }
+
+    /**
+     * The handler itself must use an eager stack, and gets the process fault
+     * endpoint since fault_handler_thread is still unset. Going through
+     * thread_handle_create also gives it a thread id, which the locks need.
+     */
+    thread_handle_t *handle = thread_handle_create(&thread_defaults_64KB_stack);
+    if(handle == NULL) {
+        ZF_LOGE("Failed to create fault handler thread");
+        goto free_ep;
+    }
+
+    error = thread_start(handle, libthread_fault_handler_routine, NULL);
+    if(error) {
+        ZF_LOGE("Failed to start fault handler thread");
+        thread_destroy_free_handle_custom(&handle, &init_objects.vspace);
+        goto free_ep;
+    }
+
+    fault_handler_thread = handle;
+    return fault_handler_ep.cptr;
+
+free_ep:
+    vka_free_object(&init_objects.vka, &fault_handler_ep);
+    fault_handler_ep.cptr = seL4_CapNull;
+    return seL4_CapNull;
+}
+
+
+/**
+ * Assumes that libthread lock is held
+ */
+seL4_CPtr libthread_fault_handler_running_ep(void)
+{
+    return (fault_handler_thread != NULL) ? fault_handler_ep.cptr : seL4_CapNull;
+}
+
+
+int thread_fault_handler_start(void)
+{
+    libthread_prologue(int, 0);
+    libthread_check_initialized(-1);
+
+    libthread_guard(libthread_fault_handler_get_ep() == seL4_CapNull, -2, libthread_epilogue,
+                    "Failed to start the fault handler");
+
+    libthread_return_success();
+    libthread_epilogue();
+}
@@ -0,0 +1,574 @@
+/**
+ * @file fiber.c
+ * @brief Cooperative user level threads (fibers) for libthread
+ *
+ * Every thread_handle_t can host any number of fibers. fiber_run becomes
+ * the host's scheduler loop and switches between fibers entirely in user
+ * space. A fiber runs until it returns, yields, or waits on a notification.
+ * When every fiber is waiting, the host blocks in seL4_Wait if they all wait
+ * on one notification, usually the scheduler's own with one badge bit per
+ * event source.
+ *
+ * Stacks come from a shared pool which is mapped in chunks and never
+ * returned to the vspace. A fiber's bookkeeping lives at the top of its own
+ * stack slot.
+ */
+#include <autoconf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <thread/thread.h>
+#include <thread/sync.h>
+#include <thread/internal.h>
+#include <mmap/mmap.h>
+#include <init/init.h>
+
+#ifdef CONFIG_LIB_THREAD_FIBERS
+
+#define FIBER_STACK_BYTES (CONFIG_LIB_THREAD_FIBER_STACK_PAGES << PAGE_BITS_4K)
+
+
+/**
+ * Save the callee saved registers on the current stack, store the stack
+ * pointer in *save_sp and resume the context saved at new_sp.
+ */
+void libthread_fiber_switch(void **save_sp, void *new_sp);
+
+#if defined(CONFIG_ARCH_AARCH64)
+#define FIBER_FRAME_BYTES (20 * sizeof(seL4_Word))
+#define FIBER_FRAME_RETURN_SLOT 11 /* x30 */
+__asm__(
+    ".text\n"
+    ".global libthread_fiber_switch\n"
+    ".type libthread_fiber_switch, %function\n"
+    "libthread_fiber_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+);
+#elif defined(CONFIG_ARCH_AARCH32)
+#ifdef __ARM_FP
+/* d8-d15 below r4-r12, lr */
+#define FIBER_FRAME_BYTES (16 * sizeof(seL4_Word) + 10 * sizeof(seL4_Word))
+#define FIBER_VFP_SAVE "    vpush {d8-d15}\n"
+#define FIBER_VFP_RESTORE "    vpop {d8-d15}\n"
+#else
+#define FIBER_FRAME_BYTES (10 * sizeof(seL4_Word))
+#define FIBER_VFP_SAVE ""
+#define FIBER_VFP_RESTORE ""
+#endif
+#define FIBER_FRAME_RETURN_SLOT (FIBER_FRAME_BYTES / sizeof(seL4_Word) - 1) /* lr */
+__asm__(
+    ".text\n"
+    ".global libthread_fiber_switch\n"
+    ".type libthread_fiber_switch, %function\n"
+    "libthread_fiber_switch:\n"
+    "    push {r4-r12, lr}\n"
+    FIBER_VFP_SAVE
+    "    str sp, [r0]\n"
+    "    mov sp, r1\n"
+    FIBER_VFP_RESTORE
+    "    pop {r4-r12, pc}\n"
+);
+#elif defined(CONFIG_ARCH_X86_64)
+/* rbp, rbx, r12-r15, return address, then a fake return slot for alignment */
+#define FIBER_FRAME_BYTES (8 * sizeof(seL4_Word))
+#define FIBER_FRAME_RETURN_SLOT 6
+__asm__(
+    ".text\n"
+    ".global libthread_fiber_switch\n"
+    ".type libthread_fiber_switch, @function\n"
+    "libthread_fiber_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+);
+#endif
+
+
+/**
+ * Pool of free stack slots, linked through their lowest word.
+ * Protected by the libthread lock.
+ */
+static void *fiber_stack_free_list = NULL;
+
+/**
+ * Scheduler for the initial thread, which has no thread_handle_t
+ */
+static fiber_sched_t main_thread_sched = {0};
+
+
+static void *fiber_stack_alloc(void)
+{
+    libthread_lock_acquire();
+
+    if(fiber_stack_free_list == NULL) {
+        void *vaddr;
+        reservation_t res;
+        int error = mmap_new_pages(CONFIG_LIB_THREAD_FIBER_STACK_PAGES *
+                                   CONFIG_LIB_THREAD_FIBER_STACKS_PER_CHUNK,
+                                   &mmap_attr_4k_data,
+                                   &vaddr,
+                                   &res);
+        if(error) {
+            ZF_LOGE("Failed to map a chunk of fiber stacks");
+            libthread_lock_release();
+            return NULL;
+        }
+
+        for(int i = CONFIG_LIB_THREAD_FIBER_STACKS_PER_CHUNK - 1; i >= 0; i--) {
+            void **slot = (void**)((uintptr_t)vaddr + i * FIBER_STACK_BYTES);
+            *slot = fiber_stack_free_list;
+            fiber_stack_free_list = slot;
+        }
+    }
+
+    void **slot = fiber_stack_free_list;
+    fiber_stack_free_list = *slot;
+
+    libthread_lock_release();
+    return slot;
+}
+
+
+static void fiber_stack_free(void *stack_base)
+{
+    libthread_lock_acquire();
+    *(void**)stack_base = fiber_stack_free_list;
+    fiber_stack_free_list = stack_base;
+    libthread_lock_release();
+}
+
+
+static fiber_sched_t *fiber_get_sched(bool create)
+{
+    thread_handle_t *handle = thread_handle_get_current();
+    if(handle == NULL) {
+        return &main_thread_sched;
+    }
+
+    if(handle->fiber_sched == NULL && create) {
+        handle->fiber_sched = calloc(1, sizeof(fiber_sched_t));
+        ZF_LOGE_IF(handle->fiber_sched == NULL, "Failed to malloc fiber scheduler");
+    }
+    return handle->fiber_sched;
+}
+
+
+static inline void fiber_run_queue_push(fiber_sched_t *sched, fiber_t *fiber)
+{
+    fiber->next = NULL;
+    if(sched->run_tail == NULL) {
+        sched->run_head = fiber;
+    } else {
+        sched->run_tail->next = fiber;
+    }
+    sched->run_tail = fiber;
+}
+
+
+static inline fiber_t *fiber_run_queue_pop(fiber_sched_t *sched)
+{
+    fiber_t *fiber = sched->run_head;
+    if(fiber != NULL) {
+        sched->run_head = fiber->next;
+        if(sched->run_head == NULL) {
+            sched->run_tail = NULL;
+        }
+    }
+    return fiber;
+}
+
+
+/**
+ * First code run on a new fiber's stack, entered by the return of
+ * libthread_fiber_switch.
+ */
+static void fiber_trampoline(void)
+{
+    fiber_sched_t *sched = fiber_get_sched(false);
+    fiber_t *fiber = sched->current;
+
+    fiber->routine(fiber->arg);
+
+    fiber->state = FIBER_DONE;
+    libthread_fiber_switch(&fiber->sp, sched->host_sp);
+
+    ZF_LOGF("Finished fiber was resumed");
+}
+
+
+fiber_t *fiber_create(fiber_routine_t routine, void *arg)
+{
+    if(routine == NULL) {
+        ZF_LOGE("Null fiber routine passed");
+        return NULL;
+    }
+
+    fiber_sched_t *sched = fiber_get_sched(true);
+    if(sched == NULL) {
+        return NULL;
+    }
+
+    void *stack_base = fiber_stack_alloc();
+    if(stack_base == NULL) {
+        return NULL;
+    }
+
+    uintptr_t top = (uintptr_t)stack_base + FIBER_STACK_BYTES;
+    fiber_t *fiber = (fiber_t*)ALIGN_DOWN(top - sizeof(fiber_t), sizeof(seL4_Word));
+    *fiber = (fiber_t) {
+        .stack_base = stack_base,
+        .state = FIBER_RUNNABLE,
+        .routine = routine,
+        .arg = arg,
+    };
+    *(seL4_Word*)stack_base = INIT_WATERMARK_CANARY;
+
+    /**
+     * Build a frame for libthread_fiber_switch to restore, with the
+     * trampoline as the return address.
+     */
+    seL4_Word *frame = (seL4_Word*)(ALIGN_DOWN((uintptr_t)fiber, 16) - FIBER_FRAME_BYTES);
+    for(seL4_Word i = 0; i < FIBER_FRAME_BYTES / sizeof(seL4_Word); i++) {
+        frame[i] = 0;
+    }
+    frame[FIBER_FRAME_RETURN_SLOT] = (seL4_Word)fiber_trampoline;
+    fiber->sp = frame;
+
+    fiber_run_queue_push(sched, fiber);
+    sched->num_fibers++;
+
+    return fiber;
+}
+
+
+static inline void fiber_wake(fiber_sched_t *sched, fiber_t *fiber, seL4_Word badge)
+{
+    fiber->wait_badge = badge;
+    fiber->state = FIBER_RUNNABLE;
+    fiber_run_queue_push(sched, fiber);
+}
+
+
+/**
+ * Move fibers whose notification has been signalled to the run queue.
+ * When block is set and nothing is ready, wait instead of spinning. That
+ * takes every waiter being on one notification, the kernel can't wait on
+ * several, so mixed waiters are polled between yields.
+ */
+static void fiber_poll_waiters(fiber_sched_t *sched, bool block)
+{
+    seL4_Word badge;
+    seL4_CPtr first_notification = seL4_CapNull;
+    bool single_notification = true;
+    fiber_t **iter = &sched->wait_head;
+
+    if(sched->notification.cptr != seL4_CapNull) {
+        seL4_Poll(sched->notification.cptr, &badge);
+        sched->pending |= badge;
+    }
+
+    while(*iter != NULL) {
+        fiber_t *fiber = *iter;
+        if(fiber->wait_mask != 0) {
+            badge = sched->pending & fiber->wait_mask;
+            sched->pending &= ~badge;
+        } else {
+            seL4_Poll(fiber->wait_notification, &badge);
+        }
+        if(badge != 0) {
+            *iter = fiber->next;
+            fiber_wake(sched, fiber, badge);
+            block = false;
+        } else {
+            if(first_notification == seL4_CapNull) {
+                first_notification = fiber->wait_notification;
+            } else if(fiber->wait_notification != first_notification) {
+                single_notification = false;
+            }
+            iter = &fiber->next;
+        }
+    }
+
+    if(!block || sched->wait_head == NULL) {
+        return;
+    }
+
+    if(!single_notification) {
+        seL4_Yield();
+        return;
+    }
+
+    /**
+     * Everyone waits on the same object, so the host can wait for real.
+     */
+    seL4_Wait(first_notification, &badge);
+    if(first_notification != sched->notification.cptr) {
+        fiber_t *fiber = sched->wait_head;
+        sched->wait_head = fiber->next;
+        fiber_wake(sched, fiber, badge);
+        return;
+    }
+
+    sched->pending |= badge;
+    for(iter = &sched->wait_head; *iter != NULL; ) {
+        fiber_t *fiber = *iter;
+        badge = sched->pending & fiber->wait_mask;
+        if(badge != 0) {
+            sched->pending &= ~badge;
+            *iter = fiber->next;
+            fiber_wake(sched, fiber, badge);
+        } else {
+            iter = &fiber->next;
+        }
+    }
+}
+
+
+int fiber_run(void)
+{
+    fiber_sched_t *sched = fiber_get_sched(false);
+    if(sched == NULL || sched->num_fibers == 0) {
+        return 0;
+    }
+
+    if(sched->current != NULL) {
+        ZF_LOGE("fiber_run called from a fiber");
+        return -1;
+    }
+
+    while(sched->num_fibers > 0) {
+        if(sched->wait_head != NULL) {
+            fiber_poll_waiters(sched, sched->run_head == NULL);
+        }
+
+        fiber_t *fiber = fiber_run_queue_pop(sched);
+        if(fiber == NULL) {
+            continue;
+        }
+
+        sched->current = fiber;
+        libthread_fiber_switch(&sched->host_sp, fiber->sp);
+        sched->current = NULL;
+
+        ZF_LOGF_IF(*(seL4_Word*)fiber->stack_base != INIT_WATERMARK_CANARY,
+                   "Fiber stack overflow, raise CONFIG_LIB_THREAD_FIBER_STACK_PAGES");
+
+        switch(fiber->state) {
+        case FIBER_RUNNABLE:
+            fiber_run_queue_push(sched, fiber);
+            break;
+        case FIBER_BLOCKED:
+            /* fiber_wait already put it on the wait list */
+            break;
+        case FIBER_DONE:
+            sched->num_fibers--;
+            fiber_stack_free(fiber->stack_base);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+void fiber_yield(void)
+{
+    fiber_sched_t *sched = fiber_get_sched(false);
+    if(sched == NULL || sched->current == NULL) {
+        seL4_Yield();
+        return;
+    }
+
+    fiber_t *fiber = sched->current;
+    libthread_fiber_switch(&fiber->sp, sched->host_sp);
+}
+
+
+void fiber_wait(seL4_CPtr notification, seL4_Word *badge)
+{
+    seL4_Word received = 0;
+    fiber_sched_t *sched = fiber_get_sched(false);
+
+    /**
+     * fiber_run polls this one into pending, so a plain poll here or a
+     * wait list entry without a mask would never see its signals
+     */
+    if(sched != NULL && notification != seL4_CapNull &&
+       notification == sched->notification.cptr) {
+        fiber_wait_bits(~(seL4_Word)0, &received);
+        if(badge != NULL) {
+            *badge = received;
+        }
+        return;
+    }
+
+    if(sched == NULL || sched->current == NULL) {
+        seL4_Wait(notification, &received);
+    } else {
+        seL4_Poll(notification, &received);
+        if(received == 0) {
+            fiber_t *fiber = sched->current;
+            fiber->state = FIBER_BLOCKED;
+            fiber->wait_notification = notification;
+            fiber->next = sched->wait_head;
+            sched->wait_head = fiber;
+
+            libthread_fiber_switch(&fiber->sp, sched->host_sp);
+
+            received = fiber->wait_badge;
+        }
+    }
+
+    if(badge != NULL) {
+        *badge = received;
+    }
+}
+
+
+fiber_t *fiber_get_current(void)
+{
+    fiber_sched_t *sched = fiber_get_sched(false);
+    return sched == NULL ? NULL : sched->current;
+}
+
+
+seL4_CPtr fiber_get_notification(void)
+{
+    fiber_sched_t *sched = fiber_get_sched(true);
+    if(sched == NULL) {
+        return seL4_CapNull;
+    }
+
+    if(sched->notification.cptr == seL4_CapNull &&
+       vka_alloc_notification(&init_objects.vka, &sched->notification)) {
+        ZF_LOGE("Failed to allocate the fiber notification");
+        sched->notification.cptr = seL4_CapNull;
+    }
+    return sched->notification.cptr;
+}
+
+
+int fiber_wait_bits(seL4_Word mask, seL4_Word *bits)
+{
+    seL4_Word received;
+
+    if(mask == 0) {
+        ZF_LOGE("Empty badge mask passed");
+        return -1;
+    }
+
+    seL4_CPtr notification = fiber_get_notification();
+    if(notification == seL4_CapNull) {
+        return -2;
+    }
+
+    fiber_sched_t *sched = fiber_get_sched(false);
+    received = sched->pending & mask;
+    sched->pending &= ~received;
+
+    if(received == 0 && sched->current != NULL) {
+        fiber_t *fiber = sched->current;
+        fiber->state = FIBER_BLOCKED;
+        fiber->wait_notification = notification;
+        fiber->wait_mask = mask;
+        fiber->next = sched->wait_head;
+        sched->wait_head = fiber;
+
+        libthread_fiber_switch(&fiber->sp, sched->host_sp);
+
+        fiber->wait_mask = 0;
+        received = fiber->wait_badge;
+    }
+
+    while(received == 0) {
+        seL4_Word badge;
+        seL4_Wait(notification, &badge);
+        sched->pending |= badge;
+        received = sched->pending & mask;
+        sched->pending &= ~received;
+    }
+
+    if(bits != NULL) {
+        *bits = received;
+    }
+    return 0;
+}
+
+
+void libthread_fiber_sched_destroy(fiber_sched_t *sched)
+{
+    if(sched == NULL) {
+        return;
+    }
+
+    /* A thread destroyed inside a fiber leaves it current, blocked ones are on the wait list too */
+    if(sched->current != NULL && sched->current->state != FIBER_BLOCKED) {
+        fiber_stack_free(sched->current->stack_base);
+    }
+
+    fiber_t *lists[] = { sched->run_head, sched->wait_head };
+    for(seL4_Word i = 0; i < ARRAY_SIZE(lists); i++) {
+        fiber_t *fiber = lists[i];
+        while(fiber != NULL) {
+            /* The fiber lives on its stack, read next first */
+            fiber_t *next = fiber->next;
+            fiber_stack_free(fiber->stack_base);
+            fiber = next;
+        }
+    }
+
+    if(sched->notification.cptr != seL4_CapNull) {
+        vka_free_object(&init_objects.vka, &sched->notification);
+    }
+    free(sched);
+}
+
+#else
+
+void libthread_fiber_sched_destroy(fiber_sched_t *sched)
+{
+    free(sched);
+}
+
+#endif /* CONFIG_LIB_THREAD_FIBERS */
@@ -0,0 +1,189 @@
+/**
+ * @file sched.c
+ * @brief Scheduling context support for periodic threads
+ *
+ * With CONFIG_KERNEL_RT a thread created with a budget and period gets its
+ * own scheduling context, so the kernel enforces that it never runs for
+ * more than budget_us in any period_us. thread_wait_next_period ends the
+ * current job and blocks until the next replenishment.
+ *
+ * Deadlines are implicit (equal to the period). Because the kernel only
+ * hands out one budget per period, a job that consumed c microseconds
+ * finished ceil(c / budget) - 1 periods late. That is what deadline_misses
+ * counts, and budget_overruns counts the jobs for which it was non-zero.
+ *
+ * Configuring a scheduling context needs the sched control cap of the
+ * target core, which only the root task holds.
+ */
+#include <autoconf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sel4/sel4.h>
+#include <vka/vka.h>
+#include <vka/object.h>
+#include <simple/simple.h>
+#include <utils/util.h>
+
+#include <thread/thread.h>
+#include <thread/sync.h>
+#include <thread/internal.h>
+#include <init/init.h>
+
+
+int libthread_sched_context_setup_unsafe(thread_handle_t *handle, const thread_attr_t *attr)
+{
+    if(attr->budget_us == 0) {
+        return 0;
+    }
+
+    if(attr->period_us < attr->budget_us) {
+        ZF_LOGE("Budget %lu us is larger than period %lu us",
+                (long unsigned)attr->budget_us, (long unsigned)attr->period_us);
+        return -1;
+    }
+
+#ifdef CONFIG_KERNEL_RT
+    int error;
+
+    if(init_objects.info == NULL) {
+        ZF_LOGE("Only the root task holds the sched control caps");
+        return -2;
+    }
+
+    error = vka_alloc_sched_context(&init_objects.vka, &handle->sched_context);
+    if(error) {
+        ZF_LOGE("Failed to allocate scheduling context");
+        return -3;
+    }
+
+    int core = handle->cpu_affinity;
+    error = seL4_SchedControl_Configure(simple_get_sched_ctrl(&init_objects.simple, core),
+                                        handle->sched_context.cptr,
+                                        attr->budget_us,
+                                        attr->period_us,
+                                        0, /* no extra refills */
+                                        0);
+    if(error) {
+        ZF_LOGE("Failed to configure scheduling context");
+        vka_free_object(&init_objects.vka, &handle->sched_context);
+        return -4;
+    }
+
+    error = seL4_SchedContext_Bind(handle->sched_context.cptr, handle->tcb.cptr);
+    if(error) {
+        ZF_LOGE("Failed to bind scheduling context");
+        vka_free_object(&init_objects.vka, &handle->sched_context);
+        return -5;
+    }
+
+    handle->budget_us = attr->budget_us;
+    handle->period_us = attr->period_us;
+    return 0;
+#else
+    ZF_LOGE("Budget and period need a CONFIG_KERNEL_RT kernel");
+    return -2;
+#endif
+}
+
+
+int libthread_sched_context_move_unsafe(thread_handle_t *handle, int core)
+{
+#ifdef CONFIG_KERNEL_RT
+    if(handle->sched_context.cptr == seL4_CapNull) {
+        ZF_LOGE("Thread %i has no scheduling context to move", handle->thread_id);
+        return -1;
+    }
+
+    if(init_objects.info == NULL) {
+        ZF_LOGE("Only the root task holds the sched control caps");
+        return -2;
+    }
+
+    int error = seL4_SchedControl_Configure(simple_get_sched_ctrl(&init_objects.simple, core),
+                                            handle->sched_context.cptr,
+                                            handle->budget_us,
+                                            handle->period_us,
+                                            0, /* no extra refills */
+                                            0);
+    if(error) {
+        ZF_LOGE("Failed to move scheduling context to core %i", core);
+        return -3;
+    }
+    return 0;
+#else
+    ZF_LOGE("Scheduling contexts need a CONFIG_KERNEL_RT kernel");
+    return -1;
+#endif
+}
+
+
+void libthread_sched_context_free_unsafe(thread_handle_t *handle)
+{
+#ifdef CONFIG_KERNEL_RT
+    if(handle->sched_context.cptr != seL4_CapNull) {
+        seL4_SchedContext_Unbind(handle->sched_context.cptr);
+        vka_free_object(&init_objects.vka, &handle->sched_context);
+    }
+#endif
+}
+
+
+int thread_wait_next_period(void)
+{
+    thread_handle_t *handle = thread_handle_get_current();
+
+    if(handle == NULL || handle->budget_us == 0) {
+        ZF_LOGE("Current thread is not periodic");
+        return -1;
+    }
+
+#ifdef CONFIG_KERNEL_RT
+    seL4_SchedContext_Consumed_t consumed = seL4_SchedContext_Consumed(handle->sched_context.cptr);
+    if(consumed.error) {
+        ZF_LOGE("Failed to read consumed time");
+        return -2;
+    }
+
+    /**
+     * Only this thread writes its own counters, readers may see them a
+     * release behind.
+     */
+    seL4_Word late = 0;
+    if(consumed.consumed > 0) {
+        late = (consumed.consumed - 1) / handle->budget_us;
+    }
+    if(late > 0) {
+        handle->sched_stats.budget_overruns++;
+        handle->sched_stats.deadline_misses += late;
+    }
+    handle->sched_stats.releases++;
+
+    /**
+     * Yielding with a scheduling context gives up the rest of the budget
+     * until the next replenishment.
+     */
+    seL4_Yield();
+    return 0;
+#else
+    return -2;
+#endif
+}
+
+
+int thread_get_sched_stats(thread_handle_t *handle, thread_sched_stats_t *stats)
+{
+    libthread_prologue(int, 0);
+
+    libthread_guard(handle == NULL || stats == NULL, -1, libthread_epilogue,
+                    "Null thread handle or stats pointer passed");
+
+    libthread_guard(handle->budget_us == 0, -2, libthread_epilogue,
+                    "Thread has no scheduling context");
+
+    *stats = handle->sched_stats;
+
+    libthread_return_success();
+    libthread_epilogue();
+}
@@ -17,6 +17,7 @@
 #include <init/init.h>
 
 #include <thread/sync.h>
+#include <thread/internal.h>
 
 const thread_attr_t thread_defaults_1MB_stack = {
     .stack_size_pages = 256,
@@ -25,6 +26,19 @@ const thread_attr_t thread_defaults_1MB_stack = {
     .cpu_affinity = THREAD_SELF_CORE,
 };
 
+/**
+ * Reserves 1MB but only commits the top two pages, the rest is faulted in.
+ * The thread must not call into the vka or vspace below those two pages,
+ * see the warning in libmmap's lazy.c.
+ */
+const thread_attr_t thread_defaults_1MB_lazy_stack = {
+    .stack_size_pages = 256,
+    .stack_commit_pages = 2,
+    .priority = seL4_MaxPrio,
+    .max_priority = seL4_MaxPrio,
+    .cpu_affinity = THREAD_SELF_CORE,
+};
+
 const thread_attr_t thread_defaults_64KB_stack = {
     .stack_size_pages = 16,
     .priority = seL4_MaxPrio,
@@ -36,6 +50,11 @@ const thread_attr_t thread_defaults_64KB_stack = {
 int thread_lib_lock_initialized = 0;
 mutex_t thread_lib_lock = {0};
 
+/**
+ * Every live handle, protected by the libthread lock
+ */
+thread_handle_t *libthread_thread_list = NULL;
+
 static inline bool is_current_thread(thread_handle_t *handle) {
     return handle == (thread_handle_t*)init_get_thread_local_storage();
 }
@@ -50,9 +69,24 @@ thread_handle_t *thread_handle_create(const thread_attr_t *attr)
     libthread_guard(attr == NULL, NULL, libthread_epilogue,
                     "Null thread attr passed into thread_handle_create");
 
+    /**
+     * Lazy stacks need someone to service their page faults.
+     */
+    seL4_CPtr fault_ep = init_objects.fault_cap;
+#ifdef CONFIG_LIB_THREAD_FAULT_HANDLER_PROCESS_EP
+    if(libthread_fault_handler_running_ep() != seL4_CapNull) {
+        fault_ep = libthread_fault_handler_running_ep();
+    }
+#endif
+    if(attr->stack_commit_pages != 0) {
+        fault_ep = libthread_fault_handler_get_ep();
+        libthread_guard(fault_ep == seL4_CapNull, NULL, libthread_epilogue,
+                        "Failed to start the stack fault handler");
+    }
+
     thread_handle_t *handle = thread_handle_create_custom(init_objects.cnode_cap,
                                                           0,
-                                                          init_objects.fault_cap,
+                                                          fault_ep,
                                                           init_objects.page_dir_cap,
                                                           &init_objects.vspace,
                                                           attr);
@@ -110,6 +144,8 @@ static void thread_init_routine(thread_handle_t *handle,
      * Take the return value of the thread and send it to the joining thread
      */
     handle->returned_value = start_routine(arg);
+
+    libthread_tls_run_destructors(handle);
     
     libthread_lock_acquire();
     //ZF_LOGD("Thread finished executing");
@@ -164,17 +200,28 @@ int thread_start(thread_handle_t *handle, void *(*start_routine) (void *), void
     regs.r2 = (seL4_Word)arg;
 #endif
 
-/**
- * TODO: finish implementing x86!
- */
 #ifdef CONFIG_ARCH_X86_64
-    regs.rdi = (seL4_Word)arg;
-    initial_stack_pointer -= sizeof(uintptr_t);
+    /**
+     * SysV: arguments in rdi, rsi, rdx. On entry rsp + 8 must be 16 byte
+     * aligned, as if a call had just pushed the return address.
+     */
+    regs.rdi = (seL4_Word)handle;
+    regs.rsi = (seL4_Word)start_routine;
+    regs.rdx = (seL4_Word)arg;
+    initial_stack_pointer = ALIGN_DOWN((uintptr_t)handle->stack_vaddr, 16) - sizeof(uintptr_t);
+    *(uintptr_t*)initial_stack_pointer = 0;
 #endif
 #ifdef CONFIG_ARCH_IA32
-    void **dest = (void**)(initial_stack_pointer);
-    *dest = arg;
-
+    /**
+     * cdecl: arguments on the stack above a null return address, with
+     * esp + 4 16 byte aligned on entry.
+     */
+    uintptr_t *frame = (uintptr_t*)(ALIGN_DOWN((uintptr_t)handle->stack_vaddr, 16) - 16 - sizeof(uintptr_t));
+    frame[0] = 0;
+    frame[1] = (uintptr_t)handle;
+    frame[2] = (uintptr_t)start_routine;
+    frame[3] = (uintptr_t)arg;
+    initial_stack_pointer = (uintptr_t)frame;
 #endif
 
     libthread_set_status(sel4utils_arch_init_context(thread_init_routine,
@@ -183,11 +230,20 @@ int thread_start(thread_handle_t *handle, void *(*start_routine) (void *), void
     libthread_guard(libthread_get_status(), -4, libthread_epilogue,
                     "Failed to initialize thread registers");
 
+    /**
+     * The vka/vspace wrappers must start locking before this thread can run.
+     */
+    lockwrapper_thread_started();
+    handle->started = true;
+
     libthread_set_status(seL4_TCB_WriteRegisters(handle->tcb.cptr, 1, 0, sizeof(regs)/sizeof(seL4_Word), &regs));
-    libthread_guard(libthread_get_status(), -5, libthread_epilogue,
+    libthread_guard(libthread_get_status(), -5, write_registers_fail,
                     "Failed to write tcb registers");
 
     libthread_return_success();
+    write_registers_fail:
+        handle->started = false;
+        lockwrapper_thread_stopped();
     libthread_epilogue();
 }
 
@@ -244,25 +300,26 @@ void *thread_join(thread_handle_t *handle)
  *  the stack/buffer to be freed is valid
  */
 static inline void thread_unmap_stack_unsafe(thread_handle_t *handle, vspace_t* vspace) {
+    if(handle->lazy_stack) {
+        mmap_lazy_release(handle->stack_vaddr);
+    }
+
     void *stack_bottom = (void*)((uintptr_t)handle->stack_vaddr -
                                  (handle->stack_size_pages << PAGE_BITS_4K));
-    vspace_unmap_pages(vspace,
-                       stack_bottom,
-                       handle->stack_size_pages,
-                       PAGE_BITS_4K,
-                       &init_objects.vka);
-    vspace_free_reservation(vspace, handle->stack_res);
+    mmap_free_pages_custom(vspace,
+                           handle->stack_size_pages,
+                           &mmap_attr_4k_data,
+                           stack_bottom,
+                           handle->stack_res);
 }
 
 
 static inline void thread_unmap_ipc_buffer_unsafe(thread_handle_t *handle, vspace_t* vspace) {
-    vspace_unmap_pages(vspace,
-                       handle->ipc_buffer_vaddr,
-                       1,
-                       PAGE_BITS_4K,
-                       &init_objects.vka);
-
-    vspace_free_reservation(vspace, handle->ipc_buffer_res);
+    mmap_free_pages_custom(vspace,
+                           1,
+                           &mmap_attr_4k_data,
+                           handle->ipc_buffer_vaddr,
+                           handle->ipc_buffer_res);
 }
 
 
@@ -281,6 +338,14 @@ thread_handle_t *thread_handle_create_custom(seL4_CPtr cnode,
     libthread_guard(attr == NULL, NULL, libthread_epilogue,
                     "Null thread attr passed into thread_handle_create_custom");
 
+    /**
+     * Faults are serviced by a thread in this process, so it can only map
+     * frames into its own vspace.
+     */
+    libthread_guard(attr->stack_commit_pages != 0 && vspace != &init_objects.vspace,
+                    NULL, libthread_epilogue,
+                    "Lazy stacks are only supported in the current vspace");
+
     thread_handle_t *handle = calloc(sizeof(thread_handle_t), 1);
     libthread_guard(handle == NULL, NULL, libthread_epilogue,
                     "Failed to malloc thread handle");
@@ -312,14 +377,36 @@ thread_handle_t *thread_handle_create_custom(seL4_CPtr cnode,
      * Allocate the stack somewhere (reserves an extra guard page)
      */
     handle->stack_size_pages = attr->stack_size_pages;
-    error = mmap_new_stack_custom(vspace,
-                                  page_dir,
-                                  handle->stack_size_pages,
-                                  &handle->stack_vaddr,
-                                  &handle->stack_res);
+    handle->lazy_stack = attr->stack_commit_pages != 0 &&
+                         attr->stack_commit_pages < attr->stack_size_pages;
+    if(handle->lazy_stack) {
+        error = mmap_new_stack_lazy_custom(vspace,
+                                           page_dir,
+                                           handle->stack_size_pages,
+                                           attr->stack_commit_pages,
+                                           &handle->stack_vaddr,
+                                           &handle->stack_res);
+    } else {
+        error = mmap_new_stack_custom(vspace,
+                                      page_dir,
+                                      handle->stack_size_pages,
+                                      &handle->stack_vaddr,
+                                      &handle->stack_res);
+    }
     libthread_guard(error, NULL, stack_fail,
                     "Failed to allocate stack");
 
+#ifdef CONFIG_LIB_THREAD_STACK_WATERMARK
+    if(!handle->lazy_stack && vspace == &init_objects.vspace) {
+        seL4_Word *word = (seL4_Word*)((uintptr_t)handle->stack_vaddr -
+                                       (handle->stack_size_pages << PAGE_BITS_4K));
+        while((uintptr_t)word < (uintptr_t)handle->stack_vaddr) {
+            *word++ = INIT_WATERMARK_CANARY;
+        }
+        handle->stack_painted = true;
+    }
+#endif
+
     /**
      * Allocate an IPC buffer
      */
@@ -355,12 +442,40 @@ thread_handle_t *thread_handle_create_custom(seL4_CPtr cnode,
                                    attr->max_priority);
     ZF_LOGW_IF(error, "Failed to set maximum control priority");
    
+    handle->priority = attr->priority;
+
+    /**
+     * Threads without an explicit core start where their creator runs and
+     * may be moved by the balancer. The main thread has no handle, libinit
+     * knows its core.
+     */
+    thread_handle_t *creator = thread_handle_get_current();
+    handle->cpu_affinity = creator == NULL ? init_objects.main_core : creator->cpu_affinity;
+    handle->pinned = false;
 #if CONFIG_MAX_NUM_NODES > 1
     if(attr->cpu_affinity != THREAD_SELF_CORE) {
+#ifdef CONFIG_KERNEL_RT
+        /* The scheduling context set up below is what puts it on the core */
+        ZF_LOGW_IF(attr->budget_us == 0, "Placing a thread on a core needs a budget on an RT kernel");
+        handle->cpu_affinity = attr->cpu_affinity;
+        handle->pinned = true;
+#else
         error = seL4_TCB_SetAffinity(handle->tcb.cptr, (seL4_Word)attr->cpu_affinity);
         ZF_LOGW_IF(error, "Failed to set affinity");
+        if(!error) {
+            handle->cpu_affinity = attr->cpu_affinity;
+            handle->pinned = true;
+        }
+#endif
     }
 #endif
+    error = libthread_sched_context_setup_unsafe(handle, attr);
+    libthread_guard(error, NULL, tcb_configure_fail,
+                    "Failed to set up scheduling context");
+
+    handle->next = libthread_thread_list;
+    libthread_thread_list = handle;
+
     libthread_return_value(handle);
     tcb_configure_fail:
         thread_unmap_ipc_buffer_unsafe(handle, vspace);
@@ -392,8 +507,19 @@ int thread_destroy_free_handle_custom(thread_handle_t **handle_ref,
 
     thread_handle_t *handle = *handle_ref;
 
+    for(thread_handle_t **iter = &libthread_thread_list; *iter != NULL; iter = &(*iter)->next) {
+        if(*iter == handle) {
+            *iter = handle->next;
+            break;
+        }
+    }
+
     seL4_TCB_Suspend(handle->tcb.cptr);
+    if(handle->started) {
+        lockwrapper_thread_stopped();
+    }
 
+    libthread_sched_context_free_unsafe(handle);
     vka_free_object(&init_objects.vka, &handle->tcb);
     vka_free_object(&init_objects.vka, &handle->sync_notification);
 
@@ -409,6 +535,7 @@ int thread_destroy_free_handle_custom(thread_handle_t **handle_ref,
     cond_signalAll(&handle->join_condition);
 
     vka_free_object(&init_objects.vka, &handle->join_notification);    
+    libthread_fiber_sched_destroy(handle->fiber_sched);
     free(handle);
     
     /**
@@ -421,6 +548,136 @@ int thread_destroy_free_handle_custom(thread_handle_t **handle_ref,
 }
 
 
+int thread_set_priority(thread_handle_t *handle, seL4_Word priority)
+{
+    libthread_prologue(int, 0);
+
+    libthread_guard(handle == NULL, -1, libthread_epilogue,
+                    "Null thread handle passed");
+
+    libthread_set_status(seL4_TCB_SetPriority(handle->tcb.cptr, init_objects.tcb_cap, priority));
+    libthread_guard(libthread_get_status(), -2, libthread_epilogue,
+                    "Failed to set priority");
+
+    handle->priority = priority;
+
+    libthread_return_success();
+    libthread_epilogue();
+}
+
+
+int libthread_migrate_unsafe(thread_handle_t *handle, int core)
+{
+#if CONFIG_MAX_NUM_NODES > 1
+#ifdef CONFIG_KERNEL_RT
+    int error = libthread_sched_context_move_unsafe(handle, core);
+#else
+    int error = seL4_TCB_SetAffinity(handle->tcb.cptr, (seL4_Word)core);
+#endif
+    if(error) {
+        return error;
+    }
+#endif
+    handle->cpu_affinity = core;
+    return 0;
+}
+
+
+int thread_set_affinity(thread_handle_t *handle, int core)
+{
+    libthread_prologue(int, 0);
+
+    libthread_guard(handle == NULL, -1, libthread_epilogue,
+                    "Null thread handle passed");
+
+    libthread_guard(core < 0 || core >= CONFIG_MAX_NUM_NODES, -2, libthread_epilogue,
+                    "Invalid core %i", core);
+
+    libthread_set_status(libthread_migrate_unsafe(handle, core));
+    libthread_guard(libthread_get_status(), -3, libthread_epilogue,
+                    "Failed to set affinity");
+
+    /* An explicit placement opts the thread out of balancing */
+    handle->pinned = true;
+
+    libthread_return_success();
+    libthread_epilogue();
+}
+
+
+int thread_get_stack_high_water(thread_handle_t *handle, seL4_Word *bytes)
+{
+    libthread_prologue(int, 0);
+
+    libthread_guard(handle == NULL || bytes == NULL, -1, libthread_epilogue,
+                    "Null thread handle or bytes pointer passed");
+
+    if(handle->lazy_stack) {
+        mmap_lazy_stats_t stats;
+        libthread_set_status(mmap_lazy_get_stats(handle->stack_vaddr, &stats));
+        libthread_guard(libthread_get_status(), -3, libthread_epilogue,
+                        "Failed to get lazy stack stats");
+
+        *bytes = stats.high_water_pages << PAGE_BITS_4K;
+        libthread_return_success();
+    }
+
+    libthread_guard(!handle->stack_painted, -2, libthread_epilogue,
+                    "Stack was not painted, enable CONFIG_LIB_THREAD_STACK_WATERMARK");
+
+    /**
+     * The stack grows down, so count untouched words up from the bottom.
+     */
+    seL4_Word *word = (seL4_Word*)((uintptr_t)handle->stack_vaddr -
+                                   (handle->stack_size_pages << PAGE_BITS_4K));
+    while((uintptr_t)word < (uintptr_t)handle->stack_vaddr && *word == INIT_WATERMARK_CANARY) {
+        word++;
+    }
+    *bytes = (uintptr_t)handle->stack_vaddr - (uintptr_t)word;
+
+    libthread_return_success();
+    libthread_epilogue();
+}
+
+
+void thread_print_memory_usage(void)
+{
+    seL4_Word used, size;
+
+    libthread_lock_acquire();
+
+    printf("%s memory usage:\n", init_objects.proc_name);
+    printf("+--------+--------------+--------------+\n");
+    printf("| thread | stack (bytes)| peak (bytes) |\n");
+    printf("+--------+--------------+--------------+\n");
+    if(init_get_main_stack_high_water(&used, &size) == 0) {
+        printf("|   main | %12lu | %12lu |\n", (long unsigned)size, (long unsigned)used);
+    } else {
+        printf("|   main |          n/a |          n/a |\n");
+    }
+    for(thread_handle_t *iter = libthread_thread_list; iter != NULL; iter = iter->next) {
+        size = iter->stack_size_pages << PAGE_BITS_4K;
+        if((iter->lazy_stack || iter->stack_painted) &&
+           thread_get_stack_high_water(iter, &used) == 0) {
+            printf("| %6i | %12lu | %12lu |\n", iter->thread_id,
+                   (long unsigned)size, (long unsigned)used);
+        } else {
+            printf("| %6i | %12lu |          n/a |\n", iter->thread_id,
+                   (long unsigned)size);
+        }
+    }
+    printf("+--------+--------------+--------------+\n");
+
+    if(init_get_heap_high_water(&used, &size) == 0) {
+        printf("heap: %lu of %lu bytes peak\n", (long unsigned)used, (long unsigned)size);
+    } else {
+        printf("heap: n/a\n");
+    }
+
+    libthread_lock_release();
+}
+
+
 int thread_destroy_free_handle(thread_handle_t **handle_ref) {
     libthread_prologue(int, 0);
 
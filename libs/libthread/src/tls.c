@@ -0,0 +1,143 @@
+/**
+ * @file tls.c
+ * @brief Thread local storage keys for libthread
+ *
+ * Keys are indices into a fixed array in every thread_handle_t, so get and
+ * set are a TLS register read plus an array access. Only creating and
+ * deleting keys takes the libthread lock.
+ *
+ * Every key has a generation that thread_key_create bumps. A slot remembers
+ * the generation it was set under, so values left behind by a deleted key
+ * read as NULL once the index is handed out again, without touching every
+ * thread.
+ */
+#include <autoconf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <thread/thread.h>
+#include <thread/sync.h>
+#include <thread/internal.h>
+
+/* Like PTHREAD_DESTRUCTOR_ITERATIONS, bounds re-set values at thread exit */
+#define THREAD_KEY_DESTRUCTOR_ROUNDS 4
+
+
+static bool key_in_use[CONFIG_LIB_THREAD_TLS_SLOTS] = {0};
+static thread_key_destructor_t key_destructors[CONFIG_LIB_THREAD_TLS_SLOTS] = {0};
+static seL4_Word key_generations[CONFIG_LIB_THREAD_TLS_SLOTS] = {0};
+
+/**
+ * The initial thread has no thread_handle_t
+ */
+static thread_tls_slot_t main_thread_tls_slots[CONFIG_LIB_THREAD_TLS_SLOTS] = {{0}};
+
+
+static inline thread_tls_slot_t *thread_tls_slots(void)
+{
+    thread_handle_t *handle = thread_handle_get_current();
+    return handle == NULL ? main_thread_tls_slots : handle->tls_slots;
+}
+
+
+static inline seL4_Word key_generation(thread_key_t key)
+{
+    return __atomic_load_n(&key_generations[key], __ATOMIC_ACQUIRE);
+}
+
+
+static inline bool key_valid(thread_key_t key)
+{
+    return key >= 0 && key < CONFIG_LIB_THREAD_TLS_SLOTS;
+}
+
+
+int thread_key_create(thread_key_t *key, thread_key_destructor_t destructor)
+{
+    libthread_prologue(int, -2);
+
+    libthread_guard(key == NULL, -1, libthread_epilogue,
+                    "Null key pointer passed");
+
+    for(int i = 0; i < CONFIG_LIB_THREAD_TLS_SLOTS; i++) {
+        if(!key_in_use[i]) {
+            key_in_use[i] = true;
+            key_destructors[i] = destructor;
+            /* Never 0, which is what a zeroed slot holds */
+            __atomic_store_n(&key_generations[i], key_generations[i] + 1, __ATOMIC_RELEASE);
+            *key = i;
+            libthread_return_success();
+        }
+    }
+
+    ZF_LOGE("Out of TLS keys, raise CONFIG_LIB_THREAD_TLS_SLOTS");
+    libthread_epilogue();
+}
+
+
+int thread_key_delete(thread_key_t key)
+{
+    libthread_prologue(int, 0);
+
+    libthread_guard(!key_valid(key) || !key_in_use[key], -1, libthread_epilogue,
+                    "Invalid TLS key %i", key);
+
+    key_in_use[key] = false;
+    key_destructors[key] = NULL;
+
+    libthread_return_success();
+    libthread_epilogue();
+}
+
+
+int thread_setspecific(thread_key_t key, void *value)
+{
+    if(unlikely(!key_valid(key))) {
+        ZF_LOGE("Invalid TLS key %i", key);
+        return -1;
+    }
+
+    thread_tls_slot_t *slot = &thread_tls_slots()[key];
+    slot->value = value;
+    slot->generation = key_generation(key);
+    return 0;
+}
+
+
+void *thread_getspecific(thread_key_t key)
+{
+    if(unlikely(!key_valid(key))) {
+        return NULL;
+    }
+
+    thread_tls_slot_t *slot = &thread_tls_slots()[key];
+    return slot->generation == key_generation(key) ? slot->value : NULL;
+}
+
+
+void libthread_tls_run_destructors(thread_handle_t *handle)
+{
+    /**
+     * A destructor may set other keys again, so go round a few times.
+     */
+    for(int round = 0; round < THREAD_KEY_DESTRUCTOR_ROUNDS; round++) {
+        bool ran = false;
+        for(int i = 0; i < CONFIG_LIB_THREAD_TLS_SLOTS; i++) {
+            thread_tls_slot_t *slot = &handle->tls_slots[i];
+            void *value = slot->value;
+            thread_key_destructor_t destructor = key_destructors[i];
+            if(value != NULL && destructor != NULL && slot->generation == key_generation(i)) {
+                slot->value = NULL;
+                destructor(value);
+                ran = true;
+            }
+        }
+        if(!ran) {
+            break;
+        }
+    }
+}